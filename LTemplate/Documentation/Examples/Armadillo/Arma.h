@@ -38,6 +38,42 @@ mma::TensorRef<T> fromArmaVec(const arma::Col<T> &v) {
     return mma::makeVector<T>(v.size(), v.memptr());
 }
 
+// The fromArma... functions above copy the result of a computation into a new Tensor.
+// For large results, this doubles memory use. Instead, we can allocate the Tensor first, wrap it
+// in an Armadillo object, and let Armadillo write the result directly into it.
+// The "strict" flag of the advanced constructors prevents Armadillo from ever replacing the memory
+// with its own. Trying to store a result of a different size is then an error.
+
+// Create a Mathematica matrix, and let f(arma::Mat<T> &) compute its transposed Armadillo equivalent in place.
+// Returns the matrix without copying. If f throws, the matrix is freed.
+template<typename T, typename F>
+mma::MatrixRef<T> makeMatrixFromArma(mint rows, mint cols, F f) {
+    auto result = mma::makeMatrix<T>(rows, cols);
+    try {
+        arma::Mat<T> am(result.data(), cols, rows, false /* do not copy */, true /* strict */);
+        f(am);
+    } catch (...) {
+        result.free();
+        throw;
+    }
+    return result;
+}
+
+// Create a Mathematica vector, and let f(arma::Col<T> &) compute it in place.
+// Returns the vector without copying. If f throws, the vector is freed.
+template<typename T, typename F>
+mma::TensorRef<T> makeVectorFromArma(mint len, F f) {
+    auto result = mma::makeVector<T>(len);
+    try {
+        arma::Col<T> av(result.data(), len, false /* do not copy */, true /* strict */);
+        f(av);
+    } catch (...) {
+        result.free();
+        throw;
+    }
+    return result;
+}
+
 // Convert from Mathematica sparse matrix to Armadillo sparse matrix
 template<typename T>
 arma::SpMat<T> toArmaSparseTransposed(mma::SparseMatrixRef<T> sm) {
@@ -52,6 +88,7 @@ arma::SpMat<T> toArmaSparseTransposed(mma::SparseMatrixRef<T> sm) {
 }
 
 // Convert from Armadillo sparse matrix to Mathematica SparseArray
+// SparseArrays can only be created from positions and values by the Wolfram Library, so here copying is unavoidable.
 template<typename T>
 mma::SparseMatrixRef<T> fromArmaSparse(const arma::SpMat<T> &am) {
     // there are am.n_nonzero explicitly stored elements in am
@@ -81,14 +118,33 @@ mma::SparseMatrixRef<T> fromArmaSparse(const arma::SpMat<T> &am) {
 class Arma {
 public:
     // Matrix inverse
+    // The inverse is written directly into the returned Tensor. Since (A^T)^-1 = (A^-1)^T,
+    // the transposed convention needs no special handling.
     mma::RealMatrixRef inv(mma::RealMatrixRef mat) {
-        arma::mat m = toArmaTransposed(mat);
-        return fromArmaTransposed<double>(arma::inv(m));
+        const arma::mat m = toArmaTransposed(mat);
+        return makeMatrixFromArma<double>(mat.rows(), mat.cols(), [&] (arma::mat &res) {
+            if (! arma::inv(res, m))
+                throw mma::LibraryError("Matrix inversion failed.");
+        });
+    }
+
+    // Matrix product
+    // Since (A B)^T = B^T A^T, the product of the transposed Armadillo equivalents is computed in reverse order.
+    mma::RealMatrixRef dot(mma::RealMatrixRef a, mma::RealMatrixRef b) {
+        if (a.cols() != b.rows())
+            throw mma::LibraryError("Incompatible matrix dimensions.");
+        return makeMatrixFromArma<double>(a.rows(), b.cols(), [&] (arma::mat &res) {
+            res = toArmaTransposed(b) * toArmaTransposed(a);
+        });
     }
 
     // The first k complex eigenvalues of a sparse matrix
     mma::ComplexTensorRef eigs(mma::SparseMatrixRef<double> sm, mint k) {
-        return fromArmaVec<mma::complex_t>(arma::eigs_gen(toArmaSparseTransposed(sm), k));
+        const arma::sp_mat am = toArmaSparseTransposed(sm);
+        return makeVectorFromArma<mma::complex_t>(k, [&] (arma::cx_vec &res) {
+            if (! arma::eigs_gen(res, am, k))
+                throw mma::LibraryError("Eigenvalue decomposition failed.");
+        });
     }
 
     // Random sparse matrix
@@ -98,12 +154,13 @@ public:
 
     // Solve a linear equation
     mma::RealTensorRef solve(mma::RealMatrixRef mat, mma::RealTensorRef vec) {
-        return fromArmaVec<double>(
-                    arma::solve(toArmaTransposed(mat).t(), // transpose back to match mat
-                    toArmaVec(vec))
-                );
+        const arma::mat m = toArmaTransposed(mat).t(); // transpose back to match mat
+        return makeVectorFromArma<double>(mat.cols(), [&] (arma::vec &res) {
+            if (! arma::solve(res, m, toArmaVec(vec)))
+                throw mma::LibraryError("No solution found.");
+        });
     }
-        
+
     // Print an Armadillo matrix
     void print(mma::RealMatrixRef mat) {
         mma::mout << toArmaTransposed(mat).t();
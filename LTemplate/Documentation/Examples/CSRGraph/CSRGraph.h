@@ -0,0 +1,435 @@
+
+#include <LTemplate.h>
+
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <queue>
+#include <functional>
+#include <utility>
+#include <cmath>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+
+/* Undirected graph stored in compressed sparse row (CSR) form.
+ *
+ * Each edge {u, v} is stored as two arcs, u -> v and v -> u. The arcs starting at vertex v occupy
+ * positions offsets[v] .. offsets[v+1]-1 of the arc arrays, in the order of their edge indices.
+ * Compared to an adjacency list, this uses a few large arrays instead of one allocation per vertex,
+ * and traversals read memory sequentially.
+ *
+ * When compiled with OpenMP, construction and all queries use multiple threads. The results
+ * do not depend on the number of threads.
+ */
+class CSRGraph {
+    mint nv = 0;
+    std::vector<mint> ends;     // edge list, two entries per edge
+    std::vector<mint> offsets;  // nv+1 entries
+    std::vector<mint> arcs;     // the vertex each arc points to
+    std::vector<mint> arcEdges; // the edge index of each arc
+
+    typedef std::vector<std::atomic<mint>> atomic_vector;
+
+    mint ecount_() const { return ends.size() / 2; }
+
+    mint degree(mint v) const { return offsets[v+1] - offsets[v]; }
+
+    void checkVertex(mint v) const {
+        if (v < 0 || v >= nv)
+            throw mma::LibraryError("Vertex index out of range.");
+    }
+
+    static mint threadCount() {
+#ifdef _OPENMP
+        return omp_get_max_threads();
+#else
+        return 1;
+#endif
+    }
+
+    /* Union-find on an array of parent pointers, safe to use from multiple threads.
+     * Roots are always linked under smaller roots, so parent pointers only ever decrease,
+     * and the root of each set is its smallest element.
+     */
+    static mint findRoot(atomic_vector &parent, mint v) {
+        while (true) {
+            mint p = parent[v].load();
+            if (p == v)
+                return v;
+            const mint gp = parent[p].load();
+            if (gp != p)
+                parent[v].compare_exchange_weak(p, gp); // path halving; failure is harmless
+            v = gp;
+        }
+    }
+
+    static void unite(atomic_vector &parent, mint a, mint b) {
+        while (true) {
+            a = findRoot(parent, a);
+            b = findRoot(parent, b);
+            if (a == b)
+                return;
+            if (a < b)
+                std::swap(a, b);
+            mint expected = a;
+            if (parent[a].compare_exchange_strong(expected, b))
+                return;
+            // another thread has linked a in the meantime; retry from the new roots
+        }
+    }
+
+    // Single source shortest paths with non-negative edge weights
+    void dijkstra(mint source, const double *weights, double *dist) const {
+        typedef std::pair<double, mint> item;
+        std::priority_queue<item, std::vector<item>, std::greater<item>> queue;
+
+        std::fill(dist, dist + nv, -1.0);
+        dist[source] = 0;
+        queue.push(item(0, source));
+        while (! queue.empty()) {
+            const item top = queue.top();
+            queue.pop();
+            const mint v = top.second;
+            if (top.first > dist[v])
+                continue; // stale entry
+            for (mint k = offsets[v]; k < offsets[v+1]; ++k) {
+                const mint w = arcs[k];
+                const double d = top.first + weights[arcEdges[k]];
+                if (dist[w] < 0 || d < dist[w]) {
+                    dist[w] = d;
+                    queue.push(item(d, w));
+                }
+            }
+        }
+    }
+
+public:
+
+    // Set vertices and edges.
+    // Expected input: edge list with 0-based vertex indices.
+    void set(mint vcount, mma::IntMatrixRef elist) {
+        if (vcount < 0)
+            throw mma::LibraryError("The vertex count must not be negative.");
+        if (elist.cols() != 2)
+            throw mma::LibraryError("The edge list must be an n-by-2 matrix.");
+
+        const mint ne = elist.rows();
+        const mint *el = elist.data();
+
+        mint invalid = 0;
+#ifdef _OPENMP
+        #pragma omp parallel for reduction(+:invalid)
+#endif
+        for (mint i=0; i < 2*ne; ++i)
+            if (el[i] < 0 || el[i] >= vcount)
+                invalid++;
+        if (invalid > 0)
+            throw mma::LibraryError("Vertex indices must be between 0 and the vertex count minus one.");
+
+        /* Arc i starts at vertex el[i] and ends at el[i^1]; it belongs to edge i/2.
+         * The arcs are ordered by their starting vertex using a stable counting sort in two passes, without atomics:
+         *
+         *  1. Each thread takes a contiguous range of arcs, and distributes them into buckets of
+         *     consecutive vertices. Buckets are filled in the order of the threads, which keeps the sort stable.
+         *  2. Each bucket is counting-sorted independently. A bucket covers few enough vertices that
+         *     its counters stay in cache.
+         *
+         * Since the sort is stable, the arcs of each vertex end up in the order of their edge indices,
+         * regardless of the number of threads.
+         */
+        const mint narcs = 2*ne;
+        const int bucketBits = 12;
+        const mint bucketSize = mint(1) << bucketBits;
+        const mint nbuckets = (vcount >> bucketBits) + 1;
+        const mint nthreads = threadCount();
+
+        // pass 1: count the arcs of each thread in each bucket
+        std::vector<mint> bucketPos(nthreads*nbuckets);
+#ifdef _OPENMP
+        #pragma omp parallel for schedule(static, 1)
+#endif
+        for (mint t=0; t < nthreads; ++t) {
+            mint *count = &bucketPos[t*nbuckets];
+            for (mint i = narcs*t/nthreads; i < narcs*(t+1)/nthreads; ++i)
+                count[el[i] >> bucketBits]++;
+        }
+
+        std::vector<mint> bucketStart(nbuckets+1);
+        mint total = 0;
+        for (mint b=0; b < nbuckets; ++b) {
+            bucketStart[b] = total;
+            for (mint t=0; t < nthreads; ++t) {
+                const mint count = bucketPos[t*nbuckets + b];
+                bucketPos[t*nbuckets + b] = total;
+                total += count;
+            }
+        }
+        bucketStart[nbuckets] = total;
+
+        mma::check_abort();
+
+        std::vector<mint> bucketed(narcs);
+#ifdef _OPENMP
+        #pragma omp parallel for schedule(static, 1)
+#endif
+        for (mint t=0; t < nthreads; ++t) {
+            mint *pos = &bucketPos[t*nbuckets];
+            for (mint i = narcs*t/nthreads; i < narcs*(t+1)/nthreads; ++i)
+                bucketed[pos[el[i] >> bucketBits]++] = i;
+        }
+
+        mma::check_abort();
+
+        // pass 2: sort each bucket by vertex
+        std::vector<mint> newOffsets(vcount+1), newArcs(narcs), newArcEdges(narcs);
+#ifdef _OPENMP
+        #pragma omp parallel for schedule(dynamic)
+#endif
+        for (mint b=0; b < nbuckets; ++b) {
+            const mint first = b << bucketBits, last = std::min(first + bucketSize, vcount);
+            if (first >= last)
+                continue;
+
+            std::vector<mint> cursor(last - first);
+            for (mint k = bucketStart[b]; k < bucketStart[b+1]; ++k)
+                cursor[el[bucketed[k]] - first]++;
+            mint pos = bucketStart[b];
+            for (mint v = first; v < last; ++v) {
+                newOffsets[v] = pos;
+                const mint count = cursor[v - first];
+                cursor[v - first] = pos;
+                pos += count;
+            }
+
+            for (mint k = bucketStart[b]; k < bucketStart[b+1]; ++k) {
+                const mint i = bucketed[k];
+                const mint j = cursor[el[i] - first]++;
+                newArcs[j] = el[i^1];
+                newArcEdges[j] = i / 2;
+            }
+        }
+        newOffsets[vcount] = narcs;
+
+        // Only modify the graph once nothing can fail anymore
+        nv = vcount;
+        ends.assign(el, el + 2*ne);
+        offsets.swap(newOffsets);
+        arcs.swap(newArcs);
+        arcEdges.swap(newArcEdges);
+    }
+
+    // Vertex count.
+    mint vcount() const { return nv; }
+
+    // Edge count.
+    mint ecount() const { return ecount_(); }
+
+    // Retrive edge list.
+    // Output: edge list with 0-based vertex indices, in the original order.
+    mma::IntMatrixRef edgeList() const {
+        auto elist = mma::makeMatrix<mint>(ecount_(), 2);
+        std::copy(ends.begin(), ends.end(), elist.begin());
+        return elist;
+    }
+
+    // Neighbours of a vertex, in the order of the connecting edges.
+    // Self-loops are listed twice.
+    mma::IntTensorRef neighbours(mint v) const {
+        checkVertex(v);
+        return mma::makeVector<mint>(degree(v), arcs.data() + offsets[v]);
+    }
+
+    // Vertex degrees. Self-loops count twice.
+    mma::IntTensorRef degrees() const {
+        auto res = mma::makeVector<mint>(nv);
+#ifdef _OPENMP
+        #pragma omp parallel for
+#endif
+        for (mint v=0; v < nv; ++v)
+            res[v] = degree(v);
+        return res;
+    }
+
+    // Degree statistics: {minimum, maximum, mean, standard deviation}
+    mma::RealTensorRef degreeStatistics() const {
+        if (nv == 0)
+            throw mma::LibraryError("The graph has no vertices.");
+
+        mint dmin = degree(0), dmax = degree(0);
+        double sum = 0, sumsq = 0;
+#ifdef _OPENMP
+        #pragma omp parallel for reduction(min:dmin) reduction(max:dmax) reduction(+:sum,sumsq)
+#endif
+        for (mint v=0; v < nv; ++v) {
+            const mint d = degree(v);
+            dmin = std::min(dmin, d);
+            dmax = std::max(dmax, d);
+            sum += d;
+            sumsq += double(d)*d;
+        }
+        const double mean = sum / nv;
+        return mma::makeVector<double>({ double(dmin), double(dmax), mean, std::sqrt(std::max(0.0, sumsq/nv - mean*mean)) });
+    }
+
+    // Number of vertices of each degree: element d is the number of vertices with degree d.
+    mma::IntTensorRef degreeHistogram() const {
+        mint dmax = 0;
+#ifdef _OPENMP
+        #pragma omp parallel for reduction(max:dmax)
+#endif
+        for (mint v=0; v < nv; ++v)
+            dmax = std::max(dmax, degree(v));
+
+        atomic_vector counts(nv > 0 ? dmax+1 : 0);
+        for (auto &c : counts)
+            c.store(0, std::memory_order_relaxed);
+#ifdef _OPENMP
+        #pragma omp parallel for
+#endif
+        for (mint v=0; v < nv; ++v)
+            counts[degree(v)].fetch_add(1, std::memory_order_relaxed);
+
+        auto res = mma::makeVector<mint>(counts.size());
+        for (mint d=0; d < res.length(); ++d)
+            res[d] = counts[d].load(std::memory_order_relaxed);
+        return res;
+    }
+
+    /* Breadth-first search from a vertex.
+     * Returns the number of edges on the shortest path to each vertex, or -1 for unreachable vertices.
+     *
+     * The search proceeds level by level. The vertices of the current level are divided between threads,
+     * and each unvisited neighbour is claimed by exactly one thread using an atomic compare-and-swap.
+     */
+    mma::IntTensorRef bfs(mint source) const {
+        checkVertex(source);
+
+        atomic_vector dist(nv);
+#ifdef _OPENMP
+        #pragma omp parallel for
+#endif
+        for (mint v=0; v < nv; ++v)
+            dist[v].store(-1, std::memory_order_relaxed);
+        dist[source].store(0, std::memory_order_relaxed);
+
+        std::vector<mint> frontier(1, source), next;
+        for (mint level=1; ! frontier.empty(); ++level) {
+            mma::check_abort();
+            next.clear();
+            const mint fsize = frontier.size();
+#ifdef _OPENMP
+            #pragma omp parallel
+#endif
+            {
+                std::vector<mint> found;
+#ifdef _OPENMP
+                #pragma omp for schedule(dynamic, 256) nowait
+#endif
+                for (mint i=0; i < fsize; ++i) {
+                    const mint v = frontier[i];
+                    for (mint k = offsets[v]; k < offsets[v+1]; ++k) {
+                        const mint w = arcs[k];
+                        mint unvisited = -1;
+                        if (dist[w].load(std::memory_order_relaxed) == -1 &&
+                            dist[w].compare_exchange_strong(unvisited, level, std::memory_order_relaxed))
+                            found.push_back(w);
+                    }
+                }
+#ifdef _OPENMP
+                #pragma omp critical
+#endif
+                next.insert(next.end(), found.begin(), found.end());
+            }
+            frontier.swap(next);
+        }
+
+        auto res = mma::makeVector<mint>(nv);
+#ifdef _OPENMP
+        #pragma omp parallel for
+#endif
+        for (mint v=0; v < nv; ++v)
+            res[v] = dist[v].load(std::memory_order_relaxed);
+        return res;
+    }
+
+    /* Connected components.
+     * Returns the 0-based component index of each vertex. Components are numbered
+     * in the order of their smallest vertex.
+     */
+    mma::IntTensorRef connectedComponents() const {
+        atomic_vector parent(nv);
+#ifdef _OPENMP
+        #pragma omp parallel for
+#endif
+        for (mint v=0; v < nv; ++v)
+            parent[v].store(v, std::memory_order_relaxed);
+
+        const mint ne = ecount_();
+#ifdef _OPENMP
+        #pragma omp parallel for schedule(dynamic, 4096)
+#endif
+        for (mint e=0; e < ne; ++e)
+            unite(parent, ends[2*e], ends[2*e+1]);
+
+        mma::check_abort();
+
+        auto comp = mma::makeVector<mint>(nv);
+#ifdef _OPENMP
+        #pragma omp parallel for
+#endif
+        for (mint v=0; v < nv; ++v)
+            comp[v] = findRoot(parent, v);
+
+        // each root is the smallest vertex of its component
+        std::vector<mint> index(nv);
+        mint count = 0;
+        for (mint v=0; v < nv; ++v)
+            if (comp[v] == v)
+                index[v] = count++;
+
+#ifdef _OPENMP
+        #pragma omp parallel for
+#endif
+        for (mint v=0; v < nv; ++v)
+            comp[v] = index[comp[v]];
+        return comp;
+    }
+
+    /* Weighted shortest path lengths from each of the given source vertices to all vertices.
+     * The weights are given for each edge, in the order of the edge list, and must be non-negative.
+     * Returns a matrix with one row per source. Unreachable vertices are indicated by -1.
+     *
+     * Each source is handled by a single thread using Dijkstra's algorithm; different sources run in parallel.
+     */
+    mma::RealMatrixRef shortestPaths(mma::IntTensorRef sources, mma::RealTensorRef weights) const {
+        if (weights.length() != ecount_())
+            throw mma::LibraryError("There must be one weight for each edge.");
+        for (const auto &s : sources)
+            checkVertex(s);
+        for (const auto &w : weights)
+            if (! (w >= 0))
+                throw mma::LibraryError("Edge weights must be non-negative.");
+
+        const mint ns = sources.length();
+        auto res = mma::makeMatrix<double>(ns, nv);
+        try {
+            const mint batch = threadCount(); // sources processed between abort checks
+            for (mint first=0; first < ns; first += batch) {
+                mma::check_abort();
+                const mint last = std::min(first + batch, ns);
+#ifdef _OPENMP
+                #pragma omp parallel for schedule(dynamic)
+#endif
+                for (mint i=first; i < last; ++i)
+                    dijkstra(sources[i], weights.data(), res.data() + i*nv);
+            }
+        } catch (...) {
+            res.free();
+            throw;
+        }
+        return res;
+    }
+};
@@ -0,0 +1,70 @@
+
+#include <LTemplate.h>
+#include <eigenmap.h>
+
+#include <Eigen/Dense>
+#include <memory>
+
+// eigenmap.h provides Eigen views of Tensors without copying.
+// Mathematica matrices are viewed as row-major Eigen matrices, so no transposition is necessary.
+
+class EigenDemo {
+    // A sparse matrix kept by the class, see setOperator()
+    std::unique_ptr<mma::EigenSparseView<double>> op;
+
+public:
+    ~EigenDemo() {
+        if (op)
+            op->sparseMatrix().disown();
+    }
+
+    // Matrix product, computed by Eigen directly into the returned Tensor
+    mma::RealMatrixRef dot(mma::RealMatrixRef a, mma::RealMatrixRef b) {
+        if (a.cols() != b.rows())
+            throw mma::LibraryError("Incompatible matrix dimensions.");
+        return mma::makeMatrixFromEigen<double>(a.rows(), b.cols(), [&] (mma::EigenMatrixMap<double> &res) {
+            res.noalias() = mma::eigenMap(a) * mma::eigenMap(b);
+        });
+    }
+
+    // Solve a linear equation using LU decomposition with partial pivoting
+    mma::RealTensorRef solve(mma::RealMatrixRef a, mma::RealTensorRef b) {
+        if (a.rows() != a.cols() || a.rows() != b.length())
+            throw mma::LibraryError("A square matrix and a vector of the same size are expected.");
+        const auto lu = mma::eigenMap(a).partialPivLu();
+        return mma::makeVectorFromEigen<double>(a.cols(), [&] (mma::EigenVectorMap<double> &x) {
+            x = lu.solve(mma::eigenMap(b));
+        });
+    }
+
+    // Store a sparse matrix, passed with "Shared" passing.
+    // The conversion of column indices to 0-based happens only here, not on every use.
+    void setOperator(mma::SparseMatrixRef<double> sm) {
+        if (op)
+            op->sparseMatrix().disown();
+        op.reset();
+        try {
+            op.reset(new mma::EigenSparseView<double>(sm));
+        } catch (...) {
+            sm.disown();
+            throw;
+        }
+    }
+
+    // Multiply a vector by the stored sparse matrix
+    mma::RealTensorRef applyOperator(mma::RealTensorRef v) {
+        if (! op)
+            throw mma::LibraryError("No operator has been set.");
+        if (v.length() != op->cols())
+            throw mma::LibraryError("The vector length does not match the operator.");
+        return mma::makeVectorFromEigen<double>(op->rows(), [&] (mma::EigenVectorMap<double> &res) {
+            res.noalias() = op->map() * mma::eigenMap(v);
+        });
+    }
+
+    // Transpose of a sparse matrix; sparse results must be copied into a new SparseArray
+    mma::SparseMatrixRef<double> transpose(mma::SparseMatrixRef<double> sm) {
+        mma::EigenSparseView<double> view(sm);
+        return mma::makeSparseMatrixFromEigen(view.map().transpose());
+    }
+};
@@ -0,0 +1,506 @@
+
+#include <LTemplate.h>
+
+#include <vector>
+#include <algorithm>
+#include <utility>
+#include <cmath>
+#include <chrono>
+
+
+/* Hierarchical matrix (H-matrix) approximation of a dense kernel matrix A(i,j) = k(p_i, p_j)
+ *
+ * Kernel matrices arising from boundary element methods and particle interactions are dense,
+ * but the interaction between two well separated groups of points is smooth, and can be approximated
+ * by a matrix of low rank. An H-matrix stores such blocks in factored form, U.V, and only the
+ * remaining blocks near the diagonal explicitly. This reduces memory use and the cost of a
+ * matrix-vector product from O(N^2) to roughly O(N log N).
+ *
+ *  - The points are organized into a cluster tree by recursively bisecting their bounding box.
+ *  - The matrix is partitioned into blocks of cluster pairs. A block is admissible, i.e. approximated
+ *    by a low-rank matrix, if min(diam(s), diam(t)) <= eta dist(s, t).
+ *  - Admissible blocks are compressed with adaptive cross approximation (ACA) with partial pivoting,
+ *    which computes only a few rows and columns of the block.
+ *
+ * When compiled with OpenMP, blocks are assembled in parallel, and matrix-vector products are
+ * parallelized over disjoint groups of rows. The results do not depend on the number of threads.
+ */
+class HMatrix {
+
+    /* Kernels are function objects with an operator () (const double *x, const double *y) returning k(x, y).
+     * To add a new kernel, define a class like the ones below and add it to set().
+     */
+    struct KernelBase {
+        mint dim;
+
+        double distance(const double *x, const double *y) const {
+            double r2 = 0;
+            for (mint i=0; i < dim; ++i)
+                r2 += (x[i] - y[i])*(x[i] - y[i]);
+            return std::sqrt(r2);
+        }
+    };
+
+    // 1/r, the fundamental solution of the 3D Laplace equation up to a constant factor
+    struct CoulombKernel : KernelBase {
+        double operator () (const double *x, const double *y) const {
+            double r = distance(x, y);
+            return r == 0 ? 0 : 1/r; // the singular diagonal is left to the caller
+        }
+    };
+
+    // -log r, the fundamental solution of the 2D Laplace equation up to a constant factor
+    struct LogarithmicKernel : KernelBase {
+        double operator () (const double *x, const double *y) const {
+            double r = distance(x, y);
+            return r == 0 ? 0 : -std::log(r);
+        }
+    };
+
+    // exp(-r^2)
+    struct GaussianKernel : KernelBase {
+        double operator () (const double *x, const double *y) const {
+            double r = distance(x, y);
+            return std::exp(-r*r);
+        }
+    };
+
+    // A node of the cluster tree: points begin .. end-1 in cluster order, and their bounding box
+    struct Cluster {
+        mint begin, end;
+        std::vector<double> lo, hi;
+        mint child[2] = {-1, -1};
+
+        mint size() const { return end - begin; }
+        bool leafQ() const { return child[0] == -1; }
+    };
+
+    /* A leaf of the block partition. Dense blocks store their m by n entries,
+     * low-rank blocks store the m by rank matrix U followed by the rank by n matrix V.
+     * Both are row-major.
+     */
+    struct Block {
+        mint s, t;      // row and column clusters
+        mint rank = -1; // -1 for dense blocks
+        std::vector<double> data;
+    };
+
+    mint dim = 0;
+    mint npoints = 0;
+    std::vector<double> coords;     // point coordinates in cluster order
+    std::vector<mint> perm;         // perm[i] is the original index of the i-th point in cluster order
+    std::vector<Cluster> clusters;  // clusters[0] is the root
+    std::vector<Block> blocks;
+
+    // For each leaf cluster, the blocks that contain its rows, and the position of its first row within them.
+    // Leaf clusters partition the rows, so they can be processed in parallel during a matrix-vector product.
+    std::vector<mint> leaves;
+    std::vector<std::vector<std::pair<mint, mint>>> leafBlocks;
+
+    double assemblySeconds = 0;
+
+    static double diameter(const Cluster &c) {
+        double d2 = 0;
+        for (size_t i=0; i < c.lo.size(); ++i)
+            d2 += (c.hi[i] - c.lo[i])*(c.hi[i] - c.lo[i]);
+        return std::sqrt(d2);
+    }
+
+    static double distance(const Cluster &a, const Cluster &b) {
+        double d2 = 0;
+        for (size_t i=0; i < a.lo.size(); ++i) {
+            double gap = std::max(0.0, std::max(a.lo[i] - b.hi[i], b.lo[i] - a.hi[i]));
+            d2 += gap*gap;
+        }
+        return std::sqrt(d2);
+    }
+
+    const double *point(mint i) const { return &coords[dim*i]; }
+
+    // Build the subtree of points begin .. end-1 of perm, and return its index
+    mint buildCluster(const mma::RealMatrixRef &pts, mint begin, mint end, mint leafSize) {
+        Cluster c;
+        c.begin = begin;
+        c.end = end;
+        c.lo.assign(dim, +HUGE_VAL);
+        c.hi.assign(dim, -HUGE_VAL);
+        for (mint i=begin; i < end; ++i)
+            for (mint k=0; k < dim; ++k) {
+                c.lo[k] = std::min(c.lo[k], pts(perm[i], k));
+                c.hi[k] = std::max(c.hi[k], pts(perm[i], k));
+            }
+
+        const mint index = clusters.size();
+        clusters.push_back(c);
+
+        if (end - begin > leafSize) {
+            // split at the median along the longest side of the bounding box
+            mint axis = 0;
+            for (mint k=1; k < dim; ++k)
+                if (c.hi[k] - c.lo[k] > c.hi[axis] - c.lo[axis])
+                    axis = k;
+            const mint mid = begin + (end - begin) / 2;
+            std::nth_element(perm.begin() + begin, perm.begin() + mid, perm.begin() + end, [&] (mint i, mint j) {
+                return pts(i, axis) < pts(j, axis) || (pts(i, axis) == pts(j, axis) && i < j);
+            });
+
+            const mint left = buildCluster(pts, begin, mid, leafSize);
+            const mint right = buildCluster(pts, mid, end, leafSize);
+            clusters[index].child[0] = left;
+            clusters[index].child[1] = right;
+        }
+        return index;
+    }
+
+    // Partition the block of clusters s and t
+    void buildBlocks(mint s, mint t, double eta) {
+        const Cluster &cs = clusters[s], &ct = clusters[t];
+        if (std::min(diameter(cs), diameter(ct)) <= eta*distance(cs, ct)) {
+            Block b;
+            b.s = s; b.t = t; b.rank = 0; // to be compressed
+            blocks.push_back(b);
+        } else if (cs.leafQ() || ct.leafQ()) {
+            Block b;
+            b.s = s; b.t = t;
+            blocks.push_back(b);
+        } else {
+            for (const mint &sc : cs.child)
+                for (const mint &tc : ct.child)
+                    buildBlocks(sc, tc, eta);
+        }
+    }
+
+    template<typename Kernel>
+    void assembleDense(const Kernel &kernel, Block &b) const {
+        const Cluster &cs = clusters[b.s], &ct = clusters[b.t];
+        b.rank = -1;
+        b.data.resize(cs.size() * ct.size());
+        double *out = b.data.data();
+        for (mint i=cs.begin; i < cs.end; ++i)
+            for (mint j=ct.begin; j < ct.end; ++j)
+                *out++ = kernel(point(i), point(j));
+    }
+
+    /* Adaptive cross approximation with partial pivoting.
+     * Builds A ~ sum_l u_l v_l^T one cross at a time, from a single residual row and column per step,
+     * until |u_k| |v_k| <= tol |S_k|_F, where S_k is the current approximation.
+     * Returns false if the block cannot be compressed below the storage size of the dense block.
+     */
+    template<typename Kernel>
+    bool assembleLowRank(const Kernel &kernel, Block &b, double tol) const {
+        const Cluster &cs = clusters[b.s], &ct = clusters[b.t];
+        const mint m = cs.size(), n = ct.size();
+        const mint maxRank = (m*n) / (m+n);
+
+        std::vector<double> us, vs; // columns of U and rows of V, one after the other
+        std::vector<double> row(n), col(m);
+        std::vector<char> usedRow(m);
+        double norm2 = 0; // squared Frobenius norm of the approximation
+        mint rank = 0;
+        mint i = 0;
+        bool converged = false;
+        while (rank < maxRank) {
+            usedRow[i] = true;
+
+            // residual row i
+            for (mint j=0; j < n; ++j)
+                row[j] = kernel(point(cs.begin + i), point(ct.begin + j));
+            for (mint l=0; l < rank; ++l) {
+                const double ui = us[l*m + i];
+                const double *vl = &vs[l*n];
+                for (mint j=0; j < n; ++j)
+                    row[j] -= ui*vl[j];
+            }
+            mint jmax = 0;
+            for (mint j=1; j < n; ++j)
+                if (std::abs(row[j]) > std::abs(row[jmax]))
+                    jmax = j;
+
+            if (row[jmax] == 0) {
+                // this row is already approximated exactly; try another one
+                i = std::find(usedRow.begin(), usedRow.end(), false) - usedRow.begin();
+                if (i == m) {
+                    converged = true;
+                    break;
+                }
+                continue;
+            }
+
+            // residual column jmax
+            for (mint r=0; r < m; ++r)
+                col[r] = kernel(point(cs.begin + r), point(ct.begin + jmax));
+            for (mint l=0; l < rank; ++l) {
+                const double vj = vs[l*n + jmax];
+                const double *ul = &us[l*m];
+                for (mint r=0; r < m; ++r)
+                    col[r] -= vj*ul[r];
+            }
+
+            const double pivot = row[jmax];
+            for (auto &el : row)
+                el /= pivot;
+
+            // |S_k|^2 = |S_{k-1}|^2 + 2 sum_l (u_l.u)(v_l.v) + |u|^2 |v|^2
+            double unorm2 = 0, vnorm2 = 0;
+            for (mint r=0; r < m; ++r) unorm2 += col[r]*col[r];
+            for (mint j=0; j < n; ++j) vnorm2 += row[j]*row[j];
+            for (mint l=0; l < rank; ++l) {
+                double uu = 0, vv = 0;
+                for (mint r=0; r < m; ++r) uu += us[l*m + r]*col[r];
+                for (mint j=0; j < n; ++j) vv += vs[l*n + j]*row[j];
+                norm2 += 2*uu*vv;
+            }
+            norm2 += unorm2*vnorm2;
+
+            us.insert(us.end(), col.begin(), col.end());
+            vs.insert(vs.end(), row.begin(), row.end());
+            ++rank;
+
+            if (unorm2*vnorm2 <= tol*tol*norm2) {
+                converged = true;
+                break;
+            }
+
+            // the next pivot row is where the new column is largest
+            i = -1;
+            for (mint r=0; r < m; ++r)
+                if (! usedRow[r] && (i == -1 || std::abs(col[r]) > std::abs(col[i])))
+                    i = r;
+            if (i == -1) {
+                converged = true;
+                break;
+            }
+        }
+
+        if (! converged)
+            return false;
+
+        // store U row-major, followed by V
+        b.rank = rank;
+        b.data.resize(rank*(m+n));
+        for (mint r=0; r < m; ++r)
+            for (mint l=0; l < rank; ++l)
+                b.data[r*rank + l] = us[l*m + r];
+        std::copy(vs.begin(), vs.end(), b.data.begin() + m*rank);
+        return true;
+    }
+
+    template<typename Kernel>
+    void assemble(const Kernel &kernel, double tol) {
+        const mint nblocks = blocks.size();
+        const mint band = 256;
+        for (mint start=0; start < nblocks; start += band) {
+            const mint end = std::min(nblocks, start + band);
+#ifdef _OPENMP
+            #pragma omp parallel for schedule(dynamic)
+#endif
+            for (mint k=start; k < end; ++k) {
+                Block &b = blocks[k];
+                if (b.rank == -1 || ! assembleLowRank(kernel, b, tol))
+                    assembleDense(kernel, b);
+            }
+            mma::check_abort();
+        }
+    }
+
+    void collectLeaves(mint c, std::vector<mint> &result) const {
+        if (clusters[c].leafQ())
+            result.push_back(c);
+        else
+            for (const mint &child : clusters[c].child)
+                collectLeaves(child, result);
+    }
+
+    void clear() {
+        dim = npoints = 0;
+        coords.clear();
+        perm.clear();
+        clusters.clear();
+        blocks.clear();
+        leaves.clear();
+        leafBlocks.clear();
+        assemblySeconds = 0;
+    }
+
+    void checkSet() const {
+        if (npoints == 0)
+            throw mma::LibraryError("The H-matrix has not been set.");
+    }
+
+public:
+    /* Set up an H-matrix for the given kernel and points
+     *
+     * points is an N by d matrix. kernel is one of "Coulomb" (1/r), "Logarithmic" (-log r) or "Gaussian" (exp(-r^2)).
+     * The singular kernels are set to zero on the diagonal. tol is the relative accuracy of the low-rank blocks,
+     * eta is the admissibility parameter and leafSize is the largest number of points in a leaf cluster.
+     */
+    void set(mma::RealMatrixRef points, mma::StringRef kernel, double tol, double eta, mint leafSize) {
+        if (points.rows() == 0 || points.cols() == 0)
+            throw mma::LibraryError("At least one point is required.");
+        if (! (tol > 0) || ! (eta > 0) || leafSize < 1)
+            throw mma::LibraryError("The tolerance, admissibility parameter and leaf size must be positive.");
+
+        clear();
+        try {
+            auto start = std::chrono::steady_clock::now();
+
+            dim = points.cols();
+            npoints = points.rows();
+            perm.resize(npoints);
+            for (mint i=0; i < npoints; ++i)
+                perm[i] = i;
+            buildCluster(points, 0, npoints, leafSize);
+            coords.resize(npoints*dim);
+            for (mint i=0; i < npoints; ++i)
+                std::copy(&points(perm[i], 0), &points(perm[i], 0) + dim, &coords[i*dim]);
+
+            buildBlocks(0, 0, eta);
+
+            if (kernel == "Coulomb") {
+                CoulombKernel k; k.dim = dim;
+                assemble(k, tol);
+            } else if (kernel == "Logarithmic") {
+                LogarithmicKernel k; k.dim = dim;
+                assemble(k, tol);
+            } else if (kernel == "Gaussian") {
+                GaussianKernel k; k.dim = dim;
+                assemble(k, tol);
+            } else {
+                throw mma::LibraryError("Unknown kernel.");
+            }
+
+            collectLeaves(0, leaves);
+            std::vector<mint> leafIndex(clusters.size(), -1);
+            for (size_t l=0; l < leaves.size(); ++l)
+                leafIndex[leaves[l]] = l;
+            leafBlocks.resize(leaves.size());
+            for (size_t k=0; k < blocks.size(); ++k) {
+                std::vector<mint> blockLeaves;
+                collectLeaves(blocks[k].s, blockLeaves);
+                for (const auto &c : blockLeaves)
+                    leafBlocks[leafIndex[c]].push_back({mint(k), clusters[c].begin - clusters[blocks[k].s].begin});
+            }
+
+            assemblySeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        } catch (...) {
+            clear();
+            throw;
+        }
+    }
+
+    // Number of rows and columns
+    mint size() const { return npoints; }
+
+    // Matrix-vector product
+    mma::RealTensorRef dot(mma::RealTensorRef x) const {
+        checkSet();
+        if (x.length() != npoints)
+            throw mma::LibraryError("The vector length does not match the size of the matrix.");
+
+        // work in cluster order
+        std::vector<double> xp(npoints), yp(npoints);
+        for (mint i=0; i < npoints; ++i)
+            xp[i] = x[perm[i]];
+
+        // V.x for low-rank blocks
+        const mint nblocks = blocks.size();
+        std::vector<std::vector<double>> vx(nblocks);
+#ifdef _OPENMP
+        #pragma omp parallel for schedule(dynamic)
+#endif
+        for (mint k=0; k < nblocks; ++k) {
+            const Block &b = blocks[k];
+            if (b.rank <= 0)
+                continue;
+            const Cluster &cs = clusters[b.s], &ct = clusters[b.t];
+            const double *v = b.data.data() + cs.size()*b.rank;
+            vx[k].assign(b.rank, 0.0);
+            for (mint l=0; l < b.rank; ++l) {
+                double sum = 0;
+                for (mint j=0; j < ct.size(); ++j)
+                    sum += v[l*ct.size() + j] * xp[ct.begin + j];
+                vx[k][l] = sum;
+            }
+        }
+
+        // Rows of different leaf clusters are disjoint, so each thread writes to its own part of the result.
+        const mint nleaves = leaves.size();
+#ifdef _OPENMP
+        #pragma omp parallel for schedule(dynamic)
+#endif
+        for (mint l=0; l < nleaves; ++l) {
+            const Cluster &leaf = clusters[leaves[l]];
+            for (const auto &entry : leafBlocks[l]) {
+                const Block &b = blocks[entry.first];
+                if (b.rank == 0) // numerically zero block, b.data is empty
+                    continue;
+                const Cluster &ct = clusters[b.t];
+                for (mint i=0; i < leaf.size(); ++i) {
+                    const mint r = entry.second + i; // row within the block
+                    double sum = 0;
+                    if (b.rank == -1) {
+                        const double *a = b.data.data() + r*ct.size();
+                        for (mint j=0; j < ct.size(); ++j)
+                            sum += a[j] * xp[ct.begin + j];
+                    } else {
+                        const double *u = b.data.data() + r*b.rank;
+                        for (mint k=0; k < b.rank; ++k)
+                            sum += u[k] * vx[entry.first][k];
+                    }
+                    yp[leaf.begin + i] += sum;
+                }
+            }
+        }
+
+        auto y = mma::makeVector<double>(npoints);
+        for (mint i=0; i < npoints; ++i)
+            y[perm[i]] = yp[i];
+        return y;
+    }
+
+    // The full matrix, for verification with small sizes
+    mma::RealMatrixRef normal() const {
+        checkSet();
+        auto mat = mma::makeMatrix<double>(npoints, npoints);
+        for (const auto &b : blocks) {
+            const Cluster &cs = clusters[b.s], &ct = clusters[b.t];
+            for (mint i=0; i < cs.size(); ++i)
+                for (mint j=0; j < ct.size(); ++j) {
+                    double value;
+                    if (b.rank == -1) {
+                        value = b.data[i*ct.size() + j];
+                    } else {
+                        value = 0;
+                        for (mint l=0; l < b.rank; ++l)
+                            value += b.data[i*b.rank + l] * b.data[cs.size()*b.rank + l*ct.size() + j];
+                    }
+                    mat(perm[cs.begin + i], perm[ct.begin + j]) = value;
+                }
+        }
+        return mat;
+    }
+
+    /* Compression statistics:
+     * {size, dense blocks, low-rank blocks, stored values, stored values / size^2,
+     *  largest rank, mean rank, assembly time in seconds}
+     */
+    mma::RealTensorRef statistics() const {
+        checkSet();
+        mint dense = 0, lowRank = 0, maxRank = 0;
+        double stored = 0, rankSum = 0;
+        for (const auto &b : blocks) {
+            stored += b.data.size();
+            if (b.rank == -1) {
+                dense++;
+            } else {
+                lowRank++;
+                rankSum += b.rank;
+                maxRank = std::max(maxRank, b.rank);
+            }
+        }
+        return mma::makeVector<double>({
+            double(npoints), double(dense), double(lowRank), stored, stored / (double(npoints)*npoints),
+            double(maxRank), lowRank > 0 ? rankSum / lowRank : 0.0, assemblySeconds
+        });
+    }
+};
@@ -2,6 +2,9 @@
 #include <LTemplate.h>
 #include <complex>
 #include <algorithm>
+#include <limits>
+#include <chrono>
+#include <string>
 
 
 struct Img {
@@ -79,30 +82,53 @@ struct Img {
      * - Creating new images
      * - Indexing into an image by pixel position
      *
+     * The value of each pixel is one more than the number of iterations taken before the point escaped,
+     * or 0 for points that did not escape. See mandelbrotImage() for how the image is computed.
      */
     mma::GenericImageRef mandelbrot(mma::complex_t lower, mma::complex_t upper, mint width, mint iter) {
+        return mandelbrotImage(lower, upper, width, iter, "Byte");
+    }
+
+    /* Creates a Mandelbrot set image of the given type: "Byte", "Bit16", "Real32" or "Real".
+     * Integer images store iteration counts like mandelbrot() does, and limit the number of iterations
+     * to what the type can represent. Real images store iteration counts divided by 'iter'.
+     *
+     * Demonstrated features:
+     *
+     * - Dispatching to the correct function based on the requested image type
+     * - Writing code that the compiler can vectorize: several pixels are iterated in lockstep
+     * - Distributing rows between threads with OpenMP, when enabled
+     * - Interrupting long computations with mma::check_abort() outside of parallel regions
+     *
+     */
+    mma::GenericImageRef mandelbrotImage(mma::complex_t lower, mma::complex_t upper, mint width, mint iter, mma::StringRef type) {
         if (! (upper.real() > lower.real() && upper.imag() > lower.imag()) )
             throw mma::LibraryError("Real and imaginary parts of 'upper' must be greater than that of 'lower'.");
-        if (iter > 255) {
-            iter = 255;
-            mma::message("The maximum number of iterations is 255. No more than this will be tried.");
-        }
-        double rat = (upper.real() - lower.real()) / width;
-        mint height = (upper.imag() - lower.imag()) / rat;
-        auto im = mma::makeImage<mma::im_byte_t>(width, height);
-
-        for (int i=0; i < height; ++i)
-            for (int j=0; j < width; ++j) {
-                mma::complex_t z = 0,  c = lower + mma::complex_t(j,i)*rat;
-                int k=0;
-                while (std::abs(z) < 2 && k < iter) {
-                    z = z*z+c;
-                    k++;
-                }
-                im(height - i - 1, j) = k == iter ? 0 : k+1;
-            }
+        if (width <= 0)
+            throw mma::LibraryError("The image width must be positive.");
+        if (iter < 0)
+            throw mma::LibraryError("The number of iterations must be non-negative.");
 
-        return im;
+        if (type == "Byte")
+            return render<mma::im_byte_t>(lower, upper, width, iter);
+        else if (type == "Bit16")
+            return render<mma::im_bit16_t>(lower, upper, width, iter);
+        else if (type == "Real32")
+            return render<mma::im_real32_t>(lower, upper, width, iter);
+        else if (type == "Real")
+            return render<mma::im_real_t>(lower, upper, width, iter);
+        else
+            throw mma::LibraryError("The image type must be one of \"Byte\", \"Bit16\", \"Real32\" or \"Real\".");
+    }
+
+    /* Performance of the last Mandelbrot set computation:
+     * {time in seconds, number of pixels, total number of iterations, iterations per second}
+     */
+    mma::RealTensorRef mandelbrotStatistics() {
+        return mma::makeVector<double>({
+            statSeconds, double(statPixels), double(statIterations),
+            statSeconds > 0 ? statIterations / statSeconds : 0.0
+        });
     }
 
     /* Adjusts each channel of an image so that the values span the whole available range (defined through top()).
@@ -140,6 +166,98 @@ struct Img {
 
 private:
 
+    // Statistics of the last Mandelbrot set computation
+    double statSeconds = 0;
+    mint statPixels = 0, statIterations = 0;
+
+    // Number of pixels iterated together; chosen so that the compiler can fill a few vector registers
+    static const int lanes = 8;
+
+    /* Escape counts for `lanes` points with the same imaginary part. A count equal to iter means that
+     * the point did not escape. All lanes are iterated until every one of them has escaped: once |z| > 2,
+     * |z| keeps growing, so escaped lanes do not come back. The comparison is done on |z|^2 to avoid
+     * a square root in each iteration.
+     */
+    static void escapeCounts(const double *cr, double ci, mint iter, mint *count) {
+        double zr[lanes], zi[lanes];
+        for (int l=0; l < lanes; ++l) {
+            zr[l] = zi[l] = 0;
+            count[l] = 0;
+        }
+        for (mint n=0; n < iter; ++n) {
+            mint active = 0;
+#ifdef _OPENMP
+            #pragma omp simd reduction(+:active)
+#endif
+            for (int l=0; l < lanes; ++l) {
+                const double zr2 = zr[l]*zr[l], zi2 = zi[l]*zi[l];
+                const mint inside = zr2 + zi2 < 4 ? 1 : 0;
+                count[l] += inside;
+                active += inside;
+                zi[l] = 2*zr[l]*zi[l] + ci;
+                zr[l] = zr2 - zi2 + cr[l];
+            }
+            if (active == 0)
+                break;
+        }
+    }
+
+    // Pixel value for an escape count
+    template<typename T>
+    static T shade(mint k, mint iter) {
+        if (k == iter)
+            return 0;
+        return std::numeric_limits<T>::is_integer ? T(k+1) : T(double(k+1) / iter);
+    }
+
+    // Specialized version of mandelbrotImage() for each image type
+    template<typename T>
+    mma::GenericImageRef render(mma::complex_t lower, mma::complex_t upper, mint width, mint iter) {
+        if (std::numeric_limits<T>::is_integer && iter > mint(mma::imageMax<T>())) {
+            iter = mma::imageMax<T>();
+            mma::message("The maximum number of iterations for this image type is " + std::to_string(iter) + ". No more than this will be tried.");
+        }
+        const double rat = (upper.real() - lower.real()) / width;
+        const mint height = (upper.imag() - lower.imag()) / rat;
+        auto im = mma::makeImage<T>(width, height);
+
+        // Rows are processed in bands. Between bands, we check for aborts outside of the parallel region.
+        const mint band = 64;
+        mint total = 0;
+        const auto start = std::chrono::steady_clock::now();
+        try {
+            for (mint first=0; first < height; first += band) {
+                mma::check_abort();
+                const mint last = std::min(first + band, height);
+#ifdef _OPENMP
+                #pragma omp parallel for schedule(dynamic) reduction(+:total)
+#endif
+                for (mint i=first; i < last; ++i) {
+                    const double ci = lower.imag() + i*rat;
+                    double cr[lanes];
+                    mint count[lanes];
+                    for (mint j=0; j < width; j += lanes) {
+                        // at the end of the row, unused lanes duplicate the last pixel
+                        for (int l=0; l < lanes; ++l)
+                            cr[l] = lower.real() + std::min(j+l, width-1)*rat;
+                        escapeCounts(cr, ci, iter, count);
+                        for (int l=0; l < lanes && j+l < width; ++l) {
+                            im(height - i - 1, j+l) = shade<T>(count[l], iter);
+                            total += count[l];
+                        }
+                    }
+                }
+            }
+        } catch (...) {
+            im.free();
+            throw;
+        }
+        statSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        statPixels = width*height;
+        statIterations = total;
+        return im;
+    }
+
     // Specialized version of adjust() for each image type
     template<typename T> void iadjust(mma::ImageRef<T> im) {
         for (int ch=0; ch < im.nonAlphaChannels(); ++ch) {
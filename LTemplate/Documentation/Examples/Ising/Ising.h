@@ -1,126 +1,481 @@
 
 #include <LTemplate.h>
+#include <philox.h>
 
 #include <random>
 #include <cmath>
+#include <cstdint>
+#include <vector>
+#include <algorithm>
 
-// Auxiliary class for holding the spin state
-template<typename T>
-class Matrix {
+// Number of set bits in a word
+inline int popcount(uint64_t x) {
+#if defined(__GNUC__)
+    return __builtin_popcountll(x);
+#else
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return int((x * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+
+/* Spin lattice with free boundary conditions, stored with multi-spin coding.
+ *
+ * Site (i,j) has colour (i+j) % 2. All neighbours of a site have the other colour,
+ * thus all sites of the same colour can be updated simultaneously (checkerboard decomposition).
+ *
+ * Each row of each colour is packed into 64-bit words, one bit per spin: 1 is up, 0 is down.
+ * Bit k of row i of colour c is the site at column 2k + (i+c) % 2. Unused bits are always 0.
+ * With this layout, the vertical neighbours of bit k are bit k of the other colour in the adjacent rows,
+ * and the horizontal neighbours are bits k and k-1 or k and k+1 of the other colour in the same row.
+ */
+class SpinLattice {
     int nrows, ncols;
-    T *data;
-    
+    int nwords; // words per row per colour
+    std::vector<uint64_t> bits[2];
+
 public:
-    Matrix(int r, int c) : nrows(r), ncols(c) {
-        data = new T[nrows*ncols];    
-    }
-    
-    ~Matrix() { delete [] data; }
-    
-    T & operator () (int i, int j) { return data[i*ncols + j]; }
-    const T & operator () (int i, int j) const { return data[i*ncols + j]; }
-
-    T & operator [] (int i) { return data[i]; }
-    const T & operator [] (int i) const { return data[i]; }
-    
+    SpinLattice(int r, int c) : nrows(r), ncols(c), nwords(((c+1)/2 + 63) / 64) {
+        bits[0].assign(size_t(nrows)*nwords, 0);
+        bits[1].assign(size_t(nrows)*nwords, 0);
+    }
+
     int rows() const { return nrows; }
     int cols() const { return ncols; }
     int size() const { return nrows*ncols; }
-    
-    T *begin() { return data; }
-    T *end() { return data + size(); }
+    int words() const { return nwords; }
+
+    uint64_t *row(int colour, int i) { return &bits[colour][size_t(i)*nwords]; }
+    const uint64_t *row(int colour, int i) const { return &bits[colour][size_t(i)*nwords]; }
+
+    // Column of bit 0 in row i of the given colour
+    int offset(int colour, int i) const { return (i + colour) % 2; }
+
+    // Number of sites in row i of the given colour
+    int count(int colour, int i) const { return (ncols - offset(colour, i) + 1) / 2; }
+
+    // Mask of the bits of word w that correspond to lattice sites
+    uint64_t valid(int colour, int i, int w) const {
+        int n = count(colour, i) - 64*w;
+        return n >= 64 ? ~uint64_t(0) : n > 0 ? (uint64_t(1) << n) - 1 : 0;
+    }
+
+    bool get(int i, int j) const {
+        int k = j / 2;
+        return (row((i+j) % 2, i)[k / 64] >> (k % 64)) & 1;
+    }
+
+    void set(int i, int j, bool up) {
+        int k = j / 2;
+        uint64_t &word = row((i+j) % 2, i)[k / 64];
+        const uint64_t bit = uint64_t(1) << (k % 64);
+        word = up ? (word | bit) : (word & ~bit);
+    }
 };
 
-typedef Matrix<bool> StateMatrix;
 
-// Convert bool value to -1 or +1
-inline int spin(bool b) { return 2*b-1; }
+/* The four neighbours of the spins in one word, and masks of which neighbours exist.
+ * Neighbours that are outside of the lattice have their presence bit cleared.
+ */
+struct Neighbours {
+    uint64_t spin[4], present[4];
+
+    Neighbours(const SpinLattice &lat, int colour, int i, int w) {
+        const int other = 1 - colour;
+        const int last = lat.words() - 1;
+        const uint64_t valid = lat.valid(colour, i, w);
+
+        // vertical: same columns in the rows above and below
+        spin[0] = i > 0 ? lat.row(other, i-1)[w] : 0;
+        present[0] = i > 0 ? valid : 0;
+        spin[1] = i < lat.rows()-1 ? lat.row(other, i+1)[w] : 0;
+        present[1] = i < lat.rows()-1 ? valid : 0;
+
+        // horizontal: bit k and either bit k-1 or bit k+1 in the same row
+        const uint64_t *side = lat.row(other, i);
+        spin[2] = side[w];
+        present[2] = lat.valid(other, i, w);
+        if (lat.offset(colour, i) == 0) {
+            spin[3]    = (side[w] << 1)              | (w > 0 ? side[w-1] >> 63 : 0);
+            present[3] = (lat.valid(other, i, w) << 1) | (w > 0 ? lat.valid(other, i, w-1) >> 63 : 0);
+        } else {
+            spin[3]    = (side[w] >> 1)              | (w < last ? side[w+1] << 63 : 0);
+            present[3] = (lat.valid(other, i, w) >> 1) | (w < last ? lat.valid(other, i, w+1) << 63 : 0);
+        }
+    }
+};
+
+
+/* Bit-sliced counts of parallel and antiparallel neighbours of 64 spins:
+ * the number of parallel neighbours of bit k is  p0_k + 2 p1_k + 4 p2_k,  similarly for antiparallel ones.
+ */
+struct BondCounts {
+    uint64_t p0, p1, p2, a0, a1, a2;
+
+    // Sum of four single-bit values, bit by bit
+    static void add4(const uint64_t x[4], uint64_t &s0, uint64_t &s1, uint64_t &s2) {
+        const uint64_t a = x[0] ^ x[1], ac = x[0] & x[1];
+        const uint64_t b = x[2] ^ x[3], bc = x[2] & x[3];
+        const uint64_t c = a & b;
+        s0 = a ^ b;
+        s1 = ac ^ bc ^ c;
+        s2 = ac & bc;
+    }
+
+    BondCounts(uint64_t s, const Neighbours &nb) {
+        uint64_t par[4], anti[4];
+        for (int d=0; d < 4; ++d) {
+            const uint64_t x = s ^ nb.spin[d];
+            anti[d] = x & nb.present[d];
+            par[d] = ~x & nb.present[d];
+        }
+        add4(par, p0, p1, p2);
+        add4(anti, a0, a1, a2);
+    }
+
+    // Sum of (parallel - antiparallel) over the sites selected by mask
+    int balance(uint64_t mask) const {
+        return    popcount(p0 & mask) + 2*popcount(p1 & mask) + 4*popcount(p2 & mask)
+               - (popcount(a0 & mask) + 2*popcount(a1 & mask) + 4*popcount(a2 & mask));
+    }
+};
+
+
+/* Metropolis acceptance probabilities at a given temperature.
+ *
+ * Flipping a spin with P parallel and A antiparallel neighbours changes the energy by 2d, with d = P - A.
+ * Flips with d <= 0 are always accepted, those with d = 1..4 with probability exp(-2d/T).
+ * The probabilities are stored as 64-bit fixed point fractions, so that they can be compared
+ * bit by bit with random words (see Ising::updateRow).
+ */
+struct AcceptanceTable {
+    uint64_t threshold[5];
+
+    explicit AcceptanceTable(double temp) {
+        threshold[0] = ~uint64_t(0);
+        for (int d=1; d <= 4; ++d) {
+            double p = std::ldexp(std::exp(-2*d/temp), 64);
+            threshold[d] = p >= 18446744073709551615.0 ? ~uint64_t(0) : uint64_t(p);
+        }
+    }
+};
+
+
+// Full computation of the energy
+inline mint latticeEnergy(const SpinLattice &lat) {
+    // Each bond connects a colour 0 and a colour 1 site, so counting from colour 0 sites visits every bond once.
+    mint E = 0;
+    for (int i=0; i < lat.rows(); ++i)
+        for (int w=0; w < lat.words(); ++w)
+            E += BondCounts(lat.row(0, i)[w], Neighbours(lat, 0, i, w)).balance(lat.valid(0, i, w));
+    return -E;
+}
+
+// Full computation of the magnetization
+inline mint latticeMagnetization(const SpinLattice &lat) {
+    mint up = 0;
+    for (int c=0; c < 2; ++c)
+        for (int i=0; i < lat.rows(); ++i)
+            for (int w=0; w < lat.words(); ++w)
+                up += popcount(lat.row(c, i)[w]);
+    return 2*up - lat.size();
+}
+
+
+/* A lattice together with its energy and magnetization.
+ * The simulation updates these incrementally after each half-sweep, from the flips it accepted.
+ */
+struct Replica {
+    SpinLattice lattice;
+    mint energy, magnetization;
+
+    explicit Replica(const SpinLattice &lat) :
+        lattice(lat), energy(latticeEnergy(lat)), magnetization(latticeMagnetization(lat))
+    { }
+
+    // Compare the tracked values with a full recomputation
+    void verify() const {
+        if (energy != latticeEnergy(lattice) || magnetization != latticeMagnetization(lattice))
+            throw mma::LibraryError("Incrementally tracked observables do not agree with the state.");
+    }
+};
 
 
 // LTemplate class for the Ising model simulation
 class Ising {
-    std::mt19937 engine;
+    uint64_t seedValue;
+    uint64_t streamsUsed; // number of random streams used by sweep() so far
+    mma::RandomStream swapStream; // for replica exchanges
+    mint sweepsSinceVerify;
+    mint pendingSteps; // steps passed to simulate() that did not make up a whole sweep yet
+
+    // Number of sweeps after which the tracked observables are checked against a full recomputation
+    static const mint verifyInterval = 1000;
 
     /* LTemplate does not currently support constructor arguments, thus Ising
-     * objects must be created with an "empty" state. We indicate this using nullptr,
-     * which is safe to delete in the destructor.
+     * objects must be created with an "empty" state. We indicate this using an empty vector.
      *
      * There is a separate function, setState(), for assigning an actual state.
+     *
+     * replicas[0] is the state seen by getState(), energy() and magnetization().
+     * Further replicas exist only after parallel tempering with temper().
+     */
+    std::vector<Replica> replicas;
+    std::vector<double> swapRate;
+    std::vector<mint> deltaE, deltaM; // per row changes during a half-sweep
+
+    void checkState() const {
+        if (replicas.empty())
+            throw mma::LibraryError("State not set.");
+    }
+
+    /* Metropolis update of all spins of one colour in row i.
+     *
+     * Each spin is accepted if a uniform random number r is below its acceptance threshold.
+     * The comparison is done for 64 spins at once, one bit of r at a time starting from the most significant one,
+     * until all spins are decided. This needs only about log2(64) + 2 random words per 64 spins on average.
+     *
+     * The changes of the energy and the magnetization caused by the accepted flips are returned in dE and dM.
+     */
+    static void updateRow(SpinLattice &lat, int colour, int i, const AcceptanceTable &table, mma::RandomStream &rs,
+                          mint &dE, mint &dM)
+    {
+        dE = 0;
+        dM = 0;
+        uint64_t *row = lat.row(colour, i);
+        for (int w=0; w < lat.words(); ++w) {
+            const uint64_t s = row[w];
+            const uint64_t valid = lat.valid(colour, i, w);
+            const BondCounts bc(s, Neighbours(lat, colour, i, w));
+
+            // classify the spins by d = P - A, the number of parallel minus antiparallel neighbours
+            const uint64_t P2 = ~bc.p2 & bc.p1 & ~bc.p0, P3 = ~bc.p2 & bc.p1 & bc.p0, P4 = bc.p2;
+            const uint64_t A0 = ~(bc.a0 | bc.a1 | bc.a2), A1 = bc.a0 & ~bc.a1 & ~bc.a2;
+            const uint64_t m[5] = { 0, P2 & A1, (P3 & A1) | (P2 & A0), P3 & A0, P4 };
+
+            uint64_t undecided = (m[1] | m[2] | m[3] | m[4]) & valid;
+            uint64_t accept = valid & ~undecided;
+            for (int bit = 63; undecided && bit >= 0; --bit) {
+                uint64_t t = 0;
+                for (int d=1; d <= 4; ++d)
+                    t |= m[d] & (uint64_t(0) - ((table.threshold[d] >> bit) & 1));
+                const uint64_t r = rs();
+                accept |= undecided & t & ~r;
+                undecided &= ~(t ^ r);
+            }
+
+            row[w] = s ^ accept;
+
+            // a flipped spin changes the energy by 2(P - A), and the magnetization by -2 or +2
+            dE += 2*bc.balance(accept);
+            dM += 2*(popcount(accept & ~s) - popcount(accept & s));
+        }
+    }
+
+    /* One sweep over the first tables.size() replicas, replica k at the temperature of tables[k].
+     * Rows of the same colour are independent, so they are updated in parallel when OpenMP is enabled.
+     * Each row of each half-sweep uses its own random stream, thus the result does not depend on the number of threads.
      */
-    StateMatrix *state;
-    
-public:    
-    Ising() : engine{ std::random_device()() }, state(nullptr) { }
-    ~Ising() { delete state; }
-    
-    void seed(mint s) { engine.seed(s); }
-    
+    void sweep(const std::vector<AcceptanceTable> &tables) {
+        const mint nrep = tables.size();
+        const mint nrows = replicas[0].lattice.rows();
+        deltaE.resize(nrep*nrows);
+        deltaM.resize(nrep*nrows);
+        for (int colour=0; colour < 2; ++colour) {
+#ifdef _OPENMP
+            #pragma omp parallel for schedule(static)
+#endif
+            for (mint task=0; task < nrep*nrows; ++task) {
+                mma::RandomStream rs(seedValue, streamsUsed + task);
+                updateRow(replicas[task / nrows].lattice, colour, task % nrows, tables[task / nrows], rs, deltaE[task], deltaM[task]);
+            }
+            streamsUsed += nrep*nrows;
+
+            for (mint task=0; task < nrep*nrows; ++task) {
+                replicas[task / nrows].energy += deltaE[task];
+                replicas[task / nrows].magnetization += deltaM[task];
+            }
+        }
+
+        if (++sweepsSinceVerify >= verifyInterval) {
+            for (mint k=0; k < nrep; ++k)
+                replicas[k].verify();
+            sweepsSinceVerify = 0;
+        }
+    }
+
+public:
+    Ising() : swapStream(0), sweepsSinceVerify(0), pendingSteps(0) { seed(std::random_device()()); }
+
+    void seed(mint s) {
+        seedValue = s;
+        streamsUsed = 0;
+        swapStream = mma::RandomStream(s, ~uint64_t(0)); // stream number not used by sweep()
+    }
+
     void setState(mma::IntMatrixRef mat) {
         if (mat.rows() < 2 || mat.cols() < 2)
             throw mma::LibraryError("State matrix must be at least of size 2 by 2.");
-        delete state;
-        state = new StateMatrix(mat.rows(), mat.cols());
-        std::copy(mat.begin(), mat.end(), state->begin());
+        SpinLattice lat(mat.rows(), mat.cols());
+        for (int i=0; i < mat.rows(); ++i)
+            for (int j=0; j < mat.cols(); ++j)
+                lat.set(i, j, mat(i,j) != 0);
+        replicas.assign(1, Replica(lat));
+        swapRate.clear();
+        pendingSteps = 0;
     }
-    
+
     mma::IntMatrixRef getState() const {
-        if (! state)
-            throw mma::LibraryError("State not set.");
-        return mma::makeMatrix<mint>(state->rows(), state->cols(), state->begin());        
+        checkState();
+        return replicaState(0);
     }
-    
+
     mint magnetization() const {
-        if (! state)
-            throw mma::LibraryError("State not set.");
-        int total = 0;
-        for (const auto &el : *state)
-            total += el;
-        return 2*total - state->size();
+        checkState();
+        return replicas[0].magnetization;
     }
-    
+
     mint energy() const {
-        if (! state)
-            throw mma::LibraryError("State not set.");
-        int E = 0;
-        for (int i=1; i < state->rows(); ++i)
-            for (int j=0; j < state->cols(); ++j)
-                E += spin((*state)(i,j)) * spin((*state)(i-1,j));
-        for (int i=0; i < state->rows(); ++i)
-            for (int j=1; j < state->cols(); ++j)                     
-                E += spin((*state)(i,j)) * spin((*state)(i,j-1));
-        return -E;
-    }
-    
+        checkState();
+        return replicas[0].energy;
+    }
+
+    /* Run the given number of Monte Carlo steps, i.e. attempted spin flips.
+     *
+     * The spins are updated in whole sweeps, each of which attempts to flip every spin once.
+     * Steps that do not make up a whole sweep are carried over to the next call.
+     */
     void simulate(mint steps, double temp) {
-        if (! state)
-            throw mma::LibraryError("State not set.");
+        checkState();
         if (temp <= 0)
             throw mma::LibraryError("Temperature must be strictly positive.");
+        if (steps < 0)
+            throw mma::LibraryError("The number of steps must not be negative.");
 
-        std::uniform_int_distribution<> randrow(0, state->rows()-1);
-        std::uniform_int_distribution<> randcol(0, state->cols()-1);
-        std::uniform_real_distribution<> rrand;
+        const mint spins = mint(replicas[0].lattice.rows()) * replicas[0].lattice.cols();
+        const mint sweeps = (pendingSteps + steps) / spins;
+        pendingSteps = (pendingSteps + steps) % spins;
 
-        for (mint i=0; i < steps; ++i) {
-            if (i % 1000 == 0)
-                mma::check_abort();
+        const std::vector<AcceptanceTable> tables(1, AcceptanceTable(temp)); // only the main replica is simulated
+        for (mint i=0; i < sweeps; ++i) {
+            mma::check_abort();
+            sweep(tables);
+        }
+    }
 
-            int ri = randrow(engine);
-            int rj = randcol(engine);
+    /* Run the given number of sweeps, and record the energy and magnetization after every `interval` sweeps.
+     * Unlike simulate(), it counts whole sweeps, not single steps.
+     * Returns a matrix with one {energy, magnetization} row per sample.
+     */
+    mma::IntMatrixRef record(mint sweeps, double temp, mint interval) {
+        checkState();
+        if (temp <= 0)
+            throw mma::LibraryError("Temperature must be strictly positive.");
+        if (sweeps < 0)
+            throw mma::LibraryError("The number of sweeps must not be negative.");
+        if (interval < 1)
+            throw mma::LibraryError("The sampling interval must be positive.");
 
-            int s = 0;
-            if (ri > 0)               s += spin((*state)(ri-1, rj));
-            if (ri < state->rows()-1) s += spin((*state)(ri+1, rj));
-            if (rj > 0)               s += spin((*state)(ri, rj-1));
-            if (rj < state->cols()-1) s += spin((*state)(ri, rj+1));
+        const std::vector<AcceptanceTable> tables(1, AcceptanceTable(temp));
+        auto samples = mma::makeMatrix<mint>(sweeps / interval, 2);
+        try {
+            for (mint i=1; i <= sweeps; ++i) {
+                mma::check_abort();
+                sweep(tables);
+                if (i % interval == 0) {
+                    samples(i/interval - 1, 0) = replicas[0].energy;
+                    samples(i/interval - 1, 1) = replicas[0].magnetization;
+                }
+            }
+        } catch (...) {
+            samples.free();
+            throw;
+        }
+        return samples;
+    }
 
-            int x = spin((*state)(ri,rj));
+    /* Parallel tempering: simulate one replica per temperature, and attempt to exchange
+     * the states of replicas at neighbouring temperatures after every `interval` sweeps.
+     *
+     * When the number of temperatures changes, all replicas are reset to copies of the main state.
+     * Afterwards, the main state is the one at the first temperature.
+     */
+    void temper(mint sweeps, mma::RealTensorRef temps, mint interval) {
+        checkState();
+        if (temps.length() < 2)
+            throw mma::LibraryError("At least two temperatures are required.");
+        if (interval < 1)
+            throw mma::LibraryError("The exchange interval must be positive.");
+        std::vector<AcceptanceTable> tables;
+        for (const auto &temp : temps) {
+            if (temp <= 0)
+                throw mma::LibraryError("Temperatures must be strictly positive.");
+            tables.push_back(AcceptanceTable(temp));
+        }
+
+        const mint nrep = temps.length();
+        if (mint(replicas.size()) != nrep) {
+            const Replica main = replicas[0];
+            replicas.assign(nrep, main);
+        }
 
-            int deltaE = 2*s*x;
-            
-            if (rrand(engine) < std::exp( -deltaE/temp )) {
-                (*state)(ri,rj) = ! (*state)(ri,rj); // do flip
+        std::vector<mint> attempts(nrep-1), accepted(nrep-1);
+        for (mint i=1; i <= sweeps; ++i) {
+            mma::check_abort();
+            sweep(tables);
+            if (i % interval == 0) {
+                // alternate between even and odd pairs
+                for (mint k = (i / interval) % 2; k+1 < nrep; k += 2) {
+                    const double delta = (1/temps[k] - 1/temps[k+1]) * (replicas[k].energy - replicas[k+1].energy);
+                    attempts[k]++;
+                    if (delta >= 0 || swapStream.uniform() < std::exp(delta)) {
+                        std::swap(replicas[k], replicas[k+1]);
+                        accepted[k]++;
+                    }
+                }
             }
         }
+
+        swapRate.resize(nrep-1);
+        for (mint k=0; k < nrep-1; ++k)
+            swapRate[k] = attempts[k] > 0 ? double(accepted[k]) / attempts[k] : 0.0;
+    }
+
+    // Energies of all replicas, ordered by temperature
+    mma::IntTensorRef replicaEnergies() const {
+        checkState();
+        auto res = mma::makeVector<mint>(replicas.size());
+        for (mint k=0; k < res.size(); ++k)
+            res[k] = replicas[k].energy;
+        return res;
+    }
+
+    // Magnetizations of all replicas, ordered by temperature
+    mma::IntTensorRef replicaMagnetizations() const {
+        checkState();
+        auto res = mma::makeVector<mint>(replicas.size());
+        for (mint k=0; k < res.size(); ++k)
+            res[k] = replicas[k].magnetization;
+        return res;
+    }
+
+    // The state of replica k, counted from 0
+    mma::IntMatrixRef replicaState(mint k) const {
+        checkState();
+        if (k < 0 || k >= mint(replicas.size()))
+            throw mma::LibraryError("Replica index out of range.");
+        const SpinLattice &lat = replicas[k].lattice;
+        auto mat = mma::makeMatrix<mint>(lat.rows(), lat.cols());
+        for (int i=0; i < lat.rows(); ++i)
+            for (int j=0; j < lat.cols(); ++j)
+                mat(i,j) = lat.get(i, j);
+        return mat;
+    }
+
+    // Fraction of accepted exchanges between neighbouring temperatures in the last temper() call
+    mma::RealTensorRef swapRates() const {
+        return mma::makeVector<double>(swapRate.size(), swapRate.data());
     }
 };
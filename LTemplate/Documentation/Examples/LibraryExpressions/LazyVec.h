@@ -0,0 +1,281 @@
+
+#include <LTemplate.h>
+#include <vector>
+#include <map>
+#include <set>
+#include <cmath>
+#include <algorithm>
+
+/* A lazily evaluated real vector
+ *
+ * A LazyVec is either a leaf, which holds values, or an operation on other LazyVec instances.
+ * Setting a LazyVec to an operation does not compute anything: it only records the IDs of the operands.
+ * Together, the instances form a directed acyclic graph, which is evaluated only when a result is needed.
+ *
+ * Evaluation fuses the entire expression into a single pass over the data. The vectors are processed
+ * in blocks small enough to stay in the L1 cache. Within a block, each operation is a simple loop that
+ * the compiler can vectorize, and its result is kept in a block-sized buffer instead of a full-length
+ * intermediate vector. Operands that are used several times are computed once per block.
+ * When OpenMP is enabled, blocks are distributed between threads.
+ *
+ * Since operands are referenced by ID, an expression reflects the current value of its operands.
+ * Evaluating an expression whose operand was released is an error.
+ */
+class LazyVec {
+    enum Kind { Leaf, LinearCombination, Product, Function };
+
+    typedef double (*unary_function)(double);
+
+    Kind kind = Leaf;
+    std::vector<double> data;     // for leaves
+    std::vector<mint> operands;   // for operations: the IDs of the operands
+    std::vector<double> coeffs;   // for linear combinations
+    unary_function fun = nullptr; // for functions
+
+    // Number of elements processed at once by each thread
+    static const mint blockSize = 1024;
+
+    /* A compiled expression: one step for each distinct node of the graph, in dependency order.
+     * The result of step k is available in register k while processing a block.
+     */
+    struct Step {
+        const LazyVec *node;
+        std::vector<mint> args; // registers of the operands
+    };
+
+    struct Program {
+        std::vector<Step> steps;
+        mint length = -1;
+    };
+
+    // Append the steps needed to compute node to the program, and return the register holding its result
+    static mint compile(const LazyVec *node, Program &prog, std::map<const LazyVec *, mint> &done) {
+        auto it = done.find(node);
+        if (it != done.end())
+            return it->second;
+
+        Step step;
+        step.node = node;
+        if (node->kind == Leaf) {
+            if (prog.length == -1)
+                prog.length = node->data.size();
+            else if (prog.length != mint(node->data.size()))
+                throw mma::LibraryError("LazyVecs are of inconsistent sizes.");
+        } else {
+            for (const auto &id : node->operands)
+                step.args.push_back(compile(&mma::getInstance<LazyVec>(id), prog, done));
+        }
+
+        prog.steps.push_back(step);
+        return done[node] = prog.steps.size() - 1;
+    }
+
+    /* Evaluate the program in blocks, and call f(b, start, n, reg) for each block. b is the block index,
+     * the block covers elements start .. start+n-1, and reg[k] points to the values of register k.
+     * f is called from multiple threads, with different blocks.
+     */
+    template<typename F>
+    static void run(const Program &prog, F f) {
+        const mint nsteps = prog.steps.size();
+        const mint nblocks = (prog.length + blockSize - 1) / blockSize;
+#ifdef _OPENMP
+        #pragma omp parallel if (nblocks > 1)
+#endif
+        {
+            std::vector<double> buffers(nsteps*blockSize);
+            std::vector<const double *> reg(nsteps);
+#ifdef _OPENMP
+            #pragma omp for schedule(static)
+#endif
+            for (mint b=0; b < nblocks; ++b) {
+                const mint start = b*blockSize;
+                const mint n = std::min<mint>(prog.length - start, blockSize);
+                for (mint k=0; k < nsteps; ++k) {
+                    const Step &step = prog.steps[k];
+                    double *out = &buffers[k*blockSize];
+                    reg[k] = out;
+                    switch (step.node->kind) {
+                    case Leaf:
+                        reg[k] = step.node->data.data() + start; // no copying
+                        break;
+                    case LinearCombination: {
+                        const double *c = step.node->coeffs.data();
+                        const double *in = reg[step.args[0]];
+                        for (mint i=0; i < n; ++i)
+                            out[i] = c[0]*in[i];
+                        for (size_t j=1; j < step.args.size(); ++j) {
+                            in = reg[step.args[j]];
+                            for (mint i=0; i < n; ++i)
+                                out[i] += c[j]*in[i];
+                        }
+                        break;
+                    }
+                    case Product: {
+                        const double *in = reg[step.args[0]];
+                        for (mint i=0; i < n; ++i)
+                            out[i] = in[i];
+                        for (size_t j=1; j < step.args.size(); ++j) {
+                            in = reg[step.args[j]];
+                            for (mint i=0; i < n; ++i)
+                                out[i] *= in[i];
+                        }
+                        break;
+                    }
+                    case Function: {
+                        const unary_function fn = step.node->fun;
+                        const double *in = reg[step.args[0]];
+                        for (mint i=0; i < n; ++i)
+                            out[i] = fn(in[i]);
+                        break;
+                    }
+                    }
+                }
+                f(b, start, n, reg.data());
+            }
+        }
+    }
+
+    // Check if node is reachable from this one
+    bool dependsOn(const LazyVec *node, std::set<const LazyVec *> &visited) const {
+        if (this == node)
+            return true;
+        if (! visited.insert(this).second)
+            return false;
+        for (const auto &id : operands)
+            if (mma::getInstance<LazyVec>(id).dependsOn(node, visited))
+                return true;
+        return false;
+    }
+
+    // Turn this vector into an operation on the given operands
+    void setOperation(Kind k, const std::vector<mint> &ids, const std::vector<double> &cs, unary_function fn) {
+        if (ids.empty())
+            throw mma::LibraryError("There must be at least one operand.");
+
+        Program prog;
+        std::map<const LazyVec *, mint> done;
+        for (const auto &id : ids) {
+            std::set<const LazyVec *> visited;
+            const LazyVec &op = mma::getInstance<LazyVec>(id);
+            if (op.dependsOn(this, visited))
+                throw mma::LibraryError("A LazyVec cannot depend on itself.");
+            compile(&op, prog, done); // verifies that all operands exist and have the same length
+        }
+
+        kind = k;
+        operands = ids;
+        coeffs = cs;
+        fun = fn;
+        std::vector<double>().swap(data); // release memory
+    }
+
+    Program compileSelf() const {
+        Program prog;
+        std::map<const LazyVec *, mint> done;
+        compile(this, prog, done);
+        return prog;
+    }
+
+public:
+    // Set the value of the vector, making it a leaf
+    void set(mma::RealTensorRef values) {
+        data.assign(values.begin(), values.end());
+        kind = Leaf;
+        operands.clear();
+        coeffs.clear();
+        fun = nullptr;
+    }
+
+    // Length of the vector
+    mint length() const { return compileSelf().length; }
+
+    // Is this a leaf, i.e. not an unevaluated operation?
+    bool leafQ() const { return kind == Leaf; }
+
+    // Compute the value of the vector
+    mma::RealTensorRef value() const {
+        const Program prog = compileSelf();
+        auto res = mma::makeVector<double>(prog.length);
+        const mint root = prog.steps.size() - 1;
+        run(prog, [&] (mint, mint start, mint n, const double * const *reg) {
+            std::copy(reg[root], reg[root] + n, res.data() + start);
+        });
+        return res;
+    }
+
+    // Compute the value of the vector and store it, making this vector a leaf
+    void evaluate() {
+        if (kind == Leaf)
+            return;
+        const Program prog = compileSelf();
+        std::vector<double> values(prog.length);
+        const mint root = prog.steps.size() - 1;
+        run(prog, [&] (mint, mint start, mint n, const double * const *reg) {
+            std::copy(reg[root], reg[root] + n, values.data() + start);
+        });
+        kind = Leaf;
+        data.swap(values);
+        operands.clear();
+        coeffs.clear();
+        fun = nullptr;
+    }
+
+    // Inner product with another vector
+    // Both expressions are evaluated in the same pass, sharing any common operands.
+    double inner(const LazyVec &v) const {
+        Program prog;
+        std::map<const LazyVec *, mint> done;
+        const mint r1 = compile(this, prog, done);
+        const mint r2 = compile(&v, prog, done);
+
+        // Block sums are added in a fixed order so that the result does not depend on the number of threads.
+        std::vector<double> partial((prog.length + blockSize - 1) / blockSize);
+        run(prog, [&] (mint b, mint, mint n, const double * const *reg) {
+            double sum = 0;
+            for (mint i=0; i < n; ++i)
+                sum += reg[r1][i] * reg[r2][i];
+            partial[b] = sum;
+        });
+        double sum = 0;
+        for (const auto &p : partial)
+            sum += p;
+        return sum;
+    }
+
+    // Set this vector to the sum of an arbitrary number of other vectors
+    // IDs are translated to references using mma::getInstance() only when evaluating the expression.
+    void setToSum(mma::IntTensorRef ids) {
+        setOperation(LinearCombination, std::vector<mint>(ids.begin(), ids.end()), std::vector<double>(ids.size(), 1.0), nullptr);
+    }
+
+    // Set this vector to a linear combination of other vectors
+    void setToLinearCombination(mma::IntTensorRef ids, mma::RealTensorRef cs) {
+        if (ids.size() != cs.size())
+            throw mma::LibraryError("There must be one coefficient for each vector.");
+        setOperation(LinearCombination, std::vector<mint>(ids.begin(), ids.end()), std::vector<double>(cs.begin(), cs.end()), nullptr);
+    }
+
+    // Set this vector to the elementwise product of other vectors
+    void setToProduct(mma::IntTensorRef ids) {
+        setOperation(Product, std::vector<mint>(ids.begin(), ids.end()), std::vector<double>(), nullptr);
+    }
+
+    // Set this vector to a function applied elementwise to another vector
+    // Supported functions: "Sqrt", "Exp", "Log", "Abs", "Sin", "Cos"
+    void setToFunction(mint id, mma::StringRef name) {
+        static const struct { const char *name; unary_function fn; } functions[] = {
+            { "Sqrt", [] (double x) { return std::sqrt(x); } },
+            { "Exp",  [] (double x) { return std::exp(x); } },
+            { "Log",  [] (double x) { return std::log(x); } },
+            { "Abs",  [] (double x) { return std::abs(x); } },
+            { "Sin",  [] (double x) { return std::sin(x); } },
+            { "Cos",  [] (double x) { return std::cos(x); } }
+        };
+        for (const auto &f : functions)
+            if (name == f.name) {
+                setOperation(Function, std::vector<mint>(1, id), std::vector<double>(), f.fn);
+                return;
+            }
+        throw mma::LibraryError("Unknown function.");
+    }
+};
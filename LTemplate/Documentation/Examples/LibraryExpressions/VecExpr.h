@@ -31,6 +31,7 @@ public:
     // Set this vector to the sum of an arbitrary number of other vectors
     // Currently there is no feature in LTemplate to expose multiple IDs as object references.
     // Instead, IDs can be translated manually using mma::getInstance().
+    // Worker threads must use mma::pinInstance() instead, which is safe to call concurrently.
     void setToSum(mma::IntTensorRef ids) {
         if (ids.size() == 0)
             throw mma::LibraryError("There must be at least one VecExpr to sum.");
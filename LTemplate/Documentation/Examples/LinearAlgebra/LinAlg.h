@@ -0,0 +1,71 @@
+
+#include <LTemplate.h>
+#include <linalg.h>
+
+// linalg.h calls CBLAS and LAPACKE directly on Mathematica's row-major data.
+// Matrices are indexed the same way as in Mathematica: there is no need to transpose anything.
+
+class LinAlg {
+public:
+    // Matrix product, computed directly into the returned Tensor
+    mma::RealMatrixRef dot(mma::RealMatrixRef a, mma::RealMatrixRef b) {
+        return mma::linalg::gemm(a, b);
+    }
+
+    // Complex matrix product with the conjugate transpose of the second argument
+    mma::ComplexMatrixRef dotConjugateTranspose(mma::ComplexMatrixRef a, mma::ComplexMatrixRef b) {
+        return mma::linalg::gemm(a, b, CblasNoTrans, CblasConjTrans);
+    }
+
+    // The Gram matrix of the columns, Transpose[a].a
+    mma::RealMatrixRef gram(mma::RealMatrixRef a) {
+        return mma::linalg::syrk(a, CblasTrans);
+    }
+
+    // Upper triangular u so that ConjugateTranspose[u].u == a, same as CholeskyDecomposition
+    mma::RealMatrixRef cholesky(mma::RealMatrixRef a) {
+        return mma::linalg::cholesky(a);
+    }
+
+    // Cholesky decomposition in place, overwriting an "InPlace" matrix, which is then returned without copying
+    void choleskyInPlace(mma::RealMatrixRef a) {
+        mma::linalg::cholesky(a, a);
+    }
+
+    // Orthonormal basis of the space spanned by the columns of a full-rank matrix, computed by QR decomposition
+    mma::RealMatrixRef orthonormalColumns(mma::RealMatrixRef a) {
+        if (a.rows() < a.cols())
+            throw mma::LibraryError("There must be at least as many rows as columns.");
+        auto q = mma::makeMatrix<double>(a.rows(), a.cols());
+        auto r = mma::makeMatrix<double>(a.cols(), a.cols());
+        try {
+            mma::linalg::qr(a, q, r);
+        } catch (...) {
+            q.free();
+            r.free();
+            throw;
+        }
+        r.free();
+        return q;
+    }
+
+    // Eigenvalues of a Hermitian matrix, in ascending order
+    mma::RealTensorRef hermitianEigenvalues(mma::ComplexMatrixRef a) {
+        return mma::linalg::symmetricEigenvalues(a);
+    }
+
+    // Eigenvectors of a symmetric matrix, as rows, in the order of ascending eigenvalues
+    mma::RealMatrixRef symmetricEigenvectors(mma::RealMatrixRef a) {
+        auto values = mma::makeVector<double>(a.rows());
+        auto vectors = mma::makeMatrix<double>(a.rows(), a.cols());
+        try {
+            mma::linalg::symmetricEigensystem(a, values, vectors);
+        } catch (...) {
+            values.free();
+            vectors.free();
+            throw;
+        }
+        values.free();
+        return vectors;
+    }
+};
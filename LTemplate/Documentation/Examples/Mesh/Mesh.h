@@ -0,0 +1,447 @@
+
+#include <LTemplate.h>
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+
+/* Unstructured mesh with cached connectivity
+ *
+ * The mesh is set once from node coordinates and element connectivity, then all adjacency information
+ * is computed and kept in compressed sparse row (CSR) form, i.e. as flat arrays of lists:
+ *
+ *  - the elements incident to each node,
+ *  - the neighbour of each element across each of its faces,
+ *  - the boundary faces, i.e. faces belonging to a single element,
+ *  - a colouring of elements such that elements of the same colour share no nodes.
+ *
+ * The colouring makes it possible to loop over elements in parallel while writing to node data,
+ * without atomics or locks: elements of one colour are processed in parallel, colours one after the other.
+ * See nodeVolumes() for an example. Since every node receives at most one contribution per colour,
+ * in the order of colours, the results do not depend on the number of threads.
+ *
+ * All node and element indices are 1-based, as in ElementMesh objects.
+ * All elements must be of the same type: "Triangle", "Quad", "Tetrahedron" or "Hexahedron".
+ * Triangles and quads may be embedded in 2D or 3D, tetrahedra and hexahedra must be in 3D.
+ */
+class Mesh {
+
+    /* Node ordering follows ElementMesh conventions. Faces are listed so that they are oriented
+     * outwards for positively oriented elements. For triangles and tetrahedra, face i is opposite node i.
+     */
+    struct ElementType {
+        const char *name;
+        mint nodes;     // nodes per element
+        mint faces;     // faces per element
+        mint faceNodes; // nodes per face
+        mint minDim;    // smallest embedding dimension
+        int face[6][4];
+    };
+
+    static const ElementType *findType(mma::StringRef name) {
+        static const ElementType types[] = {
+            { "Triangle",    3, 3, 2, 2, {{1,2}, {2,0}, {0,1}} },
+            { "Quad",        4, 4, 2, 2, {{0,1}, {1,2}, {2,3}, {3,0}} },
+            { "Tetrahedron", 4, 4, 3, 3, {{1,2,3}, {0,3,2}, {0,1,3}, {0,2,1}} },
+            { "Hexahedron",  8, 6, 4, 3, {{0,3,2,1}, {4,5,6,7}, {0,1,5,4}, {1,2,6,5}, {2,3,7,6}, {3,0,4,7}} }
+        };
+        for (const auto &t : types)
+            if (name == t.name)
+                return &t;
+        return nullptr;
+    }
+
+    const ElementType *type = nullptr;
+    mint dim = 0;
+    mint nn = 0, ne = 0;
+    std::vector<double> coords;     // nn by dim
+    std::vector<mint> elements;     // ne by type->nodes, 0-based
+
+    std::vector<mint> nodeOffsets;  // nn+1 entries
+    std::vector<mint> nodeElems;    // elements of each node, increasing
+
+    std::vector<mint> neighbours;   // ne by type->faces, -1 on the boundary
+
+    std::vector<mint> boundary;     // boundary faces as element*faces + face
+
+    std::vector<mint> colorOffsets; // ncolors+1 entries
+    std::vector<mint> colorElems;   // elements of each colour, increasing
+
+    static mint threadCount() {
+#ifdef _OPENMP
+        return omp_get_max_threads();
+#else
+        return 1;
+#endif
+    }
+
+    const mint *elementNodes(mint e) const { return &elements[e*type->nodes]; }
+
+    bool containsNode(mint e, mint node) const {
+        const mint *en = elementNodes(e);
+        return std::find(en, en + type->nodes, node) != en + type->nodes;
+    }
+
+    /* Group the positions 0 .. n-1 by keys[i], which are between 0 and nkeys-1, with a stable counting sort.
+     * The positions with key k end up in pos[offsets[k]] .. pos[offsets[k+1]-1], in increasing order.
+     *
+     * As in the CSRGraph example, this is done in two passes without atomics: first each thread distributes
+     * a contiguous range of positions into buckets of consecutive keys, then each bucket is sorted independently.
+     */
+    static void groupByKey(const mint *keys, mint n, mint nkeys, std::vector<mint> &offsets, std::vector<mint> &pos) {
+        const int bucketBits = 12;
+        const mint bucketSize = mint(1) << bucketBits;
+        const mint nbuckets = (nkeys >> bucketBits) + 1;
+        const mint nthreads = threadCount();
+
+        std::vector<mint> bucketPos(nthreads*nbuckets);
+#ifdef _OPENMP
+        #pragma omp parallel for schedule(static, 1)
+#endif
+        for (mint t=0; t < nthreads; ++t) {
+            mint *count = &bucketPos[t*nbuckets];
+            for (mint i = n*t/nthreads; i < n*(t+1)/nthreads; ++i)
+                count[keys[i] >> bucketBits]++;
+        }
+
+        std::vector<mint> bucketStart(nbuckets+1);
+        mint total = 0;
+        for (mint b=0; b < nbuckets; ++b) {
+            bucketStart[b] = total;
+            for (mint t=0; t < nthreads; ++t) {
+                const mint count = bucketPos[t*nbuckets + b];
+                bucketPos[t*nbuckets + b] = total;
+                total += count;
+            }
+        }
+        bucketStart[nbuckets] = total;
+
+        std::vector<mint> bucketed(n);
+#ifdef _OPENMP
+        #pragma omp parallel for schedule(static, 1)
+#endif
+        for (mint t=0; t < nthreads; ++t) {
+            mint *p = &bucketPos[t*nbuckets];
+            for (mint i = n*t/nthreads; i < n*(t+1)/nthreads; ++i)
+                bucketed[p[keys[i] >> bucketBits]++] = i;
+        }
+
+        offsets.assign(nkeys+1, 0);
+        pos.resize(n);
+#ifdef _OPENMP
+        #pragma omp parallel for schedule(dynamic)
+#endif
+        for (mint b=0; b < nbuckets; ++b) {
+            const mint first = b << bucketBits, last = std::min(first + bucketSize, nkeys);
+            if (first >= last)
+                continue;
+
+            std::vector<mint> cursor(last - first);
+            for (mint k = bucketStart[b]; k < bucketStart[b+1]; ++k)
+                cursor[keys[bucketed[k]] - first]++;
+            mint p = bucketStart[b];
+            for (mint key = first; key < last; ++key) {
+                offsets[key] = p;
+                const mint count = cursor[key - first];
+                cursor[key - first] = p;
+                p += count;
+            }
+            for (mint k = bucketStart[b]; k < bucketStart[b+1]; ++k)
+                pos[cursor[keys[bucketed[k]] - first]++] = bucketed[k];
+        }
+        offsets[nkeys] = n;
+    }
+
+    // The element on the other side of face f of element e, or -1 if there is none.
+    // With non-manifold faces, the lowest numbered other element is returned.
+    mint findNeighbour(mint e, mint f) const {
+        const mint *en = elementNodes(e);
+        const int *fl = type->face[f];
+        const mint first = en[fl[0]];
+        for (mint k = nodeOffsets[first]; k < nodeOffsets[first+1]; ++k) {
+            const mint c = nodeElems[k];
+            if (c == e)
+                continue;
+            bool shared = true;
+            for (mint i=1; i < type->faceNodes && shared; ++i)
+                shared = containsNode(c, en[fl[i]]);
+            if (shared)
+                return c;
+        }
+        return -1;
+    }
+
+    // Greedy colouring in element order: each element gets the smallest colour not used by
+    // an earlier element sharing a node with it.
+    void computeColoring() {
+        std::vector<mint> color(ne);
+        std::vector<mint> seen; // seen[c] == e if colour c is taken by a neighbour of e
+        mint ncolors = 0;
+        for (mint e=0; e < ne; ++e) {
+            const mint *en = elementNodes(e);
+            for (mint i=0; i < type->nodes; ++i)
+                for (mint k = nodeOffsets[en[i]]; k < nodeOffsets[en[i]+1] && nodeElems[k] < e; ++k)
+                    seen[color[nodeElems[k]]] = e;
+            mint c = 0;
+            while (c < ncolors && seen[c] == e)
+                ++c;
+            if (c == ncolors) {
+                ncolors++;
+                seen.push_back(-1);
+            }
+            color[e] = c;
+        }
+        groupByKey(color.data(), ne, ncolors, colorOffsets, colorElems);
+    }
+
+    // Length, area or volume of the simplex with the given nodes (2, 3 or 4 of them)
+    double simplexMeasure(const mint *nodes, mint count) const {
+        const double *p0 = &coords[nodes[0]*dim];
+        double v[3][3] = {};
+        for (mint i=1; i < count; ++i)
+            for (mint k=0; k < dim; ++k)
+                v[i-1][k] = coords[nodes[i]*dim + k] - p0[k];
+        if (count == 3) {
+            const double cx = v[0][1]*v[1][2] - v[0][2]*v[1][1];
+            const double cy = v[0][2]*v[1][0] - v[0][0]*v[1][2];
+            const double cz = v[0][0]*v[1][1] - v[0][1]*v[1][0];
+            return std::sqrt(cx*cx + cy*cy + cz*cz) / 2;
+        }
+        const double det = v[0][0]*(v[1][1]*v[2][2] - v[1][2]*v[2][1])
+                         - v[0][1]*(v[1][0]*v[2][2] - v[1][2]*v[2][0])
+                         + v[0][2]*(v[1][0]*v[2][1] - v[1][1]*v[2][0]);
+        return std::abs(det) / 6;
+    }
+
+    // Area or volume of an element. Quads are split into two triangles and hexahedra into six tetrahedra.
+    double measure(mint e) const {
+        const mint *en = elementNodes(e);
+        if (type->faceNodes == 2) {
+            double m = simplexMeasure(en, 3);
+            if (type->nodes == 4) {
+                const mint second[] = {en[0], en[2], en[3]};
+                m += simplexMeasure(second, 3);
+            }
+            return m;
+        }
+        if (type->nodes == 4)
+            return simplexMeasure(en, 4);
+
+        static const int tets[6][4] = {{0,1,2,6}, {0,2,3,6}, {0,3,7,6}, {0,7,4,6}, {0,4,5,6}, {0,5,1,6}};
+        double m = 0;
+        for (const auto &t : tets) {
+            const mint nodes[] = {en[t[0]], en[t[1]], en[t[2]], en[t[3]]};
+            m += simplexMeasure(nodes, 4);
+        }
+        return m;
+    }
+
+    void checkNode(mint node) const {
+        if (node < 1 || node > nn)
+            throw mma::LibraryError("Node index out of range.");
+    }
+
+    void checkElement(mint elem) const {
+        if (elem < 1 || elem > ne)
+            throw mma::LibraryError("Element index out of range.");
+    }
+
+    void checkSet() const {
+        if (! type)
+            throw mma::LibraryError("The mesh has not been set.");
+    }
+
+public:
+    // Set the node coordinates, and the elements as a matrix of 1-based node indices.
+    void set(mma::RealMatrixRef nodes, mma::IntMatrixRef elems, mma::StringRef typeName) {
+        const ElementType *newType = findType(typeName);
+        if (! newType)
+            throw mma::LibraryError("Unknown element type.");
+        if (elems.cols() != newType->nodes)
+            throw mma::LibraryError("The number of nodes per element does not match the element type.");
+        if (nodes.cols() < newType->minDim || nodes.cols() > 3)
+            throw mma::LibraryError("The embedding dimension is not valid for the element type.");
+
+        const mint newNN = nodes.rows(), newNE = elems.rows();
+        const mint n = elems.size();
+        mint invalid = 0;
+#ifdef _OPENMP
+        #pragma omp parallel for reduction(+:invalid)
+#endif
+        for (mint i=0; i < n; ++i)
+            if (elems[i] < 1 || elems[i] > newNN)
+                invalid++;
+        if (invalid > 0)
+            throw mma::LibraryError("Node indices must be between 1 and the number of nodes.");
+
+        // If the computation is aborted, the mesh is left empty
+        try {
+            type = newType;
+            dim = nodes.cols();
+            nn = newNN;
+            ne = newNE;
+            coords.assign(nodes.begin(), nodes.end());
+            elements.resize(n);
+#ifdef _OPENMP
+            #pragma omp parallel for
+#endif
+            for (mint i=0; i < n; ++i)
+                elements[i] = elems[i] - 1;
+
+            // node -> elements
+            groupByKey(elements.data(), n, nn, nodeOffsets, nodeElems);
+            for (auto &p : nodeElems)
+                p /= type->nodes; // position in the connectivity array -> element
+
+            mma::check_abort();
+
+            // element -> neighbours
+            const mint nf = type->faces;
+            neighbours.resize(ne*nf);
+#ifdef _OPENMP
+            #pragma omp parallel for schedule(dynamic, 1024)
+#endif
+            for (mint e=0; e < ne; ++e)
+                for (mint f=0; f < nf; ++f)
+                    neighbours[e*nf + f] = findNeighbour(e, f);
+
+            boundary.clear();
+            for (mint i=0; i < ne*nf; ++i)
+                if (neighbours[i] == -1)
+                    boundary.push_back(i);
+
+            mma::check_abort();
+
+            computeColoring();
+        } catch (...) {
+            type = nullptr;
+            throw;
+        }
+    }
+
+    mint nodeCount() const { return nn; }
+
+    mint elementCount() const { return ne; }
+
+    // The elements incident to a node, in increasing order
+    mma::IntTensorRef nodeElements(mint node) const {
+        checkSet();
+        checkNode(node);
+        auto res = mma::makeVector<mint>(nodeOffsets[node] - nodeOffsets[node-1]);
+        for (mint k = nodeOffsets[node-1]; k < nodeOffsets[node]; ++k)
+            res[k - nodeOffsets[node-1]] = nodeElems[k] + 1;
+        return res;
+    }
+
+    // The neighbours of an element across each of its faces, or 0 for boundary faces
+    mma::IntTensorRef elementNeighbours(mint elem) const {
+        checkSet();
+        checkElement(elem);
+        auto res = mma::makeVector<mint>(type->faces);
+        for (mint f=0; f < type->faces; ++f)
+            res[f] = neighbours[(elem-1)*type->faces + f] + 1;
+        return res;
+    }
+
+    // The neighbours of all elements, one row per element
+    mma::IntMatrixRef neighbourMatrix() const {
+        checkSet();
+        auto res = mma::makeMatrix<mint>(ne, type->faces);
+        const mint n = res.size();
+#ifdef _OPENMP
+        #pragma omp parallel for
+#endif
+        for (mint i=0; i < n; ++i)
+            res[i] = neighbours[i] + 1;
+        return res;
+    }
+
+    // The boundary faces, as rows of node indices, oriented outwards for positively oriented elements
+    mma::IntMatrixRef boundaryFaces() const {
+        checkSet();
+        auto res = mma::makeMatrix<mint>(boundary.size(), type->faceNodes);
+        for (mint b=0; b < res.rows(); ++b) {
+            const mint e = boundary[b] / type->faces, f = boundary[b] % type->faces;
+            for (mint i=0; i < type->faceNodes; ++i)
+                res(b,i) = elementNodes(e)[type->face[f][i]] + 1;
+        }
+        return res;
+    }
+
+    // The element each boundary face belongs to
+    mma::IntTensorRef boundaryFaceElements() const {
+        checkSet();
+        auto res = mma::makeVector<mint>(boundary.size());
+        for (mint b=0; b < res.length(); ++b)
+            res[b] = boundary[b] / type->faces + 1;
+        return res;
+    }
+
+    // The nodes on the boundary, in increasing order
+    mma::IntTensorRef boundaryNodes() const {
+        checkSet();
+        std::vector<char> onBoundary(nn);
+        for (const auto &bf : boundary) {
+            const mint e = bf / type->faces, f = bf % type->faces;
+            for (mint i=0; i < type->faceNodes; ++i)
+                onBoundary[elementNodes(e)[type->face[f][i]]] = true;
+        }
+        std::vector<mint> res;
+        for (mint i=0; i < nn; ++i)
+            if (onBoundary[i])
+                res.push_back(i+1);
+        return mma::makeVector<mint>(res.size(), res.data());
+    }
+
+    // The colour of each element; elements sharing a node have different colours
+    mma::IntTensorRef elementColors() const {
+        checkSet();
+        auto res = mma::makeVector<mint>(ne);
+        const mint ncolors = colorOffsets.size() - 1;
+        for (mint c=0; c < ncolors; ++c)
+            for (mint k = colorOffsets[c]; k < colorOffsets[c+1]; ++k)
+                res[colorElems[k]] = c + 1;
+        return res;
+    }
+
+    // The area or volume of each element
+    mma::RealTensorRef elementMeasures() const {
+        checkSet();
+        auto res = mma::makeVector<double>(ne);
+#ifdef _OPENMP
+        #pragma omp parallel for
+#endif
+        for (mint e=0; e < ne; ++e)
+            res[e] = measure(e);
+        return res;
+    }
+
+    // The area or volume associated with each node: each element distributes its measure equally
+    // between its nodes. This is the diagonal of the lumped mass matrix of linear elements.
+    mma::RealTensorRef nodeVolumes() const {
+        checkSet();
+        auto res = mma::makeVector<double>(nn);
+        double *vol = res.data();
+        const mint ncolors = colorOffsets.size() - 1;
+        for (mint c=0; c < ncolors; ++c) {
+            // elements of the same colour share no nodes, so they can write to node data in parallel
+            const mint first = colorOffsets[c], last = colorOffsets[c+1];
+#ifdef _OPENMP
+            #pragma omp parallel for
+#endif
+            for (mint k=first; k < last; ++k) {
+                const mint e = colorElems[k];
+                const double m = measure(e) / type->nodes;
+                const mint *en = elementNodes(e);
+                for (mint i=0; i < type->nodes; ++i)
+                    vol[en[i]] += m;
+            }
+        }
+        return res;
+    }
+};
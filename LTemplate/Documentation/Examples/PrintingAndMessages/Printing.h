@@ -41,15 +41,14 @@ public:
     }
 
     // Issue a message in Mathematica as LTemplate::info
-    void message(const char *msg) const {
-        mma::message(msg);
-        mma::disownString(msg); // release the string sent by the kernel
+    // The string sent by the kernel is released automatically when taken as mma::StringRef
+    void message(mma::StringRef msg) const {
+        mma::message(msg.c_str());
     }
 
     // Issue an error message in Mathematica as LTemplate::error
-    void errorMessage(const char *msg) const {
-        mma::message(msg, mma::M_ERROR);
-        mma::disownString(msg); // release the string sent by the kernel
+    void errorMessage(mma::StringRef msg) const {
+        mma::message(msg.c_str(), mma::M_ERROR);
     }
 
     // Use std::ostringstream to build a more complex message
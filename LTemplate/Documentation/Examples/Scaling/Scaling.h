@@ -0,0 +1,397 @@
+
+#include <LTemplate.h>
+#include <philox.h>
+
+#include <map>
+#include <vector>
+#include <chrono>
+#include <cmath>
+#include <algorithm>
+#include <string>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// The kernels that are measured, from the other examples
+#include "../Tensor/Tensor.h"
+#include "../SparseArray/Sparse.h"
+#include "../Images/Img.h"
+#include "../Ising/Ising.h"
+
+/* VecExpr::setToSum() looks up its operands with mma::getInstance(). VecExpr is not a class
+ * of this library, so the benchmark keeps its own VecExpr instances, and provides their collection.
+ * The collection is only modified by the main thread, while no kernel is running.
+ */
+class VecExpr;
+
+static std::map<mint, VecExpr *> benchmarkVecExprs;
+
+namespace mma {
+    template<> inline const std::map<mint, VecExpr *> &getCollection<VecExpr>() { return benchmarkVecExprs; }
+}
+
+#include "../LibraryExpressions/VecExpr.h"
+
+
+/* The benchmarks below share the following interface:
+ *
+ *  - The constructor creates the data of each thread, for the given working set size in bytes.
+ *    All data is created by the main thread, as it would be in a library function.
+ *  - operator () (t) runs the kernel once on the data of thread t.
+ *  - items and bytes are the number of elements processed and the bytes of memory accessed
+ *    by a single run on a single thread.
+ *  - memory() is the most memory used while creating the data of a single thread.
+ *
+ * Serial kernels have replicated = true: each thread runs its own copy of the kernel on its own data,
+ * and the working set is per thread. Kernels that are parallelized with OpenMP run once, using all threads,
+ * on a single working set.
+ */
+
+// Tensor::sum(), reads a vector
+struct SumBenchmark {
+    static const bool replicated = true;
+    static mint length(mint bytes) { return std::max<mint>(1, bytes / sizeof(double)); }
+    static mint memory(mint bytes) { return length(bytes) * sizeof(double); }
+
+    Tensor tensor;
+    std::vector<mma::RealTensorRef> vecs;
+    std::vector<double> results; // one cache line per thread
+    double items, bytes;
+
+    SumBenchmark(mint ws, int threads) : results(8*threads) {
+        const mint n = length(ws);
+        mma::RandomStream rng(1);
+        for (int t=0; t < threads; ++t) {
+            vecs.push_back(mma::makeVector<double>(n));
+            rng.uniform(vecs.back());
+        }
+        items = n;
+        bytes = n * sizeof(double);
+    }
+
+    ~SumBenchmark() {
+        for (auto &v : vecs)
+            v.free();
+    }
+
+    void operator () (int t) { results[8*t] += tensor.sum(vecs[t]); }
+};
+
+
+// mma::detail::transposedCopy(), as used by makeMatrixTransposed(), reads and writes square matrices
+struct TransposeBenchmark {
+    static const bool replicated = true;
+    static mint size(mint bytes) { return std::max<mint>(1, std::sqrt(bytes / (2.0 * sizeof(double)))); }
+    static mint memory(mint bytes) { return 2 * size(bytes) * size(bytes) * sizeof(double); }
+
+    std::vector<std::vector<double>> from, to;
+    mint n;
+    double items, bytes;
+
+    TransposeBenchmark(mint ws, int threads) : n(size(ws)) {
+        mma::RandomStream rng(2);
+        for (int t=0; t < threads; ++t) {
+            from.emplace_back(n*n);
+            to.emplace_back(n*n);
+            rng.uniform(from.back().data(), n*n);
+        }
+        items = n*n;
+        bytes = 2 * n*n * sizeof(double);
+    }
+
+    void operator () (int t) { mma::detail::transposedCopy(from[t].data(), to[t].data(), n, n); }
+};
+
+
+// Img::blur1(), updates a square single-channel Real image in place
+struct BlurBenchmark {
+    static const bool replicated = true;
+    static mint size(mint bytes) { return std::max<mint>(3, std::sqrt(bytes / double(sizeof(double)))); }
+    static mint memory(mint bytes) { return size(bytes) * size(bytes) * sizeof(double); }
+
+    Img img;
+    std::vector<mma::ImageRef<double>> images;
+    double items, bytes;
+
+    BlurBenchmark(mint ws, int threads) {
+        const mint n = size(ws);
+        mma::RandomStream rng(3);
+        for (int t=0; t < threads; ++t) {
+            images.push_back(mma::makeImage<double>(n, n));
+            rng.uniform(images.back().data(), images.back().length());
+        }
+        items = (n-2)*(n-2);
+        bytes = 2 * n*n * sizeof(double);
+    }
+
+    ~BlurBenchmark() {
+        for (auto &im : images)
+            im.free();
+    }
+
+    void operator () (int t) { img.blur1(images[t]); }
+};
+
+
+// Sparse::modify(), iterates through the explicit values of a sparse matrix with 8 elements per row
+struct SparseBenchmark {
+    static const bool replicated = true;
+    static const mint perRow = 8;
+    static mint rows(mint bytes) { return std::max<mint>(perRow, bytes / (perRow * sizeof(double))); }
+    static mint memory(mint bytes) { return rows(bytes) * perRow * (sizeof(double) + 3*sizeof(mint)); } // values, positions and column indices
+
+    Sparse sparse;
+    std::vector<mma::SparseMatrixRef<double>> matrices;
+    double items, bytes;
+
+    SparseBenchmark(mint ws, int threads) {
+        const mint n = rows(ws);
+        mma::RandomStream rng(4);
+        for (int t=0; t < threads; ++t) {
+            auto pos = mma::makeMatrix<mint>(n*perRow, 2);
+            auto vals = mma::makeVector<double>(n*perRow);
+            for (mint i=0; i < n; ++i)
+                for (mint j=0; j < perRow; ++j) {
+                    pos(i*perRow + j, 0) = i + 1;
+                    pos(i*perRow + j, 1) = (i + j*(n/perRow)) % n + 1;
+                }
+            rng.uniform(vals, -1, 1);
+            matrices.push_back(mma::makeSparseMatrix(pos, vals, n, n));
+            pos.free();
+            vals.free();
+        }
+        items = n*perRow;
+        bytes = 2 * n*perRow * sizeof(double);
+    }
+
+    ~SparseBenchmark() {
+        for (auto &sm : matrices)
+            sm.free();
+    }
+
+    void operator () (int t) { sparse.modify(matrices[t]); }
+};
+
+
+// VecExpr::setToSum(), sums 4 vectors into a fifth one
+struct SetToSumBenchmark {
+    static const bool replicated = true;
+    static const mint terms = 4;
+    static mint length(mint bytes) { return std::max<mint>(1, bytes / ((terms+1) * sizeof(double))); }
+    static mint memory(mint bytes) { return (terms+2) * length(bytes) * sizeof(double); }
+
+    std::vector<VecExpr *> targets;
+    std::vector<mma::IntTensorRef> ids;
+    double items, bytes;
+
+    SetToSumBenchmark(mint ws, int threads) {
+        const mint n = length(ws);
+        mma::RandomStream rng(5);
+        auto values = mma::makeVector<double>(n);
+        mint id = benchmarkVecExprs.empty() ? 1 : benchmarkVecExprs.rbegin()->first + 1;
+        for (int t=0; t < threads; ++t) {
+            targets.push_back(new VecExpr);
+            ids.push_back(mma::makeVector<mint>(terms));
+            for (mint k=0; k < terms; ++k) {
+                VecExpr *ve = new VecExpr;
+                rng.uniform(values);
+                ve->set(values);
+                benchmarkVecExprs[id] = ve;
+                ids.back()[k] = id++;
+            }
+            targets.back()->set(values);
+        }
+        values.free();
+        items = terms * n;
+        bytes = (3*terms + 1) * n * sizeof(double); // each term reads the target, the operand, and writes the target
+    }
+
+    ~SetToSumBenchmark() {
+        for (auto &idlist : ids) {
+            for (mint id : idlist) {
+                delete benchmarkVecExprs[id];
+                benchmarkVecExprs.erase(id);
+            }
+            idlist.free();
+        }
+        for (auto ve : targets)
+            delete ve;
+    }
+
+    void operator () (int t) { targets[t]->setToSum(ids[t]); }
+};
+
+
+// Ising::simulate(), one sweep of a square lattice above the critical temperature, parallelized with OpenMP
+struct IsingBenchmark {
+    static const bool replicated = false;
+    static mint size(mint bytes) { return std::max<mint>(2, std::sqrt(8.0 * bytes)); } // one bit per spin
+    static mint memory(mint bytes) { return size(bytes) * size(bytes) * sizeof(mint); } // the initial state is passed as an integer matrix
+
+    Ising ising;
+    mint steps;
+    double items, bytes;
+
+    IsingBenchmark(mint ws, int /* threads */) {
+        const mint n = size(ws);
+        auto state = mma::makeMatrix<mint>(n, n);
+        mma::RandomStream rng(6);
+        rng.integer(state, 0, 1);
+        ising.seed(6);
+        ising.setState(state);
+        state.free();
+        steps = n*n;
+        items = n*n;
+        bytes = 3 * n*n / 8.0; // each half-sweep reads both colours and writes one
+    }
+
+    void operator () (int) { ising.simulate(steps, 3.0); }
+};
+
+
+class Scaling {
+
+    typedef std::chrono::steady_clock clock;
+
+    // Time taken by reps runs of the benchmark on each of the threads, after one warm-up run
+    template<typename B>
+    static double time(B &bench, int threads, mint reps) {
+        clock::time_point start, end;
+        if (B::replicated) {
+            int started = 1;
+#ifdef _OPENMP
+            #pragma omp parallel num_threads(threads)
+            {
+                const int t = omp_get_thread_num();
+                bench(t); // brings the data into the caches of this thread
+                #pragma omp barrier
+                #pragma omp master
+                {
+                    started = omp_get_num_threads();
+                    start = clock::now();
+                }
+                #pragma omp barrier
+                for (mint r=0; r < reps; ++r)
+                    bench(t);
+                #pragma omp barrier
+                #pragma omp master
+                end = clock::now();
+            }
+#else
+            bench(0);
+            start = clock::now();
+            for (mint r=0; r < reps; ++r)
+                bench(0);
+            end = clock::now();
+#endif
+            if (started != threads)
+                throw mma::LibraryError("Could not start the requested number of threads.");
+        } else {
+#ifdef _OPENMP
+            const int saved = omp_get_max_threads();
+            omp_set_num_threads(threads);
+#endif
+            bench(0);
+            start = clock::now();
+            for (mint r=0; r < reps; ++r)
+                bench(0);
+            end = clock::now();
+#ifdef _OPENMP
+            omp_set_num_threads(saved);
+#endif
+        }
+        return std::chrono::duration<double>(end - start).count();
+    }
+
+    /* Repeats the benchmark until it takes at least minTime seconds.
+     * Returns {replicated, repetitions, seconds, items per second, bytes per second},
+     * where the rates are totals over all threads.
+     */
+    template<typename B>
+    static mma::RealTensorRef measure(mint ws, mint threads, double minTime) {
+        B bench(ws, B::replicated ? threads : 1);
+        mint reps = 1;
+        double seconds;
+        while (true) {
+            mma::check_abort();
+            seconds = time(bench, threads, reps);
+            if (seconds >= minTime)
+                break;
+            // aim 20% above minTime, but grow by no more than a factor of 10 at a time
+            reps = std::max<mint>(2*reps, reps * std::min(10.0, 1.2 * minTime / std::max(seconds, 1e-9)));
+        }
+        const double copies = B::replicated ? threads : 1;
+        return mma::makeVector<double>({
+            B::replicated ? 1.0 : 0.0, double(reps), seconds,
+            copies * reps * bench.items / seconds, copies * reps * bench.bytes / seconds
+        });
+    }
+
+    template<typename B>
+    static mint memory(mint ws, mint threads) {
+        return B::memory(ws) * (B::replicated ? threads : 1);
+    }
+
+    // Calls f.template operator()<B>() with the benchmark type B corresponding to the kernel name
+    template<typename F>
+    static auto dispatch(const std::string &kernel, F f) -> decltype(f.template operator()<SumBenchmark>()) {
+        if (kernel == "Tensor::sum")
+            return f.template operator()<SumBenchmark>();
+        if (kernel == "transposedCopy")
+            return f.template operator()<TransposeBenchmark>();
+        if (kernel == "Img::blur1")
+            return f.template operator()<BlurBenchmark>();
+        if (kernel == "Sparse::modify")
+            return f.template operator()<SparseBenchmark>();
+        if (kernel == "VecExpr::setToSum")
+            return f.template operator()<SetToSumBenchmark>();
+        if (kernel == "Ising::simulate")
+            return f.template operator()<IsingBenchmark>();
+        throw mma::LibraryError(std::string("Unknown kernel: ") + kernel);
+    }
+
+    struct Measure {
+        mint ws, threads;
+        double minTime;
+        template<typename B> mma::RealTensorRef operator () () const { return measure<B>(ws, threads, minTime); }
+    };
+
+    struct Memory {
+        mint ws, threads;
+        template<typename B> mint operator () () const { return memory<B>(ws, threads); }
+    };
+
+    static void checkThreads(mint threads) {
+        if (threads < 1)
+            throw mma::LibraryError("The number of threads must be positive.");
+#ifndef _OPENMP
+        if (threads > 1)
+            throw mma::LibraryError("Compile with OpenMP to use more than one thread.");
+#endif
+    }
+
+public:
+    // The number of threads that OpenMP uses by default, typically the number of cores
+    mint maxThreads() {
+#ifdef _OPENMP
+        return omp_get_max_threads();
+#else
+        return 1;
+#endif
+    }
+
+    /* Measures a kernel with the given working set size in bytes and number of threads.
+     * See Measure for the result.
+     */
+    mma::RealTensorRef run(mma::StringRef kernel, mint bytes, mint threads, double minTime) {
+        checkThreads(threads);
+        return dispatch(kernel.str(), Measure{bytes, threads, minTime});
+    }
+
+    // The memory that run() would allocate, to skip configurations that do not fit
+    mint memoryRequired(mma::StringRef kernel, mint bytes, mint threads) {
+        checkThreads(threads);
+        return dispatch(kernel.str(), Memory{bytes, threads});
+    }
+};
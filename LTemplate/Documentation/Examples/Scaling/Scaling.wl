@@ -0,0 +1,129 @@
+(* ::Package:: *)
+
+(* Size and thread scaling benchmark of the example kernels, see Scaling.h and Scaling.nb.
+
+   Run it from the command line with
+
+       wolframscript -file Scaling.wl [name]
+
+   to compile the benchmark library with OpenMP, measure all kernels with the default sizes and thread
+   counts, and write the results to name.json and name.csv (the default name is "scaling").
+   For reproducible thread placement, set the environment variables OMP_PROC_BIND=close and OMP_PLACES=cores.
+
+   When loaded with Get, it only defines the functions below.
+*)
+
+Needs["LTemplate`"]
+
+$scalingDirectory = DirectoryName[$InputFileName];
+
+scalingTemplate = LClass["Scaling",
+  {
+    LFun["maxThreads", {}, Integer],
+    LFun["run", {"UTF8String", Integer, Integer, Real}, {Real, 1}],
+    LFun["memoryRequired", {"UTF8String", Integer, Integer}, Integer]
+  }
+];
+
+$scalingKernels = {"Tensor::sum", "transposedCopy", "Img::blur1", "Sparse::modify", "VecExpr::setToSum", "Ising::simulate"};
+
+
+(* Compiles and loads the benchmark library. Options are passed to CompileTemplate. *)
+scalingCompile[opts___] :=
+    Module[{lib},
+      SetDirectory[$scalingDirectory];
+      lib = CompileTemplate[scalingTemplate, opts];
+      ResetDirectory[];
+      If[lib === $Failed, $Failed, LoadTemplate[scalingTemplate]]
+    ]
+
+
+Options[scalingBenchmark] = {
+  "Kernels" -> Automatic,  (* default: $scalingKernels *)
+  "Sizes" -> Automatic,    (* working set sizes in bytes, default: 16 kB to 256 MB *)
+  "Threads" -> Automatic,  (* default: 1, 2, 4, ... up to the number of OpenMP threads *)
+  "MinTime" -> 0.2,        (* minimum duration of each measurement in seconds *)
+  "MemoryLimit" -> 2^32,   (* configurations that need more memory are skipped *)
+  "Monitor" -> (Null &)    (* called with each result as it is measured *)
+};
+
+(* Measures every combination of kernel, size and thread count. Returns a list of associations:
+
+     "Kernel", "Mode"       "Replicated" for serial kernels, which run as independent copies on each thread,
+                            each with its own working set; "OpenMP" for kernels that are parallelized internally
+     "WorkingSetBytes"      per thread for "Replicated", total for "OpenMP"
+     "Threads"
+     "Repetitions", "Seconds"
+     "Throughput"           elements processed per second, summed over all threads
+     "Bandwidth"            bytes of memory accessed per second, summed over all threads
+     "ParallelEfficiency"   Throughput / (Threads * single-thread Throughput)
+*)
+scalingBenchmark[OptionsPattern[]] :=
+    Module[{obj, maxThreads, kernels, sizes, threads, minTime, limit, monitor, results},
+      obj = Make["Scaling"];
+      maxThreads = obj@"maxThreads"[];
+      kernels = Replace[OptionValue["Kernels"], Automatic -> $scalingKernels];
+      sizes = Replace[OptionValue["Sizes"], Automatic -> 2^Range[14, 28, 2]];
+      threads = Replace[OptionValue["Threads"], Automatic -> Union[2^Range[0, Floor@Log2[maxThreads]], {maxThreads}]];
+      {minTime, limit, monitor} = OptionValue[{"MinTime", "MemoryLimit", "Monitor"}];
+
+      results = Flatten@Table[
+        If[obj@"memoryRequired"[kernel, size, t] > limit,
+          {},
+          With[{r = obj@"run"[kernel, size, t, N[minTime]]},
+            If[Not@VectorQ[r, NumericQ],
+              {},
+              With[{res = <|
+                  "Kernel" -> kernel, "Mode" -> If[r[[1]] == 1, "Replicated", "OpenMP"],
+                  "WorkingSetBytes" -> size, "Threads" -> t,
+                  "Repetitions" -> Round@r[[2]], "Seconds" -> r[[3]],
+                  "Throughput" -> r[[4]], "Bandwidth" -> r[[5]]
+                |>},
+                monitor[res];
+                res
+              ]
+            ]
+          ]
+        ],
+        {kernel, kernels}, {size, sizes}, {t, threads}
+      ];
+
+      Join[#, <|"ParallelEfficiency" -> parallelEfficiency[#, results]|>]& /@ results
+    ]
+
+parallelEfficiency[res_, results_] :=
+    With[{base = SelectFirst[results, #Kernel === res["Kernel"] && #WorkingSetBytes === res["WorkingSetBytes"] && #Threads === 1 &]},
+      If[MissingQ[base], Missing["NotAvailable"], res["Throughput"] / (res["Threads"] base["Throughput"])]
+    ]
+
+
+(* Writes the results to name.json, together with a description of the system, and to name.csv *)
+scalingExport[name_String, results_List] :=
+    With[{rows = results /. _Missing -> Null},
+      Export[name <> ".json",
+        <|
+          "Date" -> DateString["ISODateTime"],
+          "System" -> $System,
+          "MathematicaVersion" -> $VersionNumber,
+          "ProcessorCount" -> $ProcessorCount,
+          "Results" -> rows
+        |>,
+        "RawJSON"
+      ];
+      Export[name <> ".csv", Prepend[Values /@ rows, Keys@First[rows]] /. Null -> "", "CSV"]
+    ]
+
+
+If[Length[$ScriptCommandLine] > 0,
+  Module[{name = If[Length[$ScriptCommandLine] > 1, $ScriptCommandLine[[2]], "scaling"], results},
+    If[scalingCompile["CompileOptions" -> "-O3 -fopenmp", "LinkerOptions" -> "-fopenmp"] === $Failed,
+      Exit[1]
+    ];
+    results = scalingBenchmark[
+      "Monitor" -> (Print[#Kernel, "\t", #WorkingSetBytes, " bytes\t", #Threads, " threads\t", #Bandwidth/10.^9, " GB/s"]&)
+    ];
+    If[results === {}, Exit[1]];
+    scalingExport[name, results];
+    Print["Results written to ", name, ".json and ", name, ".csv"]
+  ]
+]
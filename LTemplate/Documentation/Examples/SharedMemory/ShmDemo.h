@@ -0,0 +1,35 @@
+
+#include <LTemplate.h>
+#include <shmtensor.h>
+#include <numeric>
+
+/* Demonstrates sharing a large array between the main kernel and parallel subkernels.
+ *
+ * The main kernel publishes the array once. Subkernels attach to it by name,
+ * which does not involve copying or serializing the data.
+ */
+class ShmDemo {
+    mma::ShmTensorPool pool;
+
+public:
+    // Publish an array under the given name. Call this in the main kernel.
+    void publish(mma::StringRef name, mma::RealTensorRef t) {
+        pool.publish(name.str(), t);
+    }
+
+    // Remove a published array.
+    void unpublish(mma::StringRef name) {
+        pool.unpublish(name.str());
+    }
+
+    // Sum the elements of a published array. Call this in subkernels.
+    double total(mma::StringRef name) {
+        auto view = pool.attach<double>(name.str());
+        return std::accumulate(view.begin(), view.end(), 0.0);
+    }
+
+    // Return a process-local copy of a published array.
+    mma::RealTensorRef get(mma::StringRef name) {
+        return pool.attach<double>(name.str()).toTensor();
+    }
+};
@@ -0,0 +1,356 @@
+
+#include <LTemplate.h>
+
+#include <vector>
+#include <algorithm>
+#include <utility>
+#include <cmath>
+
+
+/* k-d tree for nearest neighbour and radius queries over a fixed set of points
+ *
+ * The tree is built once, then it can answer any number of queries. The points are split
+ * recursively at the median along the coordinate of largest spread, until at most leafSize points
+ * remain. The split positions determine the tree structure, so nodes are stored implicitly,
+ * as in a binary heap, and points are reordered so that each leaf refers to a contiguous range.
+ *
+ * Queries are batched: each call takes a matrix of query points, and distributes them between threads
+ * when OpenMP is enabled. The tree is also built in parallel. Results do not depend on the number of threads.
+ *
+ * Queries return 1-based point indices, like Nearest. The corresponding distances are kept until the next
+ * query, and can be retrieved with lastDistances(), so that they do not need to be computed twice.
+ */
+class KDTree {
+    typedef std::pair<double, mint> neighbour; // squared distance and index in tree order
+
+    static const mint leafSize = 16;
+
+    mint dim = 0, npoints = 0;
+    std::vector<double> pts;         // coordinates in tree order
+    std::vector<mint> perm;          // perm[i] is the original index of the i-th point in tree order
+    std::vector<mint> splitDim;      // for each node; -1 for leaves
+    std::vector<double> splitValue;
+
+    // Results of the last query
+    std::vector<double> lastDist;
+    std::vector<mint> lastShape;
+    std::vector<mint> lastOffs;
+
+    static mint leftSize(mint begin, mint end) { return (end - begin) / 2; }
+
+    // Build the subtree of node with points begin .. end-1 of perm; coords are the original point coordinates
+    void build(const double *coords, mint node, mint begin, mint end) {
+        if (end - begin <= leafSize) {
+            splitDim[node] = -1;
+            return;
+        }
+
+        mint best = 0;
+        double bestSpread = -1;
+        for (mint k=0; k < dim; ++k) {
+            double lo = coords[perm[begin]*dim + k], hi = lo;
+            for (mint i=begin+1; i < end; ++i) {
+                const double x = coords[perm[i]*dim + k];
+                lo = std::min(lo, x);
+                hi = std::max(hi, x);
+            }
+            if (hi - lo > bestSpread) {
+                bestSpread = hi - lo;
+                best = k;
+            }
+        }
+
+        const mint mid = begin + leftSize(begin, end);
+        std::nth_element(perm.begin() + begin, perm.begin() + mid, perm.begin() + end, [&] (mint i, mint j) {
+            const double xi = coords[i*dim + best], xj = coords[j*dim + best];
+            return xi < xj || (xi == xj && i < j);
+        });
+        splitDim[node] = best;
+        splitValue[node] = coords[perm[mid]*dim + best];
+
+        // Large subtrees are built as separate tasks
+#ifdef _OPENMP
+        #pragma omp task if (end - begin > 100000)
+#endif
+        build(coords, 2*node+1, begin, mid);
+        build(coords, 2*node+2, mid, end);
+#ifdef _OPENMP
+        #pragma omp taskwait
+#endif
+    }
+
+    // The coordinate count is a template parameter for the common cases, so that distance computations are unrolled.
+    // D == 0 means that the dimension is only known at runtime.
+    template<int D>
+    double dist2(const double *a, const double *b) const {
+        const mint d = D ? D : dim;
+        double sum = 0;
+        for (mint k=0; k < d; ++k)
+            sum += (a[k] - b[k])*(a[k] - b[k]);
+        return sum;
+    }
+
+    // State of a k nearest neighbour search
+    struct Search {
+        const double *q;
+        mint k;
+        std::vector<neighbour> best; // the best candidates so far, in increasing order
+        std::vector<double> off;     // offset of q from the current cell along each coordinate
+
+        // squared distance of the k-th best candidate, or infinity if there are fewer than k
+        double bound() const { return mint(best.size()) < k ? HUGE_VAL : best.back().first; }
+
+        void add(const neighbour &cand) {
+            if (mint(best.size()) == k) {
+                if (! (cand < best.back()))
+                    return;
+                best.pop_back();
+            }
+            best.insert(std::upper_bound(best.begin(), best.end(), cand), cand);
+        }
+    };
+
+    /* Add the neighbours of s.q in the subtree of node to the candidates.
+     * rd is the squared distance from q to the cell of the node. Tracking it together with the per-coordinate
+     * offsets (Arya and Mount, 1993) gives a tighter bound for pruning far subtrees than the distance to the
+     * splitting plane alone.
+     */
+    template<int D>
+    void knn(Search &s, mint node, mint begin, mint end, double rd) const {
+        if (splitDim[node] == -1) {
+            double bound = s.bound();
+            for (mint i=begin; i < end; ++i) {
+                const double d2 = dist2<D>(s.q, &pts[i*dim]);
+                if (d2 <= bound) { // ties are resolved by index in add()
+                    s.add(neighbour(d2, i));
+                    bound = s.bound();
+                }
+            }
+            return;
+        }
+
+        const mint mid = begin + leftSize(begin, end);
+        const mint sd = splitDim[node];
+        const double diff = s.q[sd] - splitValue[node];
+        if (diff < 0)
+            knn<D>(s, 2*node+1, begin, mid, rd);
+        else
+            knn<D>(s, 2*node+2, mid, end, rd);
+
+        const double oldOff = s.off[sd];
+        const double farRd = rd - oldOff*oldOff + diff*diff;
+        if (farRd <= s.bound()) {
+            s.off[sd] = diff;
+            if (diff < 0)
+                knn<D>(s, 2*node+2, mid, end, farRd);
+            else
+                knn<D>(s, 2*node+1, begin, mid, farRd);
+            s.off[sd] = oldOff;
+        }
+    }
+
+    // Collect all points within squared distance r2 of q in the subtree of node
+    template<int D>
+    void within(const double *q, double r2, mint node, mint begin, mint end, std::vector<neighbour> &result) const {
+        if (splitDim[node] == -1) {
+            for (mint i=begin; i < end; ++i) {
+                const double d2 = dist2<D>(q, &pts[i*dim]);
+                if (d2 <= r2)
+                    result.push_back(neighbour(d2, i));
+            }
+            return;
+        }
+
+        const mint mid = begin + leftSize(begin, end);
+        const double diff = q[splitDim[node]] - splitValue[node];
+        if (diff <= 0 || diff*diff <= r2)
+            within<D>(q, r2, 2*node+1, begin, mid, result);
+        if (diff >= 0 || diff*diff <= r2)
+            within<D>(q, r2, 2*node+2, mid, end, result);
+    }
+
+    template<int D>
+    void nearestBatch(const mma::RealMatrixRef &queries, mint k, mma::IntMatrixRef &indices) {
+        const mint nq = queries.rows();
+        const mint band = 65536;
+        for (mint start=0; start < nq; start += band) {
+            const mint end = std::min(nq, start + band);
+#ifdef _OPENMP
+            #pragma omp parallel
+#endif
+            {
+                Search s;
+                s.k = k;
+                s.best.reserve(k);
+#ifdef _OPENMP
+                #pragma omp for schedule(dynamic, 256)
+#endif
+                for (mint j=start; j < end; ++j) {
+                    s.q = &queries(j,0);
+                    s.best.clear();
+                    s.off.assign(dim, 0.0);
+                    knn<D>(s, 0, 0, npoints, 0.0);
+                    for (mint i=0; i < k; ++i) {
+                        indices(j,i) = perm[s.best[i].second] + 1;
+                        lastDist[j*k + i] = std::sqrt(s.best[i].first);
+                    }
+                }
+            }
+            mma::check_abort();
+        }
+    }
+
+    template<int D>
+    void radiusBatch(const mma::RealMatrixRef &queries, double r, std::vector<mint> &result) {
+        const mint nq = queries.rows();
+        const mint band = 16384;
+        std::vector<std::vector<neighbour>> found(std::min(nq, band));
+        lastOffs.assign(1, 0);
+        for (mint start=0; start < nq; start += band) {
+            const mint end = std::min(nq, start + band);
+#ifdef _OPENMP
+            #pragma omp parallel for schedule(dynamic, 256)
+#endif
+            for (mint j=start; j < end; ++j) {
+                std::vector<neighbour> &f = found[j - start];
+                f.clear();
+                within<D>(&queries(j,0), r*r, 0, 0, npoints, f);
+                std::sort(f.begin(), f.end());
+            }
+            mma::check_abort();
+
+            for (mint j=start; j < end; ++j) {
+                for (const auto &nb : found[j - start]) {
+                    result.push_back(perm[nb.second] + 1);
+                    lastDist.push_back(std::sqrt(nb.first));
+                }
+                lastOffs.push_back(result.size());
+            }
+        }
+    }
+
+    void checkQueries(const mma::RealMatrixRef &queries) const {
+        if (npoints == 0)
+            throw mma::LibraryError("The tree has no points.");
+        if (queries.cols() != dim)
+            throw mma::LibraryError("The dimension of the query points does not match the dimension of the tree.");
+    }
+
+    void clearLast() {
+        lastDist.clear();
+        lastShape.clear();
+        lastOffs.clear();
+    }
+
+public:
+    // Build the tree from an n by d matrix of points
+    void set(mma::RealMatrixRef points) {
+        const mint n = points.rows(), d = points.cols();
+        if (n > 0 && d == 0)
+            throw mma::LibraryError("Points must have at least one coordinate.");
+
+        mint nodes = 1;
+        for (mint size = n; size > leafSize; size = size - size/2)
+            nodes = 2*nodes + 1;
+
+        clearLast();
+        dim = d;
+        npoints = n;
+        perm.resize(n);
+        for (mint i=0; i < n; ++i)
+            perm[i] = i;
+        splitDim.assign(nodes, -1);
+        splitValue.assign(nodes, 0.0);
+
+#ifdef _OPENMP
+        #pragma omp parallel
+        #pragma omp single
+#endif
+        build(points.data(), 0, 0, n);
+
+        pts.resize(n*d);
+#ifdef _OPENMP
+        #pragma omp parallel for
+#endif
+        for (mint i=0; i < n; ++i)
+            std::copy(&points(perm[i], 0), &points(perm[i], 0) + d, &pts[i*d]);
+    }
+
+    // Number of points
+    mint size() const { return npoints; }
+
+    // Dimension of the points
+    mint dimension() const { return dim; }
+
+    /* The k nearest points to each query point, ordered by increasing distance.
+     * Returns a matrix with a row for each query point. If k is larger than the number of points,
+     * all points are returned. lastDistances() returns the matrix of corresponding distances.
+     */
+    mma::IntMatrixRef nearest(mma::RealMatrixRef queries, mint k) {
+        checkQueries(queries);
+        if (k < 1)
+            throw mma::LibraryError("The number of neighbours must be positive.");
+        k = std::min(k, npoints);
+
+        clearLast();
+        const mint nq = queries.rows();
+        auto indices = mma::makeMatrix<mint>(nq, k);
+        try {
+            lastDist.resize(nq*k);
+            lastShape = {nq, k};
+            switch (dim) {
+            case 2:  nearestBatch<2>(queries, k, indices); break;
+            case 3:  nearestBatch<3>(queries, k, indices); break;
+            default: nearestBatch<0>(queries, k, indices); break;
+            }
+        } catch (...) {
+            indices.free();
+            clearLast();
+            throw;
+        }
+        return indices;
+    }
+
+    /* All points within distance r of each query point, ordered by increasing distance.
+     * The results of all query points are concatenated into a single vector. lastOffsets() returns
+     * where the result of each query point starts, and lastDistances() the corresponding distances.
+     */
+    mma::IntTensorRef withinRadius(mma::RealMatrixRef queries, double r) {
+        checkQueries(queries);
+        if (! (r >= 0))
+            throw mma::LibraryError("The radius must be non-negative.");
+
+        clearLast();
+        std::vector<mint> result;
+        try {
+            switch (dim) {
+            case 2:  radiusBatch<2>(queries, r, result); break;
+            case 3:  radiusBatch<3>(queries, r, result); break;
+            default: radiusBatch<0>(queries, r, result); break;
+            }
+        } catch (...) {
+            clearLast();
+            throw;
+        }
+        lastShape = {mint(result.size())};
+        return mma::makeVector<mint>(result.size(), result.data());
+    }
+
+    // Distances of the points returned by the last query, in the same arrangement
+    mma::RealTensorRef lastDistances() const {
+        if (lastShape.empty())
+            throw mma::LibraryError("There was no query yet.");
+        auto res = mma::makeTensor<double>(lastShape.size(), lastShape.data());
+        std::copy(lastDist.begin(), lastDist.end(), res.begin());
+        return res;
+    }
+
+    /* Offsets of the results of the last radius query: the result for query point i (1-based)
+     * is at positions lastOffsets()[[i]]+1 .. lastOffsets()[[i+1]], so Differences gives the counts.
+     */
+    mma::IntTensorRef lastOffsets() const {
+        if (lastOffs.empty())
+            throw mma::LibraryError("There was no radius query yet.");
+        return mma::makeVector<mint>(lastOffs.size(), lastOffs.data());
+    }
+};
@@ -1,10 +1,14 @@
 
 #include <LTemplate.h>
+#include <philox.h>
 #include <random>
 #include <numeric>
 #include <iomanip>
 
 class Tensor {
+    // Counter-based random number stream, seeded once when the object is created. See philox.h.
+    mma::RandomStream rng{ std::random_device()() };
+
 public:
     // A trivial function that returns a real array as-is.
     mma::RealTensorRef identity(mma::RealTensorRef t) { return t; }
@@ -91,15 +95,10 @@ public:
     }
 
     // Create n random numbers between lower and upper.
+    // Demonstrates bulk filling of Tensors with mma::RandomStream.
     mma::RealTensorRef randomReal(mint n, double lower, double upper) {
-        std::random_device r;
-        std::default_random_engine eng(r());
-        std::uniform_real_distribution<double> dist(lower, upper);
-
         auto vec = mma::makeVector<double>(n);
-        for (auto &el : vec)
-            el = dist(eng);
-
+        rng.uniform(vec, lower, upper);
         return vec;
     }
 };
@@ -54,10 +54,12 @@ static_assert(sizeof(mint) == 8, "MINT_32 is not defined but sizeof(mint) != 8.
 #include <cstdint>
 #include <complex>
 #include <string>
+#include <cstring>
 #include <ostream>
 #include <sstream>
 #include <vector>
 #include <map>
+#include <memory>
 #include <type_traits>
 #include <iterator>
 #include <initializer_list>
@@ -98,10 +100,51 @@ void message(const char *msg, MessageType type = M_INFO);
 inline void message(const std::string &msg, MessageType type = M_INFO) { message(msg.c_str(), type); }
 
 
+#ifdef LTEMPLATE_STANDALONE
+/* When LTEMPLATE_STANDALONE is defined, classes are compiled into a separate executable
+ * (such as a worker process) that has no connection to the kernel. The stand-in runtime
+ * in LTemplateStandalone.inc provides libData, and all output goes through these hooks.
+ */
+namespace detail { // private
+    struct StandaloneHooks {
+        void (*print)(const char *msg);
+        void (*message)(const char *msg, MessageType type);
+        void (*libraryMessage)(const char *tag); // libData->Message
+        bool (*abortQ)();
+    };
+
+    StandaloneHooks &standaloneHooks();
+
+    // Sets mma::libData to the stand-in runtime. Must be called before using any LTemplate functions.
+    void standaloneInitialize();
+
+    // Creates an MTensor that refers to existing memory, which is not freed together with the MTensor.
+    MTensor standaloneBorrowTensor(mint type, mint rank, const mint *dims, void *data);
+
+    bool standaloneBorrowedQ(MTensor t);
+
+    // Releases a borrowed MTensor (but not the memory it refers to).
+    void standaloneReleaseBorrowed(MTensor t);
+
+    /* Creates a copy of an MTensor for "Shared" passing: the receiving function may keep it,
+     * and disown() it once it no longer uses it. The copy is freed when it has been disowned
+     * and released with standaloneReleaseShared(), whichever happens last.
+     */
+    MTensor standaloneShareTensor(MTensor t);
+
+    // Ends the caller's use of a Tensor created by standaloneShareTensor().
+    void standaloneReleaseShared(MTensor t);
+} // end namespace detail
+#endif // LTEMPLATE_STANDALONE
+
+
 /** \brief Call _Mathematica_'s `Print[]`.
  *
  * \sa mout, message()
  */
+#ifdef LTEMPLATE_STANDALONE
+inline void print(const char *msg) { detail::standaloneHooks().print(msg); }
+#else
 inline void print(const char *msg) {
     if (libData->AbortQ())
         return; // trying to use the MathLink connection during an abort appears to break it
@@ -115,6 +158,7 @@ inline void print(const char *msg) {
     if (pkt == RETURNPKT)
         MLNewPacket(link);
 }
+#endif // LTEMPLATE_STANDALONE
 
 /// Call _Mathematica_'s `Print[]`, `std::string` argument version.
 inline void print(const std::string &msg) { print(msg.c_str()); }
@@ -187,6 +231,61 @@ namespace detail { // private
 } // end namespace detail
 
 
+#ifdef LTEMPLATE_ALLOC_CENSUS
+/* When LTEMPLATE_ALLOC_CENSUS is defined, the functions below that create arrays or copy data
+ * report to the census of the member function call in progress on the calling thread.
+ * The results are collected per function by LTemplateCensus.h.
+ */
+namespace detail { // private
+    struct AllocCensus {
+        mint allocations = 0;
+        mint bytesAllocated = 0;
+        mint copies = 0;
+        mint bytesCopied = 0;
+    };
+
+    // The census of the member function call in progress on this thread, NULL outside of calls
+    inline AllocCensus *&currentAllocCensus() {
+        static thread_local AllocCensus *census = NULL;
+        return census;
+    }
+
+    inline void censusAllocation(mint bytes) {
+        AllocCensus *census = currentAllocCensus();
+        if (census) {
+            census->allocations++;
+            census->bytesAllocated += bytes;
+        }
+    }
+
+    inline void censusCopy(mint bytes) {
+        AllocCensus *census = currentAllocCensus();
+        if (census) {
+            census->copies++;
+            census->bytesCopied += bytes;
+        }
+    }
+} // end namespace detail
+
+template<typename T> class SparseArrayRef;
+
+namespace detail { // private
+    // Size of the explicit values and positions of a SparseArray
+    template<typename T>
+    inline mint sparseStorageBytes(const SparseArrayRef<T> &sa) {
+        return (sa.explicitValuesQ() ? sa.explicitValues().length() * sizeof(T) : 0) +
+               (sa.rowPointers().length() + sa.columnIndices().length()) * sizeof(mint);
+    }
+} // end namespace detail
+
+#define LTEMPLATE_CENSUS_ALLOC(bytes) mma::detail::censusAllocation(bytes)
+#define LTEMPLATE_CENSUS_COPY(bytes)  mma::detail::censusCopy(bytes)
+#else
+#define LTEMPLATE_CENSUS_ALLOC(bytes) ((void)0)
+#define LTEMPLATE_CENSUS_COPY(bytes)  ((void)0)
+#endif // LTEMPLATE_ALLOC_CENSUS
+
+
 /// Check for and honour user aborts.
 inline void check_abort() {
     if (libData->AbortQ())
@@ -200,6 +299,60 @@ inline void disownString(const char *str) {
 }
 
 
+/** \brief Non-owning view of a null-terminated string
+ *
+ * Member functions may take `"UTF8String"` arguments as \ref StringRef instead of `const char *`.
+ * In this case the string is released automatically when the function returns, and it must not be
+ * used after that. Use str() to keep a copy. The same applies to `std::string` parameters,
+ * which always receive a copy. The string is also released when the function is not called at all,
+ * for example because the instance does not exist or another argument is invalid.
+ *
+ * A `const char *` parameter leaves the string to the function, which must release it
+ * with \ref disownString() on every path, including when it throws. Prefer \ref StringRef.
+ *
+ * Conversely, `"UTF8String"` results may be returned as `std::string`. The returned string
+ * is kept in a buffer specific to the function until it is called again. Returning
+ * a `const std::string &` to a data member avoids copying the result altogether.
+ */
+class StringRef {
+    const char *ptr;
+    std::size_t len;
+
+public:
+    StringRef(const char *str) : ptr(str), len(std::strlen(str)) { }
+    StringRef(const std::string &str) : ptr(str.c_str()), len(str.size()) { }
+
+    /// Pointer to the null-terminated string
+    const char *c_str() const { return ptr; }
+
+    /// Pointer to the string data, same as c_str()
+    const char *data() const { return ptr; }
+
+    /// Length of the string in bytes, not including the terminating null
+    std::size_t size() const { return len; }
+
+    /// Same as size()
+    std::size_t length() const { return len; }
+
+    bool empty() const { return len == 0; }
+
+    const char *begin() const { return ptr; }
+    const char *end() const { return ptr + len; }
+
+    const char &operator [] (std::size_t i) const { return ptr[i]; }
+
+    /// Create a copy of the string
+    std::string str() const { return std::string(ptr, len); }
+
+    bool operator == (const StringRef &s) const { return len == s.len && std::memcmp(ptr, s.ptr, len) == 0; }
+    bool operator != (const StringRef &s) const { return !(*this == s); }
+};
+
+inline std::ostream &operator << (std::ostream &os, const StringRef &s) {
+    return os.write(s.data(), s.size());
+}
+
+
 namespace detail {
     template<typename LT>
     class LTAutoFree {
@@ -228,6 +381,8 @@ namespace detail {
  *
  *  Do not use `delete` on the Class pointers in this collection or a crash may result later in the session.
  *
+ *  The collection is modified whenever an instance is created or destroyed, therefore it must only be accessed
+ *  from the thread that called the library function. Use \ref getCollectionSnapshot() or \ref pinInstance() in worker threads.
  */
 template<typename Class>
 extern const std::map<mint, Class *> &getCollection();
@@ -238,6 +393,8 @@ extern const std::map<mint, Class *> &getCollection();
  *
  * If no class instance corresponding to `id` exists, a \ref LibraryError will be thrown.
  *
+ * Not safe to call from worker threads, see \ref pinInstance().
+ *
  *  \throws LibraryError
  */
 template<typename Class>
@@ -250,6 +407,102 @@ inline Class &getInstance(mint id) {
 }
 
 
+namespace detail { // private
+    /* Copy-on-write registry of class instances, maintained alongside the collection
+     * returned by getCollection().
+     *
+     * The library expression manager (which always runs on the kernel's thread) publishes
+     * a new immutable map on every creation or destruction. Readers on any thread atomically
+     * take the current map and never observe a partial update. Since instances are owned
+     * through shared_ptr, an instance that is destroyed in the kernel while still referenced
+     * by another thread is only deleted when the last reference goes away.
+     *
+     * This is not lock-free: the std::atomic_load / std::atomic_store overloads for shared_ptr
+     * are typically implemented with a small pool of mutexes or spinlocks (as in libstdc++).
+     * The lock is only held while the pointer is read or replaced, never while the map is copied
+     * or searched, so readers and the manager wait on each other for a few instructions at most.
+     *
+     * Publishing copies the whole map, so creating or destroying an instance costs O(n) time
+     * and memory with n instances.
+     */
+    template<typename Class>
+    class SharedCollection {
+    public:
+        typedef std::map<mint, std::shared_ptr<Class>> map_type;
+
+    private:
+        std::shared_ptr<const map_type> current;
+
+        void publish(const std::shared_ptr<const map_type> &m) { std::atomic_store(&current, m); }
+
+    public:
+        SharedCollection() : current(std::make_shared<map_type>()) { }
+
+        SharedCollection(const SharedCollection &) = delete;
+        SharedCollection & operator = (const SharedCollection &) = delete;
+
+        std::shared_ptr<const map_type> snapshot() const { return std::atomic_load(&current); }
+
+        void insert(mint id, const std::shared_ptr<Class> &obj) {
+            auto m = std::make_shared<map_type>(*snapshot());
+            (*m)[id] = obj;
+            publish(m);
+        }
+
+        void erase(mint id) {
+            auto m = std::make_shared<map_type>(*snapshot());
+            m->erase(id);
+            publish(m);
+        }
+    };
+} // end namespace detail
+
+
+/** \brief An immutable snapshot of all instances of an LTemplate class
+ *
+ * Each instance is held through a `std::shared_ptr`, which pins it: an instance is not deleted
+ * while a snapshot or a \ref pinInstance() reference to it is alive, even if it is destroyed in _Mathematica_.
+ *
+ * \sa getCollectionSnapshot()
+ */
+template<typename Class>
+using CollectionSnapshot = std::shared_ptr<const std::map<mint, std::shared_ptr<Class>>>;
+
+/** \brief Get a snapshot of all instances of an LTemplate class
+ *
+ * Unlike \ref getCollection(), this function may be called from any thread, including
+ * worker threads that run concurrently with the creation or destruction of instances.
+ * Taking a snapshot only contends with the creation or destruction of instances for the
+ * duration of a shared_ptr copy (the standard library may use an internal lock for this),
+ * and the snapshot does not reflect changes made after it was taken.
+ */
+template<typename Class>
+extern CollectionSnapshot<Class> getCollectionSnapshot();
+
+/** \brief Get a pinned reference to the class instance corresponding to the given managed library expression ID
+ *  \tparam Class is the LTemplate class to get an instance of.
+ *  \param id is the managed library expression ID.
+ *
+ * This is the thread-safe counterpart of \ref getInstance(). The instance will not be deleted
+ * while the returned pointer (or a copy of it) is alive. If the last reference is released
+ * after the instance was destroyed in _Mathematica_, the instance is deleted on the releasing thread.
+ *
+ * If no class instance corresponding to `id` exists, a \ref LibraryError will be thrown.
+ * Note that \ref LibraryError must not be _reported_ from worker threads; catch it and
+ * re-throw it on the main thread instead.
+ *
+ *  \throws LibraryError
+ */
+template<typename Class>
+inline std::shared_ptr<Class> pinInstance(mint id) {
+    const auto snapshot = getCollectionSnapshot<Class>();
+    auto it = snapshot->find(id);
+    if (it == snapshot->end())
+        throw LibraryError("Managed library expression instance does not exist.");
+    return it->second;
+}
+
+
 ///////////////////////////////////////  DENSE AND SPARSE ARRAY HANDLING  ///////////////////////////////////////
 
 namespace detail { // private
@@ -294,7 +547,7 @@ template<typename T> class SparseArrayRef;
  * Note that just like `MTensor`, this class only holds a reference to a Tensor.
  * Multiple \ref TensorRef objects may refer to the same Tensor.
  *
- * \sa MatrixRef, CubeRef
+ * \sa MatrixRef, CubeRef, FixedColsMatrixRef
  * \sa makeTensor(), makeVector(), makeMatrix(), makeCube()
  */
 template<typename T>
@@ -355,6 +608,8 @@ public:
         MTensor c = NULL;
         int err = libData->MTensor_clone(t, &c);
         if (err) throw LibraryError("MTensor_clone() failed.", err);
+        LTEMPLATE_CENSUS_ALLOC(length() * sizeof(T));
+        LTEMPLATE_CENSUS_COPY(length() * sizeof(T));
         return c;
     }
 
@@ -385,6 +640,8 @@ public:
         if (err) throw LibraryError("MTensor_new() failed.", err);
         TensorRef<U> tr(mt);
         std::copy(begin(), end(), tr.begin());
+        LTEMPLATE_CENSUS_ALLOC(tr.length() * sizeof(U));
+        LTEMPLATE_CENSUS_COPY(tr.length() * sizeof(U));
         return tr;
     }
 
@@ -393,6 +650,8 @@ public:
         MSparseArray sa = NULL;
         int err = libData->sparseLibraryFunctions->MSparseArray_fromMTensor(t, NULL, &sa);
         if (err) throw LibraryError("MSparseArray_fromMTensor() failed.", err);
+        LTEMPLATE_CENSUS_ALLOC(detail::sparseStorageBytes(SparseArrayRef<T>(sa)));
+        LTEMPLATE_CENSUS_COPY(detail::sparseStorageBytes(SparseArrayRef<T>(sa)));
         return sa;
     }
 };
@@ -488,6 +747,103 @@ typedef CubeRef<complex_t>  ComplexCubeRef;
 /// @}
 
 
+/** \brief Wrapper class for `MTensor` pointers to matrices with a fixed number of columns
+ *
+ * Specified as `{T, {_, N}}` in an `LTemplate` in _Mathematica_, e.g. `{Real, {_, 3}}` for a list of 3D points.
+ *
+ * The number of columns is a compile-time constant, so loops over the elements of a row can be
+ * unrolled and vectorized by the compiler. The shape is verified only once, when the object is created
+ * from a \ref TensorRef. If it is incorrect, a \ref LibraryError is thrown.
+ *
+ * \tparam N is the number of columns
+ * \sa FixedMatrixRef, FixedVectorRef
+ * \sa makeFixedColsMatrix()
+ */
+template<typename T, mint N>
+class FixedColsMatrixRef : public TensorRef<T> {
+    static_assert(N > 0, "FixedColsMatrixRef: the number of columns must be positive.");
+
+    mint nrows;
+
+public:
+    FixedColsMatrixRef(const TensorRef<T> &tr) : TensorRef<T>(tr)
+    {
+        if (TensorRef<T>::rank() != 2 || TensorRef<T>::dimensions()[1] != N)
+            throw LibraryError("FixedColsMatrixRef: Matrix with " + std::to_string(N) + " columns expected.");
+        nrows = TensorRef<T>::dimensions()[0];
+    }
+
+    /// Number of rows in the matrix
+    mint rows() const { return nrows; }
+
+    /// Number of columns in the matrix
+    static constexpr mint cols() { return N; }
+
+    /// Returns 2 for a matrix
+    mint rank() const { return 2; }
+
+    /// Index into a matrix using row and column indices
+    T & operator () (mint i, mint j) const { return (*this)[N*i + j]; }
+};
+
+
+/** \brief Wrapper class for `MTensor` pointers to matrices of a fixed size
+ *
+ * Specified as `{T, {M, N}}` in an `LTemplate` in _Mathematica_, e.g. `{Real, {3, 3}}`.
+ * Both dimensions are compile-time constants. The shape is verified when the object is created.
+ *
+ * \sa FixedColsMatrixRef, FixedVectorRef
+ * \sa makeFixedMatrix()
+ */
+template<typename T, mint M, mint N>
+class FixedMatrixRef : public FixedColsMatrixRef<T, N> {
+    static_assert(M > 0, "FixedMatrixRef: the number of rows must be positive.");
+
+public:
+    FixedMatrixRef(const TensorRef<T> &tr) : FixedColsMatrixRef<T, N>(tr)
+    {
+        if (TensorRef<T>::dimensions()[0] != M)
+            throw LibraryError("FixedMatrixRef: " + std::to_string(M) + " by " + std::to_string(N) + " matrix expected.");
+    }
+
+    /// Number of rows in the matrix
+    static constexpr mint rows() { return M; }
+};
+
+
+/** \brief Wrapper class for `MTensor` pointers to vectors of a fixed length
+ *
+ * Specified as `{T, {N}}` in an `LTemplate` in _Mathematica_, e.g. `{Real, {3}}`.
+ * The length is a compile-time constant. The shape is verified when the object is created.
+ *
+ * \sa FixedColsMatrixRef, FixedMatrixRef
+ * \sa makeFixedVector()
+ */
+template<typename T, mint N>
+class FixedVectorRef : public TensorRef<T> {
+    static_assert(N > 0, "FixedVectorRef: the length must be positive.");
+
+public:
+    FixedVectorRef(const TensorRef<T> &tr) : TensorRef<T>(tr)
+    {
+        if (TensorRef<T>::rank() != 1 || TensorRef<T>::length() != N)
+            throw LibraryError("FixedVectorRef: Vector of length " + std::to_string(N) + " expected.");
+    }
+
+    /// Number of elements in the vector
+    static constexpr mint length() { return N; }
+
+    /// Number of elements in the vector, synonym of \ref length()
+    static constexpr mint size() { return N; }
+
+    /// Returns 1 for a vector
+    mint rank() const { return 1; }
+
+    /// Iterator past the end of the vector
+    T *end() const { return TensorRef<T>::begin() + N; }
+};
+
+
 /** \brief Create a Tensor of the given dimensions
  *  \tparam T is the type of the Tensor; can be `mint`, `double` or `mma::m_complex`.
  *  \param dims are the dimensions
@@ -497,6 +853,7 @@ inline TensorRef<T> makeTensor(std::initializer_list<mint> dims) {
     MTensor t = NULL;
     int err = libData->MTensor_new(detail::libraryType<T>(), dims.size(), dims.begin(), &t);
     if (err) throw LibraryError("MTensor_new() failed.", err);
+    LTEMPLATE_CENSUS_ALLOC(libData->MTensor_getFlattenedLength(t) * sizeof(T));
     return t;
 }
 
@@ -510,6 +867,7 @@ inline TensorRef<T> makeTensor(mint rank, mint *dims) {
     MTensor t = NULL;
     int err = libData->MTensor_new(detail::libraryType<T>(), rank, dims, &t);
     if (err) throw LibraryError("MTensor_new() failed.", err);
+    LTEMPLATE_CENSUS_ALLOC(libData->MTensor_getFlattenedLength(t) * sizeof(T));
     return t;
 }
 
@@ -543,6 +901,7 @@ template<typename T, typename U>
 inline TensorRef<T> makeVector(mint length, const U *data) {
     TensorRef<T> t = makeVector<T>(length);
     std::copy(data, data+length, t.begin());
+    LTEMPLATE_CENSUS_COPY(length * sizeof(T));
     return t;
 }
 
@@ -554,6 +913,7 @@ template<typename T>
 inline TensorRef<T> makeVector(std::initializer_list<T> values) {
     TensorRef<T> t = makeVector<T>(values.size());
     std::copy(values.begin(), values.end(), t.begin());
+    LTEMPLATE_CENSUS_COPY(t.length() * sizeof(T));
     return t;
 }
 
@@ -573,6 +933,7 @@ template<typename T, typename U>
 inline MatrixRef<T> makeMatrix(mint nrow, mint ncol, const U *data) {
     MatrixRef<T> t = makeMatrix<T>(nrow, ncol);
     std::copy(data, data + t.size(), t.begin());
+    LTEMPLATE_CENSUS_COPY(t.size() * sizeof(T));
     return t;
 }
 
@@ -588,6 +949,7 @@ inline MatrixRef<T> makeMatrix(std::initializer_list<std::initializer_list<T>> v
             ptr++;
         }
     }
+    LTEMPLATE_CENSUS_COPY(t.size() * sizeof(T));
     return t;
 }
 
@@ -596,10 +958,41 @@ template<typename T, typename U>
 inline MatrixRef<T> makeMatrixTransposed(mint nrow, mint ncol, const U *data) {
     TensorRef<T> t = makeMatrix<T>(nrow, ncol);
     detail::transposedCopy(data, t.data(), nrow, ncol);
+    LTEMPLATE_CENSUS_COPY(t.size() * sizeof(T));
     return t;
 }
 
 
+/** \brief Create a matrix with a fixed number of columns
+ * \tparam T is the type of the Tensor; can be `mint`, `double` or `mma::m_complex`
+ * \tparam N is the number of columns
+ * \param nrow is the number of rows
+ */
+template<typename T, mint N>
+inline FixedColsMatrixRef<T, N> makeFixedColsMatrix(mint nrow) {
+    return makeTensor<T>({nrow, N});
+}
+
+/** \brief Create a matrix of a fixed size
+ * \tparam T is the type of the Tensor; can be `mint`, `double` or `mma::m_complex`
+ * \tparam M is the number of rows
+ * \tparam N is the number of columns
+ */
+template<typename T, mint M, mint N>
+inline FixedMatrixRef<T, M, N> makeFixedMatrix() {
+    return makeTensor<T>({M, N});
+}
+
+/** \brief Create a vector of a fixed length
+ * \tparam T is the type of the Tensor; can be `mint`, `double` or `mma::m_complex`
+ * \tparam N is the length
+ */
+template<typename T, mint N>
+inline FixedVectorRef<T, N> makeFixedVector() {
+    return makeTensor<T>({N});
+}
+
+
 /** \brief Create a rank-3 Tensor of the given dimensions
  * \tparam T is the type of the Tensor; can be `mint`, `double` or `mma::m_complex`
  * \param nslice is the number of slices
@@ -616,6 +1009,7 @@ template<typename T, typename U>
 inline CubeRef<T> makeCube(mint nslice, mint nrow, mint ncol, const U *data) {
     CubeRef<T> t = makeCube<T>(nslice, nrow, ncol);
     std::copy(data, data + t.size(), t.begin());
+    LTEMPLATE_CENSUS_COPY(t.size() * sizeof(T));
     return t;
 }
 
@@ -637,10 +1031,140 @@ inline CubeRef<T> makeCube(std::initializer_list<std::initializer_list<std::init
             }
         }
     }
+    LTEMPLATE_CENSUS_COPY(t.size() * sizeof(T));
     return t;
 }
 
 
+/** \brief Library-resident storage of Tensors, referred to by integer handles
+ *
+ * Arrays that one member function produces and another one consumes do not need to be sent
+ * to the kernel and back. Tensors returned with `"Stored"` passing are placed in the store,
+ * and only their handle is returned to _Mathematica_. Arguments with `"Stored"` passing receive
+ * a handle, and the member function gets a reference to the stored Tensor, without copying.
+ * The data is sent to _Mathematica_ only when requested with `TensorHandleData`.
+ *
+ * When the total size of the stored Tensors would exceed the memory budget, the least recently
+ * used ones are freed. Their handles become invalid. By default there is no budget.
+ *
+ * There is a single store per library, see \ref tensorStore(). It must only be used from the thread
+ * that called the library function. Tensors received as `"Stored"` arguments must not be used
+ * after the function has returned, as they may be evicted or released at any later time.
+ */
+class TensorStore {
+    struct Entry {
+        MTensor tensor;
+        mint type;
+        mint bytes;
+        uint64_t lastUse;
+    };
+
+    std::map<mint, Entry> entries;
+    mint nextHandle = 1;
+    mint totalBytes = 0;
+    mint memoryBudget = -1;
+    mint evictionCount = 0;
+    uint64_t useCounter = 0;
+
+    void remove(std::map<mint, Entry>::iterator it) {
+        libData->MTensor_free(it->second.tensor);
+        totalBytes -= it->second.bytes;
+        entries.erase(it);
+    }
+
+    // Evict least recently used Tensors until the given number of additional bytes fit into the budget
+    void evict(mint required) {
+        while (memoryBudget >= 0 && totalBytes + required > memoryBudget && ! entries.empty()) {
+            auto lru = entries.begin();
+            for (auto it = entries.begin(); it != entries.end(); ++it)
+                if (it->second.lastUse < lru->second.lastUse)
+                    lru = it;
+            remove(lru);
+            evictionCount++;
+        }
+    }
+
+public:
+    TensorStore() = default;
+    TensorStore(const TensorStore &) = delete;
+    TensorStore &operator = (const TensorStore &) = delete;
+
+    /** \brief Store a Tensor and return its handle
+     *
+     * The store takes ownership of the Tensor. Storing a Tensor that is already in the store
+     * returns its existing handle. A Tensor larger than the budget is still stored, after evicting
+     * all others.
+     */
+    template<typename T>
+    mint insert(const TensorRef<T> &t) {
+        for (auto &entry : entries)
+            if (entry.second.tensor == t.tensor()) {
+                entry.second.lastUse = ++useCounter;
+                return entry.first;
+            }
+
+        const mint bytes = t.length() * sizeof(T);
+        evict(bytes);
+        const mint handle = nextHandle++;
+        entries[handle] = Entry{t.tensor(), t.type(), bytes, ++useCounter};
+        totalBytes += bytes;
+        return handle;
+    }
+
+    /// Reference to a stored Tensor; throws a \ref LibraryError if the handle is not valid or the element type does not match
+    template<typename T>
+    TensorRef<T> get(mint handle) {
+        auto it = entries.find(handle);
+        if (it == entries.end())
+            throw LibraryError("The tensor handle " + std::to_string(handle) + " is not valid. It may have been released or evicted.");
+        if (it->second.type != detail::libraryType<T>())
+            throw LibraryError("The stored tensor does not have the expected element type.");
+        it->second.lastUse = ++useCounter;
+        return it->second.tensor;
+    }
+
+    /// Check if the handle refers to a stored Tensor
+    bool contains(mint handle) const { return entries.find(handle) != entries.end(); }
+
+    /// Free a stored Tensor. Invalid handles are ignored.
+    void release(mint handle) {
+        auto it = entries.find(handle);
+        if (it != entries.end())
+            remove(it);
+    }
+
+    /// Free all stored Tensors
+    void clear() {
+        while (! entries.empty())
+            remove(entries.begin());
+    }
+
+    /// Set the memory budget in bytes, evicting Tensors as necessary. A negative value means no budget.
+    void setBudget(mint bytes) {
+        memoryBudget = bytes;
+        evict(0);
+    }
+
+    /// The memory budget in bytes, or -1 if there is none
+    mint budget() const { return memoryBudget; }
+
+    /// Number of stored Tensors
+    mint size() const { return entries.size(); }
+
+    /// Total size of the stored Tensors in bytes
+    mint bytes() const { return totalBytes; }
+
+    /// Number of Tensors that were evicted to keep within the memory budget
+    mint evictions() const { return evictionCount; }
+};
+
+/// The Tensor store of the library
+inline TensorStore &tensorStore() {
+    static TensorStore store;
+    return store;
+}
+
+
 template<typename T> class SparseMatrixRef;
 
 /** \brief Wrapper class for `MSparseArray` pointers
@@ -723,6 +1247,8 @@ public:
         MSparseArray c = NULL;
         int err = libData->sparseLibraryFunctions->MSparseArray_clone(sa, &c);
         if (err) throw LibraryError("MSparseArray_clone() failed.", err);
+        LTEMPLATE_CENSUS_ALLOC(detail::sparseStorageBytes(SparseArrayRef(c)));
+        LTEMPLATE_CENSUS_COPY(detail::sparseStorageBytes(SparseArrayRef(c)));
         return c;
     }
 
@@ -822,6 +1348,8 @@ public:
         libData->MTensor_free(it);
         if (err) throw LibraryError("MSparseArray_resetImplicitValue() failed.", err);
 
+        LTEMPLATE_CENSUS_ALLOC(detail::sparseStorageBytes(SparseArrayRef(msa)));
+        LTEMPLATE_CENSUS_COPY(detail::sparseStorageBytes(SparseArrayRef(msa)));
         return msa;
     }
 
@@ -830,6 +1358,8 @@ public:
         MTensor t = NULL;
         int err = libData->sparseLibraryFunctions->MSparseArray_toMTensor(sa, &t);
         if (err) throw LibraryError("MSparseArray_toMTensor() failed.", err);
+        LTEMPLATE_CENSUS_ALLOC(libData->MTensor_getFlattenedLength(t) * sizeof(T));
+        LTEMPLATE_CENSUS_COPY(libData->MTensor_getFlattenedLength(t) * sizeof(T));
         return t;
     }
 
@@ -1012,6 +1542,8 @@ inline SparseArrayRef<T> makeSparseArray(IntMatrixRef pos, TensorRef<T> vals, In
         libData->MTensor_new(detail::libraryType<T>(), 1, evdims, ev);
     }
 
+    LTEMPLATE_CENSUS_ALLOC(detail::sparseStorageBytes(SparseArrayRef<T>(sa)));
+    LTEMPLATE_CENSUS_COPY(detail::sparseStorageBytes(SparseArrayRef<T>(sa)));
     return sa;
 }
 
@@ -1077,6 +1609,24 @@ namespace detail { // private
         }
     }
 
+    inline size_t rawTypeSize(rawarray_t rt) {
+        switch (rt) {
+        case MRawArray_Type_Ubit8:          return sizeof(uint8_t);
+        case MRawArray_Type_Bit8:           return sizeof(int8_t);
+        case MRawArray_Type_Ubit16:         return sizeof(uint16_t);
+        case MRawArray_Type_Bit16:          return sizeof(int16_t);
+        case MRawArray_Type_Ubit32:         return sizeof(uint32_t);
+        case MRawArray_Type_Bit32:          return sizeof(int32_t);
+        case MRawArray_Type_Ubit64:         return sizeof(uint64_t);
+        case MRawArray_Type_Bit64:          return sizeof(int64_t);
+        case MRawArray_Type_Real32:         return sizeof(float);
+        case MRawArray_Type_Real64:         return sizeof(double);
+        case MRawArray_Type_Float_Complex:  return sizeof(complex_float_t);
+        case MRawArray_Type_Double_Complex: return sizeof(complex_double_t);
+        default:                            return 0;
+        }
+    }
+
 } // end namespace detail
 
 
@@ -1125,6 +1675,8 @@ public:
         MRawArray c = NULL;
         int err = libData->rawarrayLibraryFunctions->MRawArray_clone(rawArray(), &c);
         if (err) throw LibraryError("MRawArray_clone() failed.", err);
+        LTEMPLATE_CENSUS_ALLOC(length() * detail::rawTypeSize(type()));
+        LTEMPLATE_CENSUS_COPY(length() * detail::rawTypeSize(type()));
         return c;
     }
 
@@ -1136,6 +1688,8 @@ public:
         MRawArray res = libData->rawarrayLibraryFunctions->MRawArray_convertType(ra, detail::libraryRawType<U>());
         if (! res)
             throw LibraryError("MRawArray_convertType() failed.");
+        LTEMPLATE_CENSUS_ALLOC(length() * sizeof(U));
+        LTEMPLATE_CENSUS_COPY(length() * sizeof(U));
         return res;
     }
 
@@ -1181,6 +1735,8 @@ public:
         MRawArray c = NULL;
         int err = libData->rawarrayLibraryFunctions->MRawArray_clone(rawArray(), &c);
         if (err) throw LibraryError("MRawArray_clone() failed.", err);
+        LTEMPLATE_CENSUS_ALLOC(length() * sizeof(T));
+        LTEMPLATE_CENSUS_COPY(length() * sizeof(T));
         return c;
     }
 
@@ -1204,6 +1760,7 @@ inline RawArrayRef<T> makeRawArray(std::initializer_list<mint> dims) {
     MRawArray ra = NULL;
     int err = libData->rawarrayLibraryFunctions->MRawArray_new(detail::libraryRawType<T>(), dims.size(), dims.begin(), &ra);
     if (err) throw LibraryError("MRawArray_new() failed.", err);
+    LTEMPLATE_CENSUS_ALLOC(libData->rawarrayLibraryFunctions->MRawArray_getFlattenedLength(ra) * sizeof(T));
     return ra;
 }
 
@@ -1217,6 +1774,7 @@ inline RawArrayRef<T> makeRawArray(mint rank, const mint *dims) {
     MRawArray ra = NULL;
     int err = libData->rawarrayLibraryFunctions->MRawArray_new(detail::libraryRawType<T>(), rank, dims, &ra);
     if (err) throw LibraryError("MRawArray_new() failed.", err);
+    LTEMPLATE_CENSUS_ALLOC(libData->rawarrayLibraryFunctions->MRawArray_getFlattenedLength(ra) * sizeof(T));
     return ra;
 }
 
@@ -1249,6 +1807,7 @@ template<typename T>
 inline RawArrayRef<T> makeRawVector(mint length, const T *data) {
     auto ra = makeRawVector<T>(length);
     std::copy(data, data+length, ra.begin());
+    LTEMPLATE_CENSUS_COPY(length * sizeof(T));
     return ra;
 }
 
@@ -1331,6 +1890,17 @@ namespace detail { // private
         }
     }
 
+    inline size_t imageTypeSize(imagedata_t it) {
+        switch (it) {
+        case MImage_Type_Bit:       return sizeof(im_bit_t);
+        case MImage_Type_Bit8:      return sizeof(im_byte_t);
+        case MImage_Type_Bit16:     return sizeof(im_bit16_t);
+        case MImage_Type_Real32:    return sizeof(im_real32_t);
+        case MImage_Type_Real:      return sizeof(im_real_t);
+        default:                    return 0;
+        }
+    }
+
 } // end namespace detail
 
 
@@ -1403,6 +1973,8 @@ public:
         MImage c = NULL;
         int err = libData->imageLibraryFunctions->MImage_clone(image(), &c);
         if (err) throw LibraryError("MImage_clone() failed.", err);
+        LTEMPLATE_CENSUS_ALLOC(length() * detail::imageTypeSize(type()));
+        LTEMPLATE_CENSUS_COPY(length() * detail::imageTypeSize(type()));
         return c;
     }
 
@@ -1425,6 +1997,8 @@ public:
         MImage res = libData->imageLibraryFunctions->MImage_convertType(im, detail::libraryImageType<U>(), interleaving);
         if (! res)
             throw LibraryError("MImage_convertType() failed.");
+        LTEMPLATE_CENSUS_ALLOC(length() * sizeof(U));
+        LTEMPLATE_CENSUS_COPY(length() * sizeof(U));
         return res;
     }
 
@@ -1509,6 +2083,8 @@ public:
         MImage c = NULL;
         int err = libData->imageLibraryFunctions->MImage_clone(image(), &c);
         if (err) throw LibraryError("MImage_clone() failed.", err);
+        LTEMPLATE_CENSUS_ALLOC(length() * detail::imageTypeSize(type()));
+        LTEMPLATE_CENSUS_COPY(length() * detail::imageTypeSize(type()));
         return c;
     }
 
@@ -1531,6 +2107,8 @@ public:
         MImage res = libData->imageLibraryFunctions->MImage_convertType(im, detail::libraryImageType<U>(), interleaving);
         if (! res)
             throw LibraryError("MImage_convertType() failed.");
+        LTEMPLATE_CENSUS_ALLOC(length() * sizeof(U));
+        LTEMPLATE_CENSUS_COPY(length() * sizeof(U));
         return res;
     }
 
@@ -1657,6 +2235,8 @@ public:
         MImage c = NULL;
         int err = libData->imageLibraryFunctions->MImage_clone(image(), &c);
         if (err) throw LibraryError("MImage_clone() failed.", err);
+        LTEMPLATE_CENSUS_ALLOC(length() * sizeof(T));
+        LTEMPLATE_CENSUS_COPY(length() * sizeof(T));
         return c;
     }
 
@@ -1746,6 +2326,8 @@ public:
         MImage c = NULL;
         int err = libData->imageLibraryFunctions->MImage_clone(image(), &c);
         if (err) throw LibraryError("MImage_clone() failed.", err);
+        LTEMPLATE_CENSUS_ALLOC(length() * sizeof(T));
+        LTEMPLATE_CENSUS_COPY(length() * sizeof(T));
         return c;
     }
 
@@ -1796,6 +2378,7 @@ template<typename T>
 inline ImageRef<T> makeImage(mint width, mint height, mint channels = 1, bool interleaving = true, colorspace_t colorspace = MImage_CS_Automatic) {
     MImage mim = NULL;
     libData->imageLibraryFunctions->MImage_new2D(width, height, channels, detail::libraryImageType<T>(), colorspace, interleaving, &mim);
+    LTEMPLATE_CENSUS_ALLOC(width * height * channels * sizeof(T));
     return mim;
 }
 
@@ -1813,6 +2396,7 @@ template<typename T>
 inline Image3DRef<T> makeImage3D(mint slices, mint width, mint height, mint channels = 1, bool interleaving = true, colorspace_t colorspace = MImage_CS_Automatic) {
     MImage mim = NULL;
     libData->imageLibraryFunctions->MImage_new3D(slices, width, height, channels, detail::libraryImageType<T>(), colorspace, interleaving, &mim);
+    LTEMPLATE_CENSUS_ALLOC(slices * width * height * channels * sizeof(T));
     return mim;
 }
 
@@ -0,0 +1,614 @@
+/*
+ * Copyright (c) 2018 Szabolcs Horvát.
+ *
+ * See the file LICENSE.txt for copying permission.
+ */
+
+#ifndef LTEMPLATE_CAPTURE_H
+#define LTEMPLATE_CAPTURE_H
+
+/** \file
+ * \brief Capturing library calls to a file, and replaying them outside of _Mathematica_.
+ *
+ * This header is used by code generated with `CompileTemplate[template, "CaptureCalls" -> True]`.
+ * It should not be included directly.
+ *
+ * While a capture is running (see `StartCallCapture`), every call of a member function is
+ * recorded together with its arguments, as are the creation and destruction of instances.
+ * `CompileTemplate` also builds a replay executable, `<libname>-replay`, which contains the same
+ * classes linked against the stand-in runtime of LTemplateStandalone.inc. It re-executes the
+ * recorded calls in order, and reports the time taken by each.
+ *
+ * Integer, Real, Complex, "Boolean", "UTF8String", LExpressionID and Tensor arguments are recorded.
+ * Calls with other arguments, as well as LinkObject based functions, are not replayed.
+ * Instances that existed when the capture started are recreated in their default state.
+ * `"Stored"` arguments refer to the handles created during the replay by the corresponding recorded
+ * calls. Calls with handles that were created before the capture started are not replayed.
+ * Each call is written to the file before it is made, so that a call that crashes the kernel
+ * is still recorded.
+ */
+
+#include "LTemplate.h"
+#include "LTemplateHelpers.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <map>
+
+
+namespace mma {
+namespace detail { // private
+
+    /* Capture file format. Values are written in the native byte order, as captures are meant
+     * to be replayed on the machine that recorded them.
+     *
+     *   header:    "LTCAPTUR", uint32 version, uint32 sizeof(mint)
+     *   record:    uint8 CaptureRecord, then
+     *     CR_Create, CR_Delete:  string class name, mint instance ID
+     *     CR_Call:               string function name as "Class::fun()", mint instance ID, uint32 argument count, arguments
+ *     CR_Handle:             mint handle returned by the preceding call, which has a "Stored" result and succeeded
+ *     CR_Release:            mint handle released with ReleaseTensorHandle
+     *   argument:  uint8 CommandType, then the value, if it was recorded:
+     *     CT_Integer: mint, CT_Real: mreal, CT_Complex: mcomplex, CT_Boolean: uint8, CT_String: string,
+     *     CT_Tensor: mint element type, mint rank, mint dimensions[rank], elements
+     *   string:    uint32 length, characters without a terminator
+     *
+     * Arguments whose value was not recorded are written as CT_Void.
+     */
+    enum CaptureRecord { CR_Create = 1, CR_Delete = 2, CR_Call = 3, CR_Handle = 4, CR_Release = 5 };
+
+    static const char captureMagic[8] = {'L', 'T', 'C', 'A', 'P', 'T', 'U', 'R'};
+    static const uint32_t captureVersion = 2;
+
+    inline size_t captureElementSize(mint type) {
+        switch (type) {
+        case MType_Integer: return sizeof(mint);
+        case MType_Real:    return sizeof(mreal);
+        case MType_Complex: return sizeof(mcomplex);
+        default:            return 0;
+        }
+    }
+
+    inline void *captureTensorData(MTensor t) {
+        switch (libData->MTensor_getType(t)) {
+        case MType_Integer: return libData->MTensor_getIntegerData(t);
+        case MType_Real:    return libData->MTensor_getRealData(t);
+        case MType_Complex: return libData->MTensor_getComplexData(t);
+        default:            return NULL;
+        }
+    }
+
+
+    // Writes the capture file. Write errors stop the capture, but do not affect the calls being recorded.
+    class CaptureWriter {
+        std::FILE *file = NULL;
+        mint calls = 0;
+
+        void write(const void *data, size_t size) {
+            if (file && std::fwrite(data, 1, size, file) != size) {
+                std::fclose(file);
+                file = NULL;
+                message("Call capture stopped: the capture file could not be written.", M_WARNING);
+            }
+        }
+
+        template<typename T>
+        void writeValue(const T &val) { write(&val, sizeof(T)); }
+
+        void writeString(const char *str) {
+            const uint32_t len = std::strlen(str);
+            writeValue(len);
+            write(str, len);
+        }
+
+    public:
+        CaptureWriter() = default;
+        CaptureWriter(const CaptureWriter &) = delete;
+        CaptureWriter &operator = (const CaptureWriter &) = delete;
+
+        ~CaptureWriter() { stop(); }
+
+        bool active() const { return file != NULL; }
+
+        // Number of calls recorded since the capture was started
+        mint callCount() const { return calls; }
+
+        void start(const char *path) {
+            stop();
+            file = std::fopen(path, "wb");
+            if (file == NULL)
+                throw LibraryError(std::string("Cannot open ") + path + " for writing.");
+            calls = 0;
+            write(captureMagic, sizeof(captureMagic));
+            writeValue(captureVersion);
+            writeValue(uint32_t(sizeof(mint)));
+        }
+
+        void stop() {
+            if (file)
+                std::fclose(file);
+            file = NULL;
+        }
+
+        void instance(CaptureRecord rec, const char *classname, mint id) {
+            writeValue(uint8_t(rec));
+            writeString(classname);
+            writeValue(id);
+        }
+
+        void beginCall(const char *funname, mint id, uint32_t argc) {
+            calls++;
+            writeValue(uint8_t(CR_Call));
+            writeString(funname);
+            writeValue(id);
+            writeValue(argc);
+        }
+
+        // The record is flushed before the call is made, so that calls that crash are recorded as well
+        void endCall() {
+            if (file)
+                std::fflush(file);
+        }
+
+        void handle(CaptureRecord rec, mint handle) {
+            writeValue(uint8_t(rec));
+            writeValue(handle);
+        }
+
+        void putVoid() { writeValue(uint8_t(CT_Void)); }
+
+        void putInteger(mint val)     { writeValue(uint8_t(CT_Integer)); writeValue(val); }
+        void putReal(mreal val)       { writeValue(uint8_t(CT_Real)); writeValue(val); }
+        void putComplex(mcomplex val) { writeValue(uint8_t(CT_Complex)); writeValue(val); }
+        void putBoolean(mbool val)    { writeValue(uint8_t(CT_Boolean)); writeValue(uint8_t(val ? 1 : 0)); }
+        void putString(const char *val) { writeValue(uint8_t(CT_String)); writeString(val); }
+
+        void putTensor(MTensor t) {
+            const mint type = libData->MTensor_getType(t);
+            const mint rank = libData->MTensor_getRank(t);
+            writeValue(uint8_t(CT_Tensor));
+            writeValue(type);
+            writeValue(rank);
+            write(libData->MTensor_getDimensions(t), rank * sizeof(mint));
+            write(captureTensorData(t), libData->MTensor_getFlattenedLength(t) * captureElementSize(type));
+        }
+    };
+
+    inline CaptureWriter &captureWriter() {
+        static CaptureWriter writer;
+        return writer;
+    }
+
+
+    // Records one argument of the type A in the template specification
+    template<typename A>
+    struct CaptureArgument {
+        static void put(CaptureWriter &w, MArgument) { w.putVoid(); }
+    };
+
+    template<> struct CaptureArgument<mint> {
+        static void put(CaptureWriter &w, MArgument marg) { w.putInteger(MArgument_getInteger(marg)); }
+    };
+
+    template<> struct CaptureArgument<double> {
+        static void put(CaptureWriter &w, MArgument marg) { w.putReal(MArgument_getReal(marg)); }
+    };
+
+    template<> struct CaptureArgument<std::complex<double>> {
+        static void put(CaptureWriter &w, MArgument marg) { w.putComplex(MArgument_getComplex(marg)); }
+    };
+
+    template<> struct CaptureArgument<bool> {
+        static void put(CaptureWriter &w, MArgument marg) { w.putBoolean(MArgument_getBoolean(marg)); }
+    };
+
+    template<> struct CaptureArgument<const char *> {
+        static void put(CaptureWriter &w, MArgument marg) { w.putString(MArgument_getUTF8String(marg)); }
+    };
+
+    struct CaptureTensor {
+        static void put(CaptureWriter &w, MArgument marg) { w.putTensor(MArgument_getMTensor(marg)); }
+    };
+
+    template<typename T> struct CaptureArgument<TensorRef<T>> : CaptureTensor { };
+    template<typename T, mint N> struct CaptureArgument<FixedVectorRef<T, N>> : CaptureTensor { };
+    template<typename T, mint N> struct CaptureArgument<FixedColsMatrixRef<T, N>> : CaptureTensor { };
+    template<typename T, mint M, mint N> struct CaptureArgument<FixedMatrixRef<T, M, N>> : CaptureTensor { };
+
+    template<typename R> struct CaptureArgument<InPlace<R>> : CaptureArgument<R> { };
+
+    // Stored Tensors and LExpressionID arguments are passed as integers
+    template<typename R> struct CaptureArgument<Stored<R>> : CaptureArgument<mint> { };
+    template<typename Class> struct CaptureArgument<Class &> : CaptureArgument<mint> { };
+
+
+    template<typename Spec> struct CaptureCall;
+
+    template<typename R, typename... A>
+    struct CaptureCall<R(A...)> {
+        template<std::size_t... I>
+        static void put(CaptureWriter &w, MArgument *Args, IndexList<I...>) {
+            // Args[0] is the instance ID
+            int dummy[] = { 0, (CaptureArgument<A>::put(w, Args[I+1]), 0)... };
+            (void) dummy;
+        }
+    };
+
+    template<typename Spec>
+    void captureCall(const char *funname, MArgument *Args) {
+        CaptureWriter &w = captureWriter();
+        if (! w.active())
+            return;
+        w.beginCall(funname, MArgument_getInteger(Args[0]), SpecTraits<Spec>::arity);
+        CaptureCall<Spec>::put(w, Args, typename MakeIndexList<SpecTraits<Spec>::arity>::type());
+        w.endCall();
+    }
+
+    // Records the handle returned by a function with a "Stored" result type R
+    template<typename R>
+    struct CaptureResult {
+        static void put(CaptureWriter &, MArgument) { }
+    };
+
+    template<typename R>
+    struct CaptureResult<Stored<R>> {
+        static void put(CaptureWriter &w, MArgument Res) { w.handle(CR_Handle, MArgument_getInteger(Res)); }
+    };
+
+    template<typename Spec>
+    void captureResult(MArgument Res) {
+        CaptureWriter &w = captureWriter();
+        if (w.active())
+            CaptureResult<typename SpecTraits<Spec>::result_type>::put(w, Res);
+    }
+
+    inline void captureRelease(mint handle) {
+        CaptureWriter &w = captureWriter();
+        if (w.active())
+            w.handle(CR_Release, handle);
+    }
+
+    // Called by the generated class managers
+    inline void captureInstance(const char *classname, mbool mode, mint id) {
+        CaptureWriter &w = captureWriter();
+        if (w.active())
+            w.instance(mode == 0 ? CR_Create : CR_Delete, classname, id);
+    }
+
+    /* Top-level library function for starting and stopping the capture, as used by the generated code.
+     * The argument is the path of the capture file, or an empty string to stop. existing() records the
+     * instances that already exist. Returns the number of calls recorded by the last capture.
+     */
+    inline int captureControl(mint Argc, MArgument *Args, MArgument Res, void (*existing)()) {
+        try {
+            if (Argc != 1)
+                throw LibraryError("Invalid capture request.");
+            char *path = MArgument_getUTF8String(Args[0]);
+            const std::string file = path;
+            libData->UTF8String_disown(path);
+
+            CaptureWriter &w = captureWriter();
+            const mint count = w.callCount();
+            if (file.empty())
+                w.stop();
+            else {
+                w.start(file.c_str());
+                existing();
+            }
+            MArgument_setInteger(Res, count);
+        }
+        catch (const LibraryError &libErr) {
+            libErr.report();
+            return libErr.error_code();
+        }
+        return LIBRARY_NO_ERROR;
+    }
+
+
+#ifdef LTEMPLATE_STANDALONE
+
+    /* Replay */
+
+    typedef void (*ManagerFunctionPointer)(WolframLibraryData, mbool, mint);
+
+    /* A function of the replayed library. The passing of each argument is given by a character:
+     * 'a' if the caller frees it after the call (Automatic, "Constant" and "InPlace" passing),
+     * 'm' if the function frees it ("Manual"), 's' if the library may keep it ("Shared"),
+     * and 'h' for a Tensor handle ("Stored"). result is 'a' if the function returns a Tensor owned
+     * by the caller, 'h' if it returns a Tensor handle, '-' otherwise.
+     */
+    struct ReplayFunction {
+        const char *name;
+        LibraryFunctionPointer fun;
+        const char *passing;
+        char result;
+    };
+
+    struct ReplayClass {
+        const char *name;
+        ManagerFunctionPointer manager;
+        const ReplayFunction *functions; // terminated by an entry with a NULL name
+    };
+
+    class CaptureReader {
+        std::FILE *file;
+        std::string path;
+
+        void fail() const { throw LibraryError(path + " is not a valid capture file, or it is incomplete."); }
+
+    public:
+        CaptureReader(const char *path) : file(std::fopen(path, "rb")), path(path) {
+            if (file == NULL)
+                throw LibraryError("Cannot open " + this->path + ".");
+            char magic[sizeof(captureMagic)];
+            read(magic, sizeof(magic));
+            if (std::memcmp(magic, captureMagic, sizeof(magic)) != 0 || readValue<uint32_t>() != captureVersion)
+                fail();
+            if (readValue<uint32_t>() != sizeof(mint))
+                throw LibraryError(this->path + " was recorded on a platform with a different integer size.");
+        }
+
+        CaptureReader(const CaptureReader &) = delete;
+        CaptureReader &operator = (const CaptureReader &) = delete;
+
+        ~CaptureReader() { std::fclose(file); }
+
+        void read(void *data, size_t size) {
+            if (size > 0 && std::fread(data, 1, size, file) != size)
+                fail();
+        }
+
+        template<typename T>
+        T readValue() {
+            T val;
+            read(&val, sizeof(T));
+            return val;
+        }
+
+        std::string readString() {
+            std::string str(readValue<uint32_t>(), '\0');
+            read(&str[0], str.size());
+            return str;
+        }
+
+        // Next record, or 0 at the end of the file
+        int next() {
+            uint8_t rec;
+            if (std::fread(&rec, 1, 1, file) != 1)
+                return 0;
+            if (rec < CR_Create || rec > CR_Release)
+                fail();
+            return rec;
+        }
+
+        // Reads an argument. Returns false if its value was not recorded.
+        bool readArgument(CommandValue &val) {
+            val.type = readValue<uint8_t>();
+            switch (val.type) {
+            case CT_Void:    return false;
+            case CT_Integer: val.integer = readValue<mint>(); break;
+            case CT_Real:    val.real = readValue<mreal>(); break;
+            case CT_Complex: val.cmplex = readValue<mcomplex>(); break;
+            case CT_Boolean: val.boolean = readValue<uint8_t>(); break;
+            case CT_String:
+                val.buffer = readString();
+                val.string = &val.buffer[0];
+                break;
+            case CT_Tensor: {
+                const mint type = readValue<mint>();
+                const mint rank = readValue<mint>();
+                if (captureElementSize(type) == 0 || rank < 0)
+                    fail();
+                std::vector<mint> dims(rank);
+                read(dims.data(), rank * sizeof(mint));
+                int err = libData->MTensor_new(type, rank, dims.data(), &val.tensor);
+                if (err)
+                    throw LibraryError("Cannot create a Tensor argument.", err);
+                val.owned = true;
+                read(captureTensorData(val.tensor), libData->MTensor_getFlattenedLength(val.tensor) * captureElementSize(type));
+                break;
+            }
+            default:
+                fail();
+            }
+            return true;
+        }
+    };
+
+
+    struct ReplayStats {
+        mint calls = 0;
+        double total = 0, min = 0, max = 0;
+
+        void add(double t) {
+            min = calls == 0 ? t : std::min(min, t);
+            max = calls == 0 ? t : std::max(max, t);
+            total += t;
+            calls++;
+        }
+    };
+
+    /* Replays a capture file with the given classes. Prints the time taken by each call with -v,
+     * and a summary for each function.
+     */
+    inline int replayMain(int argc, char *argv[], const ReplayClass *classes, size_t nclasses) {
+        bool verbose = false;
+        const char *path = NULL;
+        for (int i=1; i < argc; ++i) {
+            if (std::strcmp(argv[i], "-v") == 0)
+                verbose = true;
+            else
+                path = argv[i];
+        }
+        if (path == NULL) {
+            std::fprintf(stderr, "Usage: %s [-v] capture-file\n", argc > 0 ? argv[0] : "replay");
+            return 1;
+        }
+
+        standaloneInitialize();
+
+        std::map<std::string, ManagerFunctionPointer> managers;
+        std::map<std::string, const ReplayFunction *> functions;
+        for (size_t i=0; i < nclasses; ++i) {
+            managers[classes[i].name] = classes[i].manager;
+            for (const ReplayFunction *f = classes[i].functions; f->name != NULL; ++f)
+                functions[f->name] = f;
+        }
+
+        std::map<std::string, ReplayStats> stats;
+        std::vector<std::string> order; // functions in the order of their first call
+        mint skipped = 0, failed = 0, index = 0;
+        ReplayStats all;
+
+        // Tensor handles of the recorded session, and the handles created for them during the replay
+        std::map<mint, mint> handles;
+        bool haveHandle = false; // the last replayed call returned a handle
+        mint lastHandle = 0;
+
+        // A capture that was not stopped properly may end with an incomplete record. The calls before it are still replayed.
+        try {
+            CaptureReader reader(path);
+            while (int rec = reader.next()) {
+                if (rec == CR_Handle || rec == CR_Release) {
+                    const mint handle = reader.readValue<mint>();
+                    if (rec == CR_Handle) {
+                        if (haveHandle)
+                            handles[handle] = lastHandle;
+                    } else {
+                        auto it = handles.find(handle);
+                        if (it != handles.end()) {
+                            tensorStore().release(it->second);
+                            handles.erase(it);
+                        }
+                    }
+                    continue;
+                }
+                haveHandle = false;
+
+                const std::string name = reader.readString();
+                const mint id = reader.readValue<mint>();
+
+                if (rec != CR_Call) {
+                    auto it = managers.find(name);
+                    if (it == managers.end())
+                        throw LibraryError("The capture refers to the unknown class " + name + ".");
+                    it->second(libData, rec == CR_Delete, id);
+                    continue;
+                }
+
+                index++;
+                const uint32_t nargs = reader.readValue<uint32_t>();
+                std::vector<CommandValue> args(nargs + 1);
+                args[0].type = CT_Integer;
+                args[0].integer = id;
+                bool complete = true;
+                for (uint32_t i=0; i < nargs; ++i)
+                    complete = reader.readArgument(args[i+1]) && complete;
+
+                auto it = functions.find(name);
+                if (complete && it != functions.end()) {
+                    const char *passing = it->second->passing;
+                    for (uint32_t i=0; i < nargs; ++i)
+                        if (passing[i] == 'h') {
+                            auto h = handles.find(args[i+1].integer);
+                            if (h == handles.end())
+                                complete = false;
+                            else
+                                args[i+1].integer = h->second;
+                        }
+                }
+                if (! complete || it == functions.end()) {
+                    if (verbose)
+                        std::printf("%6lld  %-40s  skipped\n", (long long) index, name.c_str());
+                    skipped++;
+                    for (auto &arg : args)
+                        arg.free();
+                    continue;
+                }
+                const ReplayFunction &f = *it->second;
+
+                // "Shared" Tensors are freed once both the library has disowned them and the call has returned
+                std::vector<MTensor> shared;
+                for (uint32_t i=0; i < nargs; ++i)
+                    if (f.passing[i] == 's' && args[i+1].type == CT_Tensor) {
+                        MTensor t = standaloneShareTensor(args[i+1].tensor);
+                        args[i+1].free();
+                        args[i+1].tensor = t;
+                        shared.push_back(t);
+                    }
+
+                std::vector<MArgument> margs(nargs + 1);
+                for (uint32_t i=0; i <= nargs; ++i)
+                    margs[i] = args[i].argument();
+                CommandValue res;
+                res.type = CT_Tensor;
+
+                auto start = std::chrono::steady_clock::now();
+                int err = f.fun(libData, nargs + 1, margs.data(), res.argument());
+                std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+                for (uint32_t i=0; i < nargs; ++i)
+                    if (f.passing[i] != 'a')
+                        args[i+1].owned = false;
+                for (auto &arg : args)
+                    arg.free();
+                for (MTensor t : shared)
+                    standaloneReleaseShared(t);
+                if (err == LIBRARY_NO_ERROR && f.result == 'a') {
+                    res.owned = true;
+                    res.free();
+                }
+                if (err == LIBRARY_NO_ERROR && f.result == 'h') {
+                    haveHandle = true;
+                    lastHandle = res.integer;
+                }
+
+                if (err)
+                    failed++;
+                if (stats.find(name) == stats.end())
+                    order.push_back(name);
+                stats[name].add(elapsed.count());
+                all.add(elapsed.count());
+                if (verbose)
+                    std::printf("%6lld  %-40s  id %-6lld  %12.6f ms%s\n",
+                                (long long) index, name.c_str(), (long long) id, 1e3 * elapsed.count(), err ? "  failed" : "");
+            }
+        } catch (const LibraryError &err) {
+            std::fprintf(stderr, "%s\n", err.message().c_str());
+            if (index == 0)
+                return 1;
+        }
+        tensorStore().clear();
+
+        std::printf("%s: %lld calls replayed, %lld skipped, %lld failed, %.6f s in total\n\n",
+                    path, (long long) all.calls, (long long) skipped, (long long) failed, all.total);
+        std::printf("%-40s  %8s  %12s  %12s  %12s  %12s\n", "function", "calls", "total (s)", "mean (ms)", "min (ms)", "max (ms)");
+        for (const auto &name : order) {
+            const ReplayStats &s = stats[name];
+            std::printf("%-40s  %8lld  %12.6f  %12.6f  %12.6f  %12.6f\n",
+                        name.c_str(), (long long) s.calls, s.total, 1e3 * s.total / s.calls, 1e3 * s.min, 1e3 * s.max);
+        }
+
+#ifdef LTEMPLATE_PERF_COUNTERS
+        std::printf("\n");
+        perfCounterReport(stdout);
+#endif
+
+#ifdef LTEMPLATE_ALLOC_CENSUS
+        std::printf("\n");
+        allocCensusReport(stdout);
+#endif
+        return 0;
+    }
+
+#endif // LTEMPLATE_STANDALONE
+
+} // end namespace detail
+} // end namespace mma
+
+#endif // LTEMPLATE_CAPTURE_H
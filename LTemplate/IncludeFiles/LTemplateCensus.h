@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2018 Szabolcs Horvát.
+ *
+ * See the file LICENSE.txt for copying permission.
+ */
+
+#ifndef LTEMPLATE_CENSUS_H
+#define LTEMPLATE_CENSUS_H
+
+/** \file
+ * \brief Allocation and copy census for each member function.
+ *
+ * This header is used by code generated with `CompileTemplate[template, "AllocationCensus" -> True]`.
+ * It should not be included directly.
+ *
+ * The array functions of LTemplate.h that allocate or copy data, such as `clone()`, `convertTo()`,
+ * `toTensor()`, `makeTensor()` or `makeVector(length, data)`, report to the member function call
+ * in progress on the calling thread. The number of allocations, bytes allocated, number of copies
+ * and bytes copied are totalled for each function, together with the most bytes allocated or copied
+ * by a single call. The results are retrieved with `AllocationCensus` in _Mathematica_, worst offenders first.
+ * Replay executables (see LTemplateCapture.h) print them after the replay.
+ *
+ * Arrays allocated directly through `libData`, and copies made with other means, are not included.
+ */
+
+#include "LTemplate.h"
+
+#include <cstdio>
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <vector>
+
+
+namespace mma {
+namespace detail { // private
+
+    // Totals for a function
+    struct AllocCensusStats {
+        mint calls = 0;
+        AllocCensus total;
+        mint maxBytes = 0; // most bytes allocated and copied by a single call
+    };
+
+    class AllocCensusRegistry {
+        std::mutex mutex;
+        std::vector<const char *> names;      // function names, in the order of their first call
+        std::map<const char *, mint> indices;
+        std::map<mint, AllocCensusStats> stats; // by function index
+
+    public:
+        void add(const char *funname, const AllocCensus &census) {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = indices.find(funname);
+            if (it == indices.end()) {
+                it = indices.insert(std::make_pair(funname, mint(names.size()))).first;
+                names.push_back(funname);
+            }
+            AllocCensusStats &s = stats[it->second];
+            s.calls++;
+            s.total.allocations    += census.allocations;
+            s.total.bytesAllocated += census.bytesAllocated;
+            s.total.copies         += census.copies;
+            s.total.bytesCopied    += census.bytesCopied;
+            s.maxBytes = std::max(s.maxBytes, census.bytesAllocated + census.bytesCopied);
+        }
+
+        const char *name(mint index) {
+            std::lock_guard<std::mutex> lock(mutex);
+            return index >= 0 && index < mint(names.size()) ? names[index] : NULL;
+        }
+
+        /* Rows of {function index, calls, allocations, bytes allocated, copies, bytes copied, max bytes per call},
+         * ordered by decreasing total bytes allocated and copied.
+         */
+        std::vector<std::vector<mint>> table(bool reset) {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::vector<std::vector<mint>> rows;
+            for (const auto &entry : stats) {
+                const AllocCensusStats &s = entry.second;
+                rows.push_back({entry.first, s.calls, s.total.allocations, s.total.bytesAllocated, s.total.copies, s.total.bytesCopied, s.maxBytes});
+            }
+            std::stable_sort(rows.begin(), rows.end(),
+                             [](const std::vector<mint> &a, const std::vector<mint> &b) { return a[3] + a[5] > b[3] + b[5]; });
+            if (reset)
+                stats.clear();
+            return rows;
+        }
+    };
+
+    inline AllocCensusRegistry &allocCensusRegistry() {
+        static AllocCensusRegistry registry;
+        return registry;
+    }
+
+    // Attributes the allocations and copies made during the lifetime of the object to the function funname, which must be a string literal
+    class AllocCensusScope {
+        const char *funname;
+        AllocCensus census;
+        AllocCensus *previous;
+
+    public:
+        explicit AllocCensusScope(const char *funname) :
+            funname(funname),
+            previous(currentAllocCensus())
+        {
+            currentAllocCensus() = &census;
+        }
+
+        ~AllocCensusScope() {
+            currentAllocCensus() = previous;
+            allocCensusRegistry().add(funname, census);
+        }
+
+        AllocCensusScope(const AllocCensusScope &) = delete;
+        AllocCensusScope &operator = (const AllocCensusScope &) = delete;
+    };
+
+
+    /* Top-level library function returning the census, as used by the generated code.
+     * The argument is True to reset the values after reading them. Returns a matrix with rows
+     * {function index, calls, allocations, bytes allocated, copies, bytes copied, max bytes per call}.
+     */
+    inline int allocCensusTable(mint Argc, MArgument *Args, MArgument Res) {
+        if (Argc != 1)
+            return LIBRARY_FUNCTION_ERROR;
+        const std::vector<std::vector<mint>> rows = allocCensusRegistry().table(MArgument_getBoolean(Args[0]));
+        auto res = makeMatrix<mint>(rows.size(), 7);
+        for (mint i=0; i < res.rows(); ++i)
+            for (mint j=0; j < res.cols(); ++j)
+                res(i,j) = rows[i][j];
+        MArgument_setMTensor(Res, res.tensor());
+        return LIBRARY_NO_ERROR;
+    }
+
+    // Top-level library function returning the name of the function with the given index
+    inline int allocCensusName(mint Argc, MArgument *Args, MArgument Res) {
+        if (Argc != 1)
+            return LIBRARY_FUNCTION_ERROR;
+        const char *name = allocCensusRegistry().name(MArgument_getInteger(Args[0]));
+        if (name == NULL)
+            return LIBRARY_FUNCTION_ERROR;
+        MArgument_setUTF8String(Res, const_cast<char *>(name));
+        return LIBRARY_NO_ERROR;
+    }
+
+    // Prints the census, worst offenders first, for standalone programs
+    inline void allocCensusReport(std::FILE *out) {
+        AllocCensusRegistry &registry = allocCensusRegistry();
+        const std::vector<std::vector<mint>> rows = registry.table(false);
+
+        std::fprintf(out, "%-40s  %8s  %12s  %14s  %12s  %14s  %14s\n",
+                     "function", "calls", "allocations", "MB allocated", "copies", "MB copied", "max MB/call");
+        for (const auto &row : rows)
+            std::fprintf(out, "%-40s  %8lld  %12lld  %14.3f  %12lld  %14.3f  %14.3f\n",
+                         registry.name(row[0]), (long long) row[1],
+                         (long long) row[2], row[3] / 1048576.0, (long long) row[4], row[5] / 1048576.0, row[6] / 1048576.0);
+    }
+
+} // end namespace detail
+} // end namespace mma
+
+#endif // LTEMPLATE_CENSUS_H
@@ -11,6 +11,20 @@
 #include <algorithm>
 #include <vector>
 #include <map>
+#include <tuple>
+#include <type_traits>
+#include <cstddef>
+#include <string>
+#include <utility>
+#include <limits>
+
+#ifdef LTEMPLATE_PERF_COUNTERS
+#include "LTemplatePerf.h"
+#endif
+
+#ifdef LTEMPLATE_ALLOC_CENSUS
+#include "LTemplateCensus.h"
+#endif
 
 namespace mma {
 namespace detail {
@@ -136,7 +150,894 @@ inline void handleUnknownException(const char *what, const char *funname) {
 }
 
 
+/* Conversion of library function arguments and return values, selected by C++ type.
+ * The generated code names the C++ type corresponding to each entry of the template specification,
+ * see the types table in LTemplateInner.m.
+ */
+template<typename T> struct MArgumentConv; // no definition: unsupported type
+
+template<> struct MArgumentConv<mint> {
+    static mint get(MArgument marg) { return MArgument_getInteger(marg); }
+    static void set(MArgument marg, mint val) { MArgument_setInteger(marg, val); }
+};
+
+template<> struct MArgumentConv<double> {
+    static double get(MArgument marg) { return MArgument_getReal(marg); }
+    static void set(MArgument marg, double val) { MArgument_setReal(marg, val); }
+};
+
+template<> struct MArgumentConv<complex_t> {
+    static complex_t get(MArgument marg) { return getComplex(marg); }
+    static void set(MArgument marg, complex_t val) { setComplex(marg, val); }
+};
+
+template<> struct MArgumentConv<bool> {
+    static bool get(MArgument marg) { return MArgument_getBoolean(marg); }
+    static void set(MArgument marg, bool val) { MArgument_setBoolean(marg, val); }
+};
+
+template<> struct MArgumentConv<const char *> {
+    static const char *get(MArgument marg) { return getString(marg); }
+    static void set(MArgument marg, const char *val) { setString(marg, val); }
+};
+
+template<typename T> struct MArgumentConv<TensorRef<T>> {
+    static TensorRef<T> get(MArgument marg) { return getTensor<T>(marg); }
+    static void set(MArgument marg, TensorRef<T> val) { setTensor<T>(marg, val); }
+};
+
+// Fixed-shape tensors are verified when they are constructed, both for arguments and for return values
+template<typename T, mint N> struct MArgumentConv<FixedColsMatrixRef<T, N>> {
+    static FixedColsMatrixRef<T, N> get(MArgument marg) { return getTensor<T>(marg); }
+    static void set(MArgument marg, FixedColsMatrixRef<T, N> val) { setTensor<T>(marg, val); }
+};
+
+template<typename T, mint M, mint N> struct MArgumentConv<FixedMatrixRef<T, M, N>> {
+    static FixedMatrixRef<T, M, N> get(MArgument marg) { return getTensor<T>(marg); }
+    static void set(MArgument marg, FixedMatrixRef<T, M, N> val) { setTensor<T>(marg, val); }
+};
+
+template<typename T, mint N> struct MArgumentConv<FixedVectorRef<T, N>> {
+    static FixedVectorRef<T, N> get(MArgument marg) { return getTensor<T>(marg); }
+    static void set(MArgument marg, FixedVectorRef<T, N> val) { setTensor<T>(marg, val); }
+};
+
+template<typename T> struct MArgumentConv<SparseArrayRef<T>> {
+    static SparseArrayRef<T> get(MArgument marg) { return getSparseArray<T>(marg); }
+    static void set(MArgument marg, SparseArrayRef<T> val) { setSparseArray<T>(marg, val); }
+};
+
+template<typename T> struct MArgumentConv<ImageRef<T>> {
+    static ImageRef<T> get(MArgument marg) { return getImage<T>(marg); }
+    static void set(MArgument marg, ImageRef<T> val) { setImage<T>(marg, val); }
+};
+
+template<typename T> struct MArgumentConv<Image3DRef<T>> {
+    static Image3DRef<T> get(MArgument marg) { return getImage3D<T>(marg); }
+    static void set(MArgument marg, Image3DRef<T> val) { setImage3D<T>(marg, val); }
+};
+
+template<> struct MArgumentConv<GenericImageRef> {
+    static GenericImageRef get(MArgument marg) { return getGenericImage(marg); }
+    static void set(MArgument marg, GenericImageRef val) { setGenericImage(marg, val); }
+};
+
+template<> struct MArgumentConv<GenericImage3DRef> {
+    static GenericImage3DRef get(MArgument marg) { return getGenericImage3D(marg); }
+    static void set(MArgument marg, GenericImage3DRef val) { setGenericImage3D(marg, val); }
+};
+
+#ifdef LTEMPLATE_RAWARRAY
+template<typename T> struct MArgumentConv<RawArrayRef<T>> {
+    static RawArrayRef<T> get(MArgument marg) { return getRawArray<T>(marg); }
+    static void set(MArgument marg, RawArrayRef<T> val) { setRawArray<T>(marg, val); }
+};
+
+template<> struct MArgumentConv<GenericRawArrayRef> {
+    static GenericRawArrayRef get(MArgument marg) { return getGenericRawArray(marg); }
+    static void set(MArgument marg, GenericRawArrayRef val) { setGenericRawArray(marg, val); }
+};
+#endif // LTEMPLATE_RAWARRAY
+
+// LExpressionID: the managed library expression ID is translated to a class reference. It cannot be returned.
+template<typename Class> struct MArgumentConv<Class &> {
+    static Class &get(MArgument marg) { return getInstance<Class>(MArgument_getInteger(marg)); }
+};
+
+
+template<typename... T> struct TypeList { };
+
+template<std::size_t... I> struct IndexList { };
+
+template<std::size_t N, std::size_t... I>
+struct MakeIndexList : MakeIndexList<N-1, N-1, I...> { };
+
+template<std::size_t... I>
+struct MakeIndexList<0, I...> { typedef IndexList<I...> type; };
+
+template<bool... B> struct BoolList { };
+
+template<bool... B>
+struct AllOf : std::is_same<BoolList<true, B...>, BoolList<B..., true>> { };
+
+
+/* Properties of the member functions that LFun can be bound to.
+ * Static member functions are also allowed; they are called without an object.
+ */
+template<typename Fun> struct MemberFunction; // no definition: not a member function
+
+template<typename C, typename R, typename... P>
+struct MemberFunction<R (C::*)(P...)> {
+    typedef C class_type;
+    typedef R result_type;
+    typedef TypeList<P...> param_types;
+
+    template<typename Class, typename... A>
+    static R call(Class &obj, R (C::*fun)(P...), A &... args) { return (obj.*fun)(args...); }
+};
+
+template<typename C, typename R, typename... P>
+struct MemberFunction<R (C::*)(P...) const> {
+    typedef C class_type;
+    typedef R result_type;
+    typedef TypeList<P...> param_types;
+
+    template<typename Class, typename... A>
+    static R call(Class &obj, R (C::*fun)(P...) const, A &... args) { return (obj.*fun)(args...); }
+};
+
+template<typename R, typename... P>
+struct MemberFunction<R (*)(P...)> {
+    typedef void class_type;
+    typedef R result_type;
+    typedef TypeList<P...> param_types;
+
+    template<typename Class, typename... A>
+    static R call(Class &, R (*fun)(P...), A &... args) { return fun(args...); }
+};
+
+#ifdef __cpp_noexcept_function_type
+// Since C++17, noexcept is part of the function type
+template<typename C, typename R, typename... P>
+struct MemberFunction<R (C::*)(P...) noexcept> : MemberFunction<R (C::*)(P...)> { };
+
+template<typename C, typename R, typename... P>
+struct MemberFunction<R (C::*)(P...) const noexcept> : MemberFunction<R (C::*)(P...) const> { };
+
+template<typename R, typename... P>
+struct MemberFunction<R (*)(P...) noexcept> : MemberFunction<R (*)(P...)> { };
+#endif
+
+
+/* "InPlace" passing. Such arguments are passed with "Shared" passing, so the library works directly on the
+ * kernel's data, and they are disowned automatically after the call. With the "InPlace" return type,
+ * the same object is returned to the kernel, again without copying.
+ *
+ * In the specification, InPlace<R> stands for an argument of type R, and InPlaceResult for the return type.
+ */
+template<typename R> struct InPlace;
+struct InPlaceResult;
+
+// Disown a "Shared" argument without converting it to R, which may fail
+template<typename T>
+inline void disownShared(MArgument marg, const TensorRef<T> *) { libData->MTensor_disown(MArgument_getMTensor(marg)); }
+
+template<typename T>
+inline void disownShared(MArgument marg, const SparseArrayRef<T> *) { libData->sparseLibraryFunctions->MSparseArray_disown(MArgument_getMSparseArray(marg)); }
+
+inline void disownShared(MArgument marg, const GenericImageRef *) { libData->imageLibraryFunctions->MImage_disown(MArgument_getMImage(marg)); }
+inline void disownShared(MArgument marg, const GenericImage3DRef *) { libData->imageLibraryFunctions->MImage_disown(MArgument_getMImage(marg)); }
+
+#ifdef LTEMPLATE_RAWARRAY
+inline void disownShared(MArgument marg, const GenericRawArrayRef *) { libData->rawarrayLibraryFunctions->MRawArray_disown(MArgument_getMRawArray(marg)); }
+#endif
+
+/* "Stored" passing. Such arguments and return values are handles to Tensors kept in the
+ * library's TensorStore. In the specification, Stored<R> stands for a Tensor type R.
+ */
+template<typename R> struct Stored;
+
+template<typename R>
+struct StoredTensor {
+    typedef typename std::remove_pointer<decltype(std::declval<R>().data())>::type elem_type;
+
+    static R get(MArgument marg) { return R(tensorStore().get<elem_type>(MArgument_getInteger(marg))); }
+};
+
+template<typename R> struct MArgumentConv<Stored<R>> {
+    static void set(MArgument marg, const R &val) { MArgument_setInteger(marg, tensorStore().insert(val)); }
+};
+
+// The C++ type of an argument in the specification, how to convert it, and what to do with it after the call
+template<typename A>
+struct Argument {
+    typedef A type;
+    static const bool inplace = false;
+    static A get(MArgument marg) { return MArgumentConv<A>::get(marg); }
+    static void release(MArgument) { }
+};
+
+template<typename R>
+struct Argument<InPlace<R>> {
+    typedef R type;
+    static const bool inplace = true;
+    static R get(MArgument marg) { return MArgumentConv<R>::get(marg); }
+    static void release(MArgument marg) { disownShared(marg, static_cast<R *>(nullptr)); }
+};
+
+template<typename R>
+struct Argument<Stored<R>> {
+    typedef R type;
+    static const bool inplace = false;
+    static R get(MArgument marg) { return StoredTensor<R>::get(marg); }
+    static void release(MArgument) { }
+};
+
+/* "UTF8String" arguments are released after the call when the member function takes them as StringRef
+ * or std::string. Functions taking a const char * keep the responsibility of releasing the string.
+ * A is the type in the specification, P the parameter type of the member function.
+ */
+template<typename A, typename P>
+struct ReleaseString {
+    static void release(MArgument) { }
+};
+
+template<>
+struct ReleaseString<const char *, StringRef> {
+    static void release(MArgument marg) { disownString(getString(marg)); }
+};
+
+template<>
+struct ReleaseString<const char *, std::string> : ReleaseString<const char *, StringRef> { };
+
+/* Releases "InPlace" arguments, as well as strings passed as StringRef, when the call finishes,
+ * even if the conversion of some argument failed.
+ */
+template<typename Args, typename Params> class ReleaseArguments;
+
+template<typename... A, typename... P>
+class ReleaseArguments<TypeList<A...>, TypeList<P...>> {
+    MArgument *Args;
+
+    template<std::size_t... I>
+    void release(IndexList<I...>) {
+        int dummy[] = { 0, (Argument<A>::release(Args[I+1]), ReleaseString<A, typename std::decay<P>::type>::release(Args[I+1]), 0)... };
+        (void) dummy;
+    }
+
+public:
+    explicit ReleaseArguments(MArgument *args) : Args(args) { }
+    ~ReleaseArguments() { release(typename MakeIndexList<sizeof...(A)>::type()); }
+};
+
+// Index of the first "InPlace" argument, or the number of arguments if there is none
+template<typename... A> struct InPlaceIndex;
+
+template<>
+struct InPlaceIndex<> : std::integral_constant<std::size_t, 0> { };
+
+template<typename A, typename... Rest>
+struct InPlaceIndex<A, Rest...>
+    : std::integral_constant<std::size_t, Argument<A>::inplace ? 0 : 1 + InPlaceIndex<Rest...>::value> { };
+
+// Number of "InPlace" arguments
+template<typename... A> struct InPlaceCount;
+
+template<>
+struct InPlaceCount<> : std::integral_constant<std::size_t, 0> { };
+
+template<typename A, typename... Rest>
+struct InPlaceCount<A, Rest...>
+    : std::integral_constant<std::size_t, (Argument<A>::inplace ? 1 : 0) + InPlaceCount<Rest...>::value> { };
+
+
+/* Sets the result of type R from the value of type T returned by the member function of Class.
+ * The "UTF8String" result may be a std::string. The kernel copies the string only after the library function
+ * has returned, so a returned value is moved to a static buffer, and is kept until the next call. The buffer is
+ * specific to the member function pointer type Fun, not to the function: all functions of Class with the same signature
+ * share it. This is safe because the kernel makes only one library call at a time, and runCommands() copies string results.
+ * A returned reference to a std::string is assumed to outlive the call, and it is used directly.
+ */
+template<typename R, typename T, typename Class, typename Fun, typename = typename std::decay<T>::type>
+struct SetResult {
+    static void set(MArgument marg, T val) { MArgumentConv<R>::set(marg, std::forward<T>(val)); }
+};
+
+template<typename T, typename Class, typename Fun>
+struct SetResult<const char *, T, Class, Fun, std::string> {
+    static void set(MArgument marg, const std::string &val, std::true_type) { setString(marg, val.c_str()); }
+
+    static void set(MArgument marg, std::string val, std::false_type) {
+        static std::string buffer;
+        buffer = std::move(val);
+        setString(marg, buffer.c_str());
+    }
+
+    static void set(MArgument marg, T val) { set(marg, std::forward<T>(val), std::is_reference<T>()); }
+};
+
+// Checks if the value of type T returned by a member function can be used as a result of type R
+template<typename R, typename T>
+struct ResultMatch : std::is_convertible<T, R> { };
+
+template<typename T>
+struct ResultMatch<const char *, T>
+    : std::integral_constant<bool, std::is_convertible<T, const char *>::value || std::is_same<typename std::decay<T>::type, std::string>::value> { };
+
+template<typename R, typename T>
+struct ResultMatch<Stored<R>, T> : std::is_convertible<T, R> { };
+
+
+// Checks if arguments of types A can be passed to a function with parameter types P
+template<typename A, typename P, bool = true>
+struct ArgumentsMatch : std::false_type { };
+
+template<typename... A, typename... P>
+struct ArgumentsMatch<TypeList<A...>, TypeList<P...>, sizeof...(A) == sizeof...(P)>
+    : AllOf<std::is_convertible<typename Argument<A>::type &, P>::value...> { };
+
+
+/* Calls a member function with the arguments described by the template specification Spec,
+ * which is a function type, e.g. TensorRef<double>(mint, double) for LFun[name, {Integer, Real}, {Real, _}].
+ * Conversions are selected by Spec, so that the member function may take any parameters that
+ * the specified argument types convert to, e.g. MatrixRef<double> instead of TensorRef<double>.
+ * Arguments are released by the caller, see ReleaseArguments.
+ */
+template<typename Spec> struct Invoker;
+
+template<typename R, typename... A>
+struct Invoker<R(A...)> {
+    template<typename Class, typename Fun, std::size_t... I>
+    static void call(Class &obj, Fun fun, MArgument *Args, MArgument Res, IndexList<I...>) {
+        // Braced initialization evaluates arguments in order. Args[0] is the instance ID.
+        std::tuple<typename Argument<A>::type...> args{Argument<A>::get(Args[I+1])...};
+        SetResult<R, typename MemberFunction<Fun>::result_type, Class, Fun>::set(Res, MemberFunction<Fun>::call(obj, fun, std::get<I>(args)...));
+    }
+};
+
+template<typename... A>
+struct Invoker<void(A...)> {
+    template<typename Class, typename Fun, std::size_t... I>
+    static void call(Class &obj, Fun fun, MArgument *Args, MArgument, IndexList<I...>) {
+        std::tuple<typename Argument<A>::type...> args{Argument<A>::get(Args[I+1])...};
+        MemberFunction<Fun>::call(obj, fun, std::get<I>(args)...);
+    }
+};
+
+// The "InPlace" argument is returned after the member function has modified it
+template<typename... A>
+struct Invoker<InPlaceResult(A...)> {
+    template<typename Class, typename Fun, std::size_t... I>
+    static void call(Class &obj, Fun fun, MArgument *Args, MArgument Res, IndexList<I...>) {
+        static const std::size_t k = InPlaceIndex<A...>::value;
+        typedef typename std::tuple_element<k, std::tuple<typename Argument<A>::type...>>::type result_type;
+
+        std::tuple<typename Argument<A>::type...> args{Argument<A>::get(Args[I+1])...};
+        MemberFunction<Fun>::call(obj, fun, std::get<I>(args)...);
+        MArgumentConv<result_type>::set(Res, std::get<k>(args));
+    }
+};
+
+
+template<typename Spec> struct SpecTraits;
+
+template<typename R, typename... A>
+struct SpecTraits<R(A...)> {
+    typedef R result_type;
+    typedef TypeList<A...> arg_types;
+    static const std::size_t arity = sizeof...(A);
+    static const std::size_t inplace_count = InPlaceCount<A...>::value;
+};
+
+template<typename List> struct Arity;
+
+template<typename... P>
+struct Arity<TypeList<P...>> : std::integral_constant<std::size_t, sizeof...(P)> { };
+
+
+#ifdef LTEMPLATE_CAPTURE
+// Records the call while a capture is running, see LTemplateCapture.h
+template<typename Spec>
+void captureCall(const char *funname, MArgument *Args);
+
+// Records the handle returned by a function with a "Stored" result
+template<typename Spec>
+void captureResult(MArgument Res);
+
+// Records the release of a Tensor handle
+void captureRelease(mint handle);
+#endif
+
+/* Top-level library function for member function fun of Class, as used by the generated code.
+ * funname is used in error messages.
+ */
+template<typename Spec, typename Class, typename Fun>
+inline int invoke(const char *funname, std::map<mint, Class *> &collection, Fun fun, MArgument *Args, MArgument Res) {
+    typedef SpecTraits<Spec> spec;
+    typedef MemberFunction<Fun> member;
+
+    static_assert(std::is_void<typename member::class_type>::value || std::is_base_of<typename member::class_type, Class>::value,
+                  "LTemplate: the function is not a member of the class.");
+    static_assert(Arity<typename member::param_types>::value == spec::arity,
+                  "LTemplate: the number of arguments of the member function does not match the template specification.");
+    static_assert(Arity<typename member::param_types>::value != spec::arity || ArgumentsMatch<typename spec::arg_types, typename member::param_types>::value,
+                  "LTemplate: the argument types of the member function do not match the template specification.");
+    static_assert(std::is_void<typename spec::result_type>::value || std::is_same<typename spec::result_type, InPlaceResult>::value ||
+                  ResultMatch<typename spec::result_type, typename member::result_type>::value,
+                  "LTemplate: the return type of the member function does not match the template specification.");
+    static_assert(! std::is_same<typename spec::result_type, InPlaceResult>::value || (std::is_void<typename member::result_type>::value && spec::inplace_count == 1),
+                  "LTemplate: functions with an \"InPlace\" return type must have a single \"InPlace\" argument and return void.");
+
+    MOutFlushGuard flushguard;
+
+    // Created before anything can return early, so that arguments are also released when the call fails
+    ReleaseArguments<typename spec::arg_types, typename member::param_types> releaseguard(Args);
+
+#ifdef LTEMPLATE_CAPTURE
+    captureCall<Spec>(funname, Args);
+#endif
+
+    const mint id = MArgument_getInteger(Args[0]);
+    typename std::map<mint, Class *>::iterator it = collection.find(id);
+    if (it == collection.end()) {
+        libData->Message("noinst");
+        return LIBRARY_FUNCTION_ERROR;
+    }
+
+#ifdef LTEMPLATE_PERF_COUNTERS
+    PerfCounterScope perfscope(funname);
+#endif
+
+#ifdef LTEMPLATE_ALLOC_CENSUS
+    AllocCensusScope censusscope(funname);
+#endif
+
+    try {
+        Invoker<Spec>::call(*it->second, fun, Args, Res, typename MakeIndexList<spec::arity>::type());
+    }
+    catch (const LibraryError &libErr) {
+        libErr.report();
+        return libErr.error_code();
+    }
+    catch (const std::exception &exc) {
+        handleUnknownException(exc.what(), funname);
+        return LIBRARY_FUNCTION_ERROR;
+    }
+    catch (...) {
+        handleUnknownException(NULL, funname);
+        return LIBRARY_FUNCTION_ERROR;
+    }
+
+#ifdef LTEMPLATE_CAPTURE
+    captureResult<Spec>(Res);
+#endif
+
+    return LIBRARY_NO_ERROR;
+}
+
+
+// Top-level library function for a LinkObject based member function, as used by the generated code.
+template<typename Class>
+inline int invokeLink(const char *funname, std::map<mint, Class *> &collection, void (Class::*fun)(MLINK), MLINK mlp) {
+    MOutFlushGuard flushguard;
+    try {
+        int id;
+        int args = 2;
+
+        if (! MLTestHeadWithArgCount(mlp, "List", &args))
+            return LIBRARY_FUNCTION_ERROR;
+        if (! MLGetInteger(mlp, &id))
+            return LIBRARY_FUNCTION_ERROR;
+        typename std::map<mint, Class *>::iterator it = collection.find(id);
+        if (it == collection.end()) {
+            libData->Message("noinst");
+            return LIBRARY_FUNCTION_ERROR;
+        }
+        (it->second->*fun)(mlp);
+    }
+    catch (const LibraryError &libErr) {
+        libErr.report();
+        return libErr.error_code();
+    }
+    catch (const std::exception &exc) {
+        handleUnknownException(exc.what(), funname);
+        return LIBRARY_FUNCTION_ERROR;
+    }
+    catch (...) {
+        handleUnknownException(NULL, funname);
+        return LIBRARY_FUNCTION_ERROR;
+    }
+
+    return LIBRARY_NO_ERROR;
+}
+
+
+/* Command buffers, see RunCommands in the Mathematica package.
+ *
+ * A command buffer calls several library functions of the template with a single call from the kernel.
+ * The result of each command is kept in a slot, and may be passed to later commands without
+ * returning it to the kernel. The commands are encoded by the kernel into an integer vector, passed
+ * as the first argument. Values sent by the kernel are passed as further arguments, with the same
+ * types and passing methods as the corresponding arguments of the called functions.
+ *
+ * The encoding is
+ *
+ *   ncommands, command_1, ..., command_n, noutputs, output_1, ..., output_m
+ *
+ * with each command encoded as
+ *
+ *   function, instance ID, result type, result owned, nargs, argument_1, ..., argument_k
+ *
+ * and each argument as
+ *
+ *   source, index, type, clone
+ *
+ * function indexes the table of library functions generated for the template. The source is
+ * CS_Input for values sent by the kernel, with index into Args, and CS_Result for the result of an
+ * earlier command, with a 0-based command index. Results are passed by reference, except when the
+ * argument uses "Manual" passing: then the receiving function gets its own copy, which is freed
+ * again if the command fails. An owned result is freed when it is not needed any more. Outputs are
+ * 0-based command indices. The first output is returned directly, the others can be retrieved with
+ * commandOutput() until the next command buffer runs.
+ */
+typedef int (*LibraryFunctionPointer)(WolframLibraryData, mint, MArgument *, MArgument);
+
+enum CommandType {
+    CT_Void, CT_Integer, CT_Real, CT_Complex, CT_Boolean, CT_String, CT_Tensor, CT_SparseArray, CT_Image, CT_RawArray
+};
+
+enum CommandSource { CS_Input, CS_Result };
+
+// The result of a command
+struct CommandValue {
+    mint type;
+    bool owned;
+    union {
+        mint integer;
+        mreal real;
+        mcomplex cmplex;
+        mbool boolean;
+        char *string;
+        MTensor tensor;
+        MSparseArray sparse;
+        MImage image;
+#ifdef LTEMPLATE_RAWARRAY
+        MRawArray rawarray;
+#endif
+    };
+    std::string buffer; // string results are copied, as the library only keeps them until the function is called again
+
+    CommandValue() : type(CT_Void), owned(false), integer(0) { }
+
+    // All members of the union share the same address
+    MArgument argument() {
+        MArgument marg;
+        MArgument_setAddress(marg, &integer);
+        return marg;
+    }
+
+    void keepString() {
+        buffer = string;
+        string = const_cast<char *>(buffer.c_str());
+    }
+
+    // A copy of an array value, owned by the receiver
+    CommandValue clone() const {
+        CommandValue res = *this;
+        res.owned = true;
+        int err = LIBRARY_NO_ERROR;
+        switch (type) {
+        case CT_Tensor:      err = libData->MTensor_clone(tensor, &res.tensor); break;
+        case CT_SparseArray: err = libData->sparseLibraryFunctions->MSparseArray_clone(sparse, &res.sparse); break;
+        case CT_Image:       err = libData->imageLibraryFunctions->MImage_clone(image, &res.image); break;
+#ifdef LTEMPLATE_RAWARRAY
+        case CT_RawArray:    err = libData->rawarrayLibraryFunctions->MRawArray_clone(rawarray, &res.rawarray); break;
+#endif
+        default: break;
+        }
+        if (err)
+            throw LibraryError("Cannot copy the result of a command.", err);
+        return res;
+    }
+
+    void free() {
+        if (owned) {
+            switch (type) {
+            case CT_Tensor:      libData->MTensor_free(tensor); break;
+            case CT_SparseArray: libData->sparseLibraryFunctions->MSparseArray_free(sparse); break;
+            case CT_Image:       libData->imageLibraryFunctions->MImage_free(image); break;
+#ifdef LTEMPLATE_RAWARRAY
+            case CT_RawArray:    libData->rawarrayLibraryFunctions->MRawArray_free(rawarray); break;
+#endif
+            default: break;
+            }
+        }
+        owned = false;
+    }
+
+    // Return the value to the kernel, which takes ownership of owned arrays
+    void set(MArgument marg) {
+        switch (type) {
+        case CT_Integer:     MArgument_setInteger(marg, integer); break;
+        case CT_Real:        MArgument_setReal(marg, real); break;
+        case CT_Complex:     MArgument_setComplex(marg, cmplex); break;
+        case CT_Boolean:     MArgument_setBoolean(marg, boolean); break;
+        case CT_String:      MArgument_setUTF8String(marg, string); break;
+        case CT_Tensor:      MArgument_setMTensor(marg, tensor); break;
+        case CT_SparseArray: MArgument_setMSparseArray(marg, sparse); break;
+        case CT_Image:       MArgument_setMImage(marg, image); break;
+#ifdef LTEMPLATE_RAWARRAY
+        case CT_RawArray:    MArgument_setMRawArray(marg, rawarray); break;
+#endif
+        default: break;
+        }
+        owned = false;
+    }
+};
+
+// Results of the last command buffer. They are kept so that further outputs can be retrieved.
+class CommandResults {
+    std::vector<CommandValue> values;
+    std::vector<mint> outputs;
+
+public:
+    void clear() {
+        for (auto &v : values)
+            v.free();
+        values.clear();
+        outputs.clear();
+    }
+
+    // The returned reference stays valid until the next call to reset()
+    std::vector<CommandValue> &reset(mint n) {
+        clear();
+        values.resize(n);
+        return values;
+    }
+
+    void addOutput(mint k) {
+        if (k < 0 || k >= mint(values.size()) || values[k].type == CT_Void)
+            throw LibraryError("Invalid command buffer output.");
+        outputs.push_back(k);
+    }
+
+    // Set output k (0-based); each output can be retrieved only once
+    void setOutput(mint k, MArgument marg) {
+        if (k < 0 || k >= mint(outputs.size()) || outputs[k] < 0)
+            throw LibraryError("Command buffer output is not available.");
+        values[outputs[k]].set(marg);
+        outputs[k] = -1;
+    }
+
+    mint outputCount() const { return outputs.size(); }
+};
+
+// Copies made for the "Manual" arguments of a single command. They are freed if the command
+// does not run successfully; after a successful call, the receiving function owns them.
+class CommandClones {
+    std::vector<CommandValue> values;
+
+public:
+    CommandClones() = default;
+    CommandClones(const CommandClones &) = delete;
+    CommandClones & operator = (const CommandClones &) = delete;
+
+    ~CommandClones() { clear(); }
+
+    void clear() {
+        for (auto &v : values)
+            v.free();
+        values.clear();
+    }
+
+    // No reallocation happens after reset(), the arguments returned by add() point into values
+    void reset(mint n) {
+        clear();
+        values.resize(n);
+    }
+
+    MArgument add(mint j, const CommandValue &val) {
+        values[j] = val.clone();
+        return values[j].argument();
+    }
+
+    // Ownership was passed to the called function
+    void release() {
+        for (auto &v : values)
+            v.owned = false;
+    }
+};
+
+inline CommandResults &commandResults() {
+    static CommandResults results;
+    return results;
+}
+
+// Bounds-checked reading of the encoded commands
+class CommandReader {
+    const mint *data;
+    mint pos, len;
+
+public:
+    explicit CommandReader(const TensorRef<mint> &t) : data(t.data()), pos(0), len(t.length()) { }
+
+    mint next() {
+        if (pos == len)
+            throw LibraryError("Invalid command buffer.");
+        return data[pos++];
+    }
+
+    mint next(mint lower, mint upper) {
+        mint val = next();
+        if (val < lower || val >= upper)
+            throw LibraryError("Invalid command buffer.");
+        return val;
+    }
+
+    bool atEnd() const { return pos == len; }
+};
+
+
+/* Top-level library function for running a command buffer, as used by the generated code.
+ * funs is the table of library functions of the template, with NULL entries for functions
+ * that cannot be used in command buffers.
+ */
+inline int runCommands(const LibraryFunctionPointer *funs, mint nfuns, WolframLibraryData libData, mint Argc, MArgument *Args, MArgument Res) {
+    CommandResults &results = commandResults();
+    try {
+        CommandReader reader(getTensor<mint>(Args[0]));
+        const mint ncommands = reader.next(0, std::numeric_limits<mint>::max());
+        std::vector<CommandValue> &values = results.reset(ncommands);
+        CommandClones clones;
+        std::vector<MArgument> args;
+
+        for (mint i=0; i < ncommands; ++i) {
+            const mint fun = reader.next(0, nfuns);
+            if (funs[fun] == NULL)
+                throw LibraryError("Invalid command buffer.");
+            mint id = reader.next();
+            CommandValue &res = values[i];
+            res.type = reader.next(CT_Void, CT_RawArray + 1);
+            const bool owned = reader.next() != 0;
+            const mint nargs = reader.next(0, std::numeric_limits<mint>::max());
+
+            args.resize(nargs + 1);
+            clones.reset(nargs);
+            MArgument_setAddress(args[0], &id);
+            for (mint j=0; j < nargs; ++j) {
+                const mint source = reader.next(CS_Input, CS_Result + 1);
+                if (source == CS_Input) {
+                    const mint k = reader.next(1, Argc);
+                    reader.next(); // the type was verified by the kernel
+                    reader.next();
+                    args[j+1] = Args[k];
+                } else {
+                    CommandValue &val = values[reader.next(0, i)];
+                    if (val.type != reader.next() || val.type == CT_Void || val.type == CT_String)
+                        throw LibraryError("Invalid command buffer.");
+                    if (reader.next()) {
+                        args[j+1] = clones.add(j, val); // the receiving function owns the copy
+                    } else {
+                        args[j+1] = val.argument();
+                    }
+                }
+            }
+
+            int err = funs[fun](libData, nargs + 1, args.data(), res.argument());
+            if (err != LIBRARY_NO_ERROR) {
+                res.type = CT_Void;
+                results.clear();
+                return err;
+            }
+            clones.release();
+            res.owned = owned;
+            if (res.type == CT_String)
+                res.keepString();
+
+            check_abort();
+        }
+
+        const mint noutputs = reader.next(0, ncommands + 1);
+        for (mint j=0; j < noutputs; ++j)
+            results.addOutput(reader.next());
+        if (! reader.atEnd())
+            throw LibraryError("Invalid command buffer.");
+
+        if (noutputs > 0)
+            results.setOutput(0, Res);
+    }
+    catch (const LibraryError &libErr) {
+        results.clear();
+        libErr.report();
+        return libErr.error_code();
+    }
+    catch (const std::exception &exc) {
+        results.clear();
+        handleUnknownException(exc.what(), "RunCommands");
+        return LIBRARY_FUNCTION_ERROR;
+    }
+
+    return LIBRARY_NO_ERROR;
+}
+
+
+// Top-level library function for retrieving further outputs of the last command buffer, as used by the generated code.
+inline int commandOutput(mint Argc, MArgument *Args, MArgument Res) {
+    try {
+        if (Argc != 1)
+            throw LibraryError("Invalid command buffer output.");
+        commandResults().setOutput(MArgument_getInteger(Args[0]) - 1, Res);
+    }
+    catch (const LibraryError &libErr) {
+        libErr.report();
+        return libErr.error_code();
+    }
+    return LIBRARY_NO_ERROR;
+}
+
+
+/* Top-level library functions for managing the TensorStore from the kernel, as used by the generated code.
+ * Each takes a handle as the first argument, if applicable.
+ */
+
+// A copy of a stored Tensor. The second argument is the expected element type.
+inline int tensorStoreGet(mint Argc, MArgument *Args, MArgument Res) {
+    try {
+        if (Argc != 2)
+            throw LibraryError("Invalid tensor store request.");
+        const mint handle = MArgument_getInteger(Args[0]);
+        MTensor res;
+        switch (MArgument_getInteger(Args[1])) {
+        case MType_Integer: res = tensorStore().get<mint>(handle).clone().tensor(); break;
+        case MType_Real:    res = tensorStore().get<double>(handle).clone().tensor(); break;
+        case MType_Complex: res = tensorStore().get<complex_t>(handle).clone().tensor(); break;
+        default: throw LibraryError("Invalid tensor store request.");
+        }
+        MArgument_setMTensor(Res, res);
+    }
+    catch (const LibraryError &libErr) {
+        libErr.report();
+        return libErr.error_code();
+    }
+    return LIBRARY_NO_ERROR;
+}
+
+inline int tensorStoreRelease(mint Argc, MArgument *Args, MArgument) {
+    if (Argc != 1)
+        return LIBRARY_FUNCTION_ERROR;
+    const mint handle = MArgument_getInteger(Args[0]);
+#ifdef LTEMPLATE_CAPTURE
+    captureRelease(handle);
+#endif
+    tensorStore().release(handle);
+    return LIBRARY_NO_ERROR;
+}
+
+// Set the memory budget, then return {number of tensors, total bytes, budget, number of evictions}.
+// A budget below -1 leaves it unchanged.
+inline int tensorStoreInfo(mint Argc, MArgument *Args, MArgument Res) {
+    try {
+        if (Argc != 1)
+            throw LibraryError("Invalid tensor store request.");
+        TensorStore &store = tensorStore();
+        const mint budget = MArgument_getInteger(Args[0]);
+        if (budget >= -1)
+            store.setBudget(budget);
+        MArgument_setMTensor(Res, makeVector<mint>({store.size(), store.bytes(), store.budget(), store.evictions()}).tensor());
+    }
+    catch (const LibraryError &libErr) {
+        libErr.report();
+        return libErr.error_code();
+    }
+    return LIBRARY_NO_ERROR;
+}
+
+
 } // namespace detail
 } // namespace mma
 
+#ifdef LTEMPLATE_CAPTURE
+#include "LTemplateCapture.h"
+#endif
+
 #endif // LTEMPLATE_HELPERS_H
@@ -0,0 +1,274 @@
+/*
+ * Copyright (c) 2018 Szabolcs Horvát.
+ *
+ * See the file LICENSE.txt for copying permission.
+ */
+
+#ifndef LTEMPLATE_PERF_H
+#define LTEMPLATE_PERF_H
+
+/** \file
+ * \brief Hardware performance counters for each member function.
+ *
+ * This header is used by code generated with `CompileTemplate[template, "PerformanceCounters" -> True]`.
+ * It should not be included directly.
+ *
+ * Every member function call is measured with the CPU cycles, instructions, cache misses and
+ * branch misses counters of Linux's `perf_event_open`. The results are aggregated for each function
+ * and for each thread that made calls. They are retrieved with `PerformanceCounters` in _Mathematica_.
+ * Replay executables (see LTemplateCapture.h) print them after the replay.
+ *
+ * Only the thread that calls the member function is measured. Work done by other threads, e.g. those
+ * of an OpenMP parallel region, is not included. Counters that the system does not provide are
+ * reported as missing, e.g. on other operating systems, in some virtual machines, or when
+ * `/proc/sys/kernel/perf_event_paranoid` does not allow access. The call counts and times are always available.
+ */
+
+#include "LTemplate.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <utility>
+#include <vector>
+
+
+namespace mma {
+namespace detail { // private
+
+    enum { PC_Cycles, PC_Instructions, PC_CacheMisses, PC_BranchMisses, PC_Count };
+
+    // Counter values, -1 if not available
+    struct PerfCounterValues {
+        int64_t value[PC_Count];
+    };
+
+#ifdef __linux__
+    // The counters of the calling thread, opened on first use as a single group so that they are scheduled together
+    class PerfCounterGroup {
+        int fd[PC_Count];
+        int leader = -1;
+        int nopen = 0;
+
+        static int open(uint64_t config, int group) {
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.size = sizeof(attr);
+            attr.config = config;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            return syscall(__NR_perf_event_open, &attr, 0 /* this thread */, -1 /* any CPU */, group, 0);
+        }
+
+    public:
+        PerfCounterGroup() {
+            static const uint64_t configs[PC_Count] = {
+                PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+            };
+            for (int i=0; i < PC_Count; ++i) {
+                fd[i] = open(configs[i], leader);
+                if (fd[i] >= 0) {
+                    if (leader < 0)
+                        leader = fd[i];
+                    nopen++;
+                }
+            }
+        }
+
+        ~PerfCounterGroup() {
+            for (int i=0; i < PC_Count; ++i)
+                if (fd[i] >= 0)
+                    close(fd[i]);
+        }
+
+        PerfCounterGroup(const PerfCounterGroup &) = delete;
+        PerfCounterGroup &operator = (const PerfCounterGroup &) = delete;
+
+        /* Current counter values. When more counters are in use than the hardware has, the kernel
+         * multiplexes them, and the values are scaled up by the fraction of time they were running.
+         */
+        PerfCounterValues read() const {
+            PerfCounterValues res;
+            for (int i=0; i < PC_Count; ++i)
+                res.value[i] = -1;
+
+            uint64_t buf[3 + PC_Count]; // number of counters, time enabled, time running, values in the order of opening
+            if (leader < 0 || ::read(leader, buf, sizeof(buf)) < ssize_t((3 + nopen) * sizeof(uint64_t)))
+                return res;
+            const double scale = buf[2] > 0 ? double(buf[1]) / buf[2] : 0;
+            for (int i=0, k=0; i < PC_Count; ++i)
+                if (fd[i] >= 0)
+                    res.value[i] = int64_t(buf[3 + k++] * scale);
+            return res;
+        }
+    };
+
+    inline PerfCounterValues readPerfCounters() {
+        static thread_local PerfCounterGroup group;
+        return group.read();
+    }
+#else
+    inline PerfCounterValues readPerfCounters() {
+        PerfCounterValues res;
+        for (int i=0; i < PC_Count; ++i)
+            res.value[i] = -1;
+        return res;
+    }
+#endif // __linux__
+
+
+    // Totals for a function and thread
+    struct PerfCounterStats {
+        int64_t calls = 0;
+        int64_t nanoseconds = 0;
+        int64_t value[PC_Count] = {0, 0, 0, 0};
+    };
+
+    class PerfCounterRegistry {
+        std::mutex mutex;
+        std::vector<const char *> names;             // function names, in the order of their first call
+        std::map<const char *, mint> indices;
+        std::map<std::pair<mint, mint>, PerfCounterStats> stats; // by function index and thread index
+        std::atomic<mint> threadCount{0};
+
+    public:
+        // 1-based index of the calling thread, in the order of their first call
+        mint threadIndex() {
+            static thread_local mint index = ++threadCount;
+            return index;
+        }
+
+        void add(const char *funname, mint thread, int64_t nanoseconds, const PerfCounterValues &start, const PerfCounterValues &end) {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = indices.find(funname);
+            if (it == indices.end()) {
+                it = indices.insert(std::make_pair(funname, mint(names.size()))).first;
+                names.push_back(funname);
+            }
+            PerfCounterStats &s = stats[std::make_pair(it->second, thread)];
+            s.calls++;
+            s.nanoseconds += nanoseconds;
+            for (int i=0; i < PC_Count; ++i)
+                if (s.value[i] >= 0)
+                    s.value[i] = (start.value[i] >= 0 && end.value[i] >= 0) ? s.value[i] + (end.value[i] - start.value[i]) : -1;
+        }
+
+        const char *name(mint index) {
+            std::lock_guard<std::mutex> lock(mutex);
+            return index >= 0 && index < mint(names.size()) ? names[index] : NULL;
+        }
+
+        // Rows of {function index, thread index, calls, nanoseconds, counters...}
+        std::vector<std::vector<int64_t>> table(bool reset) {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::vector<std::vector<int64_t>> rows;
+            for (const auto &entry : stats) {
+                std::vector<int64_t> row = {entry.first.first, entry.first.second, entry.second.calls, entry.second.nanoseconds};
+                row.insert(row.end(), entry.second.value, entry.second.value + PC_Count);
+                rows.push_back(row);
+            }
+            if (reset)
+                stats.clear();
+            return rows;
+        }
+    };
+
+    inline PerfCounterRegistry &perfCounterRegistry() {
+        static PerfCounterRegistry registry;
+        return registry;
+    }
+
+    // Measures the lifetime of the object as a call of the function funname, which must be a string literal
+    class PerfCounterScope {
+        const char *funname;
+        mint thread;
+        PerfCounterValues start;
+        std::chrono::steady_clock::time_point startTime;
+
+    public:
+        explicit PerfCounterScope(const char *funname) :
+            funname(funname),
+            thread(perfCounterRegistry().threadIndex()),
+            start(readPerfCounters()),
+            startTime(std::chrono::steady_clock::now())
+        { }
+
+        ~PerfCounterScope() {
+            const auto endTime = std::chrono::steady_clock::now();
+            const PerfCounterValues end = readPerfCounters();
+            perfCounterRegistry().add(funname, thread, std::chrono::duration_cast<std::chrono::nanoseconds>(endTime - startTime).count(), start, end);
+        }
+
+        PerfCounterScope(const PerfCounterScope &) = delete;
+        PerfCounterScope &operator = (const PerfCounterScope &) = delete;
+    };
+
+
+    /* Top-level library function returning the collected values, as used by the generated code.
+     * The argument is True to reset the values after reading them. Returns a matrix with rows
+     * {function index, thread index, calls, nanoseconds, cycles, instructions, cache misses, branch misses}.
+     */
+    inline int perfCounterTable(mint Argc, MArgument *Args, MArgument Res) {
+        if (Argc != 1)
+            return LIBRARY_FUNCTION_ERROR;
+        const std::vector<std::vector<int64_t>> rows = perfCounterRegistry().table(MArgument_getBoolean(Args[0]));
+        auto res = makeMatrix<mint>(rows.size(), 4 + PC_Count);
+        for (mint i=0; i < res.rows(); ++i)
+            for (mint j=0; j < res.cols(); ++j)
+                res(i,j) = rows[i][j];
+        MArgument_setMTensor(Res, res.tensor());
+        return LIBRARY_NO_ERROR;
+    }
+
+    // Top-level library function returning the name of the function with the given index
+    inline int perfCounterName(mint Argc, MArgument *Args, MArgument Res) {
+        if (Argc != 1)
+            return LIBRARY_FUNCTION_ERROR;
+        const char *name = perfCounterRegistry().name(MArgument_getInteger(Args[0]));
+        if (name == NULL)
+            return LIBRARY_FUNCTION_ERROR;
+        MArgument_setUTF8String(Res, const_cast<char *>(name));
+        return LIBRARY_NO_ERROR;
+    }
+
+    // Prints the collected values, for standalone programs
+    inline void perfCounterReport(std::FILE *out) {
+        PerfCounterRegistry &registry = perfCounterRegistry();
+        const std::vector<std::vector<int64_t>> rows = registry.table(false);
+
+        std::fprintf(out, "%-40s  %6s  %8s  %12s  %14s  %6s  %16s  %16s\n",
+                     "function", "thread", "calls", "time (s)", "cycles/call", "IPC", "cache miss/call", "branch miss/call");
+        for (const auto &row : rows) {
+            const double calls = row[2];
+            const int64_t *v = &row[4];
+            char cycles[32] = "n/a", ipc[32] = "n/a", cache[32] = "n/a", branch[32] = "n/a";
+            if (v[PC_Cycles] >= 0)
+                std::snprintf(cycles, sizeof(cycles), "%.0f", v[PC_Cycles] / calls);
+            if (v[PC_Cycles] > 0 && v[PC_Instructions] >= 0)
+                std::snprintf(ipc, sizeof(ipc), "%.2f", double(v[PC_Instructions]) / v[PC_Cycles]);
+            if (v[PC_CacheMisses] >= 0)
+                std::snprintf(cache, sizeof(cache), "%.1f", v[PC_CacheMisses] / calls);
+            if (v[PC_BranchMisses] >= 0)
+                std::snprintf(branch, sizeof(branch), "%.1f", v[PC_BranchMisses] / calls);
+            std::fprintf(out, "%-40s  %6lld  %8lld  %12.6f  %14s  %6s  %16s  %16s\n",
+                         registry.name(row[0]), (long long) row[1], (long long) row[2], 1e-9 * row[3], cycles, ipc, cache, branch);
+        }
+    }
+
+} // end namespace detail
+} // end namespace mma
+
+#endif // LTEMPLATE_PERF_H
@@ -0,0 +1,1002 @@
+/*
+ * Copyright (c) 2018 Szabolcs Horvát.
+ *
+ * See the file LICENSE.txt for copying permission.
+ */
+
+#ifndef LTEMPLATE_WORKER_H
+#define LTEMPLATE_WORKER_H
+
+/** \file
+ * \brief Support for running LTemplate classes in a separate worker process.
+ *
+ * This header is used by code generated with `CompileTemplate[template, "WorkerProcess" -> True]`.
+ * It should not be included directly.
+ *
+ * In worker mode, the library loaded by the kernel contains only thin wrappers that forward
+ * each call to a worker executable which contains the actual classes. If a class crashes,
+ * only the worker process is lost: an error is reported, and a new worker is started on the next call.
+ * All class instances that lived in the crashed worker are lost.
+ *
+ * The library and the worker communicate through a shared memory segment. Tensors are copied
+ * into it once and are accessed in place by the worker; they are never serialized.
+ * Tensors too large for the shared buffer are passed in separate, temporary shared memory segments.
+ *
+ * Not supported in worker mode: LinkObject based functions, `"InPlace"` and `"Stored"` passing,
+ * and the `"CaptureCalls"`, `"PerformanceCounters"` and `"AllocationCensus"` options.
+ *
+ * `"Shared"` Tensor arguments are copied into the worker, and changes made during the call are written back
+ * to the kernel's Tensor when the call returns. A class that keeps a `"Shared"` Tensor keeps only this copy:
+ * after the call, the copy and the kernel's Tensor no longer affect each other.
+ *
+ * Only POSIX systems (Linux and OS X) are supported.
+ */
+
+#include "LTemplate.h"
+
+#ifdef _WIN32
+#error The LTemplate worker process mode is not available on Windows.
+#endif
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#ifndef LTEMPLATE_STANDALONE
+#include <spawn.h>
+#include <dlfcn.h>
+#endif
+
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+#include <utility>
+#include <sstream>
+
+#ifndef LTEMPLATE_STANDALONE
+extern char **environ;
+#endif
+
+/// Size of each of the request and response buffers shared with the worker process, in bytes.
+#ifndef LTEMPLATE_WORKER_BUFFER_SIZE
+#define LTEMPLATE_WORKER_BUFFER_SIZE (size_t(16) << 20)
+#endif
+
+namespace mma {
+namespace detail { // private
+
+    /////////////////  SHARED CHANNEL  /////////////////
+
+    /* Header of the shared memory segment connecting the library with the worker.
+     * It is followed by the request buffer and the response buffer, each of size `capacity`.
+     *
+     * Calls are synchronous, as the kernel waits for each library function to return.
+     * Therefore a single request and a single response slot is sufficient. Each side
+     * signals the other by incrementing a sequence number.
+     */
+    struct WorkerChannel {
+        std::atomic<uint32_t> request;   // incremented by the library after writing a request
+        std::atomic<uint32_t> response;  // incremented by the worker after writing a response
+        std::atomic<uint32_t> waiters;   // number of processes sleeping on a sequence number
+        std::atomic<uint32_t> abort;     // set by the library when the user aborts the computation
+        uint64_t capacity;
+    };
+
+    const size_t workerHeaderSize = 4096;
+
+    inline char *workerRequestBuffer(WorkerChannel *ch) { return reinterpret_cast<char *>(ch) + workerHeaderSize; }
+    inline char *workerResponseBuffer(WorkerChannel *ch) { return workerRequestBuffer(ch) + ch->capacity; }
+
+    enum WorkerOp { WO_Create = 1, WO_Destroy, WO_Call, WO_Shutdown };
+
+    enum WorkerTag { WT_Integer = 1, WT_Real, WT_Complex, WT_Boolean, WT_String, WT_Tensor, WT_Void };
+
+    enum WorkerOutput { WM_Print = 1, WM_Message, WM_LibraryMessage };
+
+    /// How a Tensor argument was passed by the kernel
+    enum WorkerPassing { WP_Automatic, WP_Shared, WP_Manual };
+
+
+    inline void workerPause() {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+
+    /* Waits until `word` is different from `old`, or until roughly `timeout_us` microseconds have passed.
+     * Returns true if the value has changed.
+     *
+     * To keep latency low, it spins for a short time first, unless there is only a single CPU,
+     * where spinning would only delay the other process. It then sleeps on a futex on Linux,
+     * and polls with short sleeps on other systems.
+     */
+    inline bool workerWait(WorkerChannel *ch, std::atomic<uint32_t> &word, uint32_t old, long timeout_us) {
+        typedef std::chrono::steady_clock clock;
+        static const bool spin = sysconf(_SC_NPROCESSORS_ONLN) > 1;
+        const auto spin_until = clock::now() + std::chrono::microseconds(spin ? 50 : 0);
+        do {
+            for (int i=0; i < 64; ++i) {
+                if (word.load(std::memory_order_acquire) != old)
+                    return true;
+                workerPause();
+            }
+        } while (clock::now() < spin_until);
+
+        ch->waiters.fetch_add(1);
+#ifdef __linux__
+        struct timespec ts = { timeout_us / 1000000, (timeout_us % 1000000) * 1000 };
+        syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAIT, old, &ts, NULL, 0);
+#else
+        struct timespec ts = { 0, 20000 };
+        for (long waited = 0; waited < timeout_us && word.load() == old; waited += 20)
+            nanosleep(&ts, NULL);
+#endif
+        ch->waiters.fetch_sub(1);
+
+        return word.load(std::memory_order_acquire) != old;
+    }
+
+    inline void workerNotify(WorkerChannel *ch, std::atomic<uint32_t> &word) {
+        word.fetch_add(1);
+#ifdef __linux__
+        if (ch->waiters.load() > 0)
+            syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+    }
+
+
+    // A memory mapped shared memory segment
+    struct WorkerMapping {
+        void *addr;
+        size_t size;
+    };
+
+    inline WorkerMapping workerMapSegment(const std::string &name, bool create, size_t size) {
+        int fd = shm_open(name.c_str(), create ? (O_CREAT | O_EXCL | O_RDWR) : O_RDWR, 0600);
+        if (fd == -1)
+            throw LibraryError("Worker: shm_open() failed: " + std::string(std::strerror(errno)));
+        if (create) {
+            if (ftruncate(fd, size) == -1) {
+                int errnum = errno;
+                close(fd);
+                shm_unlink(name.c_str());
+                throw LibraryError("Worker: ftruncate() failed: " + std::string(std::strerror(errnum)));
+            }
+        } else {
+            struct stat st;
+            if (fstat(fd, &st) == -1) {
+                int errnum = errno;
+                close(fd);
+                throw LibraryError("Worker: fstat() failed: " + std::string(std::strerror(errnum)));
+            }
+            size = st.st_size;
+        }
+        void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        int errnum = errno;
+        close(fd);
+        if (addr == MAP_FAILED) {
+            if (create)
+                shm_unlink(name.c_str());
+            throw LibraryError("Worker: mmap() failed: " + std::string(std::strerror(errnum)));
+        }
+        WorkerMapping m = { addr, size };
+        return m;
+    }
+
+    // The address of the counter distinguishes the names used by different libraries loaded into the same process.
+    inline std::string workerSegmentName(const char *kind) {
+        static unsigned counter = 0;
+        std::ostringstream name;
+        name << "/ltemplate-" << kind << '-' << getpid() << '-' << std::hex << reinterpret_cast<uintptr_t>(&counter) << '-' << counter++;
+        return name.str();
+    }
+
+
+    /////////////////  ENCODING  /////////////////
+
+    /* Writes values sequentially into a request or response buffer.
+     *
+     * Blobs (Tensor data and strings) that do not fit are placed in separate shared memory segments.
+     * The writer keeps these mapped until reset(). The reading side unlinks each segment as soon as
+     * it has mapped it. In case the worker never read them, segments referenced by a request are also
+     * unlinked by the library on reset(). The worker unlinks the segments of a response that it discard()s.
+     */
+    class WorkerWriter {
+        char *base;
+        size_t capacity;
+        size_t pos;
+        bool unlink_overflow;
+        std::vector<std::pair<std::string, WorkerMapping>> overflow;
+
+        // Tensor data to copy back into the kernel's Tensors after the call, for "Shared" passing
+        std::vector<std::pair<void *, std::pair<void *, size_t>>> copy_back;
+
+        void align(size_t a) { pos = (pos + a - 1) / a * a; }
+
+        void *reserve(size_t n, size_t a) {
+            align(a);
+            if (pos + n > capacity)
+                throw LibraryError("Worker: shared buffer is full. Increase LTEMPLATE_WORKER_BUFFER_SIZE.", LIBRARY_MEMORY_ERROR);
+            void *p = base + pos;
+            pos += n;
+            return p;
+        }
+
+    public:
+        WorkerWriter(char *base, size_t capacity, bool unlink_overflow) :
+            base(base), capacity(capacity), pos(0), unlink_overflow(unlink_overflow)
+        { }
+
+        ~WorkerWriter() { reset(); }
+
+        WorkerWriter(const WorkerWriter &) = delete;
+        WorkerWriter & operator = (const WorkerWriter &) = delete;
+
+        void reset() {
+            for (const auto &seg : overflow) {
+                munmap(seg.second.addr, seg.second.size);
+                if (unlink_overflow)
+                    shm_unlink(seg.first.c_str());
+            }
+            overflow.clear();
+            copy_back.clear();
+            pos = 0;
+        }
+
+        // Like reset(), but also unlink the overflow segments, as they will never be read
+        void discard() {
+            for (const auto &seg : overflow)
+                shm_unlink(seg.first.c_str());
+            reset();
+        }
+
+        size_t size() const { return pos; }
+
+        template<typename T>
+        void put(const T &val) {
+            static_assert(std::is_trivially_copyable<T>::value, "Only trivially copyable types can be sent to the worker.");
+            std::memcpy(reserve(sizeof(T), 8), &val, sizeof(T));
+        }
+
+        // Reserve a slot to be filled in later using at()
+        size_t placeholder() { put<uint64_t>(0); return pos - sizeof(uint64_t); }
+
+        template<typename T>
+        void at(size_t offset, const T &val) { std::memcpy(base + offset, &val, sizeof(T)); }
+
+        // Write n bytes, returns a pointer to their copy in shared memory.
+        void *putBlob(const void *data, size_t n) {
+            const size_t inline_limit = capacity / 4;
+            if (n <= inline_limit && (pos + n + 128) <= capacity) {
+                put<uint64_t>(0);
+                put<uint64_t>(n);
+                void *p = reserve(n, 64);
+                std::memcpy(p, data, n);
+                return p;
+            } else {
+                std::string name = workerSegmentName("blob");
+                WorkerMapping m = workerMapSegment(name, true, n > 0 ? n : 1);
+                overflow.push_back(std::make_pair(name, m));
+                std::memcpy(m.addr, data, n);
+                put<uint64_t>(1);
+                put<uint64_t>(n);
+                put<uint64_t>(name.size());
+                std::memcpy(reserve(name.size(), 1), name.data(), name.size());
+                return m.addr;
+            }
+        }
+
+        void putInteger(mint x)      { put<uint64_t>(WT_Integer); put(x); }
+        void putReal(double x)       { put<uint64_t>(WT_Real); put(x); }
+        void putComplex(complex_t x) { put<uint64_t>(WT_Complex); put(x.real()); put(x.imag()); }
+        void putBoolean(bool x)      { put<uint64_t>(WT_Boolean); put<mint>(x); }
+        void putVoid()               { put<uint64_t>(WT_Void); }
+
+        void putString(const char *str) {
+            put<uint64_t>(WT_String);
+            putBlob(str, std::strlen(str) + 1);
+        }
+
+        void putString(const std::string &str) {
+            put<uint64_t>(WT_String);
+            putBlob(str.c_str(), str.size() + 1);
+        }
+
+        template<typename T>
+        void putTensor(const TensorRef<T> &t, WorkerPassing passing = WP_Automatic) {
+            put<uint64_t>(WT_Tensor);
+            put<mint>(t.type());
+            put<mint>(passing);
+            put<mint>(t.rank());
+            for (mint i=0; i < t.rank(); ++i)
+                put<mint>(t.dimensions()[i]);
+            void *p = putBlob(t.data(), t.length()*sizeof(T));
+            if (passing == WP_Shared)
+                copy_back.push_back(std::make_pair(static_cast<void *>(t.data()), std::make_pair(p, t.length()*sizeof(T))));
+        }
+
+        // Copy modified "Shared" Tensors back to the kernel's Tensors
+        void copyBack() {
+            for (const auto &cb : copy_back)
+                std::memcpy(cb.first, cb.second.first, cb.second.second);
+        }
+    };
+
+
+    // Reads values written by a WorkerWriter
+    class WorkerReader {
+        char *base;
+        size_t pos;
+        bool unlink_overflow;
+        std::vector<WorkerMapping> mappings;
+        std::vector<MTensor> borrowed;
+
+        // Copy of a "Shared" Tensor and the location of the original data in shared memory
+        struct SharedCopy {
+            MTensor tensor;
+            const void *data;
+            void *original;
+            size_t size;
+        };
+        std::vector<SharedCopy> shared;
+
+        void align(size_t a) { pos = (pos + a - 1) / a * a; }
+
+        void expect(WorkerTag tag) {
+            if (get<uint64_t>() != uint64_t(tag))
+                throw LibraryError("Worker: protocol error, unexpected value type.");
+        }
+
+    public:
+        WorkerReader(char *base, bool unlink_overflow) : base(base), pos(0), unlink_overflow(unlink_overflow) { }
+
+        ~WorkerReader() { release(); }
+
+        WorkerReader(const WorkerReader &) = delete;
+        WorkerReader & operator = (const WorkerReader &) = delete;
+
+        // Unmap overflow segments and release borrowed and shared Tensors
+        void release() {
+#ifdef LTEMPLATE_STANDALONE
+            for (const auto &t : borrowed)
+                standaloneReleaseBorrowed(t);
+            for (const auto &sh : shared)
+                standaloneReleaseShared(sh.tensor);
+#endif
+            borrowed.clear();
+            shared.clear();
+            for (const auto &m : mappings)
+                munmap(m.addr, m.size);
+            mappings.clear();
+        }
+
+        void seek(size_t offset) { pos = offset; }
+
+        template<typename T>
+        T get() {
+            align(8);
+            T val;
+            std::memcpy(&val, base + pos, sizeof(T));
+            pos += sizeof(T);
+            return val;
+        }
+
+        char *getBlob(size_t &n) {
+            uint64_t kind = get<uint64_t>();
+            n = get<uint64_t>();
+            if (kind == 0) {
+                align(64);
+                char *p = base + pos;
+                pos += n;
+                return p;
+            } else {
+                size_t len = get<uint64_t>();
+                std::string name(base + pos, len);
+                pos += len;
+                WorkerMapping m = workerMapSegment(name, false, 0);
+                if (unlink_overflow)
+                    shm_unlink(name.c_str());
+                mappings.push_back(m);
+                return static_cast<char *>(m.addr);
+            }
+        }
+
+        mint getInteger()   { expect(WT_Integer); return get<mint>(); }
+        double getReal()    { expect(WT_Real); return get<double>(); }
+        bool getBoolean()   { expect(WT_Boolean); return get<mint>() != 0; }
+        void getVoid()      { expect(WT_Void); }
+
+        complex_t getComplex() {
+            expect(WT_Complex);
+            double re = get<double>();
+            double im = get<double>();
+            return complex_t(re, im);
+        }
+
+        // The string remains valid until release() is called
+        const char *getString() {
+            expect(WT_String);
+            size_t n;
+            return getBlob(n);
+        }
+
+        /* Worker side: a Tensor referring to the data in shared memory.
+         * "Manual" and "Shared" Tensors are copied, as the receiving function may keep them.
+         * Changes to "Shared" Tensors are written back by copyShared().
+         */
+        template<typename T>
+        TensorRef<T> getTensor() {
+#ifdef LTEMPLATE_STANDALONE
+            expect(WT_Tensor);
+            mint type = get<mint>();
+            if (type != libraryType<T>())
+                throw LibraryError("Worker: protocol error, unexpected Tensor type.");
+            mint passing = get<mint>();
+            mint rank = get<mint>();
+            std::vector<mint> dims(rank);
+            for (auto &d : dims)
+                d = get<mint>();
+            size_t n;
+            char *data = getBlob(n);
+            MTensor mt = standaloneBorrowTensor(type, rank, dims.data(), data);
+            borrowed.push_back(mt);
+            if (passing == WP_Manual)
+                return TensorRef<T>(mt).clone();
+            if (passing == WP_Shared) {
+                TensorRef<T> copy = standaloneShareTensor(mt);
+                SharedCopy sh = { copy.tensor(), copy.data(), data, n };
+                shared.push_back(sh);
+                return copy;
+            }
+            return mt;
+#else
+            static_assert(std::is_same<T, T&>::value, "WorkerReader::getTensor() is only available in the worker.");
+            return TensorRef<T>(nullptr);
+#endif
+        }
+
+        // Worker side: write the contents of "Shared" Tensors back into shared memory after the call
+        void copyShared() {
+            for (const auto &sh : shared)
+                std::memcpy(sh.original, sh.data, sh.size);
+        }
+
+        // Library side: copy into a new Tensor owned by the kernel
+        template<typename T>
+        TensorRef<T> copyTensor() {
+            expect(WT_Tensor);
+            mint type = get<mint>();
+            if (type != libraryType<T>())
+                throw LibraryError("Worker: protocol error, unexpected Tensor type.");
+            get<mint>(); // passing, unused in responses
+            mint rank = get<mint>();
+            std::vector<mint> dims(rank);
+            for (auto &d : dims)
+                d = get<mint>();
+            size_t n;
+            char *data = getBlob(n);
+            TensorRef<T> t = makeTensor<T>(rank, dims.data());
+            std::memcpy(t.data(), data, n);
+            return t;
+        }
+
+        // Translate an instance ID to an object, for LExpressionID arguments
+        template<typename Class>
+        Class &getObject(std::map<mint, Class *> &collection) {
+            auto it = collection.find(getInteger());
+            if (it == collection.end())
+                throw LibraryError("Managed library expression instance does not exist.");
+            return *(it->second);
+        }
+    };
+
+
+#ifndef LTEMPLATE_STANDALONE
+
+    /////////////////  LIBRARY SIDE  /////////////////
+
+    // Internal linkage, so that each library finds its own location with dladdr()
+    static const char workerLibraryAnchor = 0;
+
+    // Disowns a "UTF8String" argument of a proxy function when it goes out of scope
+    class WorkerStringArgument {
+        const char *str;
+
+    public:
+        explicit WorkerStringArgument(const char *str) : str(str) { }
+        ~WorkerStringArgument() { disownString(str); }
+
+        WorkerStringArgument(const WorkerStringArgument &) = delete;
+        WorkerStringArgument & operator = (const WorkerStringArgument &) = delete;
+    };
+
+    /* Starts and talks to the worker process, used by the generated library functions.
+     *
+     * The worker executable must be located next to the library, and must be named <libname>-worker.
+     * It is started on first use, and restarted on the first use after a crash.
+     */
+    class WorkerClient {
+        const std::string libname;
+        pid_t pid;
+        WorkerChannel *channel;
+        size_t mapsize;
+        WorkerWriter *request;
+        WorkerReader *response;
+        std::string result_string;
+
+        std::vector<std::set<mint>> live;  // instances that exist in the current worker, for each class
+        std::vector<std::set<mint>> lost;  // instances lost in a crash, for each class
+
+        std::string executablePath() {
+            Dl_info info;
+            if (! dladdr(&workerLibraryAnchor, &info) || info.dli_fname == NULL)
+                throw LibraryError("Worker: cannot determine the location of the library.");
+            std::string path = info.dli_fname;
+            size_t sep = path.rfind('/');
+            path = (sep == std::string::npos ? std::string() : path.substr(0, sep+1)) + libname + "-worker";
+            return path;
+        }
+
+        void start() {
+            std::string path = executablePath();
+            std::string name = workerSegmentName("worker");
+            WorkerMapping m = workerMapSegment(name, true, workerHeaderSize + 2*LTEMPLATE_WORKER_BUFFER_SIZE);
+            channel = new (m.addr) WorkerChannel;
+            channel->capacity = LTEMPLATE_WORKER_BUFFER_SIZE;
+            mapsize = m.size;
+
+            char *argv[] = { const_cast<char *>(path.c_str()), const_cast<char *>(name.c_str()), NULL };
+            int err = posix_spawn(&pid, path.c_str(), NULL, NULL, argv, environ);
+            if (err) {
+                shm_unlink(name.c_str());
+                unmap();
+                throw LibraryError("Worker: cannot start " + path + ": " + std::strerror(err));
+            }
+
+            // The worker signals that it is ready by incrementing the response sequence number.
+            const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+            while (! workerWait(channel, channel->response, 0, 10000)) {
+                int status;
+                if (exited(status) || std::chrono::steady_clock::now() > deadline) {
+                    kill(pid, SIGKILL);
+                    waitpid(pid, &status, 0);
+                    shm_unlink(name.c_str());
+                    unmap();
+                    throw LibraryError("Worker: " + path + " failed to start.");
+                }
+            }
+            shm_unlink(name.c_str()); // both processes have it mapped, the name is no longer needed
+
+            request  = new WorkerWriter(workerRequestBuffer(channel), channel->capacity, true);
+            response = new WorkerReader(workerResponseBuffer(channel), true);
+        }
+
+        void unmap() {
+            delete request;
+            delete response;
+            request = NULL;
+            response = NULL;
+            if (channel)
+                munmap(channel, mapsize);
+            channel = NULL;
+            pid = 0;
+        }
+
+        // Non-blocking check for the termination of the worker process.
+        // If the host ignores SIGCHLD, or the worker was reaped elsewhere, waitpid() fails with ECHILD.
+        // The worker is gone in that case too, but its exit status is unknown and is set to -1.
+        bool exited(int &status) {
+            const pid_t res = waitpid(pid, &status, WNOHANG);
+            if (res == pid)
+                return true;
+            if (res == -1 && errno == ECHILD) {
+                status = -1;
+                return true;
+            }
+            return false;
+        }
+
+        // Called when the worker process has terminated unexpectedly
+        void crashed(int status) {
+            for (size_t i=0; i < live.size(); ++i) {
+                lost[i].insert(live[i].begin(), live[i].end());
+                live[i].clear();
+            }
+            unmap();
+
+            std::ostringstream msg;
+            msg << "The worker process of " << libname << " terminated unexpectedly";
+            if (status == -1)
+                ; // exit status not available
+            else if (WIFSIGNALED(status))
+                msg << " with signal " << WTERMSIG(status);
+            else if (WIFEXITED(status))
+                msg << " with exit code " << WEXITSTATUS(status);
+            msg << ". All existing instances were lost. A new worker process will be started on the next call.";
+            throw LibraryError(msg.str());
+        }
+
+        // Send the request and wait for the response. Returns the error code reported by the worker.
+        int transact(const char *funname) {
+            const uint32_t old = channel->response.load();
+            workerNotify(channel, channel->request);
+
+            bool aborted = false;
+            while (! workerWait(channel, channel->response, old, 10000)) {
+                int status;
+                if (exited(status))
+                    crashed(status);
+                if (! aborted && libData->AbortQ()) {
+                    channel->abort.store(1);
+                    aborted = true;
+                }
+            }
+            channel->abort.store(0);
+
+            response->release();
+            response->seek(0);
+            const mint err = response->get<mint>();
+            const size_t messages = response->get<uint64_t>();
+            replayOutput(messages);
+            (void) funname;
+            return err;
+        }
+
+        // Forward output produced by the worker to the kernel
+        void replayOutput(size_t offset) {
+            WorkerReader out(workerResponseBuffer(channel), true);
+            out.seek(offset);
+            const uint64_t count = out.get<uint64_t>();
+            for (uint64_t i=0; i < count; ++i) {
+                const uint64_t kind = out.get<uint64_t>();
+                const mint type = out.get<mint>();
+                const char *text = out.getString();
+                switch (kind) {
+                case WM_Print:          print(text); break;
+                case WM_Message:        message(text, MessageType(type)); break;
+                case WM_LibraryMessage: libData->Message(text); break;
+                }
+            }
+        }
+
+        void checkInstance(size_t cls, mint id) {
+            if (lost[cls].count(id))
+                throw LibraryError("This instance was lost when the worker process terminated.");
+            if (! live[cls].count(id)) {
+                libData->Message("noinst");
+                throw LibraryError();
+            }
+        }
+
+        void ensureStarted() {
+            if (! channel)
+                start();
+        }
+
+    public:
+        WorkerClient(const char *libname, size_t nclasses) :
+            libname(libname), pid(0), channel(NULL), mapsize(0), request(NULL), response(NULL),
+            live(nclasses), lost(nclasses)
+        { }
+
+        ~WorkerClient() { shutdown(); }
+
+        WorkerClient(const WorkerClient &) = delete;
+        WorkerClient & operator = (const WorkerClient &) = delete;
+
+        // Stop the worker process. Called when the library is unloaded.
+        void shutdown() {
+            if (! channel)
+                return;
+            request->reset();
+            request->put<uint64_t>(WO_Shutdown);
+            const uint32_t old = channel->response.load();
+            workerNotify(channel, channel->request);
+            for (int i=0; i < 100 && ! workerWait(channel, channel->response, old, 10000); ++i)
+                ;
+            int status;
+            if (! exited(status)) {
+                kill(pid, SIGKILL);
+                waitpid(pid, &status, 0);
+            }
+            unmap();
+        }
+
+        // Library expression manager
+        void manage(size_t cls, mbool mode, mint id) {
+            if (mode == 0) { // create
+                try {
+                    ensureStarted();
+                    request->reset();
+                    request->put<uint64_t>(WO_Create);
+                    request->put<uint64_t>(cls);
+                    request->put<mint>(id);
+                    if (transact("create") == LIBRARY_NO_ERROR)
+                        live[cls].insert(id);
+                    else
+                        lost[cls].insert(id);
+                } catch (const LibraryError &err) {
+                    lost[cls].insert(id);
+                    err.report();
+                }
+            } else { // destroy
+                if (lost[cls].erase(id))
+                    return;
+                if (! live[cls].count(id)) {
+                    libData->Message("noinst");
+                    return;
+                }
+                live[cls].erase(id);
+                try {
+                    request->reset();
+                    request->put<uint64_t>(WO_Destroy);
+                    request->put<uint64_t>(cls);
+                    request->put<mint>(id);
+                    transact("destroy");
+                } catch (const LibraryError &err) {
+                    err.report();
+                }
+            }
+        }
+
+        // IDs of all instances of a class, for LExpressionList
+        IntTensorRef collection(size_t cls) {
+            IntTensorRef ids = makeVector<mint>(live[cls].size() + lost[cls].size());
+            std::set<mint> all(live[cls]);
+            all.insert(lost[cls].begin(), lost[cls].end());
+            std::copy(all.begin(), all.end(), ids.begin());
+            return ids;
+        }
+
+        // Start a function call, then write arguments into the returned writer
+        WorkerWriter &beginCall(size_t cls, size_t fun, mint id) {
+            checkInstance(cls, id);
+            ensureStarted();
+            request->reset();
+            request->put<uint64_t>(WO_Call);
+            request->put<uint64_t>(cls);
+            request->put<uint64_t>(fun);
+            request->put<mint>(id);
+            return *request;
+        }
+
+        // Perform the call started with beginCall(). Returns the error code of the function.
+        int call(const char *funname) {
+            int err = transact(funname);
+            if (err == LIBRARY_NO_ERROR)
+                request->copyBack();
+            return err;
+        }
+
+        // The return value, valid after a successful call()
+        WorkerReader &result() { return *response; }
+
+        // Keep a string result alive after the call returns
+        const char *keepString(const char *str) {
+            result_string = str;
+            return result_string.c_str();
+        }
+    };
+
+#endif // LTEMPLATE_STANDALONE
+
+
+#ifdef LTEMPLATE_STANDALONE
+
+    /////////////////  WORKER SIDE  /////////////////
+
+    typedef void (*WorkerFunctionPointer)(mint id, WorkerReader &args, WorkerWriter &res);
+
+    struct WorkerFunction {
+        const char *name;
+        WorkerFunctionPointer fun;
+    };
+
+    struct WorkerClass {
+        const char *name;
+        void (*manager)(WolframLibraryData, mbool, mint);
+        const WorkerFunction *funs;
+        size_t nfuns;
+    };
+
+    struct WorkerOutputItem {
+        WorkerOutput kind;
+        MessageType type;
+        std::string text;
+    };
+
+    // State of the worker process, accessed by the output hooks
+    struct WorkerState {
+        WorkerChannel *channel;
+        std::vector<WorkerOutputItem> output;
+    };
+
+    inline WorkerState &workerState() {
+        static WorkerState state;
+        return state;
+    }
+
+    inline void workerPrint(const char *msg) {
+        WorkerOutputItem item = { WM_Print, M_INFO, msg };
+        workerState().output.push_back(item);
+    }
+
+    inline void workerMessage(const char *msg, MessageType type) {
+        WorkerOutputItem item = { WM_Message, type, msg };
+        workerState().output.push_back(item);
+    }
+
+    inline void workerLibraryMessage(const char *tag) {
+        WorkerOutputItem item = { WM_LibraryMessage, M_INFO, tag };
+        workerState().output.push_back(item);
+    }
+
+    inline bool workerAbortQ() { return workerState().channel->abort.load() != 0; }
+
+    /* Send a returned Tensor to the library. Tensors created by the function are freed,
+     * unless they were returned with "Shared" passing, i.e. the class keeps them.
+     */
+    template<typename T>
+    inline void workerReturnTensor(WorkerWriter &res, const TensorRef<T> &t, bool shared) {
+        res.putTensor(t);
+        if (! shared && ! standaloneBorrowedQ(t.tensor()))
+            t.free();
+    }
+
+    // Run a single request. Returns the error code to send back.
+    inline int workerHandle(const WorkerClass *classes, size_t nclasses, WorkerReader &req, WorkerWriter &res) {
+        const uint64_t op = req.get<uint64_t>();
+        const uint64_t cls = req.get<uint64_t>();
+        if (cls >= nclasses)
+            throw LibraryError("Worker: protocol error, invalid class index.");
+        const WorkerClass &c = classes[cls];
+
+        switch (op) {
+        case WO_Create:
+        case WO_Destroy:
+            c.manager(libData, op == WO_Destroy, req.get<mint>());
+            return LIBRARY_NO_ERROR;
+        case WO_Call: {
+            const uint64_t fun = req.get<uint64_t>();
+            if (fun >= c.nfuns)
+                throw LibraryError("Worker: protocol error, invalid function index.");
+            const mint id = req.get<mint>();
+            const char *funname = c.funs[fun].name;
+            try {
+                c.funs[fun].fun(id, req, res);
+                req.copyShared();
+            }
+            catch (const LibraryError &libErr) {
+                libErr.report();
+                return libErr.error_code();
+            }
+            catch (const std::exception &exc) {
+                handleUnknownException(exc.what(), funname);
+                return LIBRARY_FUNCTION_ERROR;
+            }
+            catch (...) {
+                handleUnknownException(NULL, funname);
+                return LIBRARY_FUNCTION_ERROR;
+            }
+            return LIBRARY_NO_ERROR;
+        }
+        default:
+            throw LibraryError("Worker: protocol error, invalid operation.");
+        }
+    }
+
+    // Write the output section of the response, and clear the output
+    inline void workerPutOutput(WorkerWriter &res) {
+        WorkerState &state = workerState();
+        res.put<uint64_t>(state.output.size());
+        for (const auto &item : state.output) {
+            res.put<uint64_t>(item.kind);
+            res.put<mint>(item.type);
+            res.putString(item.text.c_str());
+        }
+        state.output.clear();
+    }
+
+    /* Main loop of the worker executable.
+     *
+     * Response layout: error code, offset of the output section, return value, output section.
+     */
+    inline int workerMain(int argc, char *argv[], const WorkerClass *classes, size_t nclasses) {
+        if (argc != 2) {
+            std::fprintf(stderr, "This program is started automatically by the %s library.\n", argc > 0 ? argv[0] : "LTemplate");
+            return 1;
+        }
+
+        standaloneInitialize();
+
+        WorkerMapping m;
+        try {
+            m = workerMapSegment(argv[1], false, 0);
+        } catch (const LibraryError &err) {
+            std::fprintf(stderr, "%s\n", err.message().c_str());
+            return 1;
+        }
+        WorkerChannel *ch = static_cast<WorkerChannel *>(m.addr);
+        WorkerState &state = workerState();
+        state.channel = ch;
+
+        StandaloneHooks &hooks = standaloneHooks();
+        hooks.print = workerPrint;
+        hooks.message = workerMessage;
+        hooks.libraryMessage = workerLibraryMessage;
+        hooks.abortQ = workerAbortQ;
+
+        const pid_t parent = getppid();
+        WorkerReader req(workerRequestBuffer(ch), true);
+        WorkerWriter res(workerResponseBuffer(ch), ch->capacity, false);
+
+        uint32_t seen = ch->request.load();
+        workerNotify(ch, ch->response); // ready
+
+        for (;;) {
+            while (! workerWait(ch, ch->request, seen, 200000))
+                if (getppid() != parent)
+                    return 0; // the kernel is gone
+            seen = ch->request.load();
+
+            req.release();
+            req.seek(0);
+            res.reset();
+
+            if (req.get<uint64_t>() == WO_Shutdown) {
+                workerNotify(ch, ch->response);
+                return 0;
+            }
+            req.seek(0);
+
+            mint err;
+            try {
+                const size_t err_slot = res.placeholder();
+                const size_t output_slot = res.placeholder();
+                err = workerHandle(classes, nclasses, req, res);
+                mout.flush();
+                if (err != LIBRARY_NO_ERROR) { // the library does not read the result, drop what was written of it
+                    res.discard();
+                    res.placeholder();
+                    res.placeholder();
+                }
+                res.at(err_slot, err);
+                res.at(output_slot, uint64_t(res.size()));
+                workerPutOutput(res);
+            } catch (const LibraryError &libErr) {
+                // Protocol errors, and a result or output that does not fit into the response
+                res.discard();
+                state.output.clear();
+                libErr.report();
+                err = libErr.error_code();
+                res.put<mint>(err);
+                res.put<uint64_t>(2*sizeof(uint64_t));
+                workerPutOutput(res);
+            }
+
+            workerNotify(ch, ch->response);
+        }
+    }
+
+#endif // LTEMPLATE_STANDALONE
+
+} // namespace detail
+} // namespace mma
+
+#endif // LTEMPLATE_WORKER_H
@@ -0,0 +1,231 @@
+/*
+ * Copyright (c) 2018 Szabolcs Horvát.
+ *
+ * See the file LICENSE.txt for copying permission.
+ */
+
+#ifndef EIGENMAP_H
+#define EIGENMAP_H
+
+/** \file eigenmap.h
+ * \brief Auxiliary header for LTemplate providing zero-copy Eigen views of Tensors and sparse matrices.
+ *
+ * LTemplate itself does not depend on eigenmap.h, so if you don't use this header,
+ * feel free to remove it from your project. It requires the [Eigen](http://eigen.tuxfamily.org/) library.
+ *
+ * _Mathematica_ stores matrices in row-major order. The views created by this header use Eigen's
+ * `RowMajor` storage option, so no transposition is needed: `eigenMap(m)(i,j)` is the same element as `m(i,j)`.
+ *
+ *  - \ref mma::eigenMap() wraps a \ref mma::MatrixRef or \ref mma::TensorRef as an `Eigen::Map`, without copying.
+ *  - \ref mma::makeMatrixFromEigen() and \ref mma::makeVectorFromEigen() create a new Tensor and let Eigen
+ *    compute a result directly into it. The Tensor can then be returned without copying.
+ *  - \ref mma::EigenSparseView wraps a \ref mma::SparseMatrixRef as an `Eigen::Map` of a row-major
+ *    `Eigen::SparseMatrix`. _Mathematica_ uses 1-based column indices, so these are converted once
+ *    and kept for as long as the view exists. Values and row pointers are not copied.
+ *
+ * Example usage:
+ * \code
+ * mma::RealTensorRef solve(mma::RealMatrixRef a, mma::RealTensorRef b) {
+ *     auto lu = mma::eigenMap(a).partialPivLu();
+ *     return mma::makeVectorFromEigen<double>(a.cols(), [&] (mma::EigenVectorMap<double> &x) {
+ *         x = lu.solve(mma::eigenMap(b));
+ *     });
+ * }
+ *
+ * // A class that keeps a sparse matrix passed as "Shared", together with its Eigen view
+ * class Operator {
+ *     std::unique_ptr<mma::EigenSparseView<double>> op;
+ *
+ * public:
+ *     void set(mma::SparseMatrixRef<double> sm) { // index conversion happens only here
+ *         if (op)
+ *             op->sparseMatrix().disown();
+ *         op.reset(new mma::EigenSparseView<double>(sm));
+ *     }
+ *
+ *     mma::RealTensorRef apply(mma::RealTensorRef v) {
+ *         return mma::makeVectorFromEigen<double>(op->rows(), [&] (mma::EigenVectorMap<double> &res) {
+ *             res.noalias() = op->map() * mma::eigenMap(v);
+ *         });
+ *     }
+ * };
+ * \endcode
+ */
+
+#include "LTemplate.h"
+
+#include <Eigen/Core>
+#include <Eigen/SparseCore>
+
+#include <vector>
+
+namespace mma {
+
+/// Dynamic size Eigen matrix with the same memory layout as a _Mathematica_ matrix
+template<typename T>
+using EigenMatrix = Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
+
+/// Dynamic size Eigen column vector
+template<typename T>
+using EigenVector = Eigen::Matrix<T, Eigen::Dynamic, 1>;
+
+/// Eigen view of a \ref MatrixRef
+template<typename T>
+using EigenMatrixMap = Eigen::Map<EigenMatrix<T>>;
+
+/// Eigen view of a \ref TensorRef as a vector
+template<typename T>
+using EigenVectorMap = Eigen::Map<EigenVector<T>>;
+
+
+/// Wrap a matrix as a row-major Eigen matrix without copying
+template<typename T>
+inline EigenMatrixMap<T> eigenMap(const MatrixRef<T> &m) {
+    return EigenMatrixMap<T>(m.data(), m.rows(), m.cols());
+}
+
+/** \brief Wrap a Tensor as an Eigen vector without copying
+ *
+ * Tensors of any rank are viewed as a vector of all their elements, in row-major order.
+ */
+template<typename T>
+inline EigenVectorMap<T> eigenMap(const TensorRef<T> &t) {
+    return EigenVectorMap<T>(t.data(), t.length());
+}
+
+
+/** \brief Create a matrix and let Eigen compute its elements in place
+ *  \param rows is the number of rows
+ *  \param cols is the number of columns
+ *  \param f is a callable taking an `EigenMatrixMap<T> &` that refers to the new matrix
+ *
+ * The result can be returned to _Mathematica_ without copying. If `f` throws, the matrix is freed.
+ * When assigning a product, use `noalias()` to avoid a temporary, e.g. `res.noalias() = a * b`.
+ */
+template<typename T, typename F>
+inline MatrixRef<T> makeMatrixFromEigen(mint rows, mint cols, F f) {
+    auto result = makeMatrix<T>(rows, cols);
+    try {
+        EigenMatrixMap<T> map = eigenMap(result);
+        f(map);
+    } catch (...) {
+        result.free();
+        throw;
+    }
+    return result;
+}
+
+/** \brief Create a vector and let Eigen compute its elements in place
+ *  \param len is the length of the vector
+ *  \param f is a callable taking an `EigenVectorMap<T> &` that refers to the new vector
+ *
+ * The result can be returned to _Mathematica_ without copying. If `f` throws, the vector is freed.
+ */
+template<typename T, typename F>
+inline TensorRef<T> makeVectorFromEigen(mint len, F f) {
+    auto result = makeVector<T>(len);
+    try {
+        EigenVectorMap<T> map = eigenMap(result);
+        f(map);
+    } catch (...) {
+        result.free();
+        throw;
+    }
+    return result;
+}
+
+
+/** \brief Eigen view of a sparse matrix
+ *
+ * Provides an `Eigen::Map` of a row-major `Eigen::SparseMatrix` referring to the row pointers and
+ * explicit values of a \ref SparseMatrixRef. Only the column indices are copied, as _Mathematica_
+ * uses 1-based indices while Eigen uses 0-based ones. The conversion is done once, on construction;
+ * keep the view for as long as the sparse matrix is used to avoid repeating it.
+ *
+ * The view refers to the sparse matrix: it must not be used after the sparse matrix was freed.
+ * Only sparse matrices with implicit value 0 and explicit values are supported.
+ */
+template<typename T>
+class EigenSparseView {
+    SparseMatrixRef<T> sm;
+    std::vector<mint> inner; // 0-based column indices
+
+public:
+    /// The type of the Eigen matrix being viewed
+    typedef Eigen::SparseMatrix<T, Eigen::RowMajor, mint> matrix_type;
+
+    /// The type of the view
+    typedef Eigen::Map<const matrix_type> map_type;
+
+    explicit EigenSparseView(const SparseMatrixRef<T> &sm) : sm(sm) {
+        if (! sm.explicitValuesQ())
+            throw LibraryError("EigenSparseView: pattern arrays are not supported.");
+        if (sm.implicitValue() != T(0))
+            throw LibraryError("EigenSparseView: the implicit value must be zero.");
+
+        const IntTensorRef ci = sm.columnIndices();
+        const mint *cidata = ci.data();
+        const mint n = ci.length();
+        inner.resize(n);
+#ifdef _OPENMP
+        #pragma omp parallel for if (n > 100000)
+#endif
+        for (mint i=0; i < n; ++i)
+            inner[i] = cidata[i] - 1;
+    }
+
+    /// The Eigen view; creating it is cheap
+    map_type map() const {
+        return map_type(sm.rows(), sm.cols(), inner.size(), sm.rowPointers().data(), inner.data(), sm.explicitValues().data());
+    }
+
+    /// The sparse matrix being viewed
+    const SparseMatrixRef<T> &sparseMatrix() const { return sm; }
+
+    /// Number of rows
+    mint rows() const { return sm.rows(); }
+
+    /// Number of columns
+    mint cols() const { return sm.cols(); }
+};
+
+
+/** \brief Create a sparse matrix from an Eigen sparse matrix or expression
+ *
+ * Unlike dense results, SparseArrays can only be created from explicit positions and values,
+ * so this function must copy the data.
+ */
+template<typename Derived>
+inline SparseMatrixRef<typename Derived::Scalar> makeSparseMatrixFromEigen(const Eigen::SparseMatrixBase<Derived> &expr) {
+    typedef typename Derived::Scalar T;
+    const Eigen::SparseMatrix<T, Eigen::RowMajor, mint> m = expr;
+
+    auto pos = makeMatrix<mint>(m.nonZeros(), 2);
+    try {
+        auto vals = makeVector<T>(m.nonZeros());
+        try {
+            mint i = 0;
+            for (mint r=0; r < m.outerSize(); ++r)
+                for (typename Eigen::SparseMatrix<T, Eigen::RowMajor, mint>::InnerIterator it(m, r); it; ++it, ++i) {
+                    pos(i,0) = it.row() + 1; // convert 0-based indices to 1-based
+                    pos(i,1) = it.col() + 1;
+                    vals[i] = it.value();
+                }
+
+            auto sm = makeSparseMatrix(pos, vals, m.rows(), m.cols());
+            vals.free();
+            pos.free();
+            return sm;
+        } catch (...) {
+            vals.free();
+            throw;
+        }
+    } catch (...) {
+        pos.free();
+        throw;
+    }
+}
+
+} // end namespace mma
+
+#endif // EIGENMAP_H
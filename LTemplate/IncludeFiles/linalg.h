@@ -0,0 +1,526 @@
+/*
+ * Copyright (c) 2018 Szabolcs Horvát.
+ *
+ * See the file LICENSE.txt for copying permission.
+ */
+
+#ifndef LINALG_H
+#define LINALG_H
+
+/** \file linalg.h
+ * \brief Auxiliary header for LTemplate providing dense linear algebra on Tensors through CBLAS and LAPACKE.
+ *
+ * LTemplate itself does not depend on linalg.h, so if you don't use this header,
+ * feel free to remove it from your project. It requires a CBLAS and a LAPACKE implementation,
+ * such as OpenBLAS, or the reference BLAS and LAPACK.
+ *
+ * All functions in the \ref mma::linalg namespace work with `double` and `mma::complex_t` matrices,
+ * and take care of _Mathematica_'s row-major storage order. There is no need to transpose
+ * either the inputs or the results, and matrices are used with the same indexing as in _Mathematica_.
+ *
+ * Results are written either into a new Tensor, which can be returned without copying,
+ * or into Tensors supplied by the caller. The factorizations accept the input matrix
+ * as their output as well, in which case they work in place.
+ *
+ * Most of the computations run directly on the Tensor data. Cholesky decomposition, QR decomposition
+ * and the symmetric eigensolvers call LAPACK on the column-major interpretation of the data, i.e. on the
+ * transposed matrix, and adapt the problem accordingly. The exception is LU decomposition, for which
+ * LAPACKE transposes the matrix internally.
+ *
+ * Errors are reported by throwing a \ref mma::LibraryError. Failed computations free any Tensors
+ * they have created.
+ *
+ * Example usage:
+ * \code
+ * // the product of two matrices, returned in a new Tensor
+ * mma::RealMatrixRef dot(mma::RealMatrixRef a, mma::RealMatrixRef b) {
+ *     return mma::linalg::gemm(a, b);
+ * }
+ *
+ * // the Gram matrix a^T a, written into an existing Tensor
+ * mma::linalg::syrk(1.0, a, 0.0, gram, CblasTrans);
+ *
+ * // in-place Cholesky decomposition
+ * mma::linalg::cholesky(a, a);
+ * \endcode
+ */
+
+#include "LTemplate.h"
+
+#include <complex>
+
+// Make LAPACKE use std::complex, which mma::complex_t is an alias of
+#ifndef lapack_complex_float
+#define lapack_complex_float std::complex<float>
+#endif
+#ifndef lapack_complex_double
+#define lapack_complex_double std::complex<double>
+#endif
+
+#include <cblas.h>
+#include <lapacke.h>
+
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <type_traits>
+
+namespace mma {
+
+/// Dense linear algebra through CBLAS and LAPACKE, see linalg.h
+namespace linalg {
+
+namespace detail { // private
+
+    // Used to prevent deducing the template parameter from scalar arguments such as alpha in gemm()
+    template<typename T> struct nondeduced { typedef T type; };
+
+    inline lapack_int lapackInt(mint n) {
+        if (n > std::numeric_limits<lapack_int>::max())
+            throw LibraryError("linalg: the matrix is too large for the BLAS/LAPACK integer type.");
+        return lapack_int(n);
+    }
+
+    // Leading dimension of a row-major matrix; BLAS and LAPACK require at least 1 even for empty matrices
+    inline lapack_int leadingDim(mint cols) { return lapackInt(std::max<mint>(1, cols)); }
+
+    inline void checkInfo(lapack_int info, const char *fun) {
+        if (info == LAPACK_WORK_MEMORY_ERROR || info == LAPACK_TRANSPOSE_MEMORY_ERROR)
+            throw LibraryError(std::string(fun) + ": not enough memory.");
+        if (info < 0)
+            throw LibraryError(std::string(fun) + ": invalid argument passed to LAPACK.");
+    }
+
+    inline bool transposedQ(CBLAS_TRANSPOSE trans) { return trans != CblasNoTrans; }
+
+    template<typename T>
+    inline bool sameQ(const TensorRef<T> &a, const TensorRef<T> &b) { return a.data() == b.data(); }
+
+    inline void conjugate(double *, mint) { }
+
+    inline void conjugate(complex_t *data, mint n) {
+        for (mint i=0; i < n; ++i)
+            data[i] = std::conj(data[i]);
+    }
+
+    // Zero the elements strictly below (lower = true) or above (lower = false) the diagonal
+    template<typename T>
+    inline void zeroTriangle(const MatrixRef<T> &m, bool lower) {
+        for (mint i=0; i < m.rows(); ++i) {
+            if (lower)
+                std::fill(&m(i,0), &m(i,0) + std::min(i, m.cols()), T(0));
+            else if (i+1 < m.cols())
+                std::fill(&m(i,i+1), &m(i,0) + m.cols(), T(0));
+        }
+    }
+
+    // BLAS
+
+    inline void gemm(CBLAS_TRANSPOSE ta, CBLAS_TRANSPOSE tb, lapack_int m, lapack_int n, lapack_int k,
+                     double alpha, const double *a, lapack_int lda, const double *b, lapack_int ldb,
+                     double beta, double *c, lapack_int ldc)
+    {
+        cblas_dgemm(CblasRowMajor, ta, tb, m, n, k, alpha, a, lda, b, ldb, beta, c, ldc);
+    }
+
+    inline void gemm(CBLAS_TRANSPOSE ta, CBLAS_TRANSPOSE tb, lapack_int m, lapack_int n, lapack_int k,
+                     complex_t alpha, const complex_t *a, lapack_int lda, const complex_t *b, lapack_int ldb,
+                     complex_t beta, complex_t *c, lapack_int ldc)
+    {
+        cblas_zgemm(CblasRowMajor, ta, tb, m, n, k, &alpha, a, lda, b, ldb, &beta, c, ldc);
+    }
+
+    inline void gemv(CBLAS_TRANSPOSE ta, lapack_int m, lapack_int n,
+                     double alpha, const double *a, lapack_int lda, const double *x,
+                     double beta, double *y)
+    {
+        cblas_dgemv(CblasRowMajor, ta, m, n, alpha, a, lda, x, 1, beta, y, 1);
+    }
+
+    inline void gemv(CBLAS_TRANSPOSE ta, lapack_int m, lapack_int n,
+                     complex_t alpha, const complex_t *a, lapack_int lda, const complex_t *x,
+                     complex_t beta, complex_t *y)
+    {
+        cblas_zgemv(CblasRowMajor, ta, m, n, &alpha, a, lda, x, 1, &beta, y, 1);
+    }
+
+    inline void syrk(CBLAS_UPLO uplo, CBLAS_TRANSPOSE trans, lapack_int n, lapack_int k,
+                     double alpha, const double *a, lapack_int lda, double beta, double *c, lapack_int ldc)
+    {
+        cblas_dsyrk(CblasRowMajor, uplo, trans, n, k, alpha, a, lda, beta, c, ldc);
+    }
+
+    inline void syrk(CBLAS_UPLO uplo, CBLAS_TRANSPOSE trans, lapack_int n, lapack_int k,
+                     complex_t alpha, const complex_t *a, lapack_int lda, complex_t beta, complex_t *c, lapack_int ldc)
+    {
+        cblas_zsyrk(CblasRowMajor, uplo, trans, n, k, &alpha, a, lda, &beta, c, ldc);
+    }
+
+    // LAPACK
+    // Functions with a uplo argument are called in column-major mode: the caller swaps 'U' and 'L'.
+
+    inline lapack_int potrf(char uplo, lapack_int n, double *a, lapack_int lda) {
+        return LAPACKE_dpotrf(LAPACK_COL_MAJOR, uplo, n, a, lda);
+    }
+
+    inline lapack_int potrf(char uplo, lapack_int n, complex_t *a, lapack_int lda) {
+        return LAPACKE_zpotrf(LAPACK_COL_MAJOR, uplo, n, a, lda);
+    }
+
+    inline lapack_int getrf(lapack_int m, lapack_int n, double *a, lapack_int lda, lapack_int *ipiv) {
+        return LAPACKE_dgetrf(LAPACK_ROW_MAJOR, m, n, a, lda, ipiv);
+    }
+
+    inline lapack_int getrf(lapack_int m, lapack_int n, complex_t *a, lapack_int lda, lapack_int *ipiv) {
+        return LAPACKE_zgetrf(LAPACK_ROW_MAJOR, m, n, a, lda, ipiv);
+    }
+
+    inline lapack_int gelqf(lapack_int m, lapack_int n, double *a, lapack_int lda, double *tau) {
+        return LAPACKE_dgelqf(LAPACK_COL_MAJOR, m, n, a, lda, tau);
+    }
+
+    inline lapack_int gelqf(lapack_int m, lapack_int n, complex_t *a, lapack_int lda, complex_t *tau) {
+        return LAPACKE_zgelqf(LAPACK_COL_MAJOR, m, n, a, lda, tau);
+    }
+
+    inline lapack_int unglq(lapack_int m, lapack_int n, lapack_int k, double *a, lapack_int lda, const double *tau) {
+        return LAPACKE_dorglq(LAPACK_COL_MAJOR, m, n, k, a, lda, tau);
+    }
+
+    inline lapack_int unglq(lapack_int m, lapack_int n, lapack_int k, complex_t *a, lapack_int lda, const complex_t *tau) {
+        return LAPACKE_zunglq(LAPACK_COL_MAJOR, m, n, k, a, lda, tau);
+    }
+
+    inline lapack_int heevd(char jobz, lapack_int n, double *a, lapack_int lda, double *w) {
+        return LAPACKE_dsyevd(LAPACK_COL_MAJOR, jobz, 'L', n, a, lda, w);
+    }
+
+    inline lapack_int heevd(char jobz, lapack_int n, complex_t *a, lapack_int lda, double *w) {
+        return LAPACKE_zheevd(LAPACK_COL_MAJOR, jobz, 'L', n, a, lda, w);
+    }
+
+} // end namespace detail
+
+
+/** \brief General matrix product, `c = alpha op(a) op(b) + beta c`
+ *  \param ta, tb determine `op()`: `CblasNoTrans`, `CblasTrans` or `CblasConjTrans`
+ *  \param c is the output; it must not refer to the same Tensor as `a` or `b`
+ */
+template<typename T>
+inline void gemm(typename detail::nondeduced<T>::type alpha, const MatrixRef<T> &a, const MatrixRef<T> &b,
+                 typename detail::nondeduced<T>::type beta, MatrixRef<T> c,
+                 CBLAS_TRANSPOSE ta = CblasNoTrans, CBLAS_TRANSPOSE tb = CblasNoTrans)
+{
+    const mint m = detail::transposedQ(ta) ? a.cols() : a.rows();
+    const mint k = detail::transposedQ(ta) ? a.rows() : a.cols();
+    const mint n = detail::transposedQ(tb) ? b.rows() : b.cols();
+    if (k != (detail::transposedQ(tb) ? b.cols() : b.rows()) || c.rows() != m || c.cols() != n)
+        throw LibraryError("gemm: incompatible matrix dimensions.");
+    if (detail::sameQ(c, a) || detail::sameQ(c, b))
+        throw LibraryError("gemm: the output must not be one of the inputs.");
+    if (m == 0 || n == 0)
+        return;
+    detail::gemm(ta, tb, detail::lapackInt(m), detail::lapackInt(n), detail::lapackInt(k),
+                 alpha, a.data(), detail::leadingDim(a.cols()), b.data(), detail::leadingDim(b.cols()),
+                 beta, c.data(), detail::leadingDim(c.cols()));
+}
+
+/// General matrix product, `op(a) op(b)`, returned as a new matrix
+template<typename T>
+inline MatrixRef<T> gemm(const MatrixRef<T> &a, const MatrixRef<T> &b,
+                         CBLAS_TRANSPOSE ta = CblasNoTrans, CBLAS_TRANSPOSE tb = CblasNoTrans)
+{
+    if ((detail::transposedQ(ta) ? a.rows() : a.cols()) != (detail::transposedQ(tb) ? b.cols() : b.rows()))
+        throw LibraryError("gemm: incompatible matrix dimensions.");
+    auto c = makeMatrix<T>(detail::transposedQ(ta) ? a.cols() : a.rows(), detail::transposedQ(tb) ? b.rows() : b.cols());
+    try {
+        gemm<T>(1, a, b, 0, c, ta, tb);
+    } catch (...) {
+        c.free();
+        throw;
+    }
+    return c;
+}
+
+
+/** \brief Matrix-vector product, `y = alpha op(a) x + beta y`
+ *  \param ta determines `op()`: `CblasNoTrans`, `CblasTrans` or `CblasConjTrans`
+ *  \param y is the output; it must not refer to the same Tensor as `x`
+ *
+ * `x` and `y` may be Tensors of any rank; they are used as vectors of all their elements.
+ */
+template<typename T>
+inline void gemv(typename detail::nondeduced<T>::type alpha, const MatrixRef<T> &a, const TensorRef<T> &x,
+                 typename detail::nondeduced<T>::type beta, TensorRef<T> y,
+                 CBLAS_TRANSPOSE ta = CblasNoTrans)
+{
+    if (x.length() != (detail::transposedQ(ta) ? a.rows() : a.cols()) ||
+        y.length() != (detail::transposedQ(ta) ? a.cols() : a.rows()))
+        throw LibraryError("gemv: incompatible dimensions.");
+    if (detail::sameQ(x, y))
+        throw LibraryError("gemv: the output must not be the same as the input vector.");
+    if (a.rows() == 0 || a.cols() == 0) { // BLAS leaves y untouched in this case
+        for (auto &el : y)
+            el *= beta;
+        return;
+    }
+    detail::gemv(ta, detail::lapackInt(a.rows()), detail::lapackInt(a.cols()),
+                 alpha, a.data(), detail::leadingDim(a.cols()), x.data(), beta, y.data());
+}
+
+/// Matrix-vector product, `op(a) x`, returned as a new vector
+template<typename T>
+inline TensorRef<T> gemv(const MatrixRef<T> &a, const TensorRef<T> &x, CBLAS_TRANSPOSE ta = CblasNoTrans) {
+    if (x.length() != (detail::transposedQ(ta) ? a.rows() : a.cols()))
+        throw LibraryError("gemv: incompatible dimensions.");
+    auto y = makeVector<T>(detail::transposedQ(ta) ? a.cols() : a.rows());
+    try {
+        gemv<T>(1, a, x, 0, y, ta);
+    } catch (...) {
+        y.free();
+        throw;
+    }
+    return y;
+}
+
+
+/** \brief Symmetric rank-k update, `c = alpha a a^T + beta c` or `c = alpha a^T a + beta c`
+ *  \param trans is `CblasNoTrans` for `a a^T` or `CblasTrans` for `a^T a`
+ *  \param uplo determines whether the upper (`CblasUpper`) or lower (`CblasLower`) triangle of `c` is computed;
+ *         the other triangle is not referenced
+ *
+ * Note that for complex matrices, the result is symmetric, not Hermitian.
+ */
+template<typename T>
+inline void syrk(typename detail::nondeduced<T>::type alpha, const MatrixRef<T> &a,
+                 typename detail::nondeduced<T>::type beta, MatrixRef<T> c,
+                 CBLAS_TRANSPOSE trans = CblasNoTrans, CBLAS_UPLO uplo = CblasUpper)
+{
+    if (trans == CblasConjTrans)
+        throw LibraryError("syrk: only CblasNoTrans and CblasTrans are supported.");
+    const mint n = detail::transposedQ(trans) ? a.cols() : a.rows();
+    const mint k = detail::transposedQ(trans) ? a.rows() : a.cols();
+    if (c.rows() != n || c.cols() != n)
+        throw LibraryError("syrk: incompatible matrix dimensions.");
+    if (detail::sameQ(c, a))
+        throw LibraryError("syrk: the output must not be the same as the input.");
+    if (n == 0)
+        return;
+    detail::syrk(uplo, trans, detail::lapackInt(n), detail::lapackInt(k),
+                 alpha, a.data(), detail::leadingDim(a.cols()), beta, c.data(), detail::leadingDim(n));
+}
+
+/// Symmetric rank-k update, `a a^T` or `a^T a`, returned as a new matrix with both triangles filled in
+template<typename T>
+inline MatrixRef<T> syrk(const MatrixRef<T> &a, CBLAS_TRANSPOSE trans = CblasNoTrans) {
+    const mint n = detail::transposedQ(trans) ? a.cols() : a.rows();
+    auto c = makeMatrix<T>(n, n);
+    try {
+        syrk<T>(1, a, 0, c, trans, CblasUpper);
+    } catch (...) {
+        c.free();
+        throw;
+    }
+    for (mint i=0; i < n; ++i)
+        for (mint j=0; j < i; ++j)
+            c(i,j) = c(j,i);
+    return c;
+}
+
+
+/** \brief Cholesky decomposition of a symmetric or Hermitian positive definite matrix
+ *  \param a is the matrix to decompose; only the triangle determined by `uplo` is referenced
+ *  \param res is the output; it may refer to the same Tensor as `a`
+ *  \param uplo is `CblasUpper` to compute an upper triangular `u` so that `a = u^H u`,
+ *         as `CholeskyDecomposition` does, or `CblasLower` to compute a lower triangular `l` so that `a = l l^H`
+ *
+ * The other triangle of `res` is set to zero.
+ */
+template<typename T>
+inline void cholesky(const MatrixRef<T> &a, MatrixRef<T> res, CBLAS_UPLO uplo = CblasUpper) {
+    const mint n = a.rows();
+    if (a.cols() != n)
+        throw LibraryError("cholesky: the matrix must be square.");
+    if (res.rows() != n || res.cols() != n)
+        throw LibraryError("cholesky: the output must be of the same size as the input.");
+    if (! detail::sameQ(a, res))
+        std::copy(a.begin(), a.end(), res.begin());
+    if (n == 0)
+        return;
+
+    // The column-major interpretation of the data is the (conjugate) transpose of the matrix,
+    // which swaps the upper and lower triangles. No data needs to be moved.
+    lapack_int info = detail::potrf(uplo == CblasUpper ? 'L' : 'U', detail::lapackInt(n), res.data(), detail::leadingDim(n));
+    detail::checkInfo(info, "cholesky");
+    if (info > 0)
+        throw LibraryError("cholesky: the matrix is not positive definite.");
+    detail::zeroTriangle(res, uplo == CblasUpper);
+}
+
+/// Cholesky decomposition of a symmetric or Hermitian positive definite matrix, returned as a new matrix
+template<typename T>
+inline MatrixRef<T> cholesky(const MatrixRef<T> &a, CBLAS_UPLO uplo = CblasUpper) {
+    auto res = makeMatrix<T>(a.rows(), a.cols());
+    try {
+        cholesky(a, res, uplo);
+    } catch (...) {
+        res.free();
+        throw;
+    }
+    return res;
+}
+
+
+/** \brief LU decomposition with partial pivoting, `p a = l u`
+ *  \param a is an `m` by `n` matrix
+ *  \param res is an `m` by `n` output; it may refer to the same Tensor as `a`.
+ *         The strictly lower triangular part receives `l`, whose unit diagonal is not stored,
+ *         the upper triangular part receives `u`.
+ *  \param pivots is an output vector of length `min(m,n)`. Row `i` was interchanged with row `pivots[i]`,
+ *         in order. Following LAPACK's convention, these indices are 1-based.
+ *  \return `false` if `u` is exactly singular; the decomposition is computed regardless
+ *
+ * LAPACKE transposes the matrix into a temporary buffer for this computation.
+ */
+template<typename T>
+inline bool lu(const MatrixRef<T> &a, MatrixRef<T> res, IntTensorRef pivots) {
+    const mint m = a.rows(), n = a.cols();
+    if (res.rows() != m || res.cols() != n || pivots.length() != std::min(m, n))
+        throw LibraryError("lu: incompatible output dimensions.");
+    if (! detail::sameQ(a, res))
+        std::copy(a.begin(), a.end(), res.begin());
+    if (m == 0 || n == 0)
+        return true;
+
+    lapack_int info;
+    if (std::is_same<lapack_int, mint>::value) {
+        info = detail::getrf(detail::lapackInt(m), detail::lapackInt(n), res.data(), detail::leadingDim(n),
+                             reinterpret_cast<lapack_int *>(pivots.data()));
+    } else {
+        std::vector<lapack_int> ipiv(pivots.length());
+        info = detail::getrf(detail::lapackInt(m), detail::lapackInt(n), res.data(), detail::leadingDim(n), ipiv.data());
+        std::copy(ipiv.begin(), ipiv.end(), pivots.begin());
+    }
+    detail::checkInfo(info, "lu");
+    return info == 0;
+}
+
+
+/** \brief Thin QR decomposition, `a = q r`
+ *  \param a is an `m` by `n` matrix
+ *  \param q is an `m` by `k` output with orthonormal columns, where `k = min(m,n)`
+ *  \param r is a `k` by `n` upper triangular output
+ *
+ * Neither output may refer to the same Tensor as `a`. Note that `QRDecomposition` returns
+ * the conjugate transpose of `q`.
+ */
+template<typename T>
+inline void qr(const MatrixRef<T> &a, MatrixRef<T> q, MatrixRef<T> r) {
+    const mint m = a.rows(), n = a.cols(), k = std::min(m, n);
+    if (q.rows() != m || q.cols() != k || r.rows() != k || r.cols() != n)
+        throw LibraryError("qr: incompatible output dimensions.");
+    if (detail::sameQ(q, a) || detail::sameQ(r, a) || detail::sameQ(q, r))
+        throw LibraryError("qr: the outputs must be distinct from each other and from the input.");
+    if (k == 0)
+        return;
+
+    // The column-major interpretation of the data is the transpose of the matrix, a^T = l q',
+    // so the LQ decomposition of a^T gives a = q'^T l^T with no data movement.
+    // The decomposition is computed in whichever output has the same shape as a.
+    const MatrixRef<T> &work = m >= n ? q : r;
+    std::copy(a.begin(), a.end(), work.begin());
+
+    std::vector<T> tau(k);
+    lapack_int info = detail::gelqf(detail::lapackInt(n), detail::lapackInt(m), work.data(), detail::leadingDim(n), tau.data());
+    detail::checkInfo(info, "qr");
+
+    // r is the upper triangle; the Householder reflectors are below the diagonal
+    if (m >= n) {
+        for (mint i=0; i < k; ++i) {
+            std::fill(&r(i,0), &r(i,0) + i, T(0));
+            std::copy(&q(i,i), &q(i,0) + n, &r(i,i));
+        }
+    } else {
+        for (mint i=0; i < k; ++i) {
+            std::copy(&r(i,0), &r(i,0) + i, &q(i,0));
+            std::fill(&r(i,0), &r(i,0) + i, T(0));
+        }
+    }
+
+    info = detail::unglq(detail::lapackInt(k), detail::lapackInt(m), detail::lapackInt(k), q.data(), detail::leadingDim(k), tau.data());
+    detail::checkInfo(info, "qr");
+}
+
+
+/** \brief Eigenvalues and eigenvectors of a real symmetric or complex Hermitian matrix
+ *  \param a is the matrix; only its upper triangle is referenced
+ *  \param values is an output vector that receives the eigenvalues in ascending order
+ *  \param vectors is an output matrix of the same size as `a`; it may refer to the same Tensor as `a`.
+ *         Row `i` receives the normalized eigenvector belonging to `values[i]`, as with `Eigensystem`.
+ *
+ * Uses LAPACK's divide and conquer algorithm.
+ */
+template<typename T>
+inline void symmetricEigensystem(const MatrixRef<T> &a, RealTensorRef values, MatrixRef<T> vectors) {
+    const mint n = a.rows();
+    if (a.cols() != n)
+        throw LibraryError("symmetricEigensystem: the matrix must be square.");
+    if (values.length() != n || vectors.rows() != n || vectors.cols() != n)
+        throw LibraryError("symmetricEigensystem: incompatible output dimensions.");
+    if (! detail::sameQ(a, vectors))
+        std::copy(a.begin(), a.end(), vectors.begin());
+    if (n == 0)
+        return;
+
+    // The column-major interpretation of the data is the (conjugate) transpose of the matrix, i.e. the
+    // matrix itself in the real case. LAPACK returns eigenvectors as columns, which are rows in row-major order.
+    lapack_int info = detail::heevd('V', detail::lapackInt(n), vectors.data(), detail::leadingDim(n), values.data());
+    detail::checkInfo(info, "symmetricEigensystem");
+    if (info > 0)
+        throw LibraryError("symmetricEigensystem: the algorithm failed to converge.");
+
+    // the eigenvectors of the complex conjugate matrix are the complex conjugates
+    detail::conjugate(vectors.data(), vectors.length());
+}
+
+/** \brief Eigenvalues of a real symmetric or complex Hermitian matrix
+ *  \param a is the matrix; only its upper triangle is referenced
+ *  \param values is an output vector that receives the eigenvalues in ascending order
+ *
+ * LAPACK overwrites its input, so the matrix is copied into a temporary buffer.
+ */
+template<typename T>
+inline void symmetricEigenvalues(const MatrixRef<T> &a, RealTensorRef values) {
+    const mint n = a.rows();
+    if (a.cols() != n)
+        throw LibraryError("symmetricEigenvalues: the matrix must be square.");
+    if (values.length() != n)
+        throw LibraryError("symmetricEigenvalues: incompatible output dimensions.");
+    if (n == 0)
+        return;
+
+    std::vector<T> work(a.begin(), a.end());
+    lapack_int info = detail::heevd('N', detail::lapackInt(n), work.data(), detail::leadingDim(n), values.data());
+    detail::checkInfo(info, "symmetricEigenvalues");
+    if (info > 0)
+        throw LibraryError("symmetricEigenvalues: the algorithm failed to converge.");
+}
+
+/// Eigenvalues of a real symmetric or complex Hermitian matrix in ascending order, returned as a new vector
+template<typename T>
+inline RealTensorRef symmetricEigenvalues(const MatrixRef<T> &a) {
+    auto values = makeVector<double>(a.rows());
+    try {
+        symmetricEigenvalues(a, values);
+    } catch (...) {
+        values.free();
+        throw;
+    }
+    return values;
+}
+
+} // end namespace linalg
+
+} // end namespace mma
+
+#endif // LINALG_H
@@ -0,0 +1,261 @@
+/*
+ * Copyright (c) 2018 Szabolcs Horvát.
+ *
+ * See the file LICENSE.txt for copying permission.
+ */
+
+#ifndef PHILOX_H
+#define PHILOX_H
+
+/** \file philox.h
+ * \brief Auxiliary header for LTemplate providing counter-based random number streams.
+ *
+ * LTemplate itself does not depend on philox.h, so if you don't use this header,
+ * feel free to remove it from your project.
+ *
+ * \ref mma::RandomStream is based on the Philox4x32-10 generator of Salmon et al. (2011).
+ * Unlike `std::mt19937`, it has no internal state apart from a seed, a stream number and
+ * a position: the n-th random value is simply a function of these. This has several consequences:
+ *
+ *  - Creating and seeding a stream is essentially free.
+ *  - Any number of independent streams can be obtained from the same seed by varying the stream number.
+ *  - Bulk fills are deterministic: they give the same result with any number of threads.
+ *    Element `i` of the output always depends only on the seed, the stream number, the position, and `i`.
+ *
+ * If the code is compiled with OpenMP enabled, large bulk fills are parallelized automatically.
+ *
+ * Example usage:
+ * \code
+ * mma::RandomStream rs(seed);
+ *
+ * auto vec = mma::makeVector<double>(n);
+ * rs.uniform(vec, -1, 1); // fill with uniform reals between -1 and 1
+ *
+ * auto ints = mma::makeVector<mint>(n);
+ * rs.integer(ints, 1, 6); // fill with integers between 1 and 6 inclusive
+ *
+ * double x = rs.normal(); // single standard normal variate
+ * \endcode
+ */
+
+#include "LTemplate.h"
+
+#include <cstdint>
+#include <cmath>
+#include <limits>
+
+namespace mma {
+
+namespace detail { // private
+
+    const uint32_t philoxM0 = 0xD2511F53, philoxM1 = 0xCD9E8D57;
+    const uint32_t philoxW0 = 0x9E3779B9, philoxW1 = 0xBB67AE85;
+
+    // Philox4x32-10: encrypts the 128-bit counter ctr using the 64-bit key
+    inline void philox4x32(const uint32_t ctr[4], const uint32_t key[2], uint32_t out[4]) {
+        uint32_t c0 = ctr[0], c1 = ctr[1], c2 = ctr[2], c3 = ctr[3];
+        uint32_t k0 = key[0], k1 = key[1];
+        for (int r=0; r < 10; ++r) {
+            const uint64_t p0 = uint64_t(philoxM0) * c0;
+            const uint64_t p1 = uint64_t(philoxM1) * c2;
+            const uint32_t n0 = uint32_t(p1 >> 32) ^ c1 ^ k0;
+            const uint32_t n2 = uint32_t(p0 >> 32) ^ c3 ^ k1;
+            c1 = uint32_t(p1);
+            c3 = uint32_t(p0);
+            c0 = n0;
+            c2 = n2;
+            k0 += philoxW0;
+            k1 += philoxW1;
+        }
+        out[0] = c0; out[1] = c1; out[2] = c2; out[3] = c3;
+    }
+
+    // Uniform double in [0, 1) from the top 53 bits
+    inline double unitInterval(uint64_t x) { return (x >> 11) * (1.0 / 9007199254740992.0); }
+
+    // Uniform double in (0, 1], safe to take the logarithm of
+    inline double unitIntervalOpen(uint64_t x) { return ((x >> 11) + 1) * (1.0 / 9007199254740992.0); }
+
+    // High 64 bits of the 128-bit product a*b
+    inline uint64_t mulhi64(uint64_t a, uint64_t b) {
+        const uint64_t a0 = uint32_t(a), a1 = a >> 32, b0 = uint32_t(b), b1 = b >> 32;
+        const uint64_t p00 = a0*b0, p01 = a0*b1, p10 = a1*b0, p11 = a1*b1;
+        const uint64_t mid = (p00 >> 32) + uint32_t(p01) + uint32_t(p10);
+        return p11 + (p01 >> 32) + (p10 >> 32) + (mid >> 32);
+    }
+
+    // Map a 64-bit random value to [0, range); range == 0 means the full 64-bit range.
+    // The bias is at most range / 2^64, which is negligible for any practical range.
+    inline uint64_t boundedInteger(uint64_t x, uint64_t range) { return range == 0 ? x : mulhi64(x, range); }
+
+    // lower + offset, where the offset may not fit into a mint when the range spans all integers.
+    // The sum is computed in unsigned arithmetic, and it is always within the range of mint.
+    inline mint offsetInteger(mint lower, uint64_t offset) { return mint(uint64_t(lower) + offset); }
+
+    const double twoPi = 6.283185307179586477;
+
+} // end namespace detail
+
+
+/** \brief Counter-based pseudorandom number stream
+ *
+ * Each block of the stream consists of two 64-bit random values. The block at position `p`
+ * is obtained by encrypting the counter (`p`, `stream`) with the key `seed`.
+ *
+ * Single values are drawn using `operator ()` and the \ref uniform(), \ref normal() and \ref integer()
+ * functions. The class satisfies the UniformRandomBitGenerator requirements, so it can be used
+ * with the standard `<random>` distributions as well.
+ *
+ * Bulk fills always start at a block boundary, and advance the stream past the blocks they used.
+ * Element `i` is taken from block `position() + i/2`.
+ */
+class RandomStream {
+    uint32_t key[2];
+    uint64_t strm;
+    uint64_t pos;       // next unused block
+    uint64_t buf[2];    // the current block, for drawing single values
+    int bufpos;         // next unused value in buf; 2 if buf is exhausted
+
+    void block(uint64_t p, uint64_t out[2]) const {
+        const uint32_t ctr[4] = { uint32_t(p), uint32_t(p >> 32), uint32_t(strm), uint32_t(strm >> 32) };
+        uint32_t res[4];
+        detail::philox4x32(ctr, key, res);
+        out[0] = (uint64_t(res[1]) << 32) | res[0];
+        out[1] = (uint64_t(res[3]) << 32) | res[2];
+    }
+
+    /* Call f(i, r0, r1) for each block needed to produce n values, with i being the index of the
+     * first element produced by the block. Blocks are independent, so they may be processed in parallel.
+     */
+    template<typename F>
+    void forBlocks(mint n, F f) {
+        if (n < 0)
+            throw LibraryError("RandomStream: negative length.");
+        const mint nblocks = (n + 1) / 2;
+        const uint64_t start = pos;
+#ifdef _OPENMP
+        #pragma omp parallel for schedule(static) if (nblocks > 16384)
+#endif
+        for (mint b=0; b < nblocks; ++b) {
+            uint64_t r[2];
+            block(start + b, r);
+            f(2*b, r[0], r[1]);
+        }
+        pos += nblocks;
+        bufpos = 2;
+    }
+
+public:
+    /// The type of the values returned by `operator ()`
+    typedef uint64_t result_type;
+
+    /** \brief Create a stream
+     *  \param seed is the key of the generator
+     *  \param stream selects one of 2^64 independent streams that belong to the same seed
+     */
+    explicit RandomStream(uint64_t seed = 0, uint64_t stream = 0) : strm(stream), pos(0), bufpos(2) {
+        key[0] = uint32_t(seed);
+        key[1] = uint32_t(seed >> 32);
+    }
+
+    /// Reset the stream with a new seed, keeping the stream number
+    void seed(uint64_t s) { *this = RandomStream(s, strm); }
+
+    /// The stream number
+    uint64_t stream() const { return strm; }
+
+    /// Another stream with the same seed, starting at position 0
+    RandomStream substream(uint64_t stream) const {
+        RandomStream rs(*this);
+        rs.strm = stream;
+        rs.pos = 0;
+        rs.bufpos = 2;
+        return rs;
+    }
+
+    /// The index of the next unused block
+    uint64_t position() const { return pos; }
+
+    /// Jump to the given block; the next value will be the first one from this block
+    void setPosition(uint64_t p) { pos = p; bufpos = 2; }
+
+    /// Skip the given number of blocks
+    void skip(uint64_t blocks) { setPosition(pos + blocks); }
+
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return std::numeric_limits<result_type>::max(); }
+
+    /// The next 64-bit random value
+    result_type operator () () {
+        if (bufpos == 2) {
+            block(pos++, buf);
+            bufpos = 0;
+        }
+        return buf[bufpos++];
+    }
+
+    /// A uniformly distributed real number in [0, 1)
+    double uniform() { return detail::unitInterval((*this)()); }
+
+    /// A uniformly distributed real number in [lower, upper)
+    double uniform(double lower, double upper) { return lower + (upper - lower)*uniform(); }
+
+    /// A normally distributed real number
+    double normal(double mean = 0, double sd = 1) {
+        const double r = std::sqrt(-2*std::log(detail::unitIntervalOpen((*this)())));
+        return mean + sd * r * std::cos(detail::twoPi * uniform());
+    }
+
+    /// A uniformly distributed integer between lower and upper, inclusive
+    mint integer(mint lower, mint upper) {
+        if (upper < lower)
+            throw LibraryError("RandomStream: empty integer range.");
+        return detail::offsetInteger(lower, detail::boundedInteger((*this)(), uint64_t(upper) - uint64_t(lower) + 1));
+    }
+
+    /// Fill an array with uniformly distributed real numbers from [lower, upper)
+    void uniform(double *data, mint n, double lower = 0, double upper = 1) {
+        const double scale = upper - lower;
+        forBlocks(n, [=] (mint i, uint64_t r0, uint64_t r1) {
+            data[i] = lower + scale*detail::unitInterval(r0);
+            if (i+1 < n)
+                data[i+1] = lower + scale*detail::unitInterval(r1);
+        });
+    }
+
+    /// Fill a Tensor with uniformly distributed real numbers from [lower, upper)
+    void uniform(RealTensorRef t, double lower = 0, double upper = 1) { uniform(t.data(), t.length(), lower, upper); }
+
+    /// Fill an array with normally distributed real numbers, using the Box-Muller transform
+    void normal(double *data, mint n, double mean = 0, double sd = 1) {
+        forBlocks(n, [=] (mint i, uint64_t r0, uint64_t r1) {
+            const double r = sd * std::sqrt(-2*std::log(detail::unitIntervalOpen(r0)));
+            const double phi = detail::twoPi * detail::unitInterval(r1);
+            data[i] = mean + r*std::cos(phi);
+            if (i+1 < n)
+                data[i+1] = mean + r*std::sin(phi);
+        });
+    }
+
+    /// Fill a Tensor with normally distributed real numbers
+    void normal(RealTensorRef t, double mean = 0, double sd = 1) { normal(t.data(), t.length(), mean, sd); }
+
+    /// Fill an array with uniformly distributed integers between lower and upper, inclusive
+    void integer(mint *data, mint n, mint lower, mint upper) {
+        if (upper < lower)
+            throw LibraryError("RandomStream: empty integer range.");
+        const uint64_t range = uint64_t(upper) - uint64_t(lower) + 1;
+        forBlocks(n, [=] (mint i, uint64_t r0, uint64_t r1) {
+            data[i] = detail::offsetInteger(lower, detail::boundedInteger(r0, range));
+            if (i+1 < n)
+                data[i+1] = detail::offsetInteger(lower, detail::boundedInteger(r1, range));
+        });
+    }
+
+    /// Fill a Tensor with uniformly distributed integers between lower and upper, inclusive
+    void integer(IntTensorRef t, mint lower, mint upper) { integer(t.data(), t.length(), lower, upper); }
+};
+
+} // end namespace mma
+
+#endif // PHILOX_H
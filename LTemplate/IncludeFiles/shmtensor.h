@@ -0,0 +1,354 @@
+/*
+ * Copyright (c) 2018 Szabolcs Horvát.
+ *
+ * See the file LICENSE.txt for copying permission.
+ */
+
+#ifndef SHMTENSOR_H
+#define SHMTENSOR_H
+
+/** \file shmtensor.h
+ * \brief Auxiliary header for LTemplate to share large read-only Tensors between processes through POSIX shared memory.
+ *
+ * LTemplate itself does not depend on shmtensor.h, so if you don't use this header,
+ * feel free to remove it from your project.
+ *
+ * When using `ParallelMap` and similar functions, each subkernel loads its own copy of the library,
+ * and each input is serialized and sent to every subkernel separately. With shmtensor.h, one
+ * process can publish a Tensor once under a name, and the library loaded into any other process
+ * on the same machine can attach to it as a read-only view, without copying.
+ *
+ * Example usage:
+ * \code
+ * class Data {
+ *     mma::ShmTensorPool pool;
+ *
+ * public:
+ *     // called once, in the main kernel
+ *     void publish(mma::StringRef name, mma::RealTensorRef t) {
+ *         pool.publish(name.str(), t);
+ *     }
+ *
+ *     // called in subkernels
+ *     double total(mma::StringRef name) {
+ *         auto view = pool.attach<double>(name.str());
+ *         return std::accumulate(view.begin(), view.end(), 0.0);
+ *     }
+ * };
+ * \endcode
+ *
+ * Published segments are removed when the publishing \ref mma::ShmTensorPool is destroyed or when
+ * \ref mma::ShmTensorPool::unpublish() is called. Processes that are already attached keep their view until they detach.
+ *
+ * Only POSIX systems (Linux and OS X) are supported. On older Linux systems, `-lrt` must be added to the linker flags.
+ */
+
+#include "LTemplate.h"
+
+#ifdef _WIN32
+#error shmtensor.h requires POSIX shared memory, which is not available on Windows.
+#endif
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <atomic>
+#include <new>
+#include <map>
+#include <memory>
+#include <string>
+#include <algorithm>
+
+namespace mma {
+
+namespace detail { // private
+
+    /* Layout of a shared Tensor segment: the header, followed by `rank` dimensions,
+     * followed by the elements, which start at `data_offset`.
+     * The magic number is written last, so a partially written segment is never attached to.
+     */
+    struct ShmTensorHeader {
+        std::atomic<uint64_t> magic;
+        mint type;
+        mint rank;
+        mint length;
+        mint data_offset;
+    };
+
+    static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "shmtensor.h requires lock-free 64-bit atomics.");
+
+    const uint64_t shmTensorMagic = 0x4c5465536d54656eULL;
+
+    const size_t shmTensorAlignment = 64; // cache line size
+
+    inline std::string shmName(const std::string &name) {
+        if (name.empty() || name.size() > 200 || name.find('/') != std::string::npos)
+            throw LibraryError("shmtensor: \"" + name + "\" is not a valid segment name. Names must be non-empty and must not contain '/'.");
+        return "/" + name;
+    }
+
+    inline std::string shmError(const char *fun, const std::string &name, int errnum) {
+        return std::string("shmtensor: ") + fun + "() failed for segment \"" + name + "\": " + std::strerror(errnum);
+    }
+
+    // Owns the memory mapping of a shared memory segment.
+    class ShmMapping {
+        void *addr;
+        size_t len;
+
+    public:
+        ShmMapping(void *addr, size_t len) : addr(addr), len(len) { }
+        ~ShmMapping() { munmap(addr, len); }
+
+        ShmMapping(const ShmMapping &) = delete;
+        ShmMapping & operator = (const ShmMapping &) = delete;
+
+        char *address() const { return static_cast<char *>(addr); }
+        size_t size() const { return len; }
+
+        const ShmTensorHeader *header() const { return reinterpret_cast<const ShmTensorHeader *>(addr); }
+        const mint *dimensions() const { return reinterpret_cast<const mint *>(address() + sizeof(ShmTensorHeader)); }
+    };
+
+    // An attached mapping, together with the identity of the segment it was mapped from.
+    struct ShmAttachment {
+        std::shared_ptr<ShmMapping> mapping;
+        dev_t dev;
+        ino_t ino;
+        off_t size;
+    };
+
+    /* Checks that a mapped segment holds a complete shared Tensor whose header, dimensions
+     * and elements of size elemSize all lie within the mapping. The element type is checked by ShmTensorRef.
+     */
+    inline bool validShmTensor(const ShmMapping &m, size_t elemSize) {
+        const ShmTensorHeader *h = m.header();
+        if (h->magic.load(std::memory_order_acquire) != shmTensorMagic)
+            return false;
+        const size_t available = m.size() - sizeof(ShmTensorHeader);
+        if (h->rank < 0 || size_t(h->rank) > available / sizeof(mint))
+            return false;
+        const size_t dims_end = sizeof(ShmTensorHeader) + h->rank*sizeof(mint);
+        if (h->data_offset < 0 || size_t(h->data_offset) < dims_end || size_t(h->data_offset) > m.size())
+            return false;
+        if (h->length < 0 || size_t(h->length) > (m.size() - h->data_offset) / elemSize)
+            return false;
+        mint length = 1;
+        for (mint i=0; i < h->rank; ++i) {
+            const mint d = m.dimensions()[i];
+            if (d < 0 || (d > 0 && length > h->length / d))
+                return false;
+            length *= d;
+        }
+        return length == h->length;
+    }
+
+} // end namespace detail
+
+
+/** \brief Read-only view of a Tensor published in shared memory by another process
+ *  \tparam T is the element type; must be `mint`, `double` or `mma::complex_t`.
+ *
+ * Provides the same read interface as \ref TensorRef. The view stays valid as long as
+ * the \ref ShmTensorRef (or a copy of it) exists, even if the segment was unpublished in the meantime.
+ *
+ * \sa ShmTensorPool
+ */
+template<typename T>
+class ShmTensorRef {
+    std::shared_ptr<detail::ShmMapping> mapping;
+    const T *tensor_data;
+    mint len;
+
+public:
+    explicit ShmTensorRef(const std::shared_ptr<detail::ShmMapping> &m) : mapping(m)
+    {
+        const detail::ShmTensorHeader *h = mapping->header();
+        if (h->type != detail::libraryType<T>())
+            throw LibraryError("ShmTensorRef: shared Tensor element type mismatch.", LIBRARY_TYPE_ERROR);
+        tensor_data = reinterpret_cast<const T *>(mapping->address() + h->data_offset);
+        len = h->length;
+    }
+
+    /// Rank of the Tensor
+    mint rank() const { return mapping->header()->rank; }
+
+    /// Dimensions of the Tensor
+    const mint *dimensions() const { return mapping->dimensions(); }
+
+    /// Number of elements in the Tensor
+    mint length() const { return len; }
+
+    /// Number of elements in the Tensor, synonym of \ref length()
+    mint size() const { return length(); }
+
+    /// Pointer to the shared data
+    const T *data() const { return tensor_data; }
+
+    /// Index into the tensor data linearly
+    const T & operator [] (mint i) const { return tensor_data[i]; }
+
+    const T *begin() const { return data(); }
+    const T *end() const { return begin() + length(); }
+
+    /// The type of the Tensor; may be `MType_Integer=2`, `MType_Real=3` or `MType_Complex=4`
+    mint type() const { return detail::libraryType<T>(); }
+
+    /// Create a new, process-local Tensor with a copy of the shared data
+    TensorRef<T> toTensor() const {
+        TensorRef<T> t = makeTensor<T>(rank(), dimensions());
+        std::copy(begin(), end(), t.begin());
+        return t;
+    }
+};
+
+
+/** \brief Publishes Tensors into and attaches to named POSIX shared memory segments
+ *
+ * Segments published through a pool are unlinked when the pool is destroyed.
+ * Attached segments are cached by name, so attaching repeatedly does not map them again.
+ * The cache is checked against the segment on each attach: if the name was unpublished
+ * and published again in the meantime, the new segment is mapped.
+ *
+ * Typically, a pool is a member of an LTemplate class.
+ *
+ * \sa ShmTensorRef
+ */
+class ShmTensorPool {
+    std::map<std::string, std::shared_ptr<detail::ShmMapping>> published;
+    std::map<std::string, detail::ShmAttachment> attached;
+
+public:
+    ShmTensorPool() = default;
+    ShmTensorPool(const ShmTensorPool &) = delete;
+    ShmTensorPool & operator = (const ShmTensorPool &) = delete;
+
+    ~ShmTensorPool() {
+        for (const auto &p : published)
+            shm_unlink(detail::shmName(p.first).c_str());
+    }
+
+    /** \brief Copy a Tensor into a new shared memory segment
+     *  \param name is the segment name; it must not contain `/`
+     *  \param t is the Tensor to publish
+     *
+     * If a segment with the same name already exists, a \ref LibraryError is thrown.
+     * Use \ref remove() to clean up segments left over from crashed processes.
+     */
+    template<typename T>
+    void publish(const std::string &name, const TensorRef<T> &t) {
+        const std::string sname = detail::shmName(name);
+        if (published.find(name) != published.end())
+            throw LibraryError("shmtensor: segment \"" + name + "\" is already published.");
+
+        const mint rank = t.rank();
+        size_t data_offset = sizeof(detail::ShmTensorHeader) + rank*sizeof(mint);
+        data_offset = (data_offset + detail::shmTensorAlignment - 1) / detail::shmTensorAlignment * detail::shmTensorAlignment;
+        const size_t size = data_offset + t.length()*sizeof(T);
+
+        int fd = shm_open(sname.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd == -1)
+            throw LibraryError(detail::shmError("shm_open", name, errno));
+        if (ftruncate(fd, size) == -1) {
+            int errnum = errno;
+            close(fd);
+            shm_unlink(sname.c_str());
+            throw LibraryError(detail::shmError("ftruncate", name, errnum));
+        }
+        void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        int errnum = errno;
+        close(fd);
+        if (addr == MAP_FAILED) {
+            shm_unlink(sname.c_str());
+            throw LibraryError(detail::shmError("mmap", name, errnum));
+        }
+        auto mapping = std::make_shared<detail::ShmMapping>(addr, size);
+
+        detail::ShmTensorHeader *h = new (addr) detail::ShmTensorHeader;
+        h->type = t.type();
+        h->rank = rank;
+        h->length = t.length();
+        h->data_offset = data_offset;
+        std::copy(t.dimensions(), t.dimensions() + rank, const_cast<mint *>(mapping->dimensions()));
+        std::copy(t.begin(), t.end(), reinterpret_cast<T *>(mapping->address() + data_offset));
+        h->magic.store(detail::shmTensorMagic, std::memory_order_release);
+
+        published[name] = mapping;
+    }
+
+    /// Unlink a segment published by this pool. Processes already attached to it keep their views.
+    void unpublish(const std::string &name) {
+        auto it = published.find(name);
+        if (it == published.end())
+            throw LibraryError("shmtensor: segment \"" + name + "\" was not published by this pool.");
+        shm_unlink(detail::shmName(name).c_str());
+        published.erase(it);
+    }
+
+    /** \brief Attach to a segment published by any process
+     *  \tparam T is the element type; it must match the type of the published Tensor
+     *  \param name is the segment name
+     */
+    template<typename T>
+    ShmTensorRef<T> attach(const std::string &name) {
+        const std::string sname = detail::shmName(name);
+        int fd = shm_open(sname.c_str(), O_RDONLY, 0);
+        if (fd == -1) {
+            int errnum = errno;
+            attached.erase(name);
+            throw LibraryError(detail::shmError("shm_open", name, errnum));
+        }
+        struct stat st;
+        if (fstat(fd, &st) == -1) {
+            int errnum = errno;
+            close(fd);
+            throw LibraryError(detail::shmError("fstat", name, errnum));
+        }
+
+        auto it = attached.find(name);
+        if (it != attached.end()) {
+            const detail::ShmAttachment &a = it->second;
+            if (a.dev == st.st_dev && a.ino == st.st_ino && a.size == st.st_size) {
+                close(fd);
+                return ShmTensorRef<T>(a.mapping);
+            }
+            attached.erase(it); // the segment was republished
+        }
+
+        if (size_t(st.st_size) < sizeof(detail::ShmTensorHeader)) {
+            close(fd);
+            throw LibraryError("shmtensor: segment \"" + name + "\" is not a shared Tensor.");
+        }
+        void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        int errnum = errno;
+        close(fd);
+        if (addr == MAP_FAILED)
+            throw LibraryError(detail::shmError("mmap", name, errnum));
+        auto mapping = std::make_shared<detail::ShmMapping>(addr, st.st_size);
+
+        if (! detail::validShmTensor(*mapping, sizeof(T)))
+            throw LibraryError("shmtensor: segment \"" + name + "\" is not a shared Tensor or it is not yet fully published.");
+
+        ShmTensorRef<T> ref(mapping); // checks type before caching
+        detail::ShmAttachment a = { mapping, st.st_dev, st.st_ino, st.st_size };
+        attached[name] = a;
+        return ref;
+    }
+
+    /// Forget a cached attachment. Existing views remain valid.
+    void detach(const std::string &name) { attached.erase(name); }
+
+    /// Unlink a segment by name, regardless of which process published it.
+    static void remove(const std::string &name) {
+        if (shm_unlink(detail::shmName(name).c_str()) == -1)
+            throw LibraryError(detail::shmError("shm_unlink", name, errno));
+    }
+};
+
+} // end namespace mma
+
+#endif // SHMTENSOR_H
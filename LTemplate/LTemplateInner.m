@@ -15,7 +15,8 @@ LFun::usage =
 LType::usage =
      "LType[head] represents an array-like library type corresponding to head.\n" <>
      "LType[head, etype] represents an array-like library type corresponding to head, with element type etype.\n" <>
-     "LType[head, etype, d] represents an array-like library type corresponding to head, with element type etype and depth/rank d.";
+     "LType[head, etype, d] represents an array-like library type corresponding to head, with element type etype and depth/rank d.\n" <>
+     "LType[List, etype, {d1, d2, \[Ellipsis]}] represents a Tensor with the given dimensions, where _ stands for any dimension. Supported forms are {n}, {m, n} and {_, n}.";
 
 TranslateTemplate::usage = "TranslateTemplate[template] translates the template into C++ code.";
 
@@ -24,7 +25,11 @@ UnloadTemplate::usage = "UnloadTemplate[template] attempts to unload the library
 
 CompileTemplate::usage =
     "CompileTemplate[template] compiles the library defined by the template. Required source files must be present in the current directory.\n" <>
-    "CompileTemplate[template, {file1, \[Ellipsis]}] includes additional source files in the compilation.";
+    "CompileTemplate[template, {file1, \[Ellipsis]}] includes additional source files in the compilation.\n" <>
+    "CompileTemplate[template, \"WorkerProcess\" -> True] runs the classes in a separate process, so that a crash does not bring down the kernel.\n" <>
+    "CompileTemplate[template, \"CaptureCalls\" -> True] allows recording calls with StartCallCapture, and builds an executable that replays them.\n" <>
+    "CompileTemplate[template, \"PerformanceCounters\" -> True] measures each member function call with hardware performance counters, see PerformanceCounters.\n" <>
+    "CompileTemplate[template, \"AllocationCensus\" -> True] counts the arrays allocated and copied by each member function, see AllocationCensus.";
 
 FormatTemplate::usage = "FormatTemplate[template] formats the template in an easy to read way.";
 
@@ -36,6 +41,25 @@ Make::usage = "Make[class] creates an instance of class.";
 
 LExpressionList::usage = "LExpressionList[class] returns all existing instances of class.";
 
+RunCommands::usage =
+    "RunCommands[{obj1@\"fun1\"[args\[Ellipsis]], obj2@\"fun2\"[args\[Ellipsis]], \[Ellipsis]}] calls the member functions in order with a single library function call, and returns the result of the last one. LResult[k] may be used as an argument to pass the result of the k-th command without returning it to the kernel.\n" <>
+    "RunCommands[commands, k] returns the result of the k-th command.\n" <>
+    "RunCommands[commands, {k1, k2, \[Ellipsis]}] returns the results of the given commands.";
+
+LResult::usage = "LResult[k] refers to the result of the k-th command in RunCommands.";
+
+LTensorHandle::usage = "LTensorHandle[lib, id, type] refers to a Tensor with element type type, kept in the library lib. Functions with \"Stored\" passing return and take such handles.";
+TensorHandleData::usage = "TensorHandleData[handle] returns the Tensor referred to by handle.";
+ReleaseTensorHandle::usage = "ReleaseTensorHandle[handle] frees the Tensor referred to by handle.";
+TensorStoreInfo::usage = "TensorStoreInfo[lib] returns the number and total size of the Tensors kept in the library lib, the memory budget and the number of evictions.";
+StartCallCapture::usage = "StartCallCapture[lib, file] records the calls to the library lib in file. The library must be compiled with CompileTemplate[template, \"CaptureCalls\" -> True]. Recorded calls can be replayed and timed outside of Mathematica with the lib-replay executable built next to the library.";
+StopCallCapture::usage = "StopCallCapture[lib] stops recording the calls to the library lib, and returns the number of recorded calls.";
+PerformanceCounters::usage = "PerformanceCounters[lib] returns the number of calls, the time and the CPU cycles, instructions, cache misses and branch misses of each member function of the library lib, separately for each calling thread. The library must be compiled with CompileTemplate[template, \"PerformanceCounters\" -> True].";
+ResetPerformanceCounters::usage = "ResetPerformanceCounters[lib] returns the same as PerformanceCounters[lib], and resets the values to zero.";
+AllocationCensus::usage = "AllocationCensus[lib] returns the number of array allocations and copies, and the bytes allocated and copied, by each member function of the library lib, ordered by the total number of bytes. The library must be compiled with CompileTemplate[template, \"AllocationCensus\" -> True].";
+ResetAllocationCensus::usage = "ResetAllocationCensus[lib] returns the same as AllocationCensus[lib], and resets the values to zero.";
+SetTensorStoreBudget::usage = "SetTensorStoreBudget[lib, bytes] limits the total size of the Tensors kept in the library lib. When the limit is exceeded, the least recently used Tensors are freed. SetTensorStoreBudget[lib, Infinity] removes the limit.";
+
 LClassContext::usage = "LClassContext[] returns the context where class symbols are created.";
 
 LExpressionID::usage = "LExpressionID[name] represents the data type corresponding to LClass[name, \[Ellipsis]] in templates.";
@@ -85,6 +109,15 @@ $includeDirectory = FileNameJoin[{$packageDirectory, "IncludeFiles"}];
 $messageSymbol := warnConfig
 $lazyLoading := warnConfig
 
+(* Set by CompileTemplate with "CaptureCalls" -> True while translating the template *)
+$captureCalls = False;
+
+(* Set by CompileTemplate with "PerformanceCounters" -> True while translating the template *)
+$perfCounters = False;
+
+(* Set by CompileTemplate with "AllocationCensus" -> True while translating the template *)
+$allocCensus = False;
+
 (* Show error and abort when ConfigureLTemplate[] was not called. *)
 warnConfig := (Print["FATAL ERROR: Must call ConfigureLTemplate[] when embedding LTemplate into another package. Aborting ..."]; Abort[])
 
@@ -147,12 +180,17 @@ rawTypePattern     = "Integer8"|"UnsignedInteger8"|"Integer16"|"UnsignedInteger1
                      "Integer64"|"UnsignedInteger64"|"Real32"|"Real64"|"Complex64"|"Complex128";
 imageTypePattern   = "Bit"|"Byte"|"Bit16"|"Real32"|"Real";
 
-passingMethodPattern = PatternSequence[]|"Shared"|"Manual"|"Constant"|Automatic;
+(* "InPlace" is "Shared" passing where LTemplate takes care of disowning, see mma::detail::InPlace *)
+(* "Stored" Tensors stay in the library and are passed as handles, see mma::TensorStore *)
+passingMethodPattern = PatternSequence[]|"Shared"|"Manual"|"Constant"|"InPlace"|"Stored"|Automatic;
 
 depthPattern = _Integer?Positive | Verbatim[_];
 depthNullPattern = PatternSequence[] | depthPattern; (* like depthPattern, but allow empty value*)
 
-arrayPattern = LType[List, numericTypePattern, depthNullPattern]; (* disallow MTensor without explicit element type specification *)
+(* Tensor dimensions known at compile time: {n}, {m, n} or {_, n}. Other dimensions lists are normalized to a depth when possible. *)
+shapePattern = {_Integer?Positive} | {_Integer?Positive | Verbatim[_], _Integer?Positive};
+
+arrayPattern = LType[List, numericTypePattern, depthNullPattern | shapePattern]; (* disallow MTensor without explicit element type specification *)
 sparseArrayPattern = LType[SparseArray, numericTypePattern, depthNullPattern]; (* disallow SparseArray without explicit element type specification *)
 rawArrayPattern = LType[RawArray, rawTypePattern] | LType[RawArray];
 byteArrayPattern = LType[ByteArray];
@@ -190,6 +228,9 @@ wrapNakedHeadsRules = Dispatch@{
 };
 
 elemTypeAliases = Dispatch@{
+  (* dimensions lists without fixed dimensions only specify the depth *)
+  LType[List, type_, dims : {Verbatim[_]..}] :> LType[List, type, Length[dims]],
+
   LType[RawArray, "Byte"]    :> LType[RawArray, "UnsignedInteger8"],
   LType[RawArray, "Bit16"]   :> LType[RawArray, "UnsignedInteger16"],
   (* omit "Integer" because the naming is confusing and people may assume it's "Integer64" *)
@@ -215,7 +256,8 @@ normalizeFunsRules = Dispatch@{
 (* These rules must only be applied to entire type specifications, not their parts. Use Replace, not ReplaceAll. *)
 typeRules = Dispatch@{
   (* allowed forms of tensor specifications include {type}, {type, depth}, {type, depth, passing}, but NOT {type, passing} *)
-  {type : numericTypePattern, depth : depthPattern, pass : passingMethodPattern} :> {LType[List, type, depth], pass},
+  {type : numericTypePattern, dims : {Verbatim[_]..}, pass : passingMethodPattern} :> {LType[List, type, Length[dims]], pass},
+  {type : numericTypePattern, depth : depthPattern | {(_Integer | Verbatim[_])..}, pass : passingMethodPattern} :> {LType[List, type, depth], pass},
   {type : numericTypePattern, pass : passingMethodPattern} :> {LType[List, type], pass},
   type : LType[__] :> {type}
 };
@@ -236,6 +278,8 @@ ValidTemplateQ::type     = "In ``: `` is not a valid type.";
 ValidTemplateQ::rettype  = "In ``: `` is not a valid return type.";
 ValidTemplateQ::dupclass = "In ``: Class `` appears more than once.";
 ValidTemplateQ::dupfun   = "In ``: Function `` appears more than once.";
+ValidTemplateQ::inplace  = "In ``: At most one argument may use \"InPlace\" passing. The \"InPlace\" return type requires such an argument.";
+ValidTemplateQ::stored   = "In ``: Only Tensors can use \"Stored\" passing.";
 
 ValidTemplateQ[tem_] := validateTemplate@NormalizeTemplate[tem]
 
@@ -267,7 +311,7 @@ validateFun[LFun[name_, args_List, ret_]] :=
       If[MemberQ[funlist, name], Message[ValidTemplateQ::dupfun, location, name]; Return[False]];
       AppendTo[funlist, name];
       Block[{location = StringTemplate["class ``, function ``"][inclass, name]},
-        nameValid && (And @@ validateType /@ args) && validateReturnType[ret]
+        nameValid && (And @@ validateType /@ args) && validateReturnType[ret] && validateInPlace[args, ret]
       ]
     ]
 validateFun[LOFun[name_]] :=
@@ -280,15 +324,27 @@ validateFun[LOFun[name_]] :=
 
 (* must be called within validateTemplate, uses location *)
 validateType[numericTypePattern|"Boolean"|"UTF8String"|LExpressionID[_String]] := True
-validateType[{arrayPattern|sparseArrayPattern|rawArrayPattern|byteArrayPattern|imagePattern, passingMethodPattern}] := True
+validateType[{arrayPattern, passingMethodPattern}] := True
+validateType[{sparseArrayPattern|rawArrayPattern|byteArrayPattern|imagePattern, "Stored"}] := (Message[ValidTemplateQ::stored, location]; False)
+validateType[{sparseArrayPattern|rawArrayPattern|byteArrayPattern|imagePattern, passingMethodPattern}] := True
 validateType[type_] := (Message[ValidTemplateQ::type, location, type]; False)
 
 (* must be called within validateTemplate, uses location *)
-(* Only "Shared" and Automatic passing allowed in return types. LExpressionID is forbidden. *)
-validateReturnType["Void"] := True
-validateReturnType[type : LExpressionID[___] | {___, "Manual"|"Constant"}] := (Message[ValidTemplateQ::rettype, location, type]; False)
+(* Only "Shared", "Stored" and Automatic passing allowed in return types. LExpressionID is forbidden.
+   The "InPlace" return type returns the "InPlace" argument. *)
+validateReturnType["Void"|"InPlace"] := True
+validateReturnType[type : LExpressionID[___] | {___, "Manual"|"Constant"|"InPlace"}] := (Message[ValidTemplateQ::rettype, location, type]; False)
 validateReturnType[type_] := validateType[type]
 
+(* must be called within validateTemplate, uses location *)
+validateInPlace[args_, ret_] :=
+    With[{count = Count[args, {_, "InPlace"}]},
+      If[count > 1 || (ret === "InPlace" && count == 0),
+        Message[ValidTemplateQ::inplace, location]; False,
+        True
+      ]
+    ]
+
 (* must be called within validateTemplate, uses location *)
 validateName[name_] := (Message[ValidTemplateQ::string, location, name]; False)
 validateName[name_String] :=
@@ -326,33 +382,50 @@ collectionName[classname_String] := classname <> "_collection"
 
 collectionType[classname_String] := "std::map<mint, " <> classname <> " *>"
 
+sharedCollectionName[classname_String] := classname <> "_shared_collection"
+
+sharedCollectionType[classname_String] := "mma::detail::SharedCollection<" <> classname <> ">"
+
 managerName[classname_String] := classname <> "_manager_fun"
 
 fullyQualifiedSymbolName[sym_Symbol] := Context[sym] <> SymbolName[sym]
 
 
+(* The shared collection owns the instances. The plain collection is used on the kernel's thread only. *)
 setupCollection[classname_String] := {
   CDeclare[collectionType[classname], collectionName[classname]],
+  CDeclare[sharedCollectionType[classname], sharedCollectionName[classname]],
   "",
   CInlineCode["namespace mma"], (* workaround for gcc bug, "specialization of template in different namespace" *)
-  CBlock@CFunction["template<> const " <> collectionType[classname] <> " &", "getCollection<" <> classname <> ">", {},
-    CReturn[collectionName[classname]]
-  ],
+  CBlock@{
+    CFunction["template<> const " <> collectionType[classname] <> " &", "getCollection<" <> classname <> ">", {},
+      CReturn[collectionName[classname]]
+    ],
+    "",
+    CFunction["template<> mma::CollectionSnapshot<" <> classname <> ">", "getCollectionSnapshot<" <> classname <> ">", {},
+      CReturn[CMember[sharedCollectionName[classname], "snapshot()"]]
+    ]
+  },
   "",
   CFunction["DLLEXPORT void", managerName[classname], {"WolframLibraryData libData", "mbool mode", "mint id"},
-    CInlineCode@StringTemplate[ (* TODO: Check if id exists, use assert *)
-      "\
+    {
+      If[$captureCalls, CCall["mma::detail::captureInstance", {CString[classname], "mode", "id"}], {}],
+      CInlineCode@StringTemplate[ (* TODO: Check if id exists, use assert *)
+        "\
 if (mode == 0) { // create
-  `collection`[id] = new `class`();
+  `class` *obj = new `class`();
+  `shared`.insert(id, std::shared_ptr<`class`>(obj));
+  `collection`[id] = obj;
 } else {  // destroy
   if (`collection`.find(id) == `collection`.end()) {
     libData->Message(\"noinst\");
     return;
   }
-  delete `collection`[id];
   `collection`.erase(id);
+  `shared`.erase(id); // deletes the instance unless it is pinned by another thread
 }\
-"][<|"collection" -> collectionName[classname], "class" -> classname|>]
+"][<|"collection" -> collectionName[classname], "shared" -> sharedCollectionName[classname], "class" -> classname|>]
+    }
   ],
   "",
   CFunction[libFunRet, classname <> "_get_collection", libFunArgs,
@@ -389,6 +462,9 @@ transTemplate[LTemplate[libname_String, classes_]] :=
       {
         "",
         CDefine["LTEMPLATE_MMA_VERSION", ToString@Round[100 $VersionNumber + $ReleaseNumber]],
+        If[$captureCalls, CDefine["LTEMPLATE_CAPTURE"], {}],
+        If[$perfCounters, CDefine["LTEMPLATE_PERF_COUNTERS"], {}],
+        If[$allocCensus, CDefine["LTEMPLATE_ALLOC_CENSUS"], {}],
         "",
         CInclude["LTemplate.h"],
         CInclude["LTemplateHelpers.h"],
@@ -421,11 +497,17 @@ transTemplate[LTemplate[libname_String, classes_]] :=
           "WolframLibrary_uninitialize", {"WolframLibraryData libData"},
           {
             unregisterClassManager /@ classlist,
+            "mma::tensorStore().clear()",
             "return"
           }
         ],
         "","",
-        classTranslations
+        classTranslations,
+        transCommandTable[classes],
+        transTensorStore[],
+        If[$captureCalls, transCapture[classlist], {}],
+        If[$perfCounters, transPerfCounters[], {}],
+        If[$allocCensus, transAllocCensus[], {}]
       }
     ]
 
@@ -469,80 +551,120 @@ catchExceptions[classname_, funname_] :=
     ]
 
 
+(* The argument unpacking, instance lookup and exception handling are done by mma::detail::invoke(),
+   see LTemplateHelpers.h. The template specification is passed to it as a function type, and
+   it checks the signature of the member function against it at compile time. *)
 transFun[classname_][LFun[name_String, args_List, ret_]] :=
-    Block[{index = 0},
-      {
-        CFunction[libFunRet, funName[classname][name], libFunArgs,
-          {
-            CDeclare["mma::detail::MOutFlushGuard", "flushguard"],
-            (* TODO: check Argc is correct, use assert *)
-            "const mint id = MArgument_getInteger(Args[0])",
-            CInlineCode@StringTemplate[
-              "if (`1`.find(id) == `1`.end()) { libData->Message(\"noinst\"); return LIBRARY_FUNCTION_ERROR; }"
-            ][collectionName[classname]],
-            "",
-            CTry[
-            (* try *) {
-              transArg /@ args,
-              "",
-              transRet[
-                ret,
-                CPointerMember[CArray[collectionName[classname], "id"], CCall[name, var /@ Range@Length[args]]]
-              ]
-            }],
-            (* catch *)
-            catchExceptions[classname, name],
-            "",
-            CReturn["LIBRARY_NO_ERROR"]
-          }
-        ],
-        "", ""
-      }
-    ]
+    {
+      CFunction[libFunRet, funName[classname][name], libFunArgs,
+        CReturn@CCall[
+          "mma::detail::invoke<" <> specType[args, ret] <> ">",
+          {CString[classname <> "::" <> name <> "()"], collectionName[classname], "&" <> classname <> "::" <> name, "Args", "Res"}
+        ]
+      ],
+      "", ""
+    }
 
 transFun[classname_][LOFun[name_String]] :=
     {
       CFunction[libFunRet, funName[classname][name], linkFunArgs,
-        {
-          CDeclare["mma::detail::MOutFlushGuard", "flushguard"],
-          CTry[
-            (* try *) {
-              CInlineCode@StringTemplate[
-"
-int id;
-int args = 2;
-
-if (! MLTestHeadWithArgCount(mlp, \"List\", &args))
-  return LIBRARY_FUNCTION_ERROR;
-if (! MLGetInteger(mlp, &id))
-  return LIBRARY_FUNCTION_ERROR;
-if (`collection`.find(id) == `collection`.end()) {
-  libData->Message(\"noinst\");
-  return LIBRARY_FUNCTION_ERROR;
-}
-`collection`[id]->`funname`(mlp);
-"
-              ][<| "collection" -> collectionName[classname], "funname" -> name |>]
-            }
-          ],
-          (* catch *)
-          catchExceptions[classname, name],
-          "",
-          CReturn["LIBRARY_NO_ERROR"]
-        }
-      ]
+        CReturn@CCall[
+          "mma::detail::invokeLink",
+          {CString[classname <> "::" <> name <> "()"], collectionName[classname], "&" <> classname <> "::" <> name, "mlp"}
+        ]
+      ],
+      "", ""
     }
 
-transArg[type_] :=
-    Module[{name, cpptype, getfun, setfun},
-      index++;
-      name = var[index];
-      {cpptype, getfun, setfun} = Replace[type, types];
+(* Command buffers, see RunCommands. Functions are indexed in the order they appear in the template,
+   LinkObject based functions cannot be used and have NULL entries. The terminating entry keeps
+   the array non-empty for templates without functions. *)
+transCommandTable[classes_] :=
+    With[{funs = Flatten@Cases[classes, LClass[classname_, fs_] :> Replace[fs, {LFun[name_, __] :> funName[classname][name], _ -> "NULL"}, {1}]]},
       {
-        CDeclareAssign[cpptype, name, StringTemplate["`1`(Args[`2`])"][getfun, index]]
+        CInlineCode[
+          "static const mma::detail::LibraryFunctionPointer ltemplate_command_functions[] = {\n" <>
+          StringJoin["  " <> # <> ",\n"& /@ funs] <>
+          "  NULL\n};"
+        ],
+        "",
+        CFunction[libFunRet, "LTemplate_run_commands", libFunArgs,
+          CReturn@CCall["mma::detail::runCommands", {"ltemplate_command_functions", Length[funs], "libData", "Argc", "Args", "Res"}]
+        ],
+        "",
+        CFunction[libFunRet, "LTemplate_command_output", libFunArgs,
+          CReturn@CCall["mma::detail::commandOutput", {"Argc", "Args", "Res"}]
+        ],
+        "", ""
       }
     ]
 
+(* Access to the Tensors kept by "Stored" passing, see TensorHandleData. Not available in worker process mode. *)
+transTensorStore[] :=
+    {
+      CFunction[libFunRet, "LTemplate_tensor_store_get", libFunArgs,
+        CReturn@CCall["mma::detail::tensorStoreGet", {"Argc", "Args", "Res"}]
+      ],
+      "",
+      CFunction[libFunRet, "LTemplate_tensor_store_release", libFunArgs,
+        CReturn@CCall["mma::detail::tensorStoreRelease", {"Argc", "Args", "Res"}]
+      ],
+      "",
+      CFunction[libFunRet, "LTemplate_tensor_store_info", libFunArgs,
+        CReturn@CCall["mma::detail::tensorStoreInfo", {"Argc", "Args", "Res"}]
+      ],
+      "", ""
+    }
+
+(* Starts and stops the call capture, see StartCallCapture. Instances that exist when the capture starts are recorded first. *)
+transCapture[classlist_] :=
+    {
+      CFunction["static void", "ltemplate_capture_instances", {},
+        CInlineCode@StringTemplate[
+          "for (const auto &entry : `collection`) mma::detail::captureInstance(\"`class`\", 0, entry.first);"
+        ][<|"collection" -> collectionName[#], "class" -> #|>]& /@ classlist
+      ],
+      "",
+      CFunction[libFunRet, "LTemplate_capture", libFunArgs,
+        CReturn@CCall["mma::detail::captureControl", {"Argc", "Args", "Res", "ltemplate_capture_instances"}]
+      ],
+      "", ""
+    }
+
+(* Retrieves the values of the performance counters, see PerformanceCounters *)
+transPerfCounters[] :=
+    {
+      CFunction[libFunRet, "LTemplate_performance_counters", libFunArgs,
+        CReturn@CCall["mma::detail::perfCounterTable", {"Argc", "Args", "Res"}]
+      ],
+      "",
+      CFunction[libFunRet, "LTemplate_performance_counter_name", libFunArgs,
+        CReturn@CCall["mma::detail::perfCounterName", {"Argc", "Args", "Res"}]
+      ],
+      "", ""
+    }
+
+(* Retrieves the allocation census, see AllocationCensus *)
+transAllocCensus[] :=
+    {
+      CFunction[libFunRet, "LTemplate_alloc_census", libFunArgs,
+        CReturn@CCall["mma::detail::allocCensusTable", {"Argc", "Args", "Res"}]
+      ],
+      "",
+      CFunction[libFunRet, "LTemplate_alloc_census_name", libFunArgs,
+        CReturn@CCall["mma::detail::allocCensusName", {"Argc", "Args", "Res"}]
+      ],
+      "", ""
+    }
+
+(* C++ function type corresponding to a template specification, e.g. mma::TensorRef<double> (mint, double) *)
+specType[args_List, ret_] :=
+    cppType[ret] <> " (" <> StringRiffle[cppType /@ args, ", "] <> ")"
+
+cppType["Void"] = "void";
+cppType["InPlace"] = "mma::detail::InPlaceResult";
+cppType[type_] := First@Replace[type, types]
+
 transRet[type_, value_] :=
     Module[{name = "res", cpptype, getfun, setfun},
       {cpptype, getfun, setfun} = Replace[type, types];
@@ -586,12 +708,28 @@ imageTypes = <|
 
 
 types = Dispatch@{
+  {type : LType[__], "InPlace"} :> MapAt["mma::detail::InPlace<" <> # <> ">"&, Replace[{type}, types], 1],
+  {type : LType[__], "Stored"}  :> MapAt["mma::detail::Stored<" <> # <> ">"&, Replace[{type}, types], 1],
+
   Integer      -> {"mint",                 "MArgument_getInteger",     "MArgument_setInteger"},
   Real         -> {"double",               "MArgument_getReal",        "MArgument_setReal"},
   Complex      -> {"std::complex<double>", "mma::detail::getComplex",  "mma::detail::setComplex"},
   "Boolean"    -> {"bool",                 "MArgument_getBoolean",     "MArgument_setBoolean"},
   "UTF8String" -> {"const char *",         "mma::detail::getString",   "mma::detail::setString"},
 
+  (* Tensors of fixed shape are verified when the C++ object is constructed. *)
+  {LType[List, type_, dims_List], ___} :>
+      With[{ctype = numericTypes[type]},
+        {
+          Replace[dims, {
+            {n_} :> StringTemplate["mma::FixedVectorRef<``, ``>"][ctype, n],
+            {Verbatim[_], n_} :> StringTemplate["mma::FixedColsMatrixRef<``, ``>"][ctype, n],
+            {m_, n_} :> StringTemplate["mma::FixedMatrixRef<``, ``, ``>"][ctype, m, n]
+          }],
+          "mma::detail::getTensor<" <> ctype <> ">", "mma::detail::setTensor<" <> ctype <> ">"
+        }
+      ],
+
   {LType[List, type_, ___], ___} :>
       With[{ctype = numericTypes[type]},
         {"mma::TensorRef<" <> ctype <> ">", "mma::detail::getTensor<" <> ctype <> ">", "mma::detail::setTensor<" <> ctype <> ">"}
@@ -635,12 +773,379 @@ types = Dispatch@{
 
 
 
+(***********  Translate template to worker process code  **********)
+
+(* In worker process mode, the library loaded by the kernel only forwards calls to a separate executable,
+   which contains the classes. See LTemplateWorker.h. Two source files are generated: the proxy library
+   and the worker. *)
+
+CompileTemplate::wtype = "In ``: the type `` is not supported in worker process mode. Only Integer, Real, Complex, \"Boolean\", \"UTF8String\", LExpressionID and numerical List types are allowed.";
+CompileTemplate::wlink = "In ``: LinkObject based functions are not supported in worker process mode.";
+CompileTemplate::wos   = "Worker process mode is not supported on ``.";
+CompileTemplate::wopt  = "The option `` is not supported in worker process mode.";
+
+workerTypePattern = numericTypePattern|"Boolean"|"UTF8String"|LExpressionID[_String]|(type : {arrayPattern, passingMethodPattern} /; Not@MatchQ[Last[type], "InPlace"|"Stored"]);
+
+validateWorkerTemplate[LTemplate[libname_String, classes_]] :=
+    And @@ Flatten@Cases[classes,
+      LClass[classname_, funs_] :> Function[fun,
+        With[{location = StringTemplate["``::``"][classname, First[fun]]},
+          Replace[fun, {
+            LOFun[_] :> (Message[CompileTemplate::wlink, location]; False),
+            LFun[_, args_, ret_] :>
+                If[MatchQ[#, workerTypePattern|"Void"], True, Message[CompileTemplate::wtype, location, #]; False]& /@ Append[args, ret]
+          }]
+        ]
+      ] /@ funs
+    ]
+
+
+workerName = "ltemplate_worker";
+
+(* {write in the request or response, read in the worker, read in the library} *)
+workerTypes = Dispatch@{
+  Integer      -> {"putInteger", "getInteger()", "getInteger()"},
+  Real         -> {"putReal",    "getReal()",    "getReal()"},
+  Complex      -> {"putComplex", "getComplex()", "getComplex()"},
+  "Boolean"    -> {"putBoolean", "getBoolean()", "getBoolean()"},
+  "UTF8String" -> {"putString",  "getString()",  "getString()"},
+
+  {LType[List, type_, ___], ___} :>
+      With[{ctype = numericTypes[type]},
+        {"putTensor", "getTensor<" <> ctype <> ">()", "copyTensor<" <> ctype <> ">()"}
+      ],
+
+  (* the library sends the ID, the worker translates it *)
+  LExpressionID[classname_String] :> {"putInteger", "getObject<" <> classname <> ">(" <> collectionName[classname] <> ")", ""}
+};
+
+workerPassing[{_, "Shared"}] = "mma::detail::WP_Shared";
+workerPassing[{_, "Manual"}] = "mma::detail::WP_Manual";
+workerPassing[_] = "mma::detail::WP_Automatic";
+
+
+translateWorkerTemplate[LTemplate[libname_String, classes_]] :=
+    Module[{classlist = Cases[classes, LClass[name_String, __] :> name]},
+      {
+        ToCCodeString[transProxyTemplate[libname, classes, classlist], "Indent" -> 1],
+        ToCCodeString[transWorkerTemplate[libname, classes, classlist], "Indent" -> 1]
+      }
+    ]
+
+
+(* Library side *)
+
+transProxyTemplate[libname_, classes_, classlist_] :=
+    {
+      "",
+      CDefine["LTEMPLATE_MMA_VERSION", ToString@Round[100 $VersionNumber + $ReleaseNumber]],
+      "",
+      CInclude["LTemplate.h"],
+      CInclude["LTemplateHelpers.h"],
+      "","",
+
+      CDefine["LTEMPLATE_MESSAGE_SYMBOL", CString[fullyQualifiedSymbolName[$messageSymbol]]],
+      "",
+      CInclude["LTemplate.inc"],
+      CInclude["LTemplateWorker.h"],
+
+      "","",
+
+      CDeclare["static mma::detail::WorkerClient *", workerName],
+      "",
+
+      MapIndexed[setupProxyCollection[#1, First[#2] - 1]&, classlist],
+
+      CFunction["extern \"C\" DLLEXPORT mint",
+        "WolframLibrary_getVersion", {},
+        "return WolframLibraryVersion"
+      ],
+      "",
+      CFunction["extern \"C\" DLLEXPORT int",
+        "WolframLibrary_initialize", {"WolframLibraryData libData"},
+        {
+          CAssign["mma::libData", "libData"],
+          CAssign[workerName, StringTemplate["new mma::detail::WorkerClient(`1`, `2`)"][CString[libname], Length[classlist]]],
+          registerClassManager /@ classlist,
+          "return LIBRARY_NO_ERROR"
+        }
+      ],
+      "",
+      CFunction["extern \"C\" DLLEXPORT void",
+        "WolframLibrary_uninitialize", {"WolframLibraryData libData"},
+        {
+          unregisterClassManager /@ classlist,
+          "delete " <> workerName, (* stops the worker process *)
+          CAssign[workerName, "NULL"],
+          "return"
+        }
+      ],
+      "","",
+      MapIndexed[transProxyClass[#1, First[#2] - 1]&, classes],
+      transCommandTable[classes]
+    }
+
+
+setupProxyCollection[classname_String, classindex_Integer] := {
+  CFunction["DLLEXPORT void", managerName[classname], {"WolframLibraryData libData", "mbool mode", "mint id"},
+    CCall[workerName <> "->manage", {classindex, "mode", "id"}]
+  ],
+  "",
+  CFunction[libFunRet, classname <> "_get_collection", libFunArgs,
+    {
+      transRet[
+        {LType[List, Integer, 1]},
+        CCall[workerName <> "->collection", classindex]
+      ],
+      CReturn["LIBRARY_NO_ERROR"]
+    }
+  ],
+  "",""
+}
+
+
+transProxyClass[LClass[classname_String, funs_], classindex_Integer] :=
+    MapIndexed[transProxyFun[classname, classindex, First[#2] - 1][#1]&, funs]
+
+
+transProxyFun[classname_, classindex_, funindex_][LFun[name_String, args_List, ret_]] :=
+    With[{begin = CCall[workerName <> "->beginCall", {classindex, funindex, "MArgument_getInteger(Args[0])"}]},
+      {
+        CFunction[libFunRet, funName[classname][name], libFunArgs,
+          {
+            CTry[
+            (* try *) {
+              (* all arguments are read before starting the call, so that strings are released even if it fails *)
+              MapIndexed[transProxyArgRead[#1, First[#2]]&, args],
+              If[args === {}, begin, CDeclareAssign["mma::detail::WorkerWriter &", "req", begin]],
+              MapIndexed[transProxyArgPut[#1, First[#2]]&, args],
+              "",
+              CDeclareAssign["int", "err", CCall[workerName <> "->call", CString[classname <> "::" <> name <> "()"]]],
+              "if (err != LIBRARY_NO_ERROR) return err",
+              transProxyRet[ret]
+            }],
+            (* catch *)
+            catchExceptions[classname, name],
+            "",
+            CReturn["LIBRARY_NO_ERROR"]
+          }
+        ],
+        "", ""
+      }
+    ]
+
+
+transProxyArgRead[type_, index_] :=
+    Module[{name = var[index], cpptype, getfun, setfun},
+      {cpptype, getfun, setfun} = Replace[Replace[type, LExpressionID[_] -> Integer], types];
+      {
+        CDeclareAssign[cpptype, name, StringTemplate["`1`(Args[`2`])"][getfun, index]],
+        If[type === "UTF8String", (* the worker receives a copy *)
+          CDeclare["mma::detail::WorkerStringArgument", name <> "_guard(" <> name <> ")"],
+          {}
+        ]
+      }
+    ]
+
+transProxyArgPut[type_, index_] :=
+    With[{name = var[index], put = First@Replace[type, workerTypes]},
+      Switch[type,
+        {LType[List, ___], ___}, CCall["req." <> put, {name, workerPassing[type]}],
+        _, CCall["req." <> put, name]
+      ]
+    ]
+
+transProxyRet["Void"] := workerName <> "->result().getVoid()"
+
+transProxyRet["UTF8String"] := transRet["UTF8String", workerName <> "->keepString(" <> workerName <> "->result().getString())"]
+
+transProxyRet[type_] := transRet[type, workerName <> "->result()." <> Last@Replace[type, workerTypes]]
+
+
+(* Worker side *)
+
+transWorkerTemplate[libname_, classes_, classlist_] :=
+    {
+      "",
+      CDefine["LTEMPLATE_MMA_VERSION", ToString@Round[100 $VersionNumber + $ReleaseNumber]],
+      CDefine["LTEMPLATE_STANDALONE"],
+      "",
+      CInclude["LTemplate.h"],
+      CInclude["LTemplateHelpers.h"],
+      CInclude /@ includeName /@ classlist,
+      "","",
+
+      CDefine["LTEMPLATE_MESSAGE_SYMBOL", CString[fullyQualifiedSymbolName[$messageSymbol]]],
+      "",
+      CInclude["LTemplate.inc"],
+      CInclude["LTemplateWorker.h"],
+
+      "","",
+
+      setupCollection /@ classlist,
+
+      transWorkerClass /@ classes,
+
+      CInlineCode[
+        "static const mma::detail::WorkerClass worker_classes[] = {\n" <>
+        StringRiffle[
+          StringTemplate["  {\"`1`\", `2`, `1`_worker_functions, `3`}"][#1, managerName[#1], Length[#2]]& @@@ Cases[classes, LClass[c_, f_] :> {c, f}],
+          ",\n"
+        ] <>
+        "\n};"
+      ],
+      "","",
+      CFunction["int", "main", {"int argc", "char *argv[]"},
+        CReturn[CCall["mma::detail::workerMain", {"argc", "argv", "worker_classes", Length[classlist]}]]
+      ]
+    }
+
+
+transWorkerClass[LClass[classname_String, funs_]] :=
+    {
+      transWorkerFun[classname] /@ funs,
+      (* the terminating entry keeps the array non-empty for classes without functions *)
+      CInlineCode[
+        "static const mma::detail::WorkerFunction " <> classname <> "_worker_functions[] = {\n" <>
+        StringJoin[
+          StringTemplate["  {\"``::``()\", ``},\n"][classname, #, funName[classname][#] <> "_worker"]& /@ Cases[funs, LFun[name_, __] :> name]
+        ] <>
+        "  {NULL, NULL}\n};"
+      ],
+      "",""
+    }
+
+
+transWorkerFun[classname_][LFun[name_String, args_List, ret_]] :=
+    Block[{index = 0},
+      With[{call = CPointerMember[CArray[collectionName[classname], "id"], CCall[name, var /@ Range@Length[args]]]},
+        {
+          CFunction["static void", funName[classname][name] <> "_worker",
+            {"mint id", "mma::detail::WorkerReader &" <> If[args === {}, "", "args"], "mma::detail::WorkerWriter &ret"},
+            {
+              CInlineCode@StringTemplate[
+                "if (`1`.find(id) == `1`.end()) { mma::libData->Message(\"noinst\"); throw mma::LibraryError(); }"
+              ][collectionName[classname]],
+              "",
+              transWorkerArg /@ args,
+              "",
+              transWorkerRet[ret, call]
+            }
+          ],
+          "", ""
+        }
+      ]
+    ]
+
+
+transWorkerArg[type_] :=
+    Module[{name, cpptype, getfun, setfun},
+      index++;
+      name = var[index];
+      {cpptype, getfun, setfun} = Replace[type, types];
+      CDeclareAssign[cpptype, name, "args." <> Replace[type, workerTypes][[2]]]
+    ]
+
+transWorkerRet["Void", value_] := {value, "ret.putVoid()"}
+
+(* Tensors returned with "Shared" passing are kept by the class, others are freed after sending them. *)
+transWorkerRet[type : {LType[List, ___], passing___}, value_] :=
+    CCall["mma::detail::workerReturnTensor", {"ret", value, If[{passing} === {"Shared"}, "true", "false"]}]
+
+transWorkerRet[type_, value_] := CCall["ret." <> First@Replace[type, workerTypes], value]
+
+
+(***********  Translate template to replay code  **********)
+
+(* With "CaptureCalls" -> True, the library can record calls, and a replay executable re-executes them
+   outside of the kernel, see LTemplateCapture.h. The replay contains the same classes and library functions,
+   built with the stand-in runtime, which only supports the types below. Other functions are left out,
+   and their calls are skipped. *)
+
+replayTypePattern = numericTypePattern|"Boolean"|"UTF8String"|LExpressionID[_String]|{arrayPattern, passingMethodPattern};
+
+replayableQ[LFun[_, args_List, ret_]] := MatchQ[args, {replayTypePattern...}] && MatchQ[ret, replayTypePattern|"Void"|"InPlace"]
+replayableQ[_] := False
+
+(* See mma::detail::ReplayFunction *)
+replayPassing[{_, "Manual"}] = "m";
+replayPassing[{_, "Shared"}] = "s";
+replayPassing[{_, "Stored"}] = "h";
+replayPassing[_] = "a";
+
+replayResult[{LType[List, ___]} | {LType[List, ___], Except["Shared"|"Stored"]}] = "a";
+replayResult[{LType[List, ___], "Stored"}] = "h";
+replayResult[_] = "-";
+
+translateReplayTemplate[LTemplate[libname_String, classes_]] :=
+    Block[{$captureCalls = False},
+      With[{classlist = Cases[classes, LClass[name_String, __] :> name]},
+        ToCCodeString[
+          {
+            "",
+            CDefine["LTEMPLATE_MMA_VERSION", ToString@Round[100 $VersionNumber + $ReleaseNumber]],
+            CDefine["LTEMPLATE_STANDALONE"],
+            If[$perfCounters, CDefine["LTEMPLATE_PERF_COUNTERS"], {}],
+            If[$allocCensus, CDefine["LTEMPLATE_ALLOC_CENSUS"], {}],
+            "",
+            CInclude["LTemplate.h"],
+            CInclude["LTemplateHelpers.h"],
+            CInclude /@ includeName /@ classlist,
+            "","",
+
+            CDefine["LTEMPLATE_MESSAGE_SYMBOL", CString[fullyQualifiedSymbolName[$messageSymbol]]],
+            "",
+            CInclude["LTemplate.inc"],
+            CInclude["LTemplateCapture.h"],
+
+            "","",
+
+            setupCollection /@ classlist,
+
+            transReplayClass /@ classes,
+
+            CInlineCode[
+              "static const mma::detail::ReplayClass replay_classes[] = {\n" <>
+              StringRiffle[StringTemplate["  {\"`1`\", `2`, `1`_replay_functions}"][#, managerName[#]]& /@ classlist, ",\n"] <>
+              "\n};"
+            ],
+            "","",
+            CFunction["int", "main", {"int argc", "char *argv[]"},
+              CReturn[CCall["mma::detail::replayMain", {"argc", "argv", "replay_classes", Length[classlist]}]]
+            ]
+          },
+          "Indent" -> 1
+        ]
+      ]
+    ]
+
+
+transReplayClass[LClass[classname_String, funs_]] :=
+    With[{replayable = Select[funs, replayableQ]},
+      {
+        transFun[classname] /@ replayable,
+        (* the terminating entry keeps the array non-empty for classes without functions *)
+        CInlineCode[
+          "static const mma::detail::ReplayFunction " <> classname <> "_replay_functions[] = {\n" <>
+          StringJoin[
+            StringTemplate["  {\"``::``()\", ``, \"``\", '``'},\n"][
+              classname, #1, funName[classname][#1], StringJoin[replayPassing /@ #2], replayResult[#3]
+            ]& @@@ replayable
+          ] <>
+          "  {NULL, NULL, NULL, 0}\n};"
+        ],
+        "",""
+      }
+    ]
+
+
 (**************** Load library ***************)
 
 (* TODO: Break out loading and compilation into separate files
    This is to make it easy to include them in other projects *)
 
 getCollection (* underlies LExpressionList, the get_collection library function is associated with it in loadClass *)
+commandSpec (* the library and the functions of each class symbol, for RunCommands, set in loadClass *)
 
 symName[classname_String] := LClassContext[] <> classname
 
@@ -660,18 +1165,26 @@ loadTemplate[tem : LTemplate[libname_String, classes_]] := (
      prevent unloading from working at least on OS X.
   *)
   If[FindLibrary[libname] =!= $Failed,
-    loadClass[libname] /@ classes,
+    (* offsets of the functions of each class in the command buffer function table, see transCommandTable *)
+    MapThread[loadClass[libname], {classes, Most@Accumulate@Prepend[Length@Last[#]& /@ classes, 0]}],
     Message[LibraryFunction::notfound, libname]
   ];
 )
 
-loadClass[libname_][tem : LClass[classname_String, funs_]] := (
+loadClass[libname_, offset_ : 0][tem : LClass[classname_String, funs_]] := (
   ClearAll[#]& @ symName[classname];
   loadFun[libname, classname] /@ funs;
   With[{sym = Symbol@symName[classname]},
     MessageName[sym, "usage"] = formatTemplate[tem];
     sym[id_Integer][(f_String)[___]] /; (Message[LTemplate::nofun, StringTemplate["``::``"][sym, f]]; False) := $Failed;
     getCollection[sym] = LibraryFunctionLoad[libname, funName[classname]["get_collection"], {}, LibraryDataType[List, Integer, 1]];
+    commandSpec[sym] = {
+      libname,
+      Association@MapIndexed[
+        Replace[#1, {LFun[name_, args_, ret_] :> name -> {offset + First[#2] - 1, args, ret}, LOFun[name_] :> name -> LinkObject}]&,
+        funs
+      ]
+    };
   ];
 )
 
@@ -679,21 +1192,36 @@ loadClass[libname_][tem : LClass[classname_String, funs_]] := (
 loadFun[libname_, classname_][LFun[name_String, args_List, ret_]] :=
     With[{classsym = Symbol@symName[classname], funname = funName[classname][name],
       loadargs = Prepend[Replace[args, loadingTypes, {1}], Integer],
-      loadret = Replace[ret, loadingTypes]
+      loadret = Replace[
+        If[ret === "InPlace", FirstCase[args, {type_, "InPlace"} :> {type, "Shared"}], ret],
+        loadingTypes
+      ]
     },
       If[$lazyLoading,
         classsym[idx_Integer]@name[argumentsx___] :=
             With[{lfun = LibraryFunctionLoad[libname, funname, loadargs, loadret]},
-              classsym[id_Integer]@name[arguments___] := lfun[id, arguments];
+              defineFun[classsym, name, lfun, libname, args, ret];
               classsym[idx]@name[argumentsx]
             ]
         ,
         With[{lfun = LibraryFunctionLoad[libname, funname, loadargs, loadret]},
-          classsym[id_Integer]@name[arguments___] := lfun[id, arguments];
+          defineFun[classsym, name, lfun, libname, args, ret];
         ]
       ]
     ];
 
+(* Functions with "Stored" passing convert between tensor handles and the integer IDs used by the library *)
+defineFun[classsym_, name_, lfun_, libname_, args_, ret_] :=
+    If[FreeQ[Append[args, ret], {_, "Stored"}],
+      classsym[id_Integer]@name[arguments___] := lfun[id, arguments],
+      With[{wrap = storedResult[libname, ret]},
+        classsym[id_Integer]@name[arguments___] := wrap@lfun[id, Sequence @@ Replace[{arguments}, LTensorHandle[libname, h_Integer, _] :> h, {1}]]
+      ]
+    ]
+
+storedResult[libname_, {LType[List, type_, ___], "Stored"}] := Replace[#, h_Integer :> LTensorHandle[libname, h, type]]&
+storedResult[_, _] := Identity
+
 loadFun[libname_, classname_][LOFun[name_String]] :=
     With[{classsym = Symbol@symName[classname], funname = funName[classname][name]},
       If[$lazyLoading,
@@ -713,7 +1241,10 @@ loadFun[libname_, classname_][LOFun[name_String]] :=
 (* For types that need to be translated to LibraryFunctionLoad compatible forms before loading. *)
 loadingTypes = Dispatch@{
   LExpressionID[_] -> Integer,
+  {type : LType[__], "InPlace"} :> Replace[{type, "Shared"}, loadingTypes],
+  {LType[__], "Stored"} -> Integer,
   {LType[RawArray, ___], passing___} :> {RawArray, passing},
+  {LType[List, type_, dims_List], passing___} :> {LibraryDataType[List, type, Length[dims]], passing},
   {LType[args__], passing___} :> {LibraryDataType[args], passing}
 };
 
@@ -732,11 +1263,276 @@ unloadTemplate[LTemplate[libname_String, classes_]] :=
       With[{syms = Symbol /@ symName /@ Cases[classes, LClass[name_, __] :> name]},
         ClearAll /@ syms;
         Quiet@Unset[getCollection[#]]& /@ syms;
+        Quiet@Unset[commandSpec[#]]& /@ syms;
       ];
+      DownValues[cachedFunction] = DeleteCases[DownValues[cachedFunction], _[Verbatim[HoldPattern][HoldPattern@cachedFunction[libname, __]], _]];
       res
     ]
 
 
+(****************** Command buffers ********************)
+
+(* RunCommands sends a sequence of calls to the library in a single library function call. The C++ side
+   is mma::detail::runCommands() in LTemplateHelpers.h, which documents the encoding. Values sent by
+   the kernel become arguments of the library function, which is loaded for each combination of
+   argument and return types that is used. *)
+
+RunCommands::cmd  = "`` is not a valid command. Commands must have the form obj@\"fun\"[args].";
+RunCommands::obj  = "Command ``: `` is not an instance of a loaded class.";
+RunCommands::lib  = "All commands must belong to classes of the same library.";
+RunCommands::link = "Command ``: LinkObject based functions cannot be used in command buffers.";
+RunCommands::argx = "Command ``: `` arguments were given, `` expected.";
+RunCommands::res  = "Command ``: `` does not refer to the result of an earlier command.";
+RunCommands::type = "Command ``: argument `` of type `` cannot receive the result of command ``, of type ``.";
+RunCommands::pass = "Command ``: argument `` of type `` cannot receive the result of an earlier command. Results cannot be passed as strings, or with \"Shared\" or \"InPlace\" passing.";
+RunCommands::out  = "`` is not a valid output specification. Outputs must be given as the indices of commands that return a value.";
+
+SetAttributes[RunCommands, HoldFirst]
+
+RunCommands[commands_List, outputs_ : Automatic] :=
+    With[{cmds = parseCommand /@ Unevaluated[commands]},
+      If[MemberQ[cmds, $Failed],
+        $Failed,
+        Catch[runCommands[cmds, outputs], runCommands]
+      ]
+    ]
+
+SetAttributes[parseCommand, HoldAll]
+parseCommand[obj_[(fun_String)[args___]]] := {obj, fun, {args}}
+parseCommand[cmd_] := (Message[RunCommands::cmd, HoldForm[cmd]]; $Failed)
+
+commandTypeCode["Void"] = 0;
+commandTypeCode[Integer | LExpressionID[_] | {_, "Stored"}] = 1;
+commandTypeCode[Real] = 2;
+commandTypeCode[Complex] = 3;
+commandTypeCode["Boolean"] = 4;
+commandTypeCode["UTF8String"] = 5;
+commandTypeCode[{LType[List, ___]} | {LType[List, ___], Except["Stored"]}] = 6;
+commandTypeCode[{LType[SparseArray, ___], ___}] = 7;
+commandTypeCode[{LType[Image | Image3D, ___], ___}] = 8;
+commandTypeCode[{LType[RawArray | ByteArray, ___], ___}] = 9;
+
+(* Types that can be passed between commands, with _ for unspecified parts *)
+commandValueKind[type_] :=
+    Replace[type, {
+      {LType[List, t_, ___], "Stored"} :> {"Stored", t},
+      {LType[List, t_, dims_List], ___} :> {List, t, Length[dims]},
+      {LType[h : List | SparseArray, t_, d_Integer], ___} :> {h, t, d},
+      {LType[h : List | SparseArray, t_, ___], ___} :> {h, t, _},
+      {LType[h_, t_], ___} :> {h, t},
+      {LType[h_], ___} :> {h, _},
+      LExpressionID[_] -> Integer
+    }]
+
+commandCompatibleQ[argtype_, restype_] :=
+    With[{a = commandValueKind[argtype], r = commandValueKind[restype]}, MatchQ[a, r] || MatchQ[r, a]]
+
+(* Array results are owned by the command buffer, unless they are kept by the class ("Shared"), by the kernel ("InPlace")
+   or by the tensor store ("Stored") *)
+commandOwnedQ[type_] := MatchQ[type, {LType[__], Except["Shared"|"Stored"]} | {LType[__]}]
+
+(* Library functions that do not belong to a class are loaded on first use. unloadTemplate clears them. *)
+cachedFunction[libname_, funname_, args_, ret_] :=
+    With[{lfun = LibraryFunctionLoad[libname, funname, args, ret]},
+      If[Head[lfun] === LibraryFunction,
+        cachedFunction[libname, funname, args, ret] = lfun,
+        $Failed
+      ]
+    ]
+
+commandFunction[libname_, funname_, args_, ret_] :=
+    Replace[cachedFunction[libname, funname, args, ret], $Failed :> Throw[$Failed, runCommands]]
+
+runCommands[cmds_, outputs_] :=
+    Module[{libname = None, inputs = {}, inputTypes = {}, results = {}, program, outs, unique, res, values},
+      program = MapIndexed[
+        Function[{cmd, pos},
+          Module[{obj, fun, vals, i = First[pos], sym, id, spec, index, args, ret},
+            {obj, fun, vals} = cmd;
+            If[Not@MatchQ[obj, s_Symbol[_Integer] /; ListQ[commandSpec[s]]],
+              Message[RunCommands::obj, i, obj]; Throw[$Failed, runCommands]
+            ];
+            sym = Head[obj]; id = First[obj];
+            If[libname =!= None && libname =!= First@commandSpec[sym], Message[RunCommands::lib]; Throw[$Failed, runCommands]];
+            libname = First@commandSpec[sym];
+            spec = Lookup[Last@commandSpec[sym], fun];
+            If[MissingQ[spec], Message[LTemplate::nofun, StringTemplate["``::``"][sym, fun]]; Throw[$Failed, runCommands]];
+            If[spec === LinkObject, Message[RunCommands::link, i]; Throw[$Failed, runCommands]];
+            {index, args, ret} = spec;
+            If[Length[vals] =!= Length[args], Message[RunCommands::argx, i, Length[vals], Length[args]]; Throw[$Failed, runCommands]];
+            (* the "InPlace" return type returns the "InPlace" argument, which is passed as "Shared" *)
+            If[ret === "InPlace", ret = FirstCase[args, {type_, "InPlace"} :> {type, "Shared"}]];
+            AppendTo[results, ret];
+            {
+              index, id, commandTypeCode[ret], Boole@commandOwnedQ[ret], Length[args],
+              MapThread[
+                Function[{val, type, j},
+                  Replace[val, {
+                    LResult[k_Integer] /; 1 <= k < i :> (
+                      If[MatchQ[type, "UTF8String" | {_, "Shared"|"InPlace"}], Message[RunCommands::pass, i, j, type]; Throw[$Failed, runCommands]];
+                      If[Not@commandCompatibleQ[type, results[[k]]], Message[RunCommands::type, i, j, type, k, results[[k]]]; Throw[$Failed, runCommands]];
+                      {1, k - 1, commandTypeCode[type], Boole@MatchQ[type, {_, "Manual"}]}
+                    ),
+                    r_LResult :> (Message[RunCommands::res, i, r]; Throw[$Failed, runCommands]),
+                    _ :> (
+                      AppendTo[inputs, If[MatchQ[type, {_, "Stored"}], Replace[val, LTensorHandle[libname, h_Integer, _] :> h], val]];
+                      AppendTo[inputTypes, Replace[type, loadingTypes]];
+                      {0, Length[inputs], commandTypeCode[type], 0}
+                    )
+                  }]
+                ],
+                {vals, args, Range@Length[args]}
+              ]
+            }
+          ]
+        ],
+        cmds
+      ];
+
+      outs = Replace[outputs, {
+        Automatic :> If[results === {} || Last[results] === "Void", {}, {Length[results]}],
+        k_Integer :> {k},
+        ks : {___Integer} :> ks,
+        _ :> {0}
+      }];
+      If[Not@AllTrue[outs, 1 <= # <= Length[results] && results[[#]] =!= "Void"&], Message[RunCommands::out, outputs]; Throw[$Failed, runCommands]];
+      unique = DeleteDuplicates[outs];
+
+      If[libname === None, Return[If[ListQ[outputs], {}, Null]]];
+      program = Flatten[{Length[cmds], program, Length[unique], unique - 1}];
+      res = commandFunction[libname, "LTemplate_run_commands",
+        Prepend[inputTypes, {Integer, 1, "Constant"}],
+        If[unique === {}, "Void", Replace[results[[First[unique]]], loadingTypes]]
+      ] @@ Prepend[inputs, program];
+      If[Head[res] === LibraryFunctionError, Return[res]];
+
+      values = Prepend[
+        MapIndexed[commandFunction[libname, "LTemplate_command_output", {Integer}, Replace[results[[#1]], loadingTypes]][First[#2] + 1]&, Rest[unique]],
+        res
+      ];
+      values = MapThread[storedResult[libname, results[[#1]]][#2]&, {unique, values}];
+      If[ListQ[outputs],
+        Lookup[AssociationThread[unique, values], outs],
+        If[outs === {}, Null, First[values]]
+      ]
+    ]
+
+
+(****************** Tensor store ********************)
+
+(* Tensors returned with "Stored" passing are kept in the library, see mma::TensorStore in LTemplate.h.
+   The kernel only sees their handles. *)
+
+tensorTypeCode = <|Integer -> 2, Real -> 3, Complex -> 4|>; (* MType_Integer, MType_Real, MType_Complex *)
+
+TensorHandleData[LTensorHandle[libname_String, h_Integer, type : numericTypePattern]] :=
+    With[{lfun = cachedFunction[libname, "LTemplate_tensor_store_get", {Integer, Integer}, {type, _}]},
+      If[lfun === $Failed, $Failed, lfun[h, tensorTypeCode[type]]]
+    ]
+
+ReleaseTensorHandle[LTensorHandle[libname_String, h_Integer, _]] :=
+    With[{lfun = cachedFunction[libname, "LTemplate_tensor_store_release", {Integer}, "Void"]},
+      If[lfun === $Failed, $Failed, lfun[h]]
+    ]
+ReleaseTensorHandle[handles : {___LTensorHandle}] := Scan[ReleaseTensorHandle, handles]
+
+TensorStoreInfo[libname_String] := tensorStoreInfo[libname, -2]
+
+SetTensorStoreBudget[libname_String, bytes : _Integer?NonNegative | Infinity] :=
+    tensorStoreInfo[libname, Replace[bytes, Infinity -> -1]]
+
+(* A budget below -1 leaves the current one unchanged *)
+tensorStoreInfo[libname_, budget_] :=
+    With[{lfun = cachedFunction[libname, "LTemplate_tensor_store_info", {Integer}, {Integer, 1}]},
+      If[lfun === $Failed,
+        $Failed,
+        Replace[lfun[budget],
+          {count_, bytes_, limit_, evictions_} :>
+              <|"Count" -> count, "Bytes" -> bytes, "MemoryBudget" -> Replace[limit, -1 -> Infinity], "Evictions" -> evictions|>
+        ]
+      ]
+    ]
+
+
+(****************** Call capture ********************)
+
+(* The library records the calls, see LTemplateCapture.h. The LTemplate_capture library function takes
+   the path of the capture file, or an empty string to stop, and returns the number of calls recorded so far. *)
+
+StartCallCapture[libname_String, file_String] :=
+    With[{path = ExpandFileName[file]},
+      If[captureControl[libname, path] === $Failed, $Failed, path]
+    ]
+
+StopCallCapture[libname_String] := captureControl[libname, ""]
+
+captureControl[libname_, path_] :=
+    With[{lfun = cachedFunction[libname, "LTemplate_capture", {"UTF8String"}, Integer]},
+      If[lfun === $Failed, $Failed, lfun[path]]
+    ]
+
+
+(****************** Performance counters ********************)
+
+(* The library measures each member function call, see LTemplatePerf.h. LTemplate_performance_counters
+   returns a matrix with a row for each function and thread. Counters that are not available are -1. *)
+
+PerformanceCounters[libname_String] := perfCounters[libname, False]
+
+ResetPerformanceCounters[libname_String] := perfCounters[libname, True]
+
+perfCounters[libname_, reset_] :=
+    With[{
+        lfun = cachedFunction[libname, "LTemplate_performance_counters", {"Boolean"}, {Integer, 2}],
+        namefun = cachedFunction[libname, "LTemplate_performance_counter_name", {Integer}, "UTF8String"]
+      },
+      If[lfun === $Failed || namefun === $Failed,
+        $Failed,
+        Replace[lfun[reset],
+          {fun_, thread_, calls_, ns_, counters___} :>
+              Join[
+                <|"Function" -> namefun[fun], "Thread" -> thread, "Calls" -> calls, "Time" -> N[ns/10^9]|>,
+                AssociationThread[
+                  {"Cycles", "Instructions", "CacheMisses", "BranchMisses"},
+                  Replace[{counters}, -1 -> Missing["NotAvailable"], {1}]
+                ]
+              ],
+          {1}
+        ]
+      ]
+    ]
+
+
+(****************** Allocation census ********************)
+
+(* The library counts the allocations and copies of each member function call, see LTemplateCensus.h.
+   LTemplate_alloc_census returns a matrix with a row for each function, ordered by decreasing total bytes. *)
+
+AllocationCensus[libname_String] := allocCensus[libname, False]
+
+ResetAllocationCensus[libname_String] := allocCensus[libname, True]
+
+allocCensus[libname_, reset_] :=
+    With[{
+        lfun = cachedFunction[libname, "LTemplate_alloc_census", {"Boolean"}, {Integer, 2}],
+        namefun = cachedFunction[libname, "LTemplate_alloc_census_name", {Integer}, "UTF8String"]
+      },
+      If[lfun === $Failed || namefun === $Failed,
+        $Failed,
+        Replace[lfun[reset],
+          {fun_, calls_, allocs_, allocBytes_, copies_, copyBytes_, maxBytes_} :>
+              <|
+                "Function" -> namefun[fun], "Calls" -> calls,
+                "Allocations" -> allocs, "BytesAllocated" -> allocBytes,
+                "Copies" -> copies, "BytesCopied" -> copyBytes,
+                "MaxBytesPerCall" -> maxBytes
+              |>,
+          {1}
+        ]
+      ]
+    ]
+
+
 (* TODO: verify class exists for Make and LExpressionList *)
 
 Make[class_Symbol] := Make@SymbolName[class] (* SymbolName returns the name of the symbol without a context *)
@@ -763,9 +1559,35 @@ CompileTemplate[tem_, opt : OptionsPattern[CreateLibrary]] := CompileTemplate[te
 
 compileTemplate[tem: LTemplate[libname_String, classes_], sources_, opt : OptionsPattern[CreateLibrary]] :=
     Catch[
-      Module[{sourcefile, code, includeDirs, classlist, print, driver},
+      Module[{sourcefile, workerfile, replayfile, code, includeDirs, classlist, print, driver, worker, capture, perf, census, libs, lib},
         print[args__] := Apply[Print, Style[#, Darker@Blue]& /@ {args}];
 
+        (* "WorkerProcess" -> True builds the classes into a separate executable, see LTemplateWorker.h *)
+        worker = TrueQ@Lookup[{opt}, "WorkerProcess", False];
+        If[worker,
+          If[$OperatingSystem === "Windows",
+            Message[CompileTemplate::wos, $OperatingSystem];
+            Throw[$Failed, compileTemplate]
+          ];
+          If[Not@validateWorkerTemplate[tem], Throw[$Failed, compileTemplate]]
+        ];
+
+        (* "CaptureCalls" -> True also builds the replay executable, see LTemplateCapture.h *)
+        capture = TrueQ@Lookup[{opt}, "CaptureCalls", False];
+        (* "PerformanceCounters" -> True measures each member function call, see LTemplatePerf.h *)
+        perf = TrueQ@Lookup[{opt}, "PerformanceCounters", False];
+        (* "AllocationCensus" -> True counts the allocations and copies of each member function, see LTemplateCensus.h *)
+        census = TrueQ@Lookup[{opt}, "AllocationCensus", False];
+        If[worker,
+          Scan[
+            If[TrueQ@Lookup[{opt}, #, False],
+              Message[CompileTemplate::wopt, #];
+              Throw[$Failed, compileTemplate]
+            ]&,
+            {"CaptureCalls", "PerformanceCounters", "AllocationCensus"}
+          ]
+        ];
+
         (* Determine the compiler driver that will be used. *)
         (* It is unclear if the "Compiler" option of CreateLibrary supports option lists as a compiler specification
            like $CCompiler does. Trying to use one frequently leads to errors as of M11.2.  This may or may not be a bug.
@@ -787,11 +1609,20 @@ compileTemplate[tem: LTemplate[libname_String, classes_], sources_, opt : Option
         print["Unloading library ", libname, " ..."];
         Quiet@LibraryUnload[libname];
         print["Generating library code ..."];
-        code = TranslateTemplate[tem];
+        If[worker,
+          workerfile = "LTemplate-" <> libname <> "-worker.cpp";
+          code = translateWorkerTemplate[tem];
+          If[FileExistsQ[workerfile], print[workerfile, " already exists and will be overwritten."]];
+          Export[workerfile, Last[code], "String"];
+          code = First[code]
+          ,
+          code = Block[{$captureCalls = capture, $perfCounters = perf, $allocCensus = census}, TranslateTemplate[tem]]
+        ];
         If[FileExistsQ[sourcefile], print[sourcefile, " already exists and will be overwritten."]];
         Export[sourcefile, code, "String"];
         print["Compiling library code ..."];
         includeDirs = Flatten[{OptionValue["IncludeDirectories"], $includeDirectory}];
+        libs = Flatten[{OptionValue["Libraries"], If[worker && $OperatingSystem === "Unix", {"rt", "dl"}, {}]}];
 
         With[{driver = driver},
           Internal`InheritedBlock[{driver},
@@ -806,10 +1637,52 @@ compileTemplate[tem: LTemplate[libname_String, classes_], sources_, opt : Option
                 ]
               }
             ];
-            CreateLibrary[
-              AbsoluteFileName /@ Flatten[{sourcefile, sources}], libname,
-              "IncludeDirectories" -> includeDirs,
-              Sequence @@ FilterRules[{opt}, Except["IncludeDirectories"]]
+            If[worker,
+              (* The classes and the extra sources go into the worker, which is placed next to the library. *)
+              lib = CreateLibrary[
+                {AbsoluteFileName[sourcefile]}, libname,
+                "IncludeDirectories" -> includeDirs,
+                "Libraries" -> libs,
+                Sequence @@ FilterRules[{opt}, Except["IncludeDirectories"|"Libraries"|"WorkerProcess"|"CaptureCalls"|"PerformanceCounters"|"AllocationCensus"]]
+              ];
+              If[lib === $Failed, Throw[$Failed, compileTemplate]];
+              print["Compiling worker process ..."];
+              If[
+                CreateExecutable[
+                  AbsoluteFileName /@ Flatten[{workerfile, sources}], libname <> "-worker",
+                  "IncludeDirectories" -> includeDirs,
+                  "Libraries" -> libs,
+                  "TargetDirectory" -> DirectoryName[lib],
+                  Sequence @@ FilterRules[{opt}, Except["IncludeDirectories"|"Libraries"|"WorkerProcess"|"CaptureCalls"|"PerformanceCounters"|"AllocationCensus"|"TargetDirectory"]]
+                ] === $Failed,
+                $Failed,
+                lib
+              ]
+              ,
+              lib = CreateLibrary[
+                AbsoluteFileName /@ Flatten[{sourcefile, sources}], libname,
+                "IncludeDirectories" -> includeDirs,
+                Sequence @@ FilterRules[{opt}, Except["IncludeDirectories"|"WorkerProcess"|"CaptureCalls"|"PerformanceCounters"|"AllocationCensus"]]
+              ];
+              If[lib === $Failed || Not[capture],
+                lib
+                ,
+                (* The replay executable contains the classes and the extra sources, and is placed next to the library. *)
+                replayfile = "LTemplate-" <> libname <> "-replay.cpp";
+                If[FileExistsQ[replayfile], print[replayfile, " already exists and will be overwritten."]];
+                Export[replayfile, Block[{$perfCounters = perf, $allocCensus = census}, translateReplayTemplate[tem]], "String"];
+                print["Compiling replay executable ..."];
+                If[
+                  CreateExecutable[
+                    AbsoluteFileName /@ Flatten[{replayfile, sources}], libname <> "-replay",
+                    "IncludeDirectories" -> includeDirs,
+                    "TargetDirectory" -> DirectoryName[lib],
+                    Sequence @@ FilterRules[{opt}, Except["IncludeDirectories"|"WorkerProcess"|"CaptureCalls"|"PerformanceCounters"|"AllocationCensus"|"TargetDirectory"]]
+                  ] === $Failed,
+                  $Failed,
+                  lib
+                ]
+              ]
             ]
           ]
         ]